@@ -22,17 +22,19 @@
 
 device_t device_default;
 
-static int addbrk(device_t dev, address_t addr, device_bptype_t type)
+static int addbrk(device_t dev, address_t addr, address_t size,
+		  device_bptype_t type)
 {
 	int i;
 	int which = -1;
 	struct device_breakpoint *bp;
 
 	for (i = 0; i < dev->max_breakpoints; i++) {
-		bp = &dev->breakpoints[i];
+		bp = device_breakpoint(dev, i);
 
 		if (bp->flags & DEVICE_BP_ENABLED) {
-			if (bp->addr == addr && bp->type == type)
+			if (bp->addr == addr && bp->type == type &&
+			    bp->size == size)
 				return i;
 		} else if (which < 0) {
 			which = i;
@@ -42,9 +44,10 @@ static int addbrk(device_t dev, address_t addr, device_bptype_t type)
 	if (which < 0)
 		return -1;
 
-	bp = &dev->breakpoints[which];
+	bp = device_breakpoint(dev, which);
 	bp->flags = DEVICE_BP_ENABLED | DEVICE_BP_DIRTY;
 	bp->addr = addr;
+	bp->size = size;
 	bp->type = type;
 
 	return which;
@@ -55,35 +58,43 @@ static void delbrk(device_t dev, address_t addr, device_bptype_t type)
 	int i;
 
 	for (i = 0; i < dev->max_breakpoints; i++) {
-		struct device_breakpoint *bp = &dev->breakpoints[i];
+		struct device_breakpoint *bp = device_breakpoint(dev, i);
 
 		if ((bp->flags & DEVICE_BP_ENABLED) &&
 		    bp->addr == addr && bp->type == type) {
 			bp->flags = DEVICE_BP_DIRTY;
 			bp->addr = 0;
+			bp->size = 0;
 		}
 	}
 }
 
-int device_setbrk(device_t dev, int which, int enabled, address_t addr,
-		  device_bptype_t type)
+int device_setbrk_range(device_t dev, int which, int enabled,
+			address_t addr, address_t size,
+			device_bptype_t type)
 {
+	if (enabled && !size)
+		size = 1;
+
 	if (which < 0) {
 		if (enabled)
-			return addbrk(dev, addr, type);
+			return addbrk(dev, addr, size, type);
 
 		delbrk(dev, addr, type);
 	} else {
-		struct device_breakpoint *bp = &dev->breakpoints[which];
+		struct device_breakpoint *bp = device_breakpoint(dev, which);
 		int new_flags = enabled ? DEVICE_BP_ENABLED : 0;
 
-		if (!enabled)
+		if (!enabled) {
 			addr = 0;
+			size = 0;
+		}
 
-		if (bp->addr != addr ||
+		if (bp->addr != addr || bp->size != size ||
 		    (bp->flags & DEVICE_BP_ENABLED) != new_flags) {
 			bp->flags = new_flags | DEVICE_BP_DIRTY;
 			bp->addr = addr;
+			bp->size = size;
 			bp->type = type;
 		}
 	}
@@ -91,6 +102,12 @@ int device_setbrk(device_t dev, int which, int enabled, address_t addr,
 	return 0;
 }
 
+int device_setbrk(device_t dev, int which, int enabled, address_t addr,
+		  device_bptype_t type)
+{
+	return device_setbrk_range(dev, which, enabled, addr, 1, type);
+}
+
 static uint8_t tlv_data[1024];
 
 int tlv_read(device_t dev)
@@ -33,7 +33,13 @@ typedef enum {
 	DEVICE_CTL_RUN,
 	DEVICE_CTL_HALT,
 	DEVICE_CTL_STEP,
-	DEVICE_CTL_SECURE
+	DEVICE_CTL_SECURE,
+
+	/* Reverse execution, for drivers which record history. These
+	 * return 1 if they stop at the start of the recorded history.
+	 */
+	DEVICE_CTL_REVERSE_STEP,
+	DEVICE_CTL_REVERSE_RUN
 } device_ctl_t;
 
 typedef enum {
@@ -66,6 +72,11 @@ struct device_breakpoint {
 	device_bptype_t		type;
 	address_t		addr;
 	int			flags;
+
+	/* Number of bytes covered by a watchpoint, starting at addr.
+	 * Drivers which can't watch ranges use only the first address.
+	 */
+	address_t		size;
 };
 
 #define DEVICE_FLAG_JTAG	0x01 /* default is SBW */
@@ -135,21 +146,41 @@ struct device {
 	 * Instead, you should use the device_setbrk() helper function. This
 	 * will set the appropriate flags and ensure that the breakpoint is
 	 * reloaded before the next run.
+	 *
+	 * A driver which supports more than DEVICE_MAX_BREAKPOINTS provides
+	 * a table of its own in big_breakpoints, which is used instead
+	 * whenever max_breakpoints is larger. Use device_breakpoint() to
+	 * find an entry.
 	 */
 	int max_breakpoints;
 	struct device_breakpoint breakpoints[DEVICE_MAX_BREAKPOINTS];
+	struct device_breakpoint *big_breakpoints;
 
 	/* Power sample buffer, if power profiling is supported by this
 	 * device.
 	 */
 	powerbuf_t power_buf;
 
+	/* Set if the driver can run the CPU backwards, with
+	 * DEVICE_CTL_REVERSE_STEP and DEVICE_CTL_REVERSE_RUN.
+	 */
+	int can_reverse;
+
 	/* Chip information data.
 	 */
 	const struct chipinfo *chip;
 	int need_probe;
 };
 
+static inline struct device_breakpoint *device_breakpoint(device_t dev,
+							   int which)
+{
+	if (dev->max_breakpoints > DEVICE_MAX_BREAKPOINTS)
+		return &dev->big_breakpoints[which];
+
+	return &dev->breakpoints[which];
+}
+
 /* Probe the device memory and extract ID bytes. This should be called
  * after the device structure is ready.
  */
@@ -171,6 +202,13 @@ int device_is_fram(device_t dev);
 int device_setbrk(device_t dev, int which, int enabled, address_t address,
 		  device_bptype_t type);
 
+/* As for device_setbrk(), but set a watchpoint covering a range of
+ * addresses.
+ */
+int device_setbrk_range(device_t dev, int which, int enabled,
+			address_t address, address_t size,
+			device_bptype_t type);
+
 extern device_t device_default;
 
 /* Helper macros for operating on the default device */
@@ -721,6 +721,10 @@ int fet_ctl(device_t dev_base, device_ctl_t action)
 			return -1;
 		}
 		break;
+
+	default:
+		printc_err("fet: unsupported operation\n");
+		return -1;
 	}
 
 	return 0;
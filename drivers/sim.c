@@ -21,97 +21,366 @@
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+
+#ifndef __Windows__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "bytes.h"
 #include "device.h"
 #include "dis.h"
 #include "util.h"
 #include "output.h"
 #include "sim.h"
+#include "sim_device.h"
+#include "sim_profile.h"
+#include "sim_coverage.h"
+#include "sim_trace.h"
+#include "sim_semihost.h"
+#include "sim_hook.h"
+#include "sim_fuzz.h"
+#include "simio.h"
 #include "simio_cpu.h"
 #include "ctrlc.h"
+#include "opdb.h"
+#include "expr.h"
+#include "output_util.h"
+#include "stab.h"
+#include "thread.h"
 
-#define MEM_SIZE	(1<<17)
+/* Size of the memory map when no chip is specified */
+#define DEFAULT_MEM_SIZE	(1 << 17)
 
 #define ADDR_BYTE_IO_END      0x100
 
-#define SIMx	dev->base.type->name
+#define WIDTH_UNDEFINED		0
 
-struct sim_device {
-	struct device           base;
+static void add_to_pc(struct sim_device *dev, int16_t offset);
 
-	uint8_t                 memory[MEM_SIZE];
-	uint32_t                regs[DEVICE_NUM_REGS];
+/* Discard any decoded instructions which overlap the given range. An
+ * instruction may begin up to one word before the range (an extension
+ * word followed by the opcode).
+ */
+void icache_invalidate(struct sim_device *dev, uint32_t addr,
+		       uint32_t len)
+{
+	uint32_t end = addr + len;
 
-	int                     running;
-	uint32_t                current_insn;
+	addr &= ~1;
+	if (addr >= 2)
+		addr -= 2;
+	if (end > MEM_SIZE)
+		end = MEM_SIZE;
 
-	int			watchpoint_hit;
+	while (addr < end) {
+		struct sim_insn *page = dev->icache[addr >> ICACHE_PAGE_SHIFT];
 
-	int			cpux;
+		if (!page) {
+			addr = (addr | (ICACHE_PAGE_SIZE - 1)) + 1;
+			continue;
+		}
 
-	uint32_t		addr_io_end;
-};
+		page[(addr & (ICACHE_PAGE_SIZE - 1)) >> 1].handler = NULL;
+		addr += 2;
+	}
+}
 
-#define WIDTH_UNDEFINED		0
+/* Allocate a page of erased memory */
+static uint8_t *page_alloc(void)
+{
+	struct mem_page *p = malloc(sizeof(*p));
+
+	if (!p) {
+		pr_error("sim: can't allocate memory page");
+		return NULL;
+	}
 
-static int mem_setb(struct sim_device *dev, uint32_t offset, uint8_t value);
-static int mem_setw(struct sim_device *dev, uint32_t offset, uint16_t value);
-static int mem_seta(struct sim_device *dev, uint32_t offset, uint32_t value);
+	p->refs = 1;
+	memset(p->data, 0xff, sizeof(p->data));
+	return p->data;
+}
 
-static uint16_t mem_getw(struct sim_device *dev, uint32_t offset);
-static uint32_t mem_geta(struct sim_device *dev, uint32_t offset);
+uint8_t *page_ref(uint8_t *mem)
+{
+	if (mem)
+		MEM_PAGE_OF(mem)->refs++;
 
-static void add_to_pc(struct sim_device *dev, int16_t offset);
+	return mem;
+}
 
-static int mem_setb(struct sim_device *dev, uint32_t offset, uint8_t value)
+void page_unref(uint8_t *mem)
 {
-	if (offset >= MEM_SIZE) {
-		printc_err("%s: write to nonexistent addr 0x%05x at PC = 0x%05x\n",
-			SIMx,offset,dev->current_insn);
-		return -1;
+	struct mem_page *p;
+
+	if (!mem)
+		return;
+
+	p = MEM_PAGE_OF(mem);
+	if (!--p->refs)
+		free(p);
+}
+
+/* Recompute the direct access entries for a page */
+void mem_update_fast(struct sim_device *dev, uint32_t page)
+{
+	uint8_t *const mem = dev->mem_pages[page];
+	const sim_memtype_t type = dev->mem_tags[page];
+	const int is_io = (page << MEM_PAGE_SHIFT) < dev->addr_io_end;
+
+	dev->mem_read_fast[page] =
+		(type != MEM_UNMAPPED && !is_io) ? mem : NULL;
+	dev->mem_write_fast[page] =
+		(type >= MEM_FLASH && !is_io && !dev->hist_buf &&
+		 !dev->trace_mem &&
+		 !(mem && MEM_PAGE_OF(mem)->refs > 1)) ? mem : NULL;
+}
+
+/* Find the page containing the given address so that it can be
+ * modified, allocating it if it hasn't been written before, or copying
+ * it if it's shared. Fresh pages read as erased memory.
+ */
+uint8_t *mem_alloc_page(struct sim_device *dev, uint32_t offset)
+{
+	uint8_t **page = &dev->mem_pages[offset >> MEM_PAGE_SHIFT];
+
+	if (!*page || MEM_PAGE_OF(*page)->refs > 1) {
+		uint8_t *mem = page_alloc();
+
+		if (!mem)
+			return NULL;
+
+		if (*page) {
+			memcpy(mem, *page, MEM_PAGE_SIZE);
+			page_unref(*page);
+		}
+
+		*page = mem;
+		mem_update_fast(dev, offset >> MEM_PAGE_SHIFT);
+	}
+
+	return *page;
+}
+
+/* Find the page to be modified by a CPU write, or return NULL if the
+ * address can't be written.
+ */
+static uint8_t *mem_write_page(struct sim_device *dev, uint32_t offset)
+{
+	const sim_memtype_t type = mem_type(dev, offset);
+
+	if (type < MEM_FLASH) {
+		printc_err("%s: write to %s addr 0x%05x at PC = 0x%05x\n",
+			SIMx, type == MEM_ROM ? "read-only" : "nonexistent",
+			offset, dev->current_insn);
+		return NULL;
 	}
-	uint8_t *mem = dev->memory;
-	mem[offset] = value;
+
+	return mem_alloc_page(dev, offset);
+}
+
+/* Remember the old contents of memory about to be written by the CPU,
+ * if history is being recorded. Word writes are flagged in bit 31 of
+ * the address.
+ */
+#define HISTORY_WORD		0x80000000
+
+static void history_log_write(struct sim_device *dev, uint32_t addr,
+			      const uint8_t *mem)
+{
+	const int n = dev->hist_num_writes++;
+
+	if (n >= HISTORY_MAX_WRITES)
+		return;
+
+	dev->hist_write_addr[n] = addr;
+	dev->hist_write_old[n] = (addr & HISTORY_WORD) ?
+		(mem[0] | (mem[1] << 8)) : mem[0];
+}
+
+/* Slow paths for CPU memory access. These handle pages which haven't
+ * been allocated, IO memory, and addresses which are out of range or
+ * can't be written. While history or a trace of writes is being
+ * recorded, all CPU writes come this way.
+ */
+int mem_setb_slow(struct sim_device *dev, uint32_t offset,
+		  uint8_t value)
+{
+	uint8_t *page = mem_write_page(dev, offset);
+
+	if (!page)
+		return -1;
+
+	if (dev->hist_buf)
+		history_log_write(dev, offset,
+				  page + (offset & (MEM_PAGE_SIZE - 1)));
+
+	if (dev->trace_mem)
+		trace_write(dev, offset, value, 0);
+
+	page[offset & (MEM_PAGE_SIZE - 1)] = value;
+	icache_invalidate(dev, offset, 1);
+	return 0;
+}
+
+int mem_setw_slow(struct sim_device *dev, uint32_t offset,
+		  uint16_t value)
+{
+	uint8_t *page = mem_write_page(dev, offset);
+
+	if (!page)
+		return -1;
+
+	icache_invalidate(dev, offset, 2);
+	page += offset & (MEM_PAGE_SIZE - 1);
+	if (dev->hist_buf)
+		history_log_write(dev, offset | HISTORY_WORD, page);
+	if (dev->trace_mem)
+		trace_write(dev, offset, value, 1);
+	page[0] = value;
+	page[1] = value >> 8;
 	return 0;
 }
-static int mem_setw(struct sim_device *dev, uint32_t offset, uint16_t value)
+
+uint16_t mem_getw_slow(struct sim_device *dev, uint32_t offset)
 {
-	if (offset >= MEM_SIZE) {
-		printc_err("%s: write to nonexistent addr 0x%05x at PC = 0x%05x\n",
+	const uint8_t *page;
+
+	if (mem_type(dev, offset) == MEM_UNMAPPED) {
+		printc_err("%s: read from nonexistent addr 0x%05x at PC = 0x%05x\n",
 			SIMx,offset,dev->current_insn);
 		return -1;
 	}
-	uint8_t *mem = dev->memory;
-	offset &= ~1;
-	mem[offset + 0] = value;
-	mem[offset + 1] = value >> 8;
-	return 0;
+
+	page = dev->mem_pages[offset >> MEM_PAGE_SHIFT];
+	if (!page)
+		return 0xffff;
+
+	page += offset & (MEM_PAGE_SIZE - 1);
+	return (page[0] | (page[1] << 8));
 }
+
 static int mem_seta(struct sim_device *dev, uint32_t offset, uint32_t value)
 {
 	if (mem_setw(dev,offset,value) < 0) return -1;
 	return mem_setw(dev,offset+2,(value >> 16) & 0xF);
 }
-static uint16_t mem_getw(struct sim_device *dev, uint32_t offset)
+
+uint32_t mem_geta(struct sim_device *dev, uint32_t offset)
 {
-	offset &= ~1;
-	if (offset >= MEM_SIZE) {
-		printc_err("%s: read from nonexistent addr 0x%05x at PC = 0x%05x\n",
-			SIMx,offset,dev->current_insn);
-		return -1;
+	return mem_getw(dev,offset) | ((mem_getw(dev,offset+2) & 0xF) << 16);
+}
+
+/* Read memory for disassembly, without complaint. Returns the number of
+ * bytes available.
+ */
+int mem_peek(struct sim_device *dev, uint32_t addr, uint8_t *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len && addr + i < MEM_SIZE; i++) {
+		const uint8_t *page = dev->mem_pages[(addr + i) >>
+						     MEM_PAGE_SHIFT];
+
+		if (mem_type(dev, addr + i) == MEM_UNMAPPED)
+			break;
+
+		buf[i] = page ? page[(addr + i) & (MEM_PAGE_SIZE - 1)] : 0xff;
 	}
-	uint8_t *mem = dev->memory;
-	return (mem[offset] | (mem[offset+1] << 8));
+
+	return i;
 }
-static uint32_t mem_geta(struct sim_device *dev, uint32_t offset)
+
+/* Advance the PC, wrapping at 64k on the original CPU and at 1M on
+ * CPUX. The execution loop passes a constant for cpux, so that each CPU
+ * gets its own specialised copy.
+ */
+static inline void advance_pc(struct sim_device *dev, int16_t offset,
+			      int cpux)
 {
-	return mem_getw(dev,offset) | ((mem_getw(dev,offset+2) & 0xF) << 16);
+	const uint32_t mask = cpux ? 0xFFFFF : 0x0FFFF;
+
+	dev->regs[MSP430_REG_PC] = (dev->regs[MSP430_REG_PC] + offset) & mask;
 }
 
 static void add_to_pc(struct sim_device *dev, int16_t offset)
 {
-	uint32_t pc = (dev->regs[MSP430_REG_PC] + offset) & 0xFFFFF;
-	if (!dev->cpux) pc &= 0x0FFFF;
-	dev->regs[MSP430_REG_PC] = pc;
+	advance_pc(dev, offset, dev->cpux);
+}
+
+/************************************************************************
+ * Lazy status flags. Most arithmetic results are overwritten before
+ * anything looks at SR, so ALU operations just record their operands
+ * and result. The flags are computed only when SR is actually read.
+ */
+
+#define ARITH_BITS (MSP430_SR_V | MSP430_SR_N | MSP430_SR_Z | MSP430_SR_C)
+
+static uint32_t set_flags(struct sim_device *dev, sim_flags_t op,
+			  uint32_t mask, uint32_t src_data, uint32_t dst_data,
+			  uint32_t res_data)
+{
+	dev->flags_op = op;
+	dev->flags_src = src_data;
+	dev->flags_dst = dst_data;
+	dev->flags_res = res_data;
+	dev->flags_mask = mask;
+
+	return res_data;
+}
+
+static void compute_flags(struct sim_device *dev)
+{
+	const uint32_t src_data = dev->flags_src;
+	const uint32_t dst_data = dev->flags_dst;
+	const uint32_t res_data = dev->flags_res;
+	const uint32_t mask = dev->flags_mask;
+	const uint32_t msb = (mask >> 1) + 1;
+	uint32_t sr = dev->regs[MSP430_REG_SR] & ~ARITH_BITS;
+
+	if (!(res_data & mask))
+		sr |= MSP430_SR_Z;
+	if (res_data & msb)
+		sr |= MSP430_SR_N;
+
+	switch (dev->flags_op) {
+	case FLAGS_ADD:
+		if (res_data & (msb << 1))
+			sr |= MSP430_SR_C;
+		if ((src_data ^ dst_data ^ res_data ^ (res_data >> 1)) & msb)
+			sr |= MSP430_SR_V;
+		break;
+
+	case FLAGS_XOR:
+		if (src_data & dst_data & msb)
+			sr |= MSP430_SR_V;
+		/* fall through */
+
+	case FLAGS_LOGIC:
+		if (res_data & mask)
+			sr |= MSP430_SR_C;
+		break;
+
+	case FLAGS_ROTATE:
+		if (src_data & 1)
+			sr |= MSP430_SR_C;
+		break;
+	}
+
+	dev->regs[MSP430_REG_SR] = sr;
+	dev->flags_op = FLAGS_NONE;
+}
+
+/* Bring the arithmetic bits of SR up to date. This must be done before
+ * SR is read, or before any of its arithmetic bits are written directly.
+ */
+void sr_sync(struct sim_device *dev)
+{
+	if (dev->flags_op != FLAGS_NONE)
+		compute_flags(dev);
 }
 
 static int invalid_opcode(struct sim_device *dev)
@@ -123,28 +392,139 @@ static int invalid_opcode(struct sim_device *dev)
 	return -1;
 }
 
-static void watchpoint_check(struct sim_device *dev, uint16_t addr,
-			     int is_write)
+/* Rebuild the breakpoint lookup tables if any entry in the device
+ * breakpoint table has changed since they were last built.
+ */
+void update_breakpoints(struct sim_device *dev)
+{
+	int dirty = 0;
+	int i;
+
+	for (i = 0; i < dev->base.max_breakpoints; i++) {
+		struct device_breakpoint *bp = &dev->breakpoints[i];
+
+		if (bp->flags & DEVICE_BP_DIRTY) {
+			bp->flags &= ~DEVICE_BP_DIRTY;
+			dirty = 1;
+		}
+	}
+
+	if (!dirty)
+		return;
+
+	if (dev->break_map)
+		memset(dev->break_map, 0, MEM_SIZE >> 3);
+	memset(dev->watch_map, 0, sizeof(dev->watch_map));
+	dev->num_breaks = 0;
+	dev->num_watches = 0;
+
+	for (i = 0; i < dev->base.max_breakpoints; i++) {
+		const struct device_breakpoint *bp = &dev->breakpoints[i];
+
+		if (!(bp->flags & DEVICE_BP_ENABLED))
+			continue;
+
+		if (bp->type != DEVICE_BPTYPE_BREAK) {
+			address_t last = bp->addr + (bp->size ? bp->size : 1) - 1;
+			address_t line;
+
+			if (last >= MEM_SIZE || last < bp->addr)
+				last = MEM_SIZE - 1;
+
+			for (line = bp->addr >> WATCH_LINE_SHIFT;
+			     line <= (last >> WATCH_LINE_SHIFT); line++)
+				dev->watch_map[line >> 3] |= 1 << (line & 7);
+
+			dev->watch_list[dev->num_watches++] = i;
+			continue;
+		}
+
+		if (!dev->break_map) {
+			dev->break_map = calloc(MEM_SIZE >> 3, 1);
+			if (!dev->break_map)
+				pr_error("sim: can't allocate breakpoint map");
+		}
+
+		if (dev->break_map && bp->addr < MEM_SIZE)
+			dev->break_map[bp->addr >> 3] |= 1 << (bp->addr & 7);
+		dev->num_breaks++;
+	}
+}
+
+/* Is there a breakpoint at the current PC? */
+int breakpoint_check(const struct sim_device *dev)
 {
+	const uint32_t pc = dev->regs[MSP430_REG_PC];
 	int i;
 
-	for (i = 0; i < DEVICE_MAX_BREAKPOINTS; i++) {
+	if (dev->break_map && pc < MEM_SIZE)
+		return (dev->break_map[pc >> 3] >> (pc & 7)) & 1;
+
+	for (i = 0; i < dev->base.max_breakpoints; i++) {
 		const struct device_breakpoint *bp =
-			&dev->base.breakpoints[i];
+			&dev->breakpoints[i];
 
 		if ((bp->flags & DEVICE_BP_ENABLED) &&
-		    (bp->addr == addr) &&
+		    (bp->type == DEVICE_BPTYPE_BREAK) &&
+		    pc == bp->addr)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void watchpoint_match(struct sim_device *dev, uint32_t addr,
+			     int is_write)
+{
+	int i;
+
+	for (i = 0; i < dev->num_watches; i++) {
+		const int n = dev->watch_list[i];
+		const struct device_breakpoint *bp =
+			&dev->breakpoints[n];
+
+		if ((addr - bp->addr < (bp->size ? bp->size : 1)) &&
 		    ((bp->type == DEVICE_BPTYPE_WATCH ||
 		      (bp->type == DEVICE_BPTYPE_READ && !is_write) ||
 		      (bp->type == DEVICE_BPTYPE_WRITE && is_write)))) {
 			printc_dbg("Watchpoint %d triggered (0x%04x, %s)\n",
-				   i, addr, is_write ? "WRITE" : "READ");
+				   n, addr, is_write ? "WRITE" : "READ");
 			dev->watchpoint_hit = 1;
 			return;
 		}
 	}
 }
 
+/* Check for watchpoints on a memory access. Only accesses to lines
+ * which contain a watched address need to be compared against the
+ * watchpoint list.
+ */
+static void watchpoint_check(struct sim_device *dev, uint32_t addr,
+			     int is_write)
+{
+	const uint32_t line = addr >> WATCH_LINE_SHIFT;
+
+	if (line < WATCH_LINES) {
+		if (!((dev->watch_map[line >> 3] >> (line & 7)) & 1))
+			return;
+	} else if (!dev->num_watches) {
+		return;
+	}
+
+	watchpoint_match(dev, addr, is_write);
+}
+
+/* Bring the IO simulator up to the start of the current instruction, so
+ * that peripherals see programmed IO at the right time.
+ */
+static void io_flush(struct sim_device *dev)
+{
+	if (dev->io_pending) {
+		simio_step(dev->simio, dev->io_status, dev->io_pending);
+		dev->io_pending = 0;
+	}
+}
+
 static int fetch_operand(struct sim_device *dev,
 			 int amode, int reg, int opwidth,
 			 uint32_t *addr_ret, uint32_t *data_ret, int ext, int ext_imm)
@@ -160,6 +540,8 @@ static int fetch_operand(struct sim_device *dev,
 				*data_ret = 0;
 			return 0;
 		}
+		if (reg == MSP430_REG_SR)
+			sr_sync(dev);
 		if (data_ret)
 			*data_ret = dev->regs[reg] & mask;
 		return 0;
@@ -238,21 +620,29 @@ static int fetch_operand(struct sim_device *dev,
 		watchpoint_check(dev, addr, 0);
 
 		if (addr < dev->addr_io_end) {
+			dev->io_access = 1;
+			io_flush(dev);
+
+			if (dev->poll_armed &&
+			    !simio_read_stable(dev->simio, addr))
+				dev->poll_unstable = 1;
 
 			if (opwidth == 8) {
 				uint8_t byte;
-				ret = simio_read_b(addr, &byte);
+				ret = simio_read_b(dev->simio, addr, &byte);
 				*data_ret = byte;
 			} else {
 				uint16_t lsw;
 
-				ret = simio_read(addr, &lsw);
+				ret = simio_read(dev->simio, addr, &lsw);
+				*data_ret = lsw;
 
 				if (ret != 0) return ret;
 
 				if (opwidth == 20) {
 					uint16_t msw;
-					ret = simio_read(addr+2, &msw);
+					ret = simio_read(dev->simio, addr + 2,
+							 &msw);
 					*data_ret = ((msw << 16) | lsw) & 0xFFFFF;
 				} else {
 					*data_ret = lsw;
@@ -273,16 +663,31 @@ static int fetch_operand(struct sim_device *dev,
 
 static int store_operand(struct sim_device *dev,
 			 int amode, int reg, int opwidth,
-			 uint16_t addr, uint32_t data)
+			 uint32_t addr, uint32_t data)
 {
 
 	if (amode == MSP430_AMODE_REGISTER) {
 		uint32_t mask = ((1 << opwidth) - 1);
+
+		/* Writing SR replaces any pending flags */
+		if (reg == MSP430_REG_SR)
+			dev->flags_op = FLAGS_NONE;
 		dev->regs[reg] = mask & data;
 		return 0;
 	}
 
-	watchpoint_check(dev, addr, 1);
+	/* The original CPU has a 16-bit address bus */
+	if (!dev->cpux)
+		addr &= 0xFFFF;
+
+	if (!dev->watchpoint_hit) {
+		watchpoint_check(dev, addr, 1);
+		if (dev->watchpoint_hit) {
+			dev->watch_written = 1;
+			dev->watch_addr = addr;
+			dev->watch_value = data & ((1 << opwidth) - 1);
+		}
+	}
 
 	int ret = 0;
 
@@ -298,21 +703,24 @@ static int store_operand(struct sim_device *dev,
 	if (ret != 0) return ret;
 
 	if (addr < dev->addr_io_end) {
+		dev->io_access = 1;
+		io_flush(dev);
+		if (dev->semihost_port && addr == dev->semihost_port &&
+		    opwidth != 8)
+			return semihost_request(dev, data);
 		if (opwidth == 8)
-			return simio_write_b(addr, data);
+			return simio_write_b(dev->simio, addr, data);
 
-		int ret = simio_write(addr, data);
+		int ret = simio_write(dev->simio, addr, data);
 
 		if (ret != 0 || opwidth != 20) return ret;
 
-		return simio_write(addr + 2, data >> 16);
+		return simio_write(dev->simio, addr + 2, data >> 16);
 	}
 
 	return 0;
 }
 
-#define ARITH_BITS (MSP430_SR_V | MSP430_SR_N | MSP430_SR_Z | MSP430_SR_C)
-
 static int determine_op_width(uint16_t ins, uint16_t ext)
 {
 	uint16_t opcode = ins & 0xff80;
@@ -328,272 +736,322 @@ static int determine_op_width(uint16_t ins, uint16_t ext)
 		return (ins & 0x0040) ? 20 : WIDTH_UNDEFINED;
 }
 
-static int step_double(struct sim_device *dev, uint16_t ins, uint16_t ext)
+/* Number of times to execute an instruction, taking into account the
+ * repeat count of its extension word.
+ */
+static int insn_rept(struct sim_device *dev,
+		     const struct sim_insn *insn)
 {
-	uint16_t opcode = ins & 0xf000;
-	int sreg = (ins >> 8) & 0xf;
-	int amode_dst = (ins >> 7) & 1;
-	int amode_src = (ins >> 4) & 0x3;
-	int dreg = ins & 0x000f;
-	uint32_t src_data;
-	uint32_t dst_addr = 0;
-	uint32_t dst_data;
-	uint32_t res_data = 0;
-	uint32_t shiftMask = 0x000f;
-	uint32_t i = 0;
-	int cycles;
-	int rept = 1;
-	uint16_t zc_sr_mask = ~0;
+	if (insn->rept)
+		return insn->rept;
 
-	int opwidth = determine_op_width(ins,ext);
-	if (opwidth == WIDTH_UNDEFINED) {
-		printc_err("%s: invalid op width encoding at PC = 0x%04x\n",
-			SIMx,dev->current_insn);
-		return -1;
-	}
-	uint32_t mask = (1 << opwidth) - 1;
-	uint32_t msb = 1 << (opwidth - 1);
+	if ((insn->ext & 0xf) == MSP430_REG_SR)
+		sr_sync(dev);
 
-	int ext_src_bits = (ext >> 7) & 0xF;
-	int ext_dst_bits = (ext >> 0) & 0xF;
+	return (dev->regs[insn->ext & 0xf] & 0xf) + 1;
+}
 
-	if (ext && amode_src == MSP430_AMODE_REGISTER
-			&& amode_dst == MSP430_AMODE_REGISTER) {
-		/* certain ext features only supported on reg-reg ops */
-		if (ext & (1<<7))
-			rept = (dev->regs[ext_dst_bits] & 0xF) + 1;
-		else
-			rept = ext_dst_bits + 1;
-		if (ext & 0x0100) 
-			zc_sr_mask = ~MSP430_SR_C;
-	}
+/************************************************************************
+ * Arithmetic operations. These compute the result of a single- or
+ * double-operand instruction and update the status register.
+ */
 
-	if (!dev->cpux) { /* original CPU timing */
+static uint32_t carry_in(struct sim_device *dev,
+			 const struct sim_insn *insn)
+{
+	sr_sync(dev);
+	return (dev->regs[MSP430_REG_SR] & insn->carry_mask) ? 1 : 0;
+}
 
-		if (amode_dst == MSP430_AMODE_REGISTER && dreg == MSP430_REG_PC) {
-			if (amode_src == MSP430_AMODE_REGISTER ||
-			    amode_src == MSP430_AMODE_INDIRECT)
-				cycles = 2;
-			else
-				cycles = 3;
-		} else if (sreg == MSP430_REG_SR || sreg == MSP430_REG_R3) {
-			if (amode_dst == MSP430_AMODE_REGISTER)
-				cycles = 1;
-			else
-				cycles = 4;
-		} else {
-			if (amode_src == MSP430_AMODE_INDIRECT ||
-			    amode_src == MSP430_AMODE_INDIRECT_INC)
-				cycles = 2;
-			else if (amode_src == MSP430_AMODE_INDEXED)
-				cycles = 3;
-			else
-				cycles = 1;
+static uint32_t alu_mov(struct sim_device *dev, const struct sim_insn *insn,
+			uint32_t src_data, uint32_t dst_data)
+{
+	(void)dev;
+	(void)insn;
+	(void)dst_data;
 
-			if (amode_dst == MSP430_AMODE_INDEXED)
-				cycles += 3;
-		}
+	return src_data;
+}
 
-	} else { /* CPUX timing */
-		cycles = 1;					/* read opcode */
-		if (ext) cycles += 1;		/* read ext wd */
+/* ADD, ADDC, SUB, SUBC and CMP. Subtraction is performed by adding the
+ * inverted source.
+ */
+static uint32_t add_common(struct sim_device *dev,
+			   const struct sim_insn *insn,
+			   uint32_t src_data, uint32_t dst_data,
+			   uint32_t res_data)
+{
+	res_data += src_data;
+	res_data += dst_data;
 
-		if (amode_src == MSP430_AMODE_INDEXED)
-			cycles += 1;			/* read offset */
+	return set_flags(dev, FLAGS_ADD, insn->mask,
+			 src_data, dst_data, res_data);
+}
 
-		if (amode_src != MSP430_AMODE_REGISTER) {
-			cycles += 1;			/* read src value */
-			if (opwidth > 16 && (sreg != MSP430_REG_PC || amode_src != MSP430_AMODE_INDIRECT_INC))
-				cycles += 1;		/* read src value high bits */
+static uint32_t alu_add(struct sim_device *dev, const struct sim_insn *insn,
+			uint32_t src_data, uint32_t dst_data)
+{
+	return add_common(dev, insn, src_data, dst_data, 0);
+}
+
+static uint32_t alu_addc(struct sim_device *dev, const struct sim_insn *insn,
+			 uint32_t src_data, uint32_t dst_data)
+{
+	return add_common(dev, insn, src_data, dst_data,
+			  carry_in(dev, insn));
+}
+
+static uint32_t alu_sub(struct sim_device *dev, const struct sim_insn *insn,
+			uint32_t src_data, uint32_t dst_data)
+{
+	return add_common(dev, insn, src_data ^ insn->mask, dst_data, 1);
+}
+
+static uint32_t alu_subc(struct sim_device *dev, const struct sim_insn *insn,
+			 uint32_t src_data, uint32_t dst_data)
+{
+	return add_common(dev, insn, src_data ^ insn->mask, dst_data,
+			  carry_in(dev, insn));
+}
+
+static uint32_t alu_dadd(struct sim_device *dev, const struct sim_insn *insn,
+			 uint32_t src_data, uint32_t dst_data)
+{
+	const uint32_t mask = insn->mask;
+	const uint32_t msb = insn->msb;
+	uint32_t res_data = carry_in(dev, insn);
+	uint32_t shiftMask = 0x000f;
+	uint32_t i;
+
+	for(i = 0; i < 5; ++i)
+	{
+		res_data += (src_data & shiftMask) + (dst_data & shiftMask);
+		if( (res_data & (0x1f << (i*4))) > (9 << (i*4))) {
+			res_data += 6 << (i*4);
+			res_data |= (0x10 << (i*4));
+			res_data &= ~(0x20 << (i*4));
 		}
-		if (amode_dst == MSP430_AMODE_INDEXED) {
-			cycles += 1;			/* read offset; */
-			if (opcode != MSP430_OP_MOV) {
-				cycles += 1;		/* read dst value */
-				if (opwidth > 16)
-					cycles += 1;	/* read dst value high bits */
-			}
-			if (opcode != MSP430_OP_BIT && opcode != MSP430_OP_CMP) {
-				cycles += 1;		/* write dst value */
-				if (opwidth > 16)
-					cycles += 1;	/* write dst value high bits */
-			}
-		} else if (dreg == MSP430_REG_PC) {
-			if (opcode != MSP430_OP_MOV
-					&& opcode != MSP430_OP_ADD
-					&& opcode != MSP430_OP_SUB)
-				cycles += 1;	/* pipelining hit */
-			if (amode_src != MSP430_AMODE_INDIRECT_INC || sreg != MSP430_REG_PC)
-				cycles += 1;	/* pipelining hit */
-		}
-		cycles += rept - 1;
+		shiftMask = shiftMask << 4;
 	}
 
-	if (fetch_operand(dev, amode_src, sreg, opwidth, NULL, &src_data, ext, ext_src_bits) < 0)
-		return -1;
-	if (fetch_operand(dev, amode_dst, dreg, opwidth, &dst_addr,
-			  opcode == MSP430_OP_MOV ? NULL : &dst_data, ext, ext_dst_bits) < 0)
-		return -1;
+	dev->regs[MSP430_REG_SR] &= ~ARITH_BITS;
+	if (!(res_data & mask))
+		dev->regs[MSP430_REG_SR] |= MSP430_SR_Z;
+	if (res_data & msb)
+		dev->regs[MSP430_REG_SR] |= MSP430_SR_N;
+	if (res_data & (msb << 1))
+		dev->regs[MSP430_REG_SR] |= MSP430_SR_C;
 
-	while (rept--) {
+	/* V not specified for DADD, but FR5939 appears to match: */
+	const int S = insn->opwidth - 4;
+	if (	(!((src_data^dst_data)&msb) && (
+				((8<<S) <= res_data && res_data < (10<<S)) ||
+				((22<<S) <= res_data && res_data < (24<<S))
+				)) ||
+			(src_data + dst_data >= (20<<S) && !(res_data & msb)) )
+		dev->regs[MSP430_REG_SR] |= MSP430_SR_V;
 
-		uint32_t src_save = src_data;
+	return res_data;
+}
 
-		switch (opcode) {
-		case MSP430_OP_MOV:
-			res_data = src_data;
-			break;
+/* AND and BIT */
+static uint32_t alu_and(struct sim_device *dev, const struct sim_insn *insn,
+			uint32_t src_data, uint32_t dst_data)
+{
+	return set_flags(dev, FLAGS_LOGIC, insn->mask,
+			 src_data, dst_data, src_data & dst_data);
+}
 
-		case MSP430_OP_SUB:
-		case MSP430_OP_SUBC:
-		case MSP430_OP_CMP:
-			src_data ^= mask;
-		case MSP430_OP_ADD:
-		case MSP430_OP_ADDC:
-			if (opcode == MSP430_OP_ADDC || opcode == MSP430_OP_SUBC)
-				res_data = (dev->regs[MSP430_REG_SR] & zc_sr_mask &
-					    MSP430_SR_C) ? 1 : 0;
-			else if (opcode == MSP430_OP_SUB || opcode == MSP430_OP_CMP)
-				res_data = 1;
-			else
-				res_data = 0;
-
-			res_data += src_data;
-			res_data += dst_data;
-
-			dev->regs[MSP430_REG_SR] &= ~ARITH_BITS;
-			if (!(res_data & mask))
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_Z;
-			if (res_data & msb)
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_N;
-			if (res_data & (msb << 1))
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_C;
-			if ((src_data ^ dst_data ^
-					res_data ^ (res_data>>1)) & msb)
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_V;
-			break;
+static uint32_t alu_bic(struct sim_device *dev, const struct sim_insn *insn,
+			uint32_t src_data, uint32_t dst_data)
+{
+	(void)dev;
+	(void)insn;
 
-		case MSP430_OP_DADD:
-			res_data = 0;
-			if (dev->regs[MSP430_REG_SR] & zc_sr_mask & MSP430_SR_C)
-				res_data++;
-			shiftMask = 0x000f;
-			for(i = 0; i < 5; ++i)
-			{
-				res_data += (src_data & shiftMask) + (dst_data & shiftMask);
-				if( (res_data & (0x1f << (i*4))) > (9 << (i*4))) {
-					res_data += 6 << (i*4);
-					res_data |= (0x10 << (i*4));
-					res_data &= ~(0x20 << (i*4));
-				}
-				shiftMask = shiftMask << 4;
-			}
+	return dst_data & ~src_data;
+}
+
+static uint32_t alu_bis(struct sim_device *dev, const struct sim_insn *insn,
+			uint32_t src_data, uint32_t dst_data)
+{
+	(void)dev;
+	(void)insn;
 
-			dev->regs[MSP430_REG_SR] &= ~ARITH_BITS;
-			if (!(res_data & mask))
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_Z;
-			if (res_data & msb)
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_N;
-			if (res_data & (msb << 1))
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_C;
-
-			/* V not specified for DADD, but FR5939 appears to match: */
-			const int S = opwidth - 4;
-			if (	(!((src_data^dst_data)&msb) && (
-						((8<<S) <= res_data && res_data < (10<<S)) ||
-						((22<<S) <= res_data && res_data < (24<<S))
-						)) ||
-					(src_data + dst_data >= (20<<S) && !(res_data & msb)) )
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_V;
+	return dst_data | src_data;
+}
 
-			break;
+static uint32_t alu_xor(struct sim_device *dev, const struct sim_insn *insn,
+			uint32_t src_data, uint32_t dst_data)
+{
+	return set_flags(dev, FLAGS_XOR, insn->mask,
+			 src_data, dst_data, dst_data ^ src_data);
+}
 
-		case MSP430_OP_BIT:
-		case MSP430_OP_AND:
-			res_data = src_data & dst_data;
+/* RRC and RRA. The single-operand operations take their operand in
+ * src_data.
+ */
+static uint32_t rotate_common(struct sim_device *dev,
+			      const struct sim_insn *insn,
+			      uint32_t src_data, uint32_t res_data)
+{
+	return set_flags(dev, FLAGS_ROTATE, insn->mask,
+			 src_data, 0, res_data);
+}
 
-			dev->regs[MSP430_REG_SR] &= ~ARITH_BITS;
-			dev->regs[MSP430_REG_SR] |=
-				(res_data & mask) ? MSP430_SR_C : MSP430_SR_Z;
-			if (res_data & msb)
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_N;
-			break;
+static uint32_t alu_rrc(struct sim_device *dev, const struct sim_insn *insn,
+			uint32_t src_data, uint32_t dst_data)
+{
+	uint32_t res_data = (src_data >> 1) & ~insn->msb;
 
-		case MSP430_OP_BIC:
-			res_data = dst_data & ~src_data;
-			break;
+	(void)dst_data;
 
-		case MSP430_OP_BIS:
-			res_data = dst_data | src_data;
-			break;
+	if (carry_in(dev, insn))
+		res_data |= insn->msb;
 
-		case MSP430_OP_XOR:
-			res_data = dst_data ^ src_data;
-			dev->regs[MSP430_REG_SR] &= ~ARITH_BITS;
-			dev->regs[MSP430_REG_SR] |=
-				(res_data & mask) ? MSP430_SR_C : MSP430_SR_Z;
-			if (res_data & msb)
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_N;
-			if (src_data & dst_data & msb)
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_V;
-			break;
+	return rotate_common(dev, insn, src_data, res_data);
+}
 
-		default:
-			return invalid_opcode(dev);
-		}
+static uint32_t alu_rra(struct sim_device *dev, const struct sim_insn *insn,
+			uint32_t src_data, uint32_t dst_data)
+{
+	uint32_t res_data = (src_data >> 1) & ~insn->msb;
 
-		/* no need to repeat ops that will yeild same result every time */
-		if (opcode == MSP430_OP_CMP || opcode == MSP430_OP_BIT
-			|| opcode == MSP430_OP_BIS || opcode == MSP430_OP_BIC
-			|| opcode == MSP430_OP_AND)
-			break;
+	(void)dst_data;
+
+	res_data |= src_data & insn->msb;
+	return rotate_common(dev, insn, src_data, res_data);
+}
+
+static uint32_t alu_swpb(struct sim_device *dev, const struct sim_insn *insn,
+			 uint32_t src_data, uint32_t dst_data)
+{
+	uint32_t res_data;
+
+	(void)dev;
+	(void)dst_data;
+
+	res_data = ((src_data & 0xff) << 8) | ((src_data >> 8) & 0xff);
+	if (insn->opwidth == 20)
+		res_data |= src_data & 0xF0000;
+
+	return res_data;
+}
+
+static uint32_t alu_sxt(struct sim_device *dev, const struct sim_insn *insn,
+			uint32_t src_data, uint32_t dst_data)
+{
+	(void)dst_data;
+
+	sr_sync(dev);
+	dev->regs[MSP430_REG_SR] &= ~ARITH_BITS;
 
-		src_data = src_save;
-		dst_data = res_data & mask;
-		if (dreg == sreg)
-			src_data = res_data & mask;
+	/* Although not documented by TI, the FR5739 extends from
+	   bit 15 rather than from bit 7 if the ZC bit of the extended
+	   opcode word is set.  This is implemented here.  */
+
+	uint32_t signbit = ((insn->ext & 0x0100) ? 0x08000 : 0x00080);
+
+	uint32_t res_data = src_data & (signbit - 1);
+
+	if (src_data & signbit) {
+		res_data |= ((1<<20) - signbit);
+		dev->regs[MSP430_REG_SR] |= MSP430_SR_N;
 	}
 
-	if (opcode != MSP430_OP_CMP && opcode != MSP430_OP_BIT &&
-		store_operand(dev, amode_dst, dreg, opwidth,
-			      dst_addr, res_data) < 0)
-		return -1;
+	dev->regs[MSP430_REG_SR] |=
+		res_data ? MSP430_SR_C : MSP430_SR_Z;
 
-	return cycles;
+	return res_data;
 }
 
-static int step_single(struct sim_device *dev, uint16_t ins, uint16_t ext)
+/************************************************************************
+ * Instruction timing. These are evaluated once, when an instruction is
+ * decoded, and give the cycle count for a single repetition.
+ */
+
+static int double_cycles(const struct sim_device *dev,
+			 const struct sim_insn *insn)
 {
-	uint16_t opcode = ins & 0xff80;
-	int amode = (ins >> 4) & 0x3;
-	int reg = ins & 0x000f;
-	uint32_t src_addr = 0;
-	uint32_t src_data;
-	uint32_t res_data = 0;
-	int cycles = 1;
-	int rept = 1;
-	uint16_t zc_sr_mask = ~0;
-	int store_results = 1;
+	uint16_t opcode = insn->ins & 0xf000;
+	int sreg = insn->sreg;
+	int amode_dst = insn->amode_dst;
+	int amode_src = insn->amode_src;
+	int dreg = insn->dreg;
+	int opwidth = insn->opwidth;
+	int cycles;
 
-	int opwidth = determine_op_width(ins,ext);
-	if (opwidth == WIDTH_UNDEFINED)
-		return invalid_opcode(dev);
+	if (!dev->cpux) { /* original CPU timing */
 
-	uint32_t mask = (1 << opwidth) - 1;
-	uint32_t msb = 1 << (opwidth - 1);
+		if (amode_dst == MSP430_AMODE_REGISTER && dreg == MSP430_REG_PC) {
+			if (amode_src == MSP430_AMODE_REGISTER ||
+			    amode_src == MSP430_AMODE_INDIRECT)
+				cycles = 2;
+			else
+				cycles = 3;
+		} else if (sreg == MSP430_REG_SR || sreg == MSP430_REG_R3) {
+			if (amode_dst == MSP430_AMODE_REGISTER)
+				cycles = 1;
+			else
+				cycles = 4;
+		} else {
+			if (amode_src == MSP430_AMODE_INDIRECT ||
+			    amode_src == MSP430_AMODE_INDIRECT_INC)
+				cycles = 2;
+			else if (amode_src == MSP430_AMODE_INDEXED)
+				cycles = 3;
+			else
+				cycles = 1;
 
-	int ext_dst_bits = (ext >> 0) & 0xF;
+			if (amode_dst == MSP430_AMODE_INDEXED)
+				cycles += 3;
+		}
 
-	if (ext && amode == MSP430_AMODE_REGISTER) {
-		/* certain ext features only supported on reg ops */
-		if (ext & (1<<7))
-			rept = (dev->regs[ext_dst_bits] & 0xF) + 1;
-		else
-			rept = ext_dst_bits + 1;
-		if (ext & 0x0100) 
-			zc_sr_mask = ~MSP430_SR_C;
+	} else { /* CPUX timing */
+		cycles = 1;					/* read opcode */
+		if (insn->ext) cycles += 1;	/* read ext wd */
+
+		if (amode_src == MSP430_AMODE_INDEXED)
+			cycles += 1;			/* read offset */
+
+		if (amode_src != MSP430_AMODE_REGISTER) {
+			cycles += 1;			/* read src value */
+			if (opwidth > 16 && (sreg != MSP430_REG_PC || amode_src != MSP430_AMODE_INDIRECT_INC))
+				cycles += 1;		/* read src value high bits */
+		}
+		if (amode_dst == MSP430_AMODE_INDEXED) {
+			cycles += 1;			/* read offset; */
+			if (opcode != MSP430_OP_MOV) {
+				cycles += 1;		/* read dst value */
+				if (opwidth > 16)
+					cycles += 1;	/* read dst value high bits */
+			}
+			if (opcode != MSP430_OP_BIT && opcode != MSP430_OP_CMP) {
+				cycles += 1;		/* write dst value */
+				if (opwidth > 16)
+					cycles += 1;	/* write dst value high bits */
+			}
+		} else if (dreg == MSP430_REG_PC) {
+			if (opcode != MSP430_OP_MOV
+					&& opcode != MSP430_OP_ADD
+					&& opcode != MSP430_OP_SUB)
+				cycles += 1;	/* pipelining hit */
+			if (amode_src != MSP430_AMODE_INDIRECT_INC || sreg != MSP430_REG_PC)
+				cycles += 1;	/* pipelining hit */
+		}
 	}
 
+	return cycles;
+}
+
+static int single_cycles(const struct sim_device *dev,
+			 const struct sim_insn *insn)
+{
+	uint16_t opcode = insn->ins & 0xff80;
+	int amode = insn->amode_dst;
+	int reg = insn->dreg;
+	int opwidth = insn->opwidth;
+	int cycles = 1;
+
 	if (!dev->cpux) { /* original CPU timing */
 
 		switch (opcode) {
@@ -629,7 +1087,7 @@ static int step_single(struct sim_device *dev, uint16_t ins, uint16_t ext)
 
 	} else { /* CPUX timing */
 		cycles = 1;					/* read opcode */
-		if (ext) cycles += 1;		/* read ext wd */
+		if (insn->ext) cycles += 1;	/* read ext wd */
 
 		if (amode == MSP430_AMODE_INDEXED)
 			cycles += 1;			/* read offset */
@@ -660,9 +1118,6 @@ static int step_single(struct sim_device *dev, uint16_t ins, uint16_t ext)
 			if (opwidth == 20 && amode == MSP430_AMODE_INDEXED)
 				cycles += 1;	/* reason unknown */
 
-			if (opwidth > 16)
-				cycles += rept - 1;
-
 			break;
 
 		default:
@@ -673,166 +1128,175 @@ static int step_single(struct sim_device *dev, uint16_t ins, uint16_t ext)
 			}
 			break;
 		}
-		cycles += rept - 1;
 	}
 
-	if (fetch_operand(dev, amode, reg, opwidth, &src_addr, &src_data,
-			ext, ext_dst_bits) < 0)
-		return -1;
-
-	while (rept--) {
-		switch (opcode) {
-		case MSP430_OP_RRC:
-		case MSP430_OP_RRA:
-			res_data = (src_data >> 1) & ~msb;
-			if (opcode == MSP430_OP_RRC) {
-				if (dev->regs[MSP430_REG_SR] & zc_sr_mask & MSP430_SR_C)
-					res_data |= msb;
-			} else {
-				res_data |= src_data & msb;
-			}
-
-			dev->regs[MSP430_REG_SR] &= ~ARITH_BITS;
-			if (!(res_data & mask))
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_Z;
-			if (res_data & msb)
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_N;
-			if (src_data & 1)
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_C;
-			break;
-
-		case MSP430_OP_SWPB:
-			res_data = ((src_data & 0xff) << 8) | ((src_data >> 8) & 0xff);
-			if (opwidth == 20)
-				res_data |= src_data & 0xF0000;
-			break;
-
-		case MSP430_OP_SXT:
-			dev->regs[MSP430_REG_SR] &= ~ARITH_BITS;
-
-			/* Although not documented by TI, the FR5739 extends from
-			   bit 15 rather than from bit 7 if the ZC bit of the extended
-			   opcode word is set.  This is implemented here.  */
+	return cycles;
+}
 
-			uint32_t signbit = ((ext & 0x0100) ? 0x08000 : 0x00080);
+/************************************************************************
+ * Instruction handlers
+ */
 
-			res_data = src_data & (signbit - 1);
+static int step_double(struct sim_device *dev, const struct sim_insn *insn)
+{
+	uint32_t src_data;
+	uint32_t dst_addr = 0;
+	uint32_t dst_data = 0;
+	uint32_t res_data;
+	int rept = insn_rept(dev, insn);
+	int cycles = insn->cycles + rept - 1;
 
-			if (src_data & signbit) {
-				res_data |= ((1<<20) - signbit);
-				dev->regs[MSP430_REG_SR] |= MSP430_SR_N;
-			}
+	if (fetch_operand(dev, insn->amode_src, insn->sreg, insn->opwidth,
+			  NULL, &src_data, insn->ext, (insn->ext >> 7) & 0xf) < 0)
+		return -1;
+	if (fetch_operand(dev, insn->amode_dst, insn->dreg, insn->opwidth,
+			  &dst_addr,
+			  (insn->flags & SIM_OP_NO_FETCH) ? NULL : &dst_data,
+			  insn->ext, insn->ext & 0xf) < 0)
+		return -1;
 
-			dev->regs[MSP430_REG_SR] |=
-				res_data ? MSP430_SR_C : MSP430_SR_Z;
+	for (;;) {
+		res_data = insn->alu(dev, insn, src_data, dst_data);
 
-			if (amode == MSP430_AMODE_REGISTER && dev->cpux)
-				opwidth = 20;	/* store all bits for reg dst */
+		/* no need to repeat ops that will yeild same result every time */
+		if (!--rept || (insn->flags & SIM_OP_NO_REPEAT))
 			break;
 
-		case MSP430_OP_PUSH:
-			res_data = src_data; // in case of repeat
-
-			dev->regs[MSP430_REG_SP] -= opwidth <= 16 ? 2 : 4;
-
-			if (opwidth == 8)
-				src_data |= mem_getw(dev, dev->regs[MSP430_REG_SP]) & 0xFF00;
-
-			if (((opwidth <= 16)
-				? mem_setw(dev, dev->regs[MSP430_REG_SP], src_data)
-				: mem_seta(dev, dev->regs[MSP430_REG_SP], src_data)) < 0)
-				return -1;
+		dst_data = res_data & insn->mask;
+		if (insn->dreg == insn->sreg)
+			src_data = dst_data;
+	}
 
-			store_results = 0;
-			break;
+	if (!(insn->flags & SIM_OP_NO_STORE) &&
+		store_operand(dev, insn->amode_dst, insn->dreg, insn->opwidth,
+			      dst_addr, res_data) < 0)
+		return -1;
 
-		case MSP430_OP_CALL:
-			dev->regs[MSP430_REG_SP] -= 2;
-			if (mem_setw(dev, dev->regs[MSP430_REG_SP],
-				 dev->regs[MSP430_REG_PC]) < 0)
-				 return -1;
-			dev->regs[MSP430_REG_PC] = src_data & 0xFFFF;
-			store_results = 0;
-			break;
+	return cycles;
+}
 
-		case MSP430_OP_RETI:
-			/* handled in step_reti_calla() for CPUX */
+/* RRC, SWPB, RRA and SXT */
+static int step_single(struct sim_device *dev, const struct sim_insn *insn)
+{
+	uint32_t src_addr = 0;
+	uint32_t src_data;
+	uint32_t res_data = 0;
+	int rept = insn_rept(dev, insn);
+	int cycles = insn->cycles + rept - 1;
 
-			{
-			dev->regs[MSP430_REG_SR] = 
-				mem_getw(dev, dev->regs[MSP430_REG_SP]) & 0x0FFF;
-			dev->regs[MSP430_REG_SP] += 2;
-			dev->regs[MSP430_REG_PC] =
-				mem_getw(dev, dev->regs[MSP430_REG_SP]);
-			dev->regs[MSP430_REG_SP] += 2;
-			store_results = 0;
-			}
-			break;
+	if (fetch_operand(dev, insn->amode_dst, insn->dreg, insn->opwidth,
+			  &src_addr, &src_data, insn->ext, insn->ext & 0xf) < 0)
+		return -1;
 
-		default:
-			return invalid_opcode(dev);
-		}
+	while (rept--) {
+		res_data = insn->alu(dev, insn, src_data, 0);
 		src_data = res_data;
 	}
 
-	if (store_results &&
-			store_operand(dev, amode, reg, opwidth, src_addr, res_data) < 0)
+	/* SXT stores all bits for reg dst */
+	if (store_operand(dev, insn->amode_dst, insn->dreg,
+			  (insn->flags & SIM_OP_WIDE_STORE) ? 20 : insn->opwidth,
+			  src_addr, res_data) < 0)
 		return -1;
 
 	return cycles;
 }
 
-static int step_jump(struct sim_device *dev, uint16_t ins)
+static int step_push(struct sim_device *dev, const struct sim_insn *insn)
 {
-	uint16_t opcode = ins & 0xfc00;
-	int32_t pc_offset = (((ins + 0x200) & 0x03ff) - 0x200) << 1;
-	uint16_t sr = dev->regs[MSP430_REG_SR];
+	const int opwidth = insn->opwidth;
+	uint32_t src_data;
+	int rept = insn_rept(dev, insn);
+	int cycles = insn->cycles + rept - 1;
 
-	switch (opcode) {
-	case MSP430_OP_JNZ:
-		sr = !(sr & MSP430_SR_Z);
-		break;
+	if (opwidth > 16)
+		cycles += rept - 1;
 
-	case MSP430_OP_JZ:
-		sr &= MSP430_SR_Z;
-		break;
+	if (fetch_operand(dev, insn->amode_dst, insn->dreg, opwidth,
+			  NULL, &src_data, insn->ext, insn->ext & 0xf) < 0)
+		return -1;
 
-	case MSP430_OP_JNC:
-		sr = !(sr & MSP430_SR_C);
-		break;
+	while (rept--) {
+		uint32_t data = src_data;
 
-	case MSP430_OP_JC:
-		sr &= MSP430_SR_C;
-		break;
+		dev->regs[MSP430_REG_SP] -= opwidth <= 16 ? 2 : 4;
 
-	case MSP430_OP_JN:
-		sr &= MSP430_SR_N;
-		break;
+		if (opwidth == 8)
+			data |= mem_getw(dev, dev->regs[MSP430_REG_SP]) & 0xFF00;
 
-	case MSP430_OP_JGE:
-		sr = ((sr & MSP430_SR_N) ? 1 : 0) ==
-			((sr & MSP430_SR_V) ? 1 : 0);
-		break;
+		if (((opwidth <= 16)
+			? mem_setw(dev, dev->regs[MSP430_REG_SP], data)
+			: mem_seta(dev, dev->regs[MSP430_REG_SP], data)) < 0)
+			return -1;
+	}
 
-	case MSP430_OP_JL:
-		sr = ((sr & MSP430_SR_N) ? 1 : 0) !=
-			((sr & MSP430_SR_V) ? 1 : 0);
-		break;
+	return cycles;
+}
 
-	case MSP430_OP_JMP:
-		sr = 1;
-		break;
-	}
+static int step_call(struct sim_device *dev, const struct sim_insn *insn)
+{
+	uint32_t src_data;
 
-	if (sr) {
-		add_to_pc(dev,pc_offset);
-	}
+	if (fetch_operand(dev, insn->amode_dst, insn->dreg, insn->opwidth,
+			  NULL, &src_data, insn->ext, insn->ext & 0xf) < 0)
+		return -1;
+
+	dev->regs[MSP430_REG_SP] -= 2;
+	if (mem_setw(dev, dev->regs[MSP430_REG_SP],
+		 dev->regs[MSP430_REG_PC]) < 0)
+		 return -1;
+	dev->regs[MSP430_REG_PC] = src_data & 0xFFFF;
+
+	return insn->cycles;
+}
+
+/* RETI for the original CPU. CPUX handles this in step_reti_calla(). */
+static int step_reti(struct sim_device *dev, const struct sim_insn *insn)
+{
+	dev->flags_op = FLAGS_NONE;
+	dev->regs[MSP430_REG_SR] =
+		mem_getw(dev, dev->regs[MSP430_REG_SP]) & 0x0FFF;
+	dev->regs[MSP430_REG_SP] += 2;
+	dev->regs[MSP430_REG_PC] =
+		mem_getw(dev, dev->regs[MSP430_REG_SP]);
+	dev->regs[MSP430_REG_SP] += 2;
+
+	return insn->cycles;
+}
 
-	return 2;
+/* Conditional jumps. The offset is computed when the instruction is
+ * decoded. Each jump is built once for each CPU.
+ */
+#define JUMP_FUNC_CPU(name, cpux, cond) \
+static int name(struct sim_device *dev, const struct sim_insn *insn) \
+{ \
+	uint16_t sr; \
+\
+	sr_sync(dev); \
+	sr = dev->regs[MSP430_REG_SR]; \
+	(void)sr; \
+	if (cond) \
+		advance_pc(dev, insn->offset, cpux); \
+\
+	return 2; \
 }
 
-static int step_RxxM(struct sim_device *dev, uint16_t ins)
+#define JUMP_FUNC(name, cond) \
+	JUMP_FUNC_CPU(name##_msp430, 0, cond) \
+	JUMP_FUNC_CPU(name##_cpux, 1, cond)
+
+JUMP_FUNC(step_jnz, !(sr & MSP430_SR_Z))
+JUMP_FUNC(step_jz, sr & MSP430_SR_Z)
+JUMP_FUNC(step_jnc, !(sr & MSP430_SR_C))
+JUMP_FUNC(step_jc, sr & MSP430_SR_C)
+JUMP_FUNC(step_jn, sr & MSP430_SR_N)
+JUMP_FUNC(step_jge, !(sr & MSP430_SR_N) == !(sr & MSP430_SR_V))
+JUMP_FUNC(step_jl, !(sr & MSP430_SR_N) != !(sr & MSP430_SR_V))
+JUMP_FUNC(step_jmp, 1)
+
+static int step_RxxM(struct sim_device *dev, const struct sim_insn *insn)
 {
+	uint16_t ins = insn->ins;
 	/* RxxM instruction */
 	// XXX TBD
 
@@ -845,12 +1309,15 @@ static int step_RxxM(struct sim_device *dev, uint16_t ins)
 	uint32_t mask = (1 << opwidth) - 1;
 	uint32_t msb = 1 << (opwidth - 1);
 
-	uint32_t src_data = dev->regs[dreg] & mask;
+	uint32_t src_data;
 	uint32_t res_data = 0;
-
-	uint32_t cy = dev->regs[MSP430_REG_SR] & MSP430_SR_C;
+	uint32_t cy;
 	uint32_t oflo = 0;
 
+	sr_sync(dev);
+	src_data = dev->regs[dreg] & mask;
+	cy = dev->regs[MSP430_REG_SR] & MSP430_SR_C;
+
 
 	while (rept--) {
 
@@ -928,8 +1395,9 @@ const struct addr_inst_info_s addr_inst_lut[] = {
 *	in two cycles, and so that value is used here.
 */
 
-static int step_0xxx_addr(struct sim_device *dev, uint16_t ins)
+static int step_0xxx_addr(struct sim_device *dev, const struct sim_insn *insn)
 {
+	uint16_t ins = insn->ins;
 	/* MSP430_OP_MOVA, MSP430_OP_CMPA, MSP430_OP_ADDA, MSP430_OP_SUBA */
 
 	const struct addr_inst_info_s *info = &addr_inst_lut[(ins & 0x00F0) >> 4];
@@ -940,6 +1408,8 @@ static int step_0xxx_addr(struct sim_device *dev, uint16_t ins)
 	int src = (ins & 0x0F00) >> 8;
 	int dst = (ins & 0x000F) >> 0;
 
+	sr_sync(dev);
+
 	const uint32_t mask = 0xFFFFF;
 	const uint32_t msb  = 0x80000;
 
@@ -1054,230 +1524,2103 @@ static int step_0xxx_addr(struct sim_device *dev, uint16_t ins)
 }
 
 
-static int step_pushm_popm(struct sim_device *dev, uint16_t ins)
+static int step_pushm_popm(struct sim_device *dev, const struct sim_insn *insn)
+{
+	uint16_t ins = insn->ins;
+	/* PUSHM/POPM */
+
+	uint16_t opcode = ins & 0xfe00;
+	int is_aword = ins & 0x0100;
+	int reg = ins & 0x000f;
+	int rept = ((ins >> 4) & 0xf) + 1;
+
+	int cycles = 2 + (is_aword ? 2 : 1) * rept;
+
+	sr_sync(dev);
+
+	switch (opcode) {
+
+	case MSP430_OP_PUSHM:
+		while (rept--) {
+			dev->regs[MSP430_REG_SP] -= 2;
+			if (mem_setw(dev, dev->regs[MSP430_REG_SP], dev->regs[reg--]) < 0)
+				return -1;
+		}
+		break;
+
+	case MSP430_OP_POPM:
+		while (rept--) {
+			dev->regs[reg++] = mem_getw(dev, dev->regs[MSP430_REG_SP]);
+			dev->regs[MSP430_REG_SP] += 2;
+		}
+		break;
+
+	default:
+		return invalid_opcode(dev);
+	};
+
+	return cycles;
+}
+
+static int step_reti_calla(struct sim_device *dev, const struct sim_insn *insn)
+{
+	uint16_t ins = insn->ins;
+	/* RETI, CALLA */
+
+	int amode;
+	int reg = 0;
+	int ext_imm = 0;
+	uint32_t data;
+	int cycles = 0;
+
+	sr_sync(dev);
+
+	switch ((ins & 0x00C0)>>6) {
+		case 0:				/* RETI */
+			/* note: RETI handled in step_single() for basic CPU */
+			if (ins != MSP430_OP_RETI)
+				return invalid_opcode(dev);
+
+			uint16_t w1 = mem_getw(dev, dev->regs[MSP430_REG_SP]);
+			dev->regs[MSP430_REG_SR] = w1 & 0x0FFF;
+			dev->regs[MSP430_REG_SP] += 2;
+			dev->regs[MSP430_REG_PC] =
+				mem_getw(dev, dev->regs[MSP430_REG_SP]);
+			dev->regs[MSP430_REG_PC] |= ((w1 & 0xF000) << 4);
+			dev->regs[MSP430_REG_SP] += 2;
+			cycles = 5;
+
+		case 1:				/* CALLA Rd, x(Rd), @Rd, @Rd+ */
+			amode = (ins & 0x30) >> 4;
+			reg = (ins & 0xF);
+			cycles = (amode & 2) ? 6 : 5;
+			if (amode == 1 && reg == MSP430_REG_SP)
+				cycles++;
+			goto calla_common;
+
+		case 2:				/* CALLA &abs20, rel20, #imm20 */
+			if ((ins & 0x30) == 0x20)
+				return invalid_opcode(dev);
+
+			amode = ((ins & 0x30) >> 4) | 1;
+			ext_imm = (ins & 0xF);
+			cycles = (amode & 2) ? 5 : 7;
+			goto calla_common;
+
+		calla_common:
+
+			if (fetch_operand(dev,amode,reg,20,NULL,&data,1,ext_imm) < 0)
+				return -1;
+
+			dev->regs[MSP430_REG_SP] -= 4;
+			if (mem_setw(dev, dev->regs[MSP430_REG_SP] + 2,
+				 (dev->regs[MSP430_REG_PC] >> 16) & 0x0000F) < 0)
+				 return -1;
+			if (mem_setw(dev, dev->regs[MSP430_REG_SP],
+				 dev->regs[MSP430_REG_PC]) < 0)
+				 return -1;
+			dev->regs[MSP430_REG_PC] = data;
+			break;
+
+		case 3:				/* RESERVED */
+			return invalid_opcode(dev);
+	}
+	return cycles;
+}
+
+static int step_invalid(struct sim_device *dev, const struct sim_insn *insn)
+{
+	(void)insn;
+	return invalid_opcode(dev);
+}
+
+static int step_bad_width(struct sim_device *dev, const struct sim_insn *insn)
+{
+	(void)insn;
+	printc_err("%s: invalid op width encoding at PC = 0x%04x\n",
+		SIMx,dev->current_insn);
+	return -1;
+}
+
+/************************************************************************
+ * Instruction decoding
+ *
+ * Instructions are classified by looking up their top 12 bits in a
+ * dispatch table. There is one table for the original CPU, and two
+ * for CPUX: one for ordinary instructions and one for instructions
+ * following an extension word.
+ */
+
+typedef enum {
+	SIM_FMT_OTHER,
+	SIM_FMT_DOUBLE,
+	SIM_FMT_SINGLE,
+	SIM_FMT_JUMP
+} sim_format_t;
+
+struct sim_op {
+	sim_handler_t		handler;
+	sim_alu_t		alu;
+	int			flags;
+	sim_format_t		format;
+};
+
+#define DISPATCH_SIZE		4096
+#define DISPATCH_INDEX(ins)	((ins) >> 4)
+
+static const struct sim_op double_ops[16] = {
+	[0x4] = {step_double, alu_mov,	SIM_OP_NO_FETCH, SIM_FMT_DOUBLE},
+	[0x5] = {step_double, alu_add,	0, SIM_FMT_DOUBLE},
+	[0x6] = {step_double, alu_addc,	0, SIM_FMT_DOUBLE},
+	[0x7] = {step_double, alu_subc,	0, SIM_FMT_DOUBLE},
+	[0x8] = {step_double, alu_sub,	0, SIM_FMT_DOUBLE},
+	[0x9] = {step_double, alu_sub,
+		 SIM_OP_NO_STORE | SIM_OP_NO_REPEAT, SIM_FMT_DOUBLE},
+	[0xa] = {step_double, alu_dadd,	0, SIM_FMT_DOUBLE},
+	[0xb] = {step_double, alu_and,
+		 SIM_OP_NO_STORE | SIM_OP_NO_REPEAT, SIM_FMT_DOUBLE},
+	[0xc] = {step_double, alu_bic,	SIM_OP_NO_REPEAT, SIM_FMT_DOUBLE},
+	[0xd] = {step_double, alu_bis,	SIM_OP_NO_REPEAT, SIM_FMT_DOUBLE},
+	[0xe] = {step_double, alu_xor,	0, SIM_FMT_DOUBLE},
+	[0xf] = {step_double, alu_and,	SIM_OP_NO_REPEAT, SIM_FMT_DOUBLE}
+};
+
+static const struct sim_op single_ops[8] = {
+	{step_single,	alu_rrc,	0, SIM_FMT_SINGLE},
+	{step_single,	alu_swpb,	0, SIM_FMT_SINGLE},
+	{step_single,	alu_rra,	0, SIM_FMT_SINGLE},
+	{step_single,	alu_sxt,	0, SIM_FMT_SINGLE},
+	{step_push,	NULL,		0, SIM_FMT_SINGLE},
+	{step_call,	NULL,		0, SIM_FMT_SINGLE},
+	{step_reti,	NULL,		0, SIM_FMT_SINGLE},
+	{step_invalid,	NULL,		0, SIM_FMT_OTHER}
+};
+
+static const struct sim_op msp430_jump_ops[8] = {
+	{step_jnz_msp430,	NULL, 0, SIM_FMT_JUMP},
+	{step_jz_msp430,	NULL, 0, SIM_FMT_JUMP},
+	{step_jnc_msp430,	NULL, 0, SIM_FMT_JUMP},
+	{step_jc_msp430,	NULL, 0, SIM_FMT_JUMP},
+	{step_jn_msp430,	NULL, 0, SIM_FMT_JUMP},
+	{step_jge_msp430,	NULL, 0, SIM_FMT_JUMP},
+	{step_jl_msp430,	NULL, 0, SIM_FMT_JUMP},
+	{step_jmp_msp430,	NULL, 0, SIM_FMT_JUMP}
+};
+
+static const struct sim_op cpux_jump_ops[8] = {
+	{step_jnz_cpux,		NULL, 0, SIM_FMT_JUMP},
+	{step_jz_cpux,		NULL, 0, SIM_FMT_JUMP},
+	{step_jnc_cpux,		NULL, 0, SIM_FMT_JUMP},
+	{step_jc_cpux,		NULL, 0, SIM_FMT_JUMP},
+	{step_jn_cpux,		NULL, 0, SIM_FMT_JUMP},
+	{step_jge_cpux,		NULL, 0, SIM_FMT_JUMP},
+	{step_jl_cpux,		NULL, 0, SIM_FMT_JUMP},
+	{step_jmp_cpux,		NULL, 0, SIM_FMT_JUMP}
+};
+
+static const struct sim_op op_invalid = {step_invalid, NULL, 0, SIM_FMT_OTHER};
+static const struct sim_op op_RxxM = {step_RxxM, NULL, 0, SIM_FMT_OTHER};
+static const struct sim_op op_0xxx_addr =
+	{step_0xxx_addr, NULL, 0, SIM_FMT_OTHER};
+static const struct sim_op op_pushm_popm =
+	{step_pushm_popm, NULL, 0, SIM_FMT_OTHER};
+static const struct sim_op op_reti_calla =
+	{step_reti_calla, NULL, 0, SIM_FMT_OTHER};
+
+static const struct sim_op *msp430_dispatch[DISPATCH_SIZE];
+static const struct sim_op *cpux_dispatch[DISPATCH_SIZE];
+static const struct sim_op *cpux_ext_dispatch[DISPATCH_SIZE];
+
+static const struct sim_op *classify(uint16_t ins, int cpux)
+{
+	if ((ins & 0xf0e0) == 0x0040 && cpux)
+		return &op_RxxM;
+	if ((ins & 0xf000) == 0x0000 && cpux)
+		return &op_0xxx_addr;
+	if ((ins & 0xfc00) == 0x1400 && cpux)
+		return &op_pushm_popm;
+	if ((ins & 0xff00) == 0x1300 && cpux)
+		return &op_reti_calla;
+	if ((ins & 0xf000) == 0x1000)
+		return &single_ops[(ins >> 7) & 7];
+	if ((ins & 0xe000) == 0x2000)
+		return cpux ? &cpux_jump_ops[(ins >> 10) & 7]
+			    : &msp430_jump_ops[(ins >> 10) & 7];
+	if ((ins & 0xf000) >= 0x4000)
+		return &double_ops[ins >> 12];
+
+	return &op_invalid;
+}
+
+/* Classify an instruction which follows an extension word. */
+static const struct sim_op *classify_ext(uint16_t ins)
+{
+	if ((ins & 0xf000) >= 0x4000)
+		return &double_ops[ins >> 12];
+	if ((ins & 0xf000) == 0x1000 && (ins & 0xfc00) < 0x1280)
+		return &single_ops[(ins >> 7) & 7];
+
+	return &op_invalid;
+}
+
+static void fill_dispatch(void)
+{
+	int i;
+
+	for (i = 0; i < DISPATCH_SIZE; i++) {
+		const uint16_t ins = i << 4;
+
+		msp430_dispatch[i] = classify(ins, 0);
+		cpux_dispatch[i] = classify(ins, 1);
+		cpux_ext_dispatch[i] = classify_ext(ins);
+	}
+}
+
+/* Fill in the dispatch tables. This is done once, by whichever
+ * simulator is opened first, and they are only read after that.
+ */
+static void build_dispatch(void)
+{
+	static thread_once_t once = THREAD_ONCE_INIT;
+
+	thread_once(&once, fill_dispatch);
+}
+
+/* Work out the repeat count and carry behaviour given by an extension
+ * word. These features only apply to register-mode operands.
+ */
+static void decode_ext(struct sim_insn *insn)
+{
+	const uint16_t ext = insn->ext;
+
+	insn->rept = 1;
+	insn->carry_mask = MSP430_SR_C;
+
+	if (!ext || insn->amode_src != MSP430_AMODE_REGISTER ||
+	    insn->amode_dst != MSP430_AMODE_REGISTER)
+		return;
+
+	insn->rept = (ext & (1 << 7)) ? 0 : (ext & 0xf) + 1;
+	if (ext & 0x0100)
+		insn->carry_mask = 0;
+}
+
+/* Number of bytes of operand words which follow an operand with the
+ * given addressing mode.
+ */
+static int operand_size(int amode, int reg)
+{
+	if (amode == MSP430_AMODE_INDEXED && reg != MSP430_REG_R3)
+		return 2;
+	if (amode == MSP430_AMODE_INDIRECT_INC && reg == MSP430_REG_PC)
+		return 2;
+
+	return 0;
+}
+
+/* Decode the instruction at the given address into a cache entry. */
+void decode_insn(struct sim_device *dev, uint32_t addr,
+		 struct sim_insn *insn)
+{
+	uint16_t ins = mem_getw(dev, addr);
+	uint16_t ext = 0;
+	const struct sim_op *op;
+
+	insn->len = 2;
+
+	if ((ins & 0xf800) == 0x1800 && dev->ext_dispatch) {
+		/* found extension word */
+		ext = ins;
+		ins = mem_getw(dev, addr + 2);
+		insn->len = 4;
+		op = dev->ext_dispatch[DISPATCH_INDEX(ins)];
+	} else {
+		op = dev->dispatch[DISPATCH_INDEX(ins)];
+	}
+
+	insn->handler = op->handler;
+	insn->alu = op->alu;
+	insn->flags = op->flags;
+	insn->ins = ins;
+	insn->ext = ext;
+	insn->sreg = (ins >> 8) & 0xf;
+	insn->amode_dst = (ins >> 7) & 1;
+	insn->amode_src = (ins >> 4) & 0x3;
+	insn->dreg = ins & 0x000f;
+	insn->opwidth = WIDTH_UNDEFINED;
+	insn->rept = 1;
+	insn->cycles = 0;
+	insn->size = 0;
+
+	switch (op->format) {
+	case SIM_FMT_DOUBLE:
+		insn->opwidth = determine_op_width(ins, ext);
+		if (insn->opwidth == WIDTH_UNDEFINED) {
+			insn->handler = step_bad_width;
+			break;
+		}
+
+		decode_ext(insn);
+		insn->cycles = double_cycles(dev, insn);
+		insn->size = insn->len +
+			operand_size(insn->amode_src, insn->sreg) +
+			operand_size(insn->amode_dst, insn->dreg);
+		break;
+
+	case SIM_FMT_SINGLE:
+		insn->amode_dst = insn->amode_src;
+		insn->opwidth = determine_op_width(ins, ext);
+		if (insn->opwidth == WIDTH_UNDEFINED) {
+			insn->handler = step_invalid;
+			break;
+		}
+
+		decode_ext(insn);
+		insn->cycles = single_cycles(dev, insn);
+		insn->size = insn->len +
+			operand_size(insn->amode_dst, insn->dreg);
+
+		if ((ins & 0xff80) == MSP430_OP_SXT && dev->cpux &&
+		    insn->amode_dst == MSP430_AMODE_REGISTER)
+			insn->flags |= SIM_OP_WIDE_STORE;
+		break;
+
+	case SIM_FMT_JUMP:
+		insn->offset = (((ins + 0x200) & 0x03ff) - 0x200) << 1;
+		insn->size = insn->len;
+		break;
+
+	case SIM_FMT_OTHER:
+		break;
+	}
+
+	if (insn->opwidth != WIDTH_UNDEFINED) {
+		insn->mask = (1 << insn->opwidth) - 1;
+		insn->msb = 1 << (insn->opwidth - 1);
+	}
+
+	if (dev->covering)
+		insn->flags |= SIM_OP_COVER;
+}
+
+/* Look up the decoded instruction at the given address, decoding it
+ * if necessary. Returns NULL if the address isn't mapped, or if memory
+ * for the cache can't be allocated.
+ */
+struct sim_insn *icache_fetch(struct sim_device *dev, uint32_t addr)
+{
+	struct sim_insn **page = &dev->icache[addr >> ICACHE_PAGE_SHIFT];
+	struct sim_insn *insn;
+
+	if (!*page) {
+		*page = calloc(ICACHE_PAGE_SIZE >> 1, sizeof(**page));
+		if (!*page) {
+			pr_error("sim: can't allocate decode cache");
+			return NULL;
+		}
+	}
+
+	insn = &(*page)[(addr & (ICACHE_PAGE_SIZE - 1)) >> 1];
+	if (!insn->handler) {
+		if (mem_type(dev, addr) == MEM_UNMAPPED) {
+			printc_err("%s: executing in unmapped memory: "
+				   "PC = 0x%05x\n", SIMx, addr);
+			return NULL;
+		}
+
+		decode_insn(dev, addr, insn);
+		if (dev->hooks && hook_find(dev, addr))
+			insn->handler = step_hook;
+	}
+
+	return insn;
+}
+
+/* Record the first execution of an instruction in the coverage map */
+static void coverage_mark(struct sim_device *dev, struct sim_insn *insn)
+{
+	const uint32_t addr = dev->current_insn;
+
+	dev->cover_map[addr >> 4] |= 1 << ((addr >> 1) & 7);
+	insn->flags &= ~SIM_OP_COVER;
+}
+
+/* Fetch and execute one instruction. Return the number of CPU cycles
+ * it would have taken, or -1 if an error occurs. If next_pc is given,
+ * it receives the address following the instruction, so that the caller
+ * can tell whether a branch was taken. Where the length isn't known in
+ * advance, the instruction's own address is given instead.
+ */
+static inline int step_cpu(struct sim_device *dev, int cpux,
+			   uint32_t *next_pc)
+{
+	struct sim_insn *insn;
+	int ret;
+
+	const char *where = NULL;
+	if (dev->regs[MSP430_REG_PC] < dev->addr_io_end)
+		where = "in device space";
+	else if (dev->regs[MSP430_REG_PC] >= MEM_SIZE)
+		where = "beyond end of memory";
+	if (where) {
+		/* report bogus PC, provide previous location */
+		printc_err("%s: executing %s: PC = 0x%05x; "
+			"previous PC value 0x%05x\n",
+			SIMx,where,dev->regs[MSP430_REG_PC],dev->current_insn);
+		return -1;
+	}
+
+	/* Fetch the instruction */
+	dev->current_insn = dev->regs[MSP430_REG_PC];
+
+	insn = icache_fetch(dev, dev->current_insn);
+	if (!insn)
+		return -1;
+
+	if (insn->flags & SIM_OP_COVER)
+		coverage_mark(dev, insn);
+
+	if (next_pc)
+		*next_pc = dev->current_insn + insn->size;
+	advance_pc(dev, insn->len, cpux);
+	ret = insn->handler(dev, insn);
+
+	/* If things went wrong, restart at the current instruction */
+	if (ret < 0)
+		dev->regs[MSP430_REG_PC] = dev->current_insn;
+	else if (dev->trace)
+		trace_insn(dev, ret);
+
+	return ret;
+}
+
+static void do_reset(struct sim_device *dev)
+{
+	simio_step(dev->simio, dev->regs[MSP430_REG_SR], 4);
+	memset(dev->regs, 0, sizeof(dev->regs));
+	dev->flags_op = FLAGS_NONE;
+	dev->regs[MSP430_REG_PC] = mem_getw(dev, 0xfffe);
+	dev->regs[MSP430_REG_SR] = 0;
+	simio_reset(dev->simio);
+
+	if (dev->trace)
+		trace_event(dev, TRACE_RESET, 0, 4);
+}
+
+/* Push PC and SR and jump to an interrupt vector. Returns the number of
+ * cycles taken, or -1 if an error occurs.
+ */
+static int enter_interrupt(struct sim_device *dev, int irq)
+{
+	if (irq >= 16) {
+		printc_err("%s: invalid interrupt number: %d\n", SIMx, irq);
+		return -1;
+	}
+
+	dev->regs[MSP430_REG_SP] -= 2;
+	if (mem_setw(dev, dev->regs[MSP430_REG_SP],
+		 dev->regs[MSP430_REG_PC]) < 0)
+		 return -1;
+
+	sr_sync(dev);
+	dev->regs[MSP430_REG_SP] -= 2;
+	if (mem_setw(dev, dev->regs[MSP430_REG_SP],
+		 dev->regs[MSP430_REG_SR]) < 0)
+		 return -1;
+
+	dev->regs[MSP430_REG_SR] &=
+		~(MSP430_SR_GIE | MSP430_SR_CPUOFF);
+	dev->regs[MSP430_REG_PC] = mem_getw(dev, 0xffe0 + irq * 2);
+
+	simio_ack_interrupt(dev->simio, irq);
+	return 6;
+}
+
+static inline int step_system(struct sim_device *dev, int cpux)
+{
+	int count = 1;
+	int irq;
+	uint16_t status = dev->regs[MSP430_REG_SR];
+
+	irq = simio_check_interrupt(dev->simio);
+	if (irq == 15) {
+		do_reset(dev);
+		return 0;
+	} else if (((status & MSP430_SR_GIE) && irq >= 0) || irq >= 14) {
+		count = enter_interrupt(dev, irq);
+		if (count < 0)
+			return -1;
+		if (dev->trace)
+			trace_event(dev, TRACE_IRQ, irq, count);
+	} else if (!(status & MSP430_SR_CPUOFF)) {
+		count = step_cpu(dev, cpux, NULL);
+		if (count < 0)
+			return -1;
+	} else if (dev->trace) {
+		trace_event(dev, TRACE_SLEEP, 0, count);
+	}
+
+	simio_step(dev->simio, status, count);
+	return 0;
+}
+
+/* Bits of SR which affect interrupts and the system clocks. A block
+ * ends when any of these change.
+ */
+#define SR_MODE_BITS	(MSP430_SR_GIE | MSP430_SR_CPUOFF | \
+			 MSP430_SR_OSCOFF | MSP430_SR_SCG0 | MSP430_SR_SCG1)
+
+/* Longest time to sleep in one go if no peripheral event is due */
+#define MAX_SLEEP_CYCLES	0x10000
+
+/* Longest polling loop, in bytes, and the number of passes which may
+ * differ before we give up on it.
+ */
+#define POLL_LOOP_SIZE		32
+#define POLL_MAX_MISSES		8
+
+/* Shorten the time to the next event so as not to overrun the cycle
+ * budget.
+ */
+static int budget_horizon(const struct sim_device *dev, int horizon)
+{
+	uint64_t now;
+
+	if (!dev->cycle_limit)
+		return horizon;
+
+	now = simio_time(dev->simio);
+	if (now >= dev->cycle_limit)
+		return 1;
+	if (dev->cycle_limit - now < (uint64_t)horizon)
+		return dev->cycle_limit - now;
+
+	return horizon;
+}
+
+void poll_reset(struct sim_device *dev)
+{
+	dev->poll_start = 0;
+	dev->poll_end = 0;
+	dev->poll_armed = 0;
+}
+
+/* Check that the instructions from start up to the branch at end write
+ * nothing but general-purpose registers and flags.
+ */
+static int poll_loop_pure(struct sim_device *dev,
+			  uint32_t start, uint32_t end)
+{
+	uint32_t addr = start;
+
+	for (;;) {
+		const struct sim_insn *insn = icache_fetch(dev, addr);
+
+		if (!insn || !insn->size || insn->ext)
+			return 0;
+
+		if ((insn->ins & 0xe000) == 0x2000) {
+			/* Jumps are always allowed */
+		} else if (insn->handler == step_double) {
+			if (!(insn->flags & SIM_OP_NO_STORE) &&
+			    (insn->amode_dst != MSP430_AMODE_REGISTER ||
+			     insn->dreg < MSP430_REG_R4))
+				return 0;
+		} else if (insn->handler == step_single) {
+			if (insn->amode_dst != MSP430_AMODE_REGISTER ||
+			    insn->dreg < MSP430_REG_R4)
+				return 0;
+		} else {
+			return 0;
+		}
+
+		if (addr == end)
+			return 1;
+
+		addr += insn->size;
+		if (addr > end)
+			return 0;
+	}
+}
+
+/* Called when a block ends with a short backward branch at the given
+ * address. If the loop changes only registers, reads only memory and
+ * stable IO registers, and the registers are unchanged by a whole pass
+ * in which no peripheral event occurred, then every pass will be the
+ * same until the next event. The passes up until then are skipped.
+ */
+static void poll_check(struct sim_device *dev, uint32_t end)
+{
+	const uint32_t start = dev->regs[MSP430_REG_PC];
+	int horizon;
+	int passes;
+
+	if (start != dev->poll_start || end != dev->poll_end) {
+		dev->poll_start = start;
+		dev->poll_end = end;
+		dev->poll_pure = poll_loop_pure(dev, start, end);
+		dev->poll_armed = 0;
+		dev->poll_misses = 0;
+	}
+
+	if (!dev->poll_pure)
+		return;
+
+	sr_sync(dev);
+	if (!dev->poll_armed || dev->poll_unstable ||
+	    memcmp(dev->poll_regs, dev->regs, sizeof(dev->regs))) {
+		if (dev->poll_armed && ++dev->poll_misses >= POLL_MAX_MISSES) {
+			dev->poll_pure = 0;
+			dev->poll_armed = 0;
+			return;
+		}
+
+		memcpy(dev->poll_regs, dev->regs, sizeof(dev->regs));
+		dev->poll_armed = 1;
+		dev->poll_unstable = 0;
+		goto next_pass;
+	}
+
+	/* An event during the pass may have changed something the loop
+	 * read earlier in it. The next pass will see it.
+	 */
+	if (dev->poll_cycles >= dev->poll_event)
+		goto next_pass;
+
+	horizon = simio_next_event(dev->simio, dev->regs[MSP430_REG_SR]);
+	if (horizon > MAX_SLEEP_CYCLES)
+		horizon = MAX_SLEEP_CYCLES;
+	horizon = budget_horizon(dev, horizon);
+
+	passes = (horizon - 1) / dev->poll_cycles;
+	if (passes > 0) {
+		simio_step(dev->simio, dev->regs[MSP430_REG_SR],
+			   passes * dev->poll_cycles);
+		dev->poll_skipped += passes * dev->poll_cycles;
+	}
+
+next_pass:
+	dev->poll_cycles = 0;
+	dev->poll_event = simio_next_event(dev->simio,
+					   dev->regs[MSP430_REG_SR]);
+}
+
+/* Count a branch taken while fuzzing, by the address of the branch and
+ * of its target. Branches which aren't taken needn't be counted, since
+ * the path through the program follows from those which are.
+ */
+static inline void fuzz_edge(struct sim_device *dev, uint32_t from,
+			     uint32_t to)
+{
+	const uint32_t hash = (((from >> 1) * 0x9e3779b1u) >> 16) ^ (to >> 1);
+	uint8_t *count = &dev->fuzz_edges[hash & (FUZZ_MAP_SIZE - 1)];
+
+	if (*count != 0xff)
+		(*count)++;
+}
+
+/* Execute a block of straight-line code, and step the IO simulator once
+ * for the whole block. The block ends at a branch, at any instruction
+ * which performs programmed IO or changes the CPU mode, before a
+ * breakpoint, or when the IO simulator's next event is due. Nothing can
+ * change the interrupt state within a block, so interrupts are taken at
+ * exactly the same point as they would be when stepping. While the CPU
+ * is off, a block is a single sleep until the next event. A block which
+ * closes a polling loop may be followed by a skip to the next event.
+ *
+ * Returns the number of instructions executed, or -1 if an error
+ * occurs.
+ */
+static inline int step_block(struct sim_device *dev, int cpux, int limit)
+{
+	const uint16_t status = dev->regs[MSP430_REG_SR];
+	const uint32_t pc_mask = cpux ? 0xFFFFF : 0x0FFFF;
+	uint32_t next_pc = 0;
+	int horizon;
+	int cycles = 0;
+	int count = 0;
+	int irq;
+
+	/* Interrupts are handled one step at a time */
+	irq = simio_check_interrupt(dev->simio);
+	if (irq >= 14 || ((status & MSP430_SR_GIE) && irq >= 0)) {
+		poll_reset(dev);
+		return step_system(dev, cpux) < 0 ? -1 : 1;
+	}
+
+	/* In any low-power mode, nothing can happen until the next
+	 * peripheral event, so skip straight to it. Which clocks are
+	 * still running is taken into account by the IO simulator.
+	 */
+	horizon = budget_horizon(dev, simio_next_event(dev->simio, status));
+	if (status & MSP430_SR_CPUOFF) {
+		if (horizon > MAX_SLEEP_CYCLES)
+			horizon = MAX_SLEEP_CYCLES;
+
+		simio_step(dev->simio, status, horizon);
+		if (dev->trace)
+			trace_event(dev, TRACE_SLEEP, 0, horizon);
+		return 1;
+	}
+
+	/* Leaving a loop means starting again */
+	if (dev->poll_start && (dev->regs[MSP430_REG_PC] < dev->poll_start ||
+				dev->regs[MSP430_REG_PC] > dev->poll_end))
+		poll_reset(dev);
+
+	dev->io_access = 0;
+	dev->io_status = status;
+
+	for (;;) {
+		int ret;
+
+		ret = step_cpu(dev, cpux, &next_pc);
+		if (ret < 0) {
+			io_flush(dev);
+			return -1;
+		}
+
+		dev->io_pending += ret;
+		cycles += ret;
+		count++;
+
+		if (cycles >= horizon || count >= limit ||
+		    dev->io_access || dev->watchpoint_hit ||
+		    dev->regs[MSP430_REG_PC] != (next_pc & pc_mask) ||
+		    ((dev->regs[MSP430_REG_SR] ^ status) & SR_MODE_BITS))
+			break;
+
+		if (dev->num_breaks && breakpoint_check(dev))
+			break;
+	}
+
+	io_flush(dev);
+
+	if (dev->fuzz_edges &&
+	    dev->regs[MSP430_REG_PC] != (next_pc & pc_mask))
+		fuzz_edge(dev, dev->current_insn, dev->regs[MSP430_REG_PC]);
+
+	if (dev->poll_armed)
+		dev->poll_cycles += cycles;
+
+	if (dev->skip_polling && !dev->watchpoint_hit &&
+	    dev->regs[MSP430_REG_PC] < dev->current_insn &&
+	    dev->current_insn - dev->regs[MSP430_REG_PC] <= POLL_LOOP_SIZE)
+		poll_check(dev, dev->current_insn);
+
+	return count;
+}
+
+/* The execution loop is built separately for each CPU, so that the
+ * original CPU never pays for 20-bit address handling.
+ */
+static int msp430_step(struct sim_device *dev)
+{
+	return step_system(dev, 0);
+}
+
+static int cpux_step(struct sim_device *dev)
+{
+	return step_system(dev, 1);
+}
+
+int msp430_step_block(struct sim_device *dev, int limit)
+{
+	return step_block(dev, 0, limit);
+}
+
+int cpux_step_block(struct sim_device *dev, int limit)
+{
+	return step_block(dev, 1, limit);
+}
+
+/************************************************************************
+ * Execution history
+ *
+ * While the sim_history option is set, the CPU is run one step at a
+ * time, and each step appends an undo record to a ring buffer. The
+ * record holds the old values of the registers and memory which the
+ * step changed:
+ *
+ *	length (2 bytes)
+ *	mask of changed registers (2 bytes)
+ *	old value of each changed register (4 bytes each)
+ *	address and old contents of each write (3 bytes + 1 or 2 bytes)
+ *	length (2 bytes)
+ *
+ * The oldest records are discarded to make room for new ones.
+ * Peripheral state can't be undone like this, so a checkpoint of the
+ * IO simulator is also taken each time another 1/HISTORY_CHECKPOINTS
+ * of the ring has been filled. To return to an earlier step, records
+ * are undone back to the checkpoint before it, the checkpoint is
+ * restored, and the CPU is run forward again.
+ */
+#define HISTORY_CHECKPOINTS	8
+#define HISTORY_MIN_SIZE	4096
+#define HISTORY_MAX_RECORD	(6 + DEVICE_NUM_REGS * 4 + \
+				 HISTORY_MAX_WRITES * 5)
+
+struct history_checkpoint {
+	struct history_checkpoint	*next;
+	uint64_t			step;
+	struct simio_snapshot		*io;
+};
+
+static void ring_write(struct sim_device *dev, uint32_t pos,
+		       const uint8_t *data, uint32_t len)
+{
+	const uint32_t n = dev->hist_size - pos;
+
+	if (len <= n) {
+		memcpy(dev->hist_buf + pos, data, len);
+	} else {
+		memcpy(dev->hist_buf + pos, data, n);
+		memcpy(dev->hist_buf, data + n, len - n);
+	}
+}
+
+static void ring_read(const struct sim_device *dev, uint32_t pos,
+		      uint8_t *data, uint32_t len)
+{
+	const uint32_t n = dev->hist_size - pos;
+
+	if (len <= n) {
+		memcpy(data, dev->hist_buf + pos, len);
+	} else {
+		memcpy(data, dev->hist_buf + pos, n);
+		memcpy(data + n, dev->hist_buf, len - n);
+	}
+}
+
+static void checkpoint_free(struct history_checkpoint *c)
+{
+	simio_snapshot_free(c->io);
+	free(c);
+}
+
+/* Discard checkpoints after the given step */
+static void history_drop_after(struct sim_device *dev, uint64_t step)
+{
+	while (dev->hist_checkpoints && dev->hist_checkpoints->step > step) {
+		struct history_checkpoint *c = dev->hist_checkpoints;
+
+		dev->hist_checkpoints = c->next;
+		checkpoint_free(c);
+	}
+}
+
+/* Discard checkpoints whose records are no longer all in the ring.
+ * Checkpoints are kept newest first.
+ */
+static void history_drop_old(struct sim_device *dev)
+{
+	struct history_checkpoint **c = &dev->hist_checkpoints;
+
+	while (*c && (*c)->step >= dev->hist_first)
+		c = &(*c)->next;
+
+	while (*c) {
+		struct history_checkpoint *old = *c;
+
+		*c = old->next;
+		checkpoint_free(old);
+	}
+}
+
+/* The earliest step which can be returned to */
+static uint64_t history_oldest(const struct sim_device *dev)
+{
+	const struct history_checkpoint *c = dev->hist_checkpoints;
+
+	if (!c)
+		return dev->hist_step;
+
+	while (c->next)
+		c = c->next;
+
+	return c->step;
+}
+
+/* Forget all recorded history. This is done whenever the state of the
+ * simulation is changed by something other than the CPU.
+ */
+static void history_reset(struct sim_device *dev)
+{
+	while (dev->hist_checkpoints) {
+		struct history_checkpoint *c = dev->hist_checkpoints;
+
+		dev->hist_checkpoints = c->next;
+		checkpoint_free(c);
+	}
+
+	dev->hist_head = 0;
+	dev->hist_tail = 0;
+	dev->hist_used = 0;
+	dev->hist_first = 0;
+	dev->hist_step = 0;
+}
+
+/* Start or stop recording, or change the size of the ring, according
+ * to the sim_history option.
+ */
+void history_setup(struct sim_device *dev)
+{
+	uint32_t size = opdb_get_numeric("sim_history") * 1024;
+	uint32_t i;
+
+	if (size && size < HISTORY_MIN_SIZE)
+		size = HISTORY_MIN_SIZE;
+
+	if (size == dev->hist_size)
+		return;
+
+	history_reset(dev);
+	free(dev->hist_buf);
+	dev->hist_buf = NULL;
+	dev->hist_size = 0;
+
+	if (size) {
+		dev->hist_buf = malloc(size);
+		if (dev->hist_buf)
+			dev->hist_size = size;
+		else
+			pr_error("sim: can't allocate history buffer");
+	}
+
+	/* Writes must take the slow path while recording */
+	for (i = 0; i < MEM_PAGES; i++)
+		mem_update_fast(dev, i);
+}
+
+static int history_checkpoint(struct sim_device *dev)
+{
+	struct history_checkpoint *c = malloc(sizeof(*c));
+
+	if (!c) {
+		pr_error("sim: can't allocate history checkpoint");
+		return -1;
+	}
+
+	c->io = simio_snapshot_save(dev->simio);
+	if (!c->io) {
+		free(c);
+		return -1;
+	}
+
+	c->step = dev->hist_step;
+	c->next = dev->hist_checkpoints;
+	dev->hist_checkpoints = c;
+	dev->hist_since_checkpoint = 0;
+	return 0;
+}
+
+/* Add a record for the step just taken, given the registers as they
+ * were before it.
+ */
+static void history_append(struct sim_device *dev, const uint32_t *old_regs)
+{
+	uint8_t rec[HISTORY_MAX_RECORD];
+	uint32_t len = 4;
+	uint16_t mask = 0;
+	int i;
+
+	/* A step which can't be undone ends the history */
+	if (dev->hist_barrier) {
+		dev->hist_barrier = 0;
+		history_reset(dev);
+		return;
+	}
+
+	if (dev->hist_num_writes > HISTORY_MAX_WRITES) {
+		printc_err("%s: too many writes to record, history "
+			   "discarded\n", SIMx);
+		history_reset(dev);
+		return;
+	}
+
+	for (i = 0; i < DEVICE_NUM_REGS; i++) {
+		const uint32_t old = old_regs[i];
+
+		if (dev->regs[i] == old)
+			continue;
+
+		mask |= 1 << i;
+		rec[len++] = old;
+		rec[len++] = old >> 8;
+		rec[len++] = old >> 16;
+		rec[len++] = old >> 24;
+	}
+
+	for (i = 0; i < dev->hist_num_writes; i++) {
+		const uint32_t addr = dev->hist_write_addr[i];
+		const uint16_t old = dev->hist_write_old[i];
+
+		rec[len++] = addr;
+		rec[len++] = addr >> 8;
+		rec[len++] = ((addr >> 16) & 0x0f) |
+			((addr & HISTORY_WORD) ? 0x80 : 0);
+		rec[len++] = old;
+		if (addr & HISTORY_WORD)
+			rec[len++] = old >> 8;
+	}
+
+	len += 2;
+	rec[0] = rec[len - 2] = len;
+	rec[1] = rec[len - 1] = len >> 8;
+	rec[2] = mask;
+	rec[3] = mask >> 8;
+
+	while (dev->hist_used + len > dev->hist_size) {
+		uint8_t hdr[2];
+		uint32_t n;
+
+		ring_read(dev, dev->hist_tail, hdr, 2);
+		n = hdr[0] | (hdr[1] << 8);
+		dev->hist_tail = (dev->hist_tail + n) % dev->hist_size;
+		dev->hist_used -= n;
+		dev->hist_first++;
+	}
+
+	ring_write(dev, dev->hist_head, rec, len);
+	dev->hist_head = (dev->hist_head + len) % dev->hist_size;
+	dev->hist_used += len;
+	dev->hist_since_checkpoint += len;
+	dev->hist_step++;
+
+	history_drop_old(dev);
+}
+
+/* Undo the most recent step. Writes to watched addresses are reported
+ * as they're undone.
+ */
+static void history_undo(struct sim_device *dev)
+{
+	uint8_t rec[HISTORY_MAX_RECORD];
+	uint32_t writes[HISTORY_MAX_WRITES];
+	uint32_t start;
+	uint32_t len;
+	uint32_t pos = 4;
+	uint16_t mask;
+	int num_writes = 0;
+	int i;
+
+	ring_read(dev, (dev->hist_head + dev->hist_size - 2) % dev->hist_size,
+		  rec, 2);
+	len = rec[0] | (rec[1] << 8);
+	start = (dev->hist_head + dev->hist_size - len) % dev->hist_size;
+	ring_read(dev, start, rec, len);
+	mask = rec[2] | (rec[3] << 8);
+
+	for (i = 0; i < DEVICE_NUM_REGS; i++) {
+		if (!(mask & (1 << i)))
+			continue;
+
+		dev->regs[i] = rec[pos] | (rec[pos + 1] << 8) |
+			(rec[pos + 2] << 16) | ((uint32_t)rec[pos + 3] << 24);
+		pos += 4;
+	}
+
+	while (pos < len - 2) {
+		writes[num_writes++] = pos;
+		pos += (rec[pos + 2] & 0x80) ? 5 : 4;
+	}
+
+	/* If a step wrote the same address twice, the oldest value must
+	 * be the one left behind.
+	 */
+	while (num_writes--) {
+		const uint8_t *w = rec + writes[num_writes];
+		const int word = w[2] & 0x80;
+		const uint32_t addr = w[0] | (w[1] << 8) | ((w[2] & 0x0f) << 16);
+		uint8_t *page = mem_alloc_page(dev, addr);
+
+		if (!page)
+			continue;
+
+		page += addr & (MEM_PAGE_SIZE - 1);
+		page[0] = w[3];
+		if (word)
+			page[1] = w[4];
+
+		icache_invalidate(dev, addr, word ? 2 : 1);
+		if (dev->num_watches)
+			watchpoint_check(dev, addr, 1);
+	}
+
+	dev->flags_op = FLAGS_NONE;
+	dev->hist_head = start;
+	dev->hist_used -= len;
+	dev->hist_step--;
+}
+
+/* Run one step, recording it */
+static int history_step(struct sim_device *dev)
+{
+	uint32_t old_regs[DEVICE_NUM_REGS];
+	int ret;
+
+	if ((!dev->hist_checkpoints ||
+	     dev->hist_since_checkpoint >=
+	     dev->hist_size / HISTORY_CHECKPOINTS) &&
+	    history_checkpoint(dev) < 0)
+		return -1;
+
+	sr_sync(dev);
+	memcpy(old_regs, dev->regs, sizeof(old_regs));
+	dev->hist_num_writes = 0;
+
+	ret = dev->cpux ? cpux_step_block(dev, 1) : msp430_step_block(dev, 1);
+
+	sr_sync(dev);
+	history_append(dev, old_regs);
+	return ret;
+}
+
+/* Return to the given step, which mustn't be earlier than the oldest
+ * checkpoint. Breakpoints and watchpoints are ignored on the way.
+ */
+static int history_rewind(struct sim_device *dev, uint64_t step)
+{
+	const int num_watches = dev->num_watches;
+	int ret = 0;
+
+	history_drop_after(dev, step);
+
+	dev->num_watches = 0;
+	while (dev->hist_step > dev->hist_checkpoints->step)
+		history_undo(dev);
+
+	if (simio_snapshot_restore(dev->simio,
+				   dev->hist_checkpoints->io) < 0) {
+		history_reset(dev);
+		ret = -1;
+	}
+
+	poll_reset(dev);
+	dev->hist_since_checkpoint = 0;
+	while (!ret && dev->hist_step < step)
+		if (history_step(dev) < 0)
+			ret = -1;
+
+	dev->num_watches = num_watches;
+	dev->watchpoint_hit = 0;
+	return ret;
+}
+
+/* Go back by up to count steps, stopping early at a breakpoint or at a
+ * step which wrote to a watched address. Returns 1 if the start of the
+ * history was reached, or -1 if an error occurs.
+ */
+static int history_reverse(struct sim_device *dev, uint64_t count)
+{
+	struct sim_trace *trace;
+	int trace_mem;
+	uint64_t oldest;
+	int ret;
+
+	history_setup(dev);
+	if (!dev->hist_buf) {
+		printc_err("%s: no execution history is being recorded "
+			   "(see the sim_history option)\n", SIMx);
+		return -1;
+	}
+
+	oldest = history_oldest(dev);
+	if (dev->hist_step == oldest)
+		return 1;
+
+	update_breakpoints(dev);
+	dev->watchpoint_hit = 0;
+
+	/* Steps replayed on the way back aren't traced */
+	trace = dev->trace;
+	trace_mem = dev->trace_mem;
+	dev->trace = NULL;
+	dev->trace_mem = 0;
+
+	while (count-- && dev->hist_step > oldest) {
+		history_undo(dev);
+		if (dev->watchpoint_hit ||
+		    (dev->num_breaks && breakpoint_check(dev)))
+			break;
+	}
+
+	ret = history_rewind(dev, dev->hist_step);
+	dev->trace = trace;
+	dev->trace_mem = trace_mem;
+	if (ret < 0)
+		return -1;
+
+	profile_resync(dev);
+	trace_sync(dev);
+	return dev->hist_step == oldest;
+}
+
+/************************************************************************
+ * Device interface
+ */
+
+/************************************************************************
+ * Snapshots
+ */
+
+void snapshot_free(struct sim_snapshot *snap)
+{
+	int i;
+
+	for (i = 0; i < MEM_PAGES; i++)
+		page_unref(snap->mem_pages[i]);
+
+	simio_snapshot_free(snap->io);
+	free(snap);
+}
+
+static struct sim_snapshot **snapshot_find(struct sim_device *dev,
+					   const char *name)
+{
+	struct sim_snapshot **s = &dev->snapshots;
+
+	while (*s && strcmp((*s)->name, name))
+		s = &(*s)->next;
+
+	return s;
+}
+
+/* Save the state of the simulator, without giving it a name */
+struct sim_snapshot *snapshot_take(struct sim_device *dev)
+{
+	struct sim_snapshot *snap = malloc(sizeof(*snap));
+	int i;
+
+	if (!snap) {
+		pr_error("sim snapshot: can't allocate memory");
+		return NULL;
+	}
+
+	snap->io = simio_snapshot_save(dev->simio);
+	if (!snap->io) {
+		free(snap);
+		return NULL;
+	}
+
+	snap->next = NULL;
+	snap->name[0] = 0;
+	sr_sync(dev);
+	memcpy(snap->regs, dev->regs, sizeof(snap->regs));
+	snap->current_insn = dev->current_insn;
+
+	/* Share every page. From now on, writes to them go through
+	 * mem_alloc_page(), which makes a private copy.
+	 */
+	for (i = 0; i < MEM_PAGES; i++) {
+		snap->mem_pages[i] = page_ref(dev->mem_pages[i]);
+		if (snap->mem_pages[i])
+			mem_update_fast(dev, i);
+	}
+
+	return snap;
+}
+
+static int snapshot_save(struct sim_device *dev, const char *name)
+{
+	struct sim_snapshot **old = snapshot_find(dev, name);
+	struct sim_snapshot *snap;
+
+	if (strlen(name) >= sizeof(snap->name)) {
+		printc_err("sim snapshot: name too long: %s\n", name);
+		return -1;
+	}
+
+	snap = snapshot_take(dev);
+	if (!snap)
+		return -1;
+
+	strcpy(snap->name, name);
+	if (*old) {
+		snap->next = (*old)->next;
+		snapshot_free(*old);
+	}
+
+	*old = snap;
+	return 0;
+}
+
+static int snapshot_restore(struct sim_device *dev, const char *name)
+{
+	struct sim_snapshot *snap = *snapshot_find(dev, name);
+	int i;
+
+	if (!snap) {
+		printc_err("sim snapshot: no such snapshot: %s\n", name);
+		return -1;
+	}
+
+	if (simio_snapshot_restore(dev->simio, snap->io) < 0)
+		return -1;
+
+	/* Only pages which have been written since the snapshot differ,
+	 * and only those need their decoded instructions discarded.
+	 */
+	for (i = 0; i < MEM_PAGES; i++) {
+		if (dev->mem_pages[i] == snap->mem_pages[i])
+			continue;
+
+		page_unref(dev->mem_pages[i]);
+		dev->mem_pages[i] = page_ref(snap->mem_pages[i]);
+		mem_update_fast(dev, i);
+		icache_invalidate(dev, i << MEM_PAGE_SHIFT, MEM_PAGE_SIZE);
+	}
+
+	memcpy(dev->regs, snap->regs, sizeof(dev->regs));
+	dev->flags_op = FLAGS_NONE;
+	dev->current_insn = snap->current_insn;
+	dev->watchpoint_hit = 0;
+	poll_reset(dev);
+	history_reset(dev);
+	profile_resync(dev);
+	trace_sync(dev);
+
+	return 0;
+}
+
+/************************************************************************
+ * Checkpoint files
+ *
+ * A checkpoint file holds the complete state of the simulator:
+ *
+ *	header (CKPT_HEADER_LEN bytes)
+ *	IO simulator state, from simio_snapshot_encode()
+ *	memory pages, from the next 4-byte boundary
+ *
+ * The header is:
+ *
+ *	magic (8 bytes)
+ *	format version (4 bytes)
+ *	non-zero for CPUX (4 bytes)
+ *	chip name, padded with zeroes (CKPT_CHIP_LEN bytes)
+ *	current_insn (4 bytes)
+ *	registers (4 bytes each)
+ *	length of IO simulator state (4 bytes)
+ *	number of memory pages (4 bytes)
+ *
+ * Each memory page is stored as a 4-byte page number followed by its
+ * contents, which is the layout of struct mem_page. Pages are stored in
+ * order, and only where the chip has memory. The file is mapped
+ * into memory when loaded, and the pages are used where they lie: the
+ * page number is overwritten with a pinned reference count, and the
+ * page is copied before it's first written. All values are
+ * little-endian.
+ */
+#define CKPT_MAGIC		"MSPDSIMC"
+#define CKPT_VERSION		2
+#define CKPT_CHIP_LEN		32
+#define CKPT_REGS		(20 + CKPT_CHIP_LEN)
+#define CKPT_HEADER_LEN		(CKPT_REGS + 8 + DEVICE_NUM_REGS * 4)
+#define CKPT_PAGE_LEN		(4 + MEM_PAGE_SIZE)
+
+/* A loaded checkpoint file, which must be kept until the device is
+ * destroyed, since its pages may still be in use.
+ */
+struct checkpoint_file {
+	struct checkpoint_file	*next;
+	uint8_t			*data;
+	size_t			len;
+	int			mapped;
+};
+
+/* Checkpoints may only be loaded into a simulation of the same chip */
+static void ckpt_chip_name(const struct sim_device *dev, uint8_t *buf)
+{
+	memset(buf, 0, CKPT_CHIP_LEN);
+	if (dev->base.chip)
+		strncpy((char *)buf, dev->base.chip->name, CKPT_CHIP_LEN - 1);
+}
+
+static int checkpoint_save(struct sim_device *dev, const char *path)
+{
+	static const uint8_t pad[4];
+	uint8_t hdr[CKPT_HEADER_LEN];
+	struct simio_snapshot *io;
+	uint32_t num_pages = 0;
+	void *io_data;
+	size_t io_len;
+	FILE *out;
+	int i;
+
+	io = simio_snapshot_save(dev->simio);
+	if (!io)
+		return -1;
+
+	io_data = simio_snapshot_encode(io, &io_len);
+	simio_snapshot_free(io);
+	if (!io_data)
+		return -1;
+
+	for (i = 0; i < MEM_PAGES; i++)
+		if (dev->mem_pages[i])
+			num_pages++;
+
+	sr_sync(dev);
+	memcpy(hdr, CKPT_MAGIC, 8);
+	w32le(hdr + 8, CKPT_VERSION);
+	w32le(hdr + 12, dev->cpux);
+	ckpt_chip_name(dev, hdr + 16);
+	w32le(hdr + CKPT_REGS - 4, dev->current_insn);
+	for (i = 0; i < DEVICE_NUM_REGS; i++)
+		w32le(hdr + CKPT_REGS + i * 4, dev->regs[i]);
+	w32le(hdr + CKPT_REGS + DEVICE_NUM_REGS * 4, io_len);
+	w32le(hdr + CKPT_REGS + 4 + DEVICE_NUM_REGS * 4, num_pages);
+
+	out = fopen(path, "wb");
+	if (!out) {
+		pr_error(path);
+		free(io_data);
+		return -1;
+	}
+
+	fwrite(hdr, sizeof(hdr), 1, out);
+	fwrite(io_data, io_len, 1, out);
+	fwrite(pad, (4 - (CKPT_HEADER_LEN + io_len)) & 3, 1, out);
+	free(io_data);
+
+	for (i = 0; i < MEM_PAGES; i++) {
+		uint8_t num[4];
+
+		if (!dev->mem_pages[i])
+			continue;
+
+		w32le(num, i);
+		fwrite(num, 4, 1, out);
+		fwrite(dev->mem_pages[i], MEM_PAGE_SIZE, 1, out);
+	}
+
+	if (ferror(out) | fclose(out)) {
+		pr_error(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void checkpoint_file_free(struct checkpoint_file *f)
+{
+#ifndef __Windows__
+	if (f->mapped) {
+		munmap(f->data, f->len);
+		free(f);
+		return;
+	}
+#endif
+	free(f->data);
+	free(f);
+}
+
+/* Bring a file into memory, mapping it if possible. The mapping is
+ * private, so the pages in it can be modified.
+ */
+static struct checkpoint_file *checkpoint_file_open(const char *path)
+{
+	struct checkpoint_file *f = calloc(1, sizeof(*f));
+	FILE *in;
+	long len;
+
+	if (!f) {
+		pr_error("sim checkpoint: can't allocate memory");
+		return NULL;
+	}
+
+#ifndef __Windows__
+	{
+		struct stat st;
+		int fd = open(path, O_RDONLY);
+
+		if (fd < 0) {
+			pr_error(path);
+			free(f);
+			return NULL;
+		}
+
+		if (!fstat(fd, &st) && st.st_size >= CKPT_HEADER_LEN) {
+			void *data = mmap(NULL, st.st_size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE, fd, 0);
+
+			if (data != MAP_FAILED) {
+				close(fd);
+				f->data = data;
+				f->len = st.st_size;
+				f->mapped = 1;
+				return f;
+			}
+		}
+
+		close(fd);
+	}
+#endif
+
+	in = fopen(path, "rb");
+	if (!in) {
+		pr_error(path);
+		free(f);
+		return NULL;
+	}
+
+	if (fseek(in, 0, SEEK_END) < 0 || (len = ftell(in)) < 0 ||
+	    fseek(in, 0, SEEK_SET) < 0) {
+		pr_error(path);
+		fclose(in);
+		free(f);
+		return NULL;
+	}
+
+	f->len = len;
+	f->data = malloc(len ? len : 1);
+	if (!f->data) {
+		pr_error("sim checkpoint: can't allocate memory");
+		fclose(in);
+		free(f);
+		return NULL;
+	}
+
+	if (fread(f->data, 1, len, in) != (size_t)len) {
+		pr_error(path);
+		fclose(in);
+		checkpoint_file_free(f);
+		return NULL;
+	}
+
+	fclose(in);
+	return f;
+}
+
+static int checkpoint_load(struct sim_device *dev, const char *path)
+{
+	struct checkpoint_file *f = checkpoint_file_open(path);
+	uint8_t chip[CKPT_CHIP_LEN];
+	struct simio_snapshot *io;
+	const uint8_t *hdr;
+	uint32_t io_len;
+	uint32_t num_pages;
+	uint64_t pages;
+	uint32_t i;
+
+	if (!f)
+		return -1;
+
+	hdr = f->data;
+	if (f->len < CKPT_HEADER_LEN || memcmp(hdr, CKPT_MAGIC, 8)) {
+		printc_err("sim checkpoint: %s: not a checkpoint file\n", path);
+		goto fail;
+	}
+
+	if (r32le(hdr + 8) != CKPT_VERSION) {
+		printc_err("sim checkpoint: %s: unsupported version: %d\n",
+			   path, r32le(hdr + 8));
+		goto fail;
+	}
+
+	if ((r32le(hdr + 12) != 0) != (dev->cpux != 0)) {
+		printc_err("sim checkpoint: %s: saved by the %s driver\n",
+			   path, dev->cpux ? "sim" : "simx");
+		goto fail;
+	}
+
+	ckpt_chip_name(dev, chip);
+	if (memcmp(hdr + 16, chip, CKPT_CHIP_LEN)) {
+		printc_err("sim checkpoint: %s: saved for a different "
+			   "chip\n", path);
+		goto fail;
+	}
+
+	io_len = r32le(hdr + CKPT_REGS + DEVICE_NUM_REGS * 4);
+	num_pages = r32le(hdr + CKPT_REGS + 4 + DEVICE_NUM_REGS * 4);
+	pages = ((uint64_t)CKPT_HEADER_LEN + io_len + 3) & ~3ULL;
+	if (num_pages > MEM_PAGES ||
+	    pages + (uint64_t)num_pages * CKPT_PAGE_LEN > f->len) {
+		printc_err("sim checkpoint: %s: file is truncated\n", path);
+		goto fail;
+	}
+
+	for (i = 0; i < num_pages; i++) {
+		const uint32_t page = r32le(f->data + pages + i * CKPT_PAGE_LEN);
+
+		if (page >= MEM_PAGES || dev->mem_tags[page] == MEM_UNMAPPED ||
+		    (i && page <= r32le(f->data + pages +
+					(i - 1) * CKPT_PAGE_LEN))) {
+			printc_err("sim checkpoint: %s: file is corrupt\n",
+				   path);
+			goto fail;
+		}
+	}
+
+	io = simio_snapshot_decode(hdr + CKPT_HEADER_LEN, io_len);
+	if (!io)
+		goto fail;
+
+	if (simio_snapshot_restore(dev->simio, io) < 0) {
+		simio_snapshot_free(io);
+		goto fail;
+	}
+
+	simio_snapshot_free(io);
+
+	for (i = 0; i < MEM_PAGES; i++) {
+		page_unref(dev->mem_pages[i]);
+		dev->mem_pages[i] = NULL;
+	}
+
+	for (i = 0; i < num_pages; i++) {
+		struct mem_page *p =
+			(struct mem_page *)(f->data + pages + i * CKPT_PAGE_LEN);
+
+		dev->mem_pages[r32le((const uint8_t *)p)] = p->data;
+		p->refs = PAGE_PINNED;
+	}
+
+	for (i = 0; i < MEM_PAGES; i++)
+		mem_update_fast(dev, i);
+
+	icache_invalidate(dev, 0, MEM_SIZE);
+
+	for (i = 0; i < DEVICE_NUM_REGS; i++)
+		dev->regs[i] = r32le(hdr + CKPT_REGS + i * 4);
+
+	dev->flags_op = FLAGS_NONE;
+	dev->current_insn = r32le(hdr + CKPT_REGS - 4);
+	dev->watchpoint_hit = 0;
+	poll_reset(dev);
+	history_reset(dev);
+	profile_resync(dev);
+	trace_sync(dev);
+
+	f->next = dev->checkpoint_files;
+	dev->checkpoint_files = f;
+	return 0;
+
+fail:
+	checkpoint_file_free(f);
+	return -1;
+}
+
+void symbol_name(uint32_t addr, char *buf, int max_len)
+{
+	char name[64];
+	address_t offset;
+
+	if (stab_nearest(addr, name, sizeof(name), &offset))
+		snprintf(buf, max_len, "0x%05x", addr);
+	else if (offset)
+		snprintf(buf, max_len, "%s+0x%x", name, offset);
+	else
+		snprintf(buf, max_len, "%s", name);
+}
+
+struct sim_device *snapshot_device(void)
+{
+	if (!device_default || (device_default->type != &device_sim &&
+				device_default->type != &device_simx)) {
+		printc_err("sim: the simulator is not in use\n");
+		return NULL;
+	}
+
+	return (struct sim_device *)device_default;
+}
+
+static int cmd_snapshot(char **arg_text)
+{
+	const char *subcmd = get_arg(arg_text);
+	const char *name = get_arg(arg_text);
+	struct sim_device *dev = snapshot_device();
+	struct sim_snapshot **s;
+
+	if (!dev)
+		return -1;
+
+	if (subcmd && !strcasecmp(subcmd, "list")) {
+		for (s = &dev->snapshots; *s; s = &(*s)->next)
+			printc("    %s\n", (*s)->name);
+		return 0;
+	}
+
+	if (!(subcmd && name)) {
+		printc_err("sim snapshot: you must specify a subcommand "
+			   "and a name\n");
+		return -1;
+	}
+
+	if (!strcasecmp(subcmd, "save"))
+		return snapshot_save(dev, name);
+
+	if (!strcasecmp(subcmd, "restore"))
+		return snapshot_restore(dev, name);
+
+	if (!strcasecmp(subcmd, "delete")) {
+		struct sim_snapshot *snap;
+
+		s = snapshot_find(dev, name);
+		snap = *s;
+		if (!snap) {
+			printc_err("sim snapshot: no such snapshot: %s\n",
+				   name);
+			return -1;
+		}
+
+		*s = snap->next;
+		snapshot_free(snap);
+		return 0;
+	}
+
+	printc_err("sim snapshot: unknown subcommand: %s\n", subcmd);
+	return -1;
+}
+
+static int cmd_checkpoint(char **arg_text)
+{
+	const char *subcmd = get_arg(arg_text);
+	const char *path = get_arg(arg_text);
+	struct sim_device *dev = snapshot_device();
+
+	if (!dev)
+		return -1;
+
+	if (!(subcmd && path)) {
+		printc_err("sim checkpoint: you must specify a subcommand "
+			   "and a filename\n");
+		return -1;
+	}
+
+	if (!strcasecmp(subcmd, "save"))
+		return checkpoint_save(dev, path);
+
+	if (!strcasecmp(subcmd, "load"))
+		return checkpoint_load(dev, path);
+
+	printc_err("sim checkpoint: unknown subcommand: %s\n", subcmd);
+	return -1;
+}
+
+static int cmd_history(char **arg_text)
+{
+	struct sim_device *dev = snapshot_device();
+	uint64_t steps;
+	int checkpoints = 0;
+	const struct history_checkpoint *c;
+
+	(void)arg_text;
+
+	if (!dev)
+		return -1;
+
+	history_setup(dev);
+	if (!dev->hist_buf) {
+		printc("Execution history is not being recorded.\n");
+		return 0;
+	}
+
+	for (c = dev->hist_checkpoints; c; c = c->next)
+		checkpoints++;
+
+	steps = dev->hist_step - dev->hist_first;
+	printc("History buffer: %u of %u bytes used\n",
+	       dev->hist_used, dev->hist_size);
+	printc("Steps recorded: %llu (%.1f bytes per step)\n",
+	       (unsigned long long)steps,
+	       steps ? (double)dev->hist_used / steps : 0.0);
+	printc("Steps which can be undone: %llu\n",
+	       (unsigned long long)(dev->hist_step - history_oldest(dev)));
+	printc("Checkpoints: %d\n", checkpoints);
+	return 0;
+}
+
+static int reverse_common(char **arg_text, uint64_t count)
+{
+	struct sim_device *dev = snapshot_device();
+	address_t regs[DEVICE_NUM_REGS];
+	int ret;
+	int i;
+
+	(void)arg_text;
+
+	if (!dev)
+		return -1;
+
+	ret = history_reverse(dev, count);
+	if (ret < 0)
+		return -1;
+
+	if (ret)
+		printc("Reached the start of the recorded history\n");
+
+	sr_sync(dev);
+	for (i = 0; i < DEVICE_NUM_REGS; i++)
+		regs[i] = dev->regs[i];
+
+	show_regs(regs);
+	return 0;
+}
+
+static int cmd_reverse_step(char **arg_text)
+{
+	const char *count_text = get_arg(arg_text);
+	address_t count = 1;
+
+	if (count_text && expr_eval(count_text, &count) < 0) {
+		printc_err("sim reverse-step: can't parse count: %s\n",
+			   count_text);
+		return -1;
+	}
+
+	return reverse_common(arg_text, count);
+}
+
+static int cmd_reverse_continue(char **arg_text)
+{
+	return reverse_common(arg_text, UINT64_MAX);
+}
+
+int cmd_sim(char **arg_text)
 {
-	/* PUSHM/POPM */
+	const char *subcmd = get_arg(arg_text);
+	static const struct {
+		const char *name;
+		int (*func)(char **arg_text);
+	} cmd_table[] = {
+		{"snapshot",		cmd_snapshot},
+		{"checkpoint",		cmd_checkpoint},
+		{"history",		cmd_history},
+		{"profile",		cmd_profile},
+		{"coverage",		cmd_coverage},
+		{"trace",		cmd_trace},
+		{"hook",		cmd_hook},
+		{"fuzz",		cmd_fuzz},
+		{"reverse-step",	cmd_reverse_step},
+		{"reverse-continue",	cmd_reverse_continue}
+	};
+	int i;
 
-	uint16_t opcode = ins & 0xfe00;
-	int is_aword = ins & 0x0100;
-	int reg = ins & 0x000f;
-	int rept = ((ins >> 4) & 0xf) + 1;
+	if (!subcmd) {
+		printc_err("sim: a subcommand is required\n");
+		return -1;
+	}
 
-	int cycles = 2 + (is_aword ? 2 : 1) * rept;
+	for (i = 0; i < ARRAY_LEN(cmd_table); i++)
+		if (!strcasecmp(cmd_table[i].name, subcmd))
+			return cmd_table[i].func(arg_text);
 
-	switch (opcode) {
+	printc_err("sim: unknown subcommand: %s\n", subcmd);
+	return -1;
+}
 
-	case MSP430_OP_PUSHM:
-		while (rept--) {
-			dev->regs[MSP430_REG_SP] -= 2;
-			if (mem_setw(dev, dev->regs[MSP430_REG_SP], dev->regs[reg--]) < 0)
-				return -1;
-		}
-		break;
+int sim_set_cycle_limit(device_t dev_base, uint64_t cycles)
+{
+	struct sim_device *dev = (struct sim_device *)dev_base;
 
-	case MSP430_OP_POPM:
-		while (rept--) {
-			dev->regs[reg++] = mem_getw(dev, dev->regs[MSP430_REG_SP]);
-			dev->regs[MSP430_REG_SP] += 2;
-		}
-		break;
+	if (dev_base->type != &device_sim && dev_base->type != &device_simx) {
+		printc_err("sim: cycle limits need the simulator\n");
+		return -1;
+	}
 
-	default:
-		return invalid_opcode(dev);
-	};
+	dev->cycle_limit = cycles ? simio_time(dev->simio) + cycles : 0;
+	dev->cycle_limit_hit = 0;
+	return 0;
+}
 
-	return cycles;
+int sim_cycle_limit_reached(device_t dev_base)
+{
+	if (dev_base->type != &device_sim && dev_base->type != &device_simx)
+		return 0;
+
+	return ((struct sim_device *)dev_base)->cycle_limit_hit;
 }
 
-static int step_reti_calla(struct sim_device *dev, uint16_t ins)
+int sim_exited(device_t dev_base, int *status)
 {
-	/* RETI, CALLA */
+	struct sim_device *dev = (struct sim_device *)dev_base;
 
-	int amode;
-	int reg = 0;
-	int ext_imm = 0;
-	uint32_t data;
-	int cycles = 0;
+	if (dev_base->type != &device_sim && dev_base->type != &device_simx)
+		return 0;
 
-	switch ((ins & 0x00C0)>>6) {
-		case 0:				/* RETI */
-			/* note: RETI handled in step_single() for basic CPU */
-			if (ins != MSP430_OP_RETI)
-				return invalid_opcode(dev);
+	if (!dev->exited)
+		return 0;
 
-			uint16_t w1 = mem_getw(dev, dev->regs[MSP430_REG_SP]);
-			dev->regs[MSP430_REG_SR] = w1 & 0x0FFF;
-			dev->regs[MSP430_REG_SP] += 2;
-			dev->regs[MSP430_REG_PC] =
-				mem_getw(dev, dev->regs[MSP430_REG_SP]);
-			dev->regs[MSP430_REG_PC] |= ((w1 & 0xF000) << 4);
-			dev->regs[MSP430_REG_SP] += 2;
-			cycles = 5;
+	*status = dev->exit_status;
+	return 1;
+}
 
-		case 1:				/* CALLA Rd, x(Rd), @Rd, @Rd+ */
-			amode = (ins & 0x30) >> 4;
-			reg = (ins & 0xF);
-			cycles = (amode & 2) ? 6 : 5;
-			if (amode == 1 && reg == MSP430_REG_SP)
-				cycles++;
-			goto calla_common;
+int sim_watch_write(device_t dev_base, address_t *addr, address_t *value)
+{
+	struct sim_device *dev = (struct sim_device *)dev_base;
 
-		case 2:				/* CALLA &abs20, rel20, #imm20 */
-			if ((ins & 0x30) == 0x20)
-				return invalid_opcode(dev);
+	if (dev_base->type != &device_sim && dev_base->type != &device_simx)
+		return 0;
 
-			amode = ((ins & 0x30) >> 4) | 1;
-			ext_imm = (ins & 0xF);
-			cycles = (amode & 2) ? 5 : 7;
-			goto calla_common;
+	if (!dev->watch_written)
+		return 0;
 
-		calla_common:
+	*addr = dev->watch_addr;
+	*value = dev->watch_value;
+	return 1;
+}
 
-			if (fetch_operand(dev,amode,reg,20,NULL,&data,1,ext_imm) < 0)
-				return -1;
+int sim_get_cycles(device_t dev_base, uint64_t *cycles)
+{
+	if (dev_base->type != &device_sim && dev_base->type != &device_simx)
+		return -1;
 
-			dev->regs[MSP430_REG_SP] -= 4;
-			if (mem_setw(dev, dev->regs[MSP430_REG_SP] + 2,
-				 (dev->regs[MSP430_REG_PC] >> 16) & 0x0000F) < 0)
-				 return -1;
-			if (mem_setw(dev, dev->regs[MSP430_REG_SP],
-				 dev->regs[MSP430_REG_PC]) < 0)
-				 return -1;
-			dev->regs[MSP430_REG_PC] = data;
-			break;
+	*cycles = simio_time(((struct sim_device *)dev_base)->simio);
+	return 0;
+}
 
-		case 3:				/* RESERVED */
-			return invalid_opcode(dev);
+int cmd_simio(char **arg_text)
+{
+	if (!device_default || (device_default->type != &device_sim &&
+				device_default->type != &device_simx)) {
+		printc_err("simio: the simulator is not in use\n");
+		return -1;
 	}
-	return cycles;
+
+	return simio_command(((struct sim_device *)device_default)->simio,
+			     arg_text);
 }
 
-/* Fetch and execute one instruction. Return the number of CPU cycles
- * it would have taken, or -1 if an error occurs.
- */
-static int step_cpu(struct sim_device *dev)
+static void sim_destroy(device_t dev_base)
 {
-	uint16_t ins;
-	int ret;
+	struct sim_device *dev = (struct sim_device *)dev_base;
+	int i;
 
-	const char *where = NULL;
-	if (dev->regs[MSP430_REG_PC] < dev->addr_io_end)
-		where = "in device space";
-	else if (dev->regs[MSP430_REG_PC] >= MEM_SIZE)
-		where = "beyond end of memory";
-	if (where) {
-		/* report bogus PC, provide previous location */
-		printc_err("%s: executing %s: PC = 0x%05x; "
-			"previous PC value 0x%05x\n",
-			SIMx,where,dev->regs[MSP430_REG_PC],dev->current_insn);
-		return -1;
+	while (dev->snapshots) {
+		struct sim_snapshot *snap = dev->snapshots;
+
+		dev->snapshots = snap->next;
+		snapshot_free(snap);
 	}
 
-	/* Fetch the instruction */
-	dev->current_insn = dev->regs[MSP430_REG_PC];
+	history_reset(dev);
+	free(dev->hist_buf);
+	profile_free(dev->profile);
 
-	ins = mem_getw(dev, dev->current_insn);
-	add_to_pc(dev,2);
+	if (dev->trace)
+		trace_stop(dev);
 
-	/* Handle different instruction types */
-	if ((ins & 0xf800) == 0x1800 && dev->cpux) {
+	if (dev->cover_file && dev->cover_map)
+		coverage_save(dev, dev->cover_file);
 
-		/* found extension word */
-		uint16_t ext = ins;
-		ins = mem_getw(dev, dev->current_insn + 2);
-		add_to_pc(dev,2);
+	free(dev->cover_file);
 
-		if ((ins & 0xf000) >= 0x4000)
-			ret = step_double(dev, ins, ext);
-		else if ((ins & 0xf000) == 0x1000 && (ins & 0xfc00) < 0x1280)
-			ret = step_single(dev, ins, ext);
-		else
-			ret = invalid_opcode(dev);
+	for (i = 0; i < SEMIHOST_MAX_FILES; i++)
+		if (dev->semihost_files[i])
+			fclose(dev->semihost_files[i]);
 
-	} else {
-		if ((ins & 0xf0e0) == 0x0040 && dev->cpux)
-			ret = step_RxxM(dev, ins);
-		else if ((ins & 0xf000) == 0x0000 && dev->cpux)
-			ret = step_0xxx_addr(dev, ins);
-		else if ((ins & 0xfc00) == 0x1400 && dev->cpux)
-			ret = step_pushm_popm(dev, ins);
-		else if ((ins & 0xff00) == 0x1300 && dev->cpux)
-			ret = step_reti_calla(dev, ins);
-		else if ((ins & 0xf000) == 0x1000)
-			ret = step_single(dev, ins, 0);
-		else if ((ins & 0xe000) == 0x2000)
-			ret = step_jump(dev, ins);
-		else if ((ins & 0xf000) >= 0x4000)
-			ret = step_double(dev, ins, 0);
-		else
-			ret = invalid_opcode(dev);
-	}
+	hook_clear(dev);
+	free(dev->cover_map);
+	simio_context_free(dev->simio);
 
-	/* If things went wrong, restart at the current instruction */
-	if (ret < 0)
-		dev->regs[MSP430_REG_PC] = dev->current_insn;
+	for (i = 0; i < ICACHE_PAGES; i++)
+		free(dev->icache[i]);
 
-	return ret;
+	for (i = 0; i < MEM_PAGES; i++)
+		page_unref(dev->mem_pages[i]);
+
+	/* Pages in checkpoint files are no longer in use by now */
+	while (dev->checkpoint_files) {
+		struct checkpoint_file *f = dev->checkpoint_files;
+
+		dev->checkpoint_files = f->next;
+		checkpoint_file_free(f);
+	}
+
+	free(dev->break_map);
+	free(dev);
 }
 
-static void do_reset(struct sim_device *dev)
+/* Copy memory out to the host. Pages which have never been written read
+ * as erased memory.
+ */
+static void mem_read_block(struct sim_device *dev, uint32_t addr,
+			   uint8_t *mem, uint32_t len)
 {
-	simio_step(dev->regs[MSP430_REG_SR], 4);
-	memset(dev->regs, 0, sizeof(dev->regs));
-	dev->regs[MSP430_REG_PC] = mem_getw(dev, 0xfffe);
-	dev->regs[MSP430_REG_SR] = 0;
-	simio_reset();
+	while (len) {
+		const uint8_t *page = dev->mem_pages[addr >> MEM_PAGE_SHIFT];
+		const uint32_t offset = addr & (MEM_PAGE_SIZE - 1);
+		uint32_t n = MEM_PAGE_SIZE - offset;
+
+		if (n > len)
+			n = len;
+
+		if (page)
+			memcpy(mem, page + offset, n);
+		else
+			memset(mem, 0xff, n);
+
+		mem += n;
+		addr += n;
+		len -= n;
+	}
 }
 
-static int step_system(struct sim_device *dev)
+/* Copy memory in from the host. Any mapped memory, including ROM, may
+ * be written this way.
+ */
+int mem_write_block(struct sim_device *dev, uint32_t addr,
+		    const uint8_t *mem, uint32_t len)
 {
-	int count = 1;
-	int irq;
-	uint16_t status = dev->regs[MSP430_REG_SR];
+	while (len) {
+		const uint32_t offset = addr & (MEM_PAGE_SIZE - 1);
+		uint32_t n = MEM_PAGE_SIZE - offset;
+		uint8_t *page;
 
-	irq = simio_check_interrupt();
-	if (irq == 15) {
-		do_reset(dev);
-		return 0;
-	} else if (((status & MSP430_SR_GIE) && irq >= 0) || irq >= 14) {
-		if (irq >= 16) {
-			printc_err("%s: invalid interrupt number: %d\n", SIMx, irq);
+		if (n > len)
+			n = len;
+
+		if (mem_type(dev, addr) == MEM_UNMAPPED) {
+			printc_err("%s: memory write to unmapped address "
+				   "0x%05x\n", SIMx, addr);
 			return -1;
 		}
 
-		dev->regs[MSP430_REG_SP] -= 2;
-		if (mem_setw(dev, dev->regs[MSP430_REG_SP],
-			 dev->regs[MSP430_REG_PC]) < 0)
-			 return -1;
-
-		dev->regs[MSP430_REG_SP] -= 2;
-		if (mem_setw(dev, dev->regs[MSP430_REG_SP],
-			 dev->regs[MSP430_REG_SR]) < 0)
-			 return -1;
+		page = mem_alloc_page(dev, addr);
+		if (!page)
+			return -1;
 
-		dev->regs[MSP430_REG_SR] &=
-			~(MSP430_SR_GIE | MSP430_SR_CPUOFF);
-		dev->regs[MSP430_REG_PC] = mem_getw(dev, 0xffe0 + irq * 2);
+		memcpy(page + offset, mem, n);
+		icache_invalidate(dev, addr, n);
 
-		simio_ack_interrupt(irq);
-		count = 6;
-	} else if (!(status & MSP430_SR_CPUOFF)) {
-		count = step_cpu(dev);
-		if (count < 0)
-			return -1;
+		mem += n;
+		addr += n;
+		len -= n;
 	}
 
-	simio_step(status, count);
 	return 0;
 }
 
-/************************************************************************
- * Device interface
- */
-
-static void sim_destroy(device_t dev_base)
+/* Erase a range of memory. ROM is left untouched. */
+static void mem_erase(struct sim_device *dev, uint32_t addr, uint32_t len)
 {
-	free(dev_base);
+	const uint32_t end = addr + len;
+
+	icache_invalidate(dev, addr, len);
+
+	while (addr < end) {
+		uint8_t **page = &dev->mem_pages[addr >> MEM_PAGE_SHIFT];
+		const uint32_t offset = addr & (MEM_PAGE_SIZE - 1);
+		uint32_t n = MEM_PAGE_SIZE - offset;
+
+		if (n > end - addr)
+			n = end - addr;
+
+		if (*page && mem_type(dev, addr) != MEM_ROM) {
+			if (n == MEM_PAGE_SIZE) {
+				page_unref(*page);
+				*page = NULL;
+				mem_update_fast(dev,
+						addr >> MEM_PAGE_SHIFT);
+			} else if (mem_alloc_page(dev, addr)) {
+				memset(*page + offset, 0xff, n);
+			}
+		}
+
+		addr += n;
+	}
 }
 
 static int sim_readmem(device_t dev_base, address_t addr,
@@ -1296,7 +3639,7 @@ static int sim_readmem(device_t dev_base, address_t addr,
 
 	/* Read byte IO addresses */
 	while (len && (addr < ADDR_BYTE_IO_END)) {
-		simio_read_b(addr, mem);
+		simio_read_b(dev->simio, addr, mem);
 		mem++;
 		len--;
 		addr++;
@@ -1306,7 +3649,7 @@ static int sim_readmem(device_t dev_base, address_t addr,
 	while (len >= 2 && addr < dev->addr_io_end) {
 		uint16_t data = 0;
 
-		simio_read(addr, &data);
+		simio_read(dev->simio, addr, &data);
 		mem[0] = data & 0xff;
 		mem[1] = data >> 8;
 		mem += 2;
@@ -1314,7 +3657,7 @@ static int sim_readmem(device_t dev_base, address_t addr,
 		addr += 2;
 	}
 
-	memcpy(mem, dev->memory + addr, len);
+	mem_read_block(dev, addr, mem, len);
 	return 0;
 }
 
@@ -1329,9 +3672,11 @@ static int sim_writemem(device_t dev_base, address_t addr,
 		return -1;
 	}
 
+	history_reset(dev);
+
 	/* Write byte IO addresses */
 	while (len && (addr < ADDR_BYTE_IO_END)) {
-		simio_write_b(addr, *mem);
+		simio_write_b(dev->simio, addr, *mem);
 		mem++;
 		len--;
 		addr++;
@@ -1346,14 +3691,14 @@ static int sim_writemem(device_t dev_base, address_t addr,
                    "the last byte is ignored.\n",SIMx);
 	}
 	while (len >= 2 && addr < dev->addr_io_end) {
-		simio_write(addr, ((uint16_t)mem[1] << 8) | mem[0]);
+		simio_write(dev->simio, addr,
+			    ((uint16_t)mem[1] << 8) | mem[0]);
 		mem += 2;
 		len -= 2;
 		addr += 2;
 	}
 
-	memcpy(dev->memory + addr, mem, len);
-	return 0;
+	return mem_write_block(dev, addr, mem, len);
 }
 
 static int sim_getregs(device_t dev_base, address_t *regs)
@@ -1361,6 +3706,7 @@ static int sim_getregs(device_t dev_base, address_t *regs)
 	struct sim_device *dev = (struct sim_device *)dev_base;
 	int i;
 
+	sr_sync(dev);
 	for (i = 0; i < DEVICE_NUM_REGS; i++)
 		regs[i] = dev->regs[i];
 	return 0;
@@ -1371,8 +3717,17 @@ static int sim_setregs(device_t dev_base, const address_t *regs)
 	struct sim_device *dev = (struct sim_device *)dev_base;
 	int i;
 
+	/* Debuggers often write back registers they haven't changed */
+	sr_sync(dev);
+	for (i = 0; i < DEVICE_NUM_REGS; i++)
+		if (dev->regs[i] != regs[i])
+			history_reset(dev);
+
+	dev->flags_op = FLAGS_NONE;
 	for (i = 0; i < DEVICE_NUM_REGS; i++)
 		dev->regs[i] = regs[i];
+
+	profile_resync(dev);
 	return 0;
 }
 
@@ -1383,17 +3738,51 @@ static int sim_ctl(device_t dev_base, device_ctl_t op)
 	switch (op) {
 	case DEVICE_CTL_RESET:
 		do_reset(dev);
+		history_reset(dev);
+		profile_resync(dev);
 		return 0;
 
 	case DEVICE_CTL_HALT:
 		dev->running = 0;
+		if (dev->poll_skipped) {
+			printc_dbg("%s: %llu cycles skipped in polling loops\n",
+				   SIMx,
+				   (unsigned long long)dev->poll_skipped);
+			dev->poll_skipped = 0;
+		}
 		return 0;
 
 	case DEVICE_CTL_STEP:
-		return step_system(dev);
+		update_breakpoints(dev);
+		history_setup(dev);
+		dev->semihost_port = opdb_get_numeric("sim_semihost");
+		if (dev->profiling)
+			profile_step_begin(dev);
+
+		if (dev->hist_buf) {
+			dev->skip_polling = 0;
+			if (history_step(dev) < 0)
+				return -1;
+		} else if ((dev->cpux ? cpux_step(dev) :
+			    msp430_step(dev)) < 0) {
+			return -1;
+		}
+
+		if (dev->profiling)
+			profile_step_end(dev);
+		return 0;
+
+	case DEVICE_CTL_REVERSE_STEP:
+		return history_reverse(dev, 1);
+
+	case DEVICE_CTL_REVERSE_RUN:
+		return history_reverse(dev, UINT64_MAX);
 
 	case DEVICE_CTL_RUN:
 		dev->running = 1;
+		dev->cycle_limit_hit = 0;
+		dev->exited = 0;
+		dev->watch_written = 0;
 		return 0;
 
 	default:
@@ -1409,55 +3798,128 @@ static int sim_erase(device_t dev_base, device_erase_type_t type,
 {
 	struct sim_device *dev = (struct sim_device *)dev_base;
 
+	history_reset(dev);
+
 	switch (type) {
 	case DEVICE_ERASE_MAIN:
-		memset(dev->memory + 0x2000, 0xff, MEM_SIZE - 0x2000);
+		mem_erase(dev, 0x2000, MEM_SIZE - 0x2000);
 		break;
 
 	case DEVICE_ERASE_ALL:
-		memset(dev->memory, 0xff, MEM_SIZE);
+		mem_erase(dev, 0, MEM_SIZE);
 		break;
 
 	case DEVICE_ERASE_SEGMENT:
 		addr &= ~0x3f;
 		addr &= (MEM_SIZE - 1);
-		memset(dev->memory + addr, 0xff, 64);
+		mem_erase(dev, addr, 64);
 		break;
 	}
 
 	return 0;
 }
 
-static device_status_t sim_poll(device_t dev_base)
+/* Limits on the number of instructions run by a call to poll. The
+ * clock is read a few times in each call, so that a slow stretch of the
+ * program can't hold on to the caller for much longer than the target.
+ */
+#define RUN_QUANTUM_MIN		1000
+#define RUN_QUANTUM_MAX		(INT32_MAX >> 2)
+#define RUN_QUANTUM_INITIAL	100000
+#define RUN_CLOCK_CHECKS	8
+
+/* Scale the quantum by the ratio of the target time to the time the last
+ * call took, at most by a factor of four in either direction.
+ */
+static void run_quantum_update(struct sim_device *dev, int executed,
+			       uint64_t elapsed, uint64_t target)
 {
-	struct sim_device *dev = (struct sim_device *)dev_base;
-	int count = 1000000;
+	uint64_t q;
+
+	if (elapsed * 4 <= target)
+		q = (uint64_t)executed * 4;
+	else if (elapsed >= target * 4)
+		q = executed / 4;
+	else
+		q = (uint64_t)executed * target / elapsed;
+
+	if (q < RUN_QUANTUM_MIN)
+		q = RUN_QUANTUM_MIN;
+	if (q > RUN_QUANTUM_MAX)
+		q = RUN_QUANTUM_MAX;
+
+	dev->run_quantum = q;
+}
+
+static inline device_status_t run_loop(struct sim_device *dev, int cpux)
+{
+	const uint64_t target = (uint64_t)opdb_get_numeric("sim_poll_ms") * 1000;
+	const uint64_t start = time_us();
+	int quantum;
+	int slice;
+	int count;
+	int until_check;
 
 	if (!dev->running)
 		return DEVICE_STATUS_HALTED;
 
+	if (!dev->run_quantum)
+		dev->run_quantum = RUN_QUANTUM_INITIAL;
+
+	quantum = target ? dev->run_quantum : RUN_QUANTUM_MAX;
+	slice = quantum / RUN_CLOCK_CHECKS;
+	count = quantum;
+	until_check = slice;
+
+	update_breakpoints(dev);
+	poll_reset(dev);
+	history_setup(dev);
+	dev->semihost_port = opdb_get_numeric("sim_semihost");
+
+	/* Skipping must be done identically when a step is run again
+	 * from history, so it's not done while recording. The profiler
+	 * and the trace see every pass of a loop, so it's not done then
+	 * either.
+	 */
+	dev->skip_polling = opdb_get_boolean("sim_skip_polling") &&
+		!dev->hist_buf && !dev->profiling && !dev->trace;
+
 	dev->watchpoint_hit = 0;
 	while (count > 0) {
-		int i;
+		int n;
 
-		for (i = 0; i < dev->base.max_breakpoints; i++) {
-			struct device_breakpoint *bp =
-				&dev->base.breakpoints[i];
+		if (dev->num_breaks && breakpoint_check(dev)) {
+			dev->running = 0;
+			return DEVICE_STATUS_HALTED;
+		}
 
-			if ((bp->flags & DEVICE_BP_ENABLED) &&
-			    (bp->type == DEVICE_BPTYPE_BREAK) &&
-			    dev->regs[MSP430_REG_PC] == bp->addr) {
-				dev->running = 0;
-				return DEVICE_STATUS_HALTED;
-			}
+		if (dev->cycle_limit &&
+		    simio_time(dev->simio) >= dev->cycle_limit) {
+			dev->cycle_limit_hit = 1;
+			dev->running = 0;
+			return DEVICE_STATUS_HALTED;
 		}
 
-		if (step_system(dev) < 0) {
+		if (dev->profiling)
+			profile_step_begin(dev);
+
+		if (dev->hist_buf)
+			n = history_step(dev);
+		else if (dev->profiling)
+			n = cpux ? cpux_step_block(dev, 1) :
+				msp430_step_block(dev, 1);
+		else
+			n = cpux ? cpux_step_block(dev, until_check) :
+				msp430_step_block(dev, until_check);
+		if (n < 0) {
 			dev->running = 0;
 			return DEVICE_STATUS_ERROR;
 		}
 
-		if (dev->watchpoint_hit) {
+		if (dev->profiling)
+			profile_step_end(dev);
+
+		if (dev->watchpoint_hit || dev->exited) {
 			dev->running = 0;
 			return DEVICE_STATUS_HALTED;
 		}
@@ -1465,18 +3927,103 @@ static device_status_t sim_poll(device_t dev_base)
 		if (ctrlc_check())
 			return DEVICE_STATUS_INTR;
 
-		count--;
+		count -= n;
+		until_check -= n;
+		if (until_check <= 0) {
+			if (target && time_us() - start >= target)
+				break;
+			until_check = count < slice ? count : slice;
+		}
 	}
 
+	if (target)
+		run_quantum_update(dev, quantum - count, time_us() - start,
+				   target);
+
 	return DEVICE_STATUS_RUNNING;
 }
 
-static device_t sim_open(const struct device_args *args)
+static device_status_t sim_poll(device_t dev_base)
+{
+	return run_loop((struct sim_device *)dev_base, 0);
+}
+
+static device_status_t simx_poll(device_t dev_base)
+{
+	return run_loop((struct sim_device *)dev_base, 1);
+}
+
+/* Tag the pages overlapping a range of addresses. Where different
+ * types of memory share a page, the most permissive type is used.
+ */
+static void map_range(struct sim_device *dev, uint32_t addr, uint32_t size,
+		      sim_memtype_t type)
 {
-	struct sim_device *dev = malloc(sizeof(*dev));
+	uint32_t page;
 
-	(void)args;
+	if (!size || addr >= MEM_SIZE)
+		return;
+	if (size > MEM_SIZE - addr)
+		size = MEM_SIZE - addr;
 
+	for (page = addr >> MEM_PAGE_SHIFT;
+	     page <= (addr + size - 1) >> MEM_PAGE_SHIFT; page++)
+		if (dev->mem_tags[page] < type)
+			dev->mem_tags[page] = type;
+}
+
+/* Build the memory map from the chip's memory layout. Without a chip,
+ * the original CPU gets 128 kB of RAM and CPUX gets the whole address
+ * space.
+ */
+static void map_memory(struct sim_device *dev)
+{
+	const struct chipinfo *chip = dev->base.chip;
+	const struct chipinfo_memory *m;
+	uint32_t mapped = 0;
+	int i;
+
+	if (!chip) {
+		map_range(dev, 0, dev->cpux ? MEM_SIZE : DEFAULT_MEM_SIZE,
+			  MEM_RAM);
+	} else {
+		for (m = chip->memory; m->name; m++) {
+			sim_memtype_t type = MEM_RAM;
+
+			if (m->type == CHIPINFO_MEMTYPE_ROM)
+				type = MEM_ROM;
+			else if (m->type == CHIPINFO_MEMTYPE_FLASH)
+				type = MEM_FLASH;
+
+			map_range(dev, m->offset, m->size, type);
+		}
+
+		/* Peripherals are always backed by memory */
+		map_range(dev, 0, dev->addr_io_end, MEM_RAM);
+	}
+
+	for (i = 0; i < MEM_PAGES; i++)
+		if (dev->mem_tags[i] != MEM_UNMAPPED)
+			mapped += MEM_PAGE_SIZE;
+
+	printc_dbg("Simulation started, 0x%x bytes of memory\n", mapped);
+}
+
+static device_t open_common(const struct device_args *args, int cpux)
+{
+	const struct chipinfo *chip = NULL;
+	struct sim_device *dev;
+
+	if (args->forced_chip_id) {
+		chip = chipinfo_find_by_name(args->forced_chip_id);
+		if (!chip) {
+			printc_err("sim: unknown chip: %s\n",
+				   args->forced_chip_id);
+			return NULL;
+		}
+	}
+
+	dev = malloc(sizeof(*dev));
 	if (!dev) {
 		pr_error("can't allocate memory for simulation");
 		return NULL;
@@ -1484,28 +4031,46 @@ static device_t sim_open(const struct device_args *args)
 
 	memset(dev, 0, sizeof(*dev));
 
-	dev->base.type = &device_sim;
-	dev->base.max_breakpoints = DEVICE_MAX_BREAKPOINTS;
+	dev->simio = simio_context_new();
+	if (!dev->simio) {
+		free(dev);
+		return NULL;
+	}
+
+	dev->base.type = cpux ? &device_simx : &device_sim;
+	dev->base.max_breakpoints = SIM_MAX_BREAKPOINTS;
+	dev->base.big_breakpoints = dev->breakpoints;
+	dev->base.can_reverse = 1;
+	dev->base.chip = chip;
 
-	memset(dev->memory, 0xff, sizeof(dev->memory));
 	memset(dev->regs, 0xff, sizeof(dev->regs));
 
 	dev->running = 0;
 	dev->current_insn = 0;
 
-	dev->addr_io_end = 0x200;
+	build_dispatch();
+	dev->cpux = cpux;
+	if (cpux) {
+		dev->addr_io_end = 0x1000;
+		dev->dispatch = cpux_dispatch;
+		dev->ext_dispatch = cpux_ext_dispatch;
+	} else {
+		dev->addr_io_end = 0x200;
+		dev->dispatch = msp430_dispatch;
+	}
 
-	printc_dbg("Simulation started, 0x%x bytes of RAM\n", MEM_SIZE);
+	map_memory(dev);
 	return (device_t)dev;
 }
 
+static device_t sim_open(const struct device_args *args)
+{
+	return open_common(args, 0);
+}
+
 static device_t simx_open(const struct device_args *args)
 {
-	struct sim_device *dev = (struct sim_device *)sim_open(args);
-	dev->base.type = &device_simx;
-	dev->cpux = 1;
-	dev->addr_io_end = 0x1000;
-	return (device_t)dev;
+	return open_common(args, 1);
 }
 
 const struct device_class device_sim = {
@@ -1534,7 +4099,6 @@ const struct device_class device_simx = {
 	.getregs	= sim_getregs,
 	.setregs	= sim_setregs,
 	.ctl		= sim_ctl,
-	.poll		= sim_poll,
+	.poll		= simx_poll,
 	.getconfigfuses = NULL
 };
-
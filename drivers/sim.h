@@ -25,4 +25,33 @@
 extern const struct device_class device_sim;
 extern const struct device_class device_simx;
 
+/* Cycle budget, for batch runs. While a limit is set, the simulator
+ * halts once the given number of system cycles have passed since it
+ * was set. Zero removes the limit. sim_cycle_limit_reached() returns
+ * non-zero if the last run stopped because the budget was spent.
+ */
+int sim_set_cycle_limit(device_t dev, uint64_t cycles);
+int sim_cycle_limit_reached(device_t dev);
+
+/* Returns non-zero if the last run stopped because the program made a
+ * semihosting exit request, and gives the status it asked for.
+ */
+int sim_exited(device_t dev, int *status);
+
+/* Returns non-zero if the last run stopped at a write watchpoint, and
+ * gives the address and the value written.
+ */
+int sim_watch_write(device_t dev, address_t *addr, address_t *value);
+
+/* Fetch the number of system cycles simulated so far. Returns -1 if the
+ * device isn't a simulator.
+ */
+int sim_get_cycles(device_t dev, uint64_t *cycles);
+
+/* Simulator commands. "simio" operates on the peripherals of the
+ * default device.
+ */
+int cmd_sim(char **arg_text);
+int cmd_simio(char **arg_text);
+
 #endif
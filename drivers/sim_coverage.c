@@ -0,0 +1,431 @@
+/* MSPDebug - debugging tool for the eZ430
+ * Copyright (C) 2009, 2010, 2020 Daniel Beer
+ * Copyright (C) 2020 Bruce G. Burns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef __Windows__
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "sim_coverage.h"
+#include "output.h"
+#include "dis.h"
+#include "expr.h"
+#include "stab.h"
+#include "vector.h"
+#include "util.h"
+#include "bytes.h"
+
+/* Coverage
+ *
+ * The coverage map has one bit for each word of memory, which is set
+ * when an instruction starting at that word is executed. Marking costs
+ * almost nothing: while covering, instructions are decoded with
+ * SIM_OP_COVER set, and the flag is cleared once the instruction has
+ * been marked (see coverage_mark()).
+ *
+ * Coverage files hold a map, and are merged with, rather than replaced
+ * by, the map being saved. They consist of:
+ *
+ *	magic (8 bytes)
+ *	map (COVER_MAP_SIZE bytes)
+ */
+#define COVER_MAGIC		"MSPDCOV1"
+
+struct cover_func {
+	uint32_t		addr;
+	uint32_t		end;
+	int			executed;
+	int			total;
+};
+
+int coverage_start(struct sim_device *dev)
+{
+	if (!dev->cover_map) {
+		dev->cover_map = calloc(1, COVER_MAP_SIZE);
+		if (!dev->cover_map) {
+			printc_err("sim coverage: can't allocate memory\n");
+			return -1;
+		}
+	}
+
+	/* Instructions must be decoded again to be marked */
+	dev->covering = 1;
+	icache_invalidate(dev, 0, MEM_SIZE);
+	return 0;
+}
+
+static void coverage_stop(struct sim_device *dev)
+{
+	dev->covering = 0;
+	icache_invalidate(dev, 0, MEM_SIZE);
+}
+
+static int coverage_load(struct sim_device *dev, const char *path)
+{
+	uint8_t hdr[8];
+	uint8_t *map;
+	FILE *in;
+	int i;
+
+	in = fopen(path, "rb");
+	if (!in) {
+		pr_error(path);
+		return -1;
+	}
+
+	map = malloc(COVER_MAP_SIZE);
+	if (!map) {
+		printc_err("sim coverage: can't allocate memory\n");
+		fclose(in);
+		return -1;
+	}
+
+	if (fread(hdr, sizeof(hdr), 1, in) != 1 ||
+	    memcmp(hdr, COVER_MAGIC, sizeof(hdr)) ||
+	    fread(map, COVER_MAP_SIZE, 1, in) != 1) {
+		printc_err("sim coverage: %s: not a coverage file\n", path);
+		fclose(in);
+		free(map);
+		return -1;
+	}
+
+	fclose(in);
+
+	if (!dev->cover_map) {
+		dev->cover_map = map;
+		return 0;
+	}
+
+	for (i = 0; i < COVER_MAP_SIZE; i++)
+		dev->cover_map[i] |= map[i];
+
+	free(map);
+	return 0;
+}
+
+/* Open a coverage file for update, creating it if necessary. Other
+ * instances are kept out until it's closed.
+ */
+static FILE *coverage_open(const char *path)
+{
+#ifndef __Windows__
+	struct flock lock;
+	FILE *f;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		pr_error(path);
+		return NULL;
+	}
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+
+	if (fcntl(fd, F_SETLKW, &lock) < 0 || !(f = fdopen(fd, "r+b"))) {
+		pr_error(path);
+		close(fd);
+		return NULL;
+	}
+
+	return f;
+#else
+	FILE *f = fopen(path, "r+b");
+
+	if (!f)
+		f = fopen(path, "w+b");
+	if (!f)
+		pr_error(path);
+
+	return f;
+#endif
+}
+
+int coverage_save(struct sim_device *dev, const char *path)
+{
+	uint8_t hdr[8];
+	uint8_t *map;
+	FILE *f;
+	int i;
+
+	map = calloc(1, COVER_MAP_SIZE);
+	if (!map) {
+		printc_err("sim coverage: can't allocate memory\n");
+		return -1;
+	}
+
+	f = coverage_open(path);
+	if (!f) {
+		free(map);
+		return -1;
+	}
+
+	/* An empty file has just been created */
+	if (fread(hdr, sizeof(hdr), 1, f) == 1 &&
+	    (memcmp(hdr, COVER_MAGIC, sizeof(hdr)) ||
+	     fread(map, COVER_MAP_SIZE, 1, f) != 1)) {
+		printc_err("sim coverage: %s: not a coverage file\n", path);
+		fclose(f);
+		free(map);
+		return -1;
+	}
+
+	for (i = 0; i < COVER_MAP_SIZE; i++)
+		map[i] |= dev->cover_map[i];
+
+	rewind(f);
+	fwrite(COVER_MAGIC, sizeof(hdr), 1, f);
+	fwrite(map, COVER_MAP_SIZE, 1, f);
+	free(map);
+
+	if (ferror(f) | fclose(f)) {
+		pr_error(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Count the instructions in a function, by disassembling it from the
+ * start, and those of which were executed. The function ends early at
+ * the first erased word.
+ */
+static void coverage_count(struct sim_device *dev, struct cover_func *f)
+{
+	uint32_t addr = f->addr;
+
+	while (addr < f->end) {
+		struct msp430_instruction insn;
+		uint8_t code[6];
+		int len = mem_peek(dev, addr, code, sizeof(code));
+
+		if (len < 2 || (code[0] == 0xff && code[1] == 0xff))
+			break;
+
+		len = dis_decode(code, addr, len, &insn);
+		if (len < 2)
+			len = 2;
+
+		f->total++;
+		addr += len;
+	}
+
+	f->end = addr;
+	for (addr = f->addr; addr < f->end; addr += 2)
+		if (dev->cover_map[addr >> 4] & (1 << ((addr >> 1) & 7)))
+			f->executed++;
+
+	/* Code and data may be mixed, so the count can be wrong */
+	if (f->executed > f->total)
+		f->total = f->executed;
+}
+
+static int coverage_add_sym(void *user_data, const char *name,
+			    address_t value)
+{
+	struct cover_func f;
+
+	(void)name;
+
+	memset(&f, 0, sizeof(f));
+	f.addr = value & ~1;
+	return vector_push((struct vector *)user_data, &f, 1);
+}
+
+static int cmp_cover_addr(const void *a, const void *b)
+{
+	const struct cover_func *x = (const struct cover_func *)a;
+	const struct cover_func *y = (const struct cover_func *)b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* Report coverage of each function in the given range. A function runs
+ * from its symbol up to the next. Symbols in RAM are taken to be data
+ * unless code there has been executed.
+ */
+static int coverage_report(struct sim_device *dev,
+			   uint32_t start, uint32_t end)
+{
+	struct vector funcs;
+	int executed = 0;
+	int total = 0;
+	int count = 0;
+	int i, j;
+
+	vector_init(&funcs, sizeof(struct cover_func));
+	if (stab_enum(coverage_add_sym, &funcs) < 0 ||
+	    coverage_add_sym(&funcs, NULL, start) < 0) {
+		printc_err("sim coverage: can't allocate memory\n");
+		vector_destroy(&funcs);
+		return -1;
+	}
+
+	qsort(funcs.ptr, funcs.size, funcs.elemsize, cmp_cover_addr);
+
+	printc("%10s %10s %7s  %s\n", "Executed", "Total", "%", "Function");
+
+	for (i = 0; i < funcs.size; i = j) {
+		struct cover_func *f = VECTOR_PTR(funcs, i, struct cover_func);
+		char name[128];
+
+		for (j = i + 1; j < funcs.size &&
+			     VECTOR_AT(funcs, j, struct cover_func).addr ==
+			     f->addr; j++)
+			;
+
+		if (f->addr < start || f->addr >= end ||
+		    f->addr < dev->addr_io_end)
+			continue;
+
+		f->end = (j < funcs.size) ?
+			VECTOR_AT(funcs, j, struct cover_func).addr : end;
+		if (f->end > end)
+			f->end = end;
+
+		coverage_count(dev, f);
+		if (!f->total ||
+		    (!f->executed && mem_type(dev, f->addr) == MEM_RAM))
+			continue;
+
+		symbol_name(f->addr, name, sizeof(name));
+		printc("%10d %10d %7.2f  %s\n", f->executed, f->total,
+		       f->executed * 100.0 / f->total, name);
+
+		executed += f->executed;
+		total += f->total;
+		count++;
+	}
+
+	vector_destroy(&funcs);
+
+	printc("\nExecuted %d of %d instructions (%.2f%%) in %d functions\n",
+	       executed, total, total ? executed * 100.0 / total : 0.0,
+	       count);
+	return 0;
+}
+
+int cmd_coverage(char **arg_text)
+{
+	const char *subcmd = get_arg(arg_text);
+	struct sim_device *dev = snapshot_device();
+	const char *arg;
+
+	if (!dev)
+		return -1;
+
+	if (!subcmd) {
+		printc("Coverage is %s.\n", dev->covering ? "on" : "off");
+		if (dev->cover_file)
+			printc("Coverage will be saved to %s\n",
+			       dev->cover_file);
+		return 0;
+	}
+
+	arg = get_arg(arg_text);
+
+	if (!strcasecmp(subcmd, "on")) {
+		if (arg) {
+			char *path = strdup(arg);
+
+			if (!path) {
+				printc_err("sim coverage: can't allocate "
+					   "memory\n");
+				return -1;
+			}
+
+			free(dev->cover_file);
+			dev->cover_file = path;
+		}
+
+		return coverage_start(dev);
+	}
+
+	if (!strcasecmp(subcmd, "off")) {
+		coverage_stop(dev);
+		return 0;
+	}
+
+	if (!strcasecmp(subcmd, "clear")) {
+		if (dev->cover_map)
+			memset(dev->cover_map, 0, COVER_MAP_SIZE);
+
+		/* Instructions already marked must be marked again */
+		if (dev->covering)
+			icache_invalidate(dev, 0, MEM_SIZE);
+		return 0;
+	}
+
+	if (!strcasecmp(subcmd, "load")) {
+		if (!arg) {
+			printc_err("sim coverage: you must specify a "
+				   "filename\n");
+			return -1;
+		}
+
+		return coverage_load(dev, arg);
+	}
+
+	if (!dev->cover_map) {
+		printc_err("sim coverage: no coverage has been collected\n");
+		return -1;
+	}
+
+	if (!strcasecmp(subcmd, "save")) {
+		if (!arg) {
+			printc_err("sim coverage: you must specify a "
+				   "filename\n");
+			return -1;
+		}
+
+		return coverage_save(dev, arg);
+	}
+
+	if (!strcasecmp(subcmd, "report")) {
+		const char *end_text = get_arg(arg_text);
+		address_t start = 0;
+		address_t end = MEM_SIZE;
+
+		if (arg && expr_eval(arg, &start) < 0) {
+			printc_err("sim coverage: can't parse start: %s\n",
+				   arg);
+			return -1;
+		}
+
+		if (end_text && expr_eval(end_text, &end) < 0) {
+			printc_err("sim coverage: can't parse end: %s\n",
+				   end_text);
+			return -1;
+		}
+
+		if (end > MEM_SIZE)
+			end = MEM_SIZE;
+
+		return coverage_report(dev, start, end);
+	}
+
+	printc_err("sim coverage: unknown subcommand: %s\n", subcmd);
+	return -1;
+}
@@ -0,0 +1,496 @@
+/* MSPDebug - debugging tool for the eZ430
+ * Copyright (C) 2009, 2010, 2020 Daniel Beer
+ * Copyright (C) 2020 Bruce G. Burns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SIM_DEVICE_H_
+#define SIM_DEVICE_H_
+
+/* This file describes the state of the simulator, which is shared by
+ * the CPU core in sim.c and the tools built on it: the profiler,
+ * coverage, instruction trace, semihosting, host-native routines and
+ * the fuzzer. None of it is used outside the simulator.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "device.h"
+#include "simio_cpu.h"
+
+/* Memory covers the full 20-bit address space. It's split into pages
+ * which are allocated the first time they're written. Each page is
+ * tagged with the type of memory at that address on the simulated chip.
+ * Pages are reference counted so that snapshots can share them, and a
+ * shared page is copied before it's modified.
+ */
+#define MEM_SIZE		(1 << 20)
+#define MEM_PAGE_SHIFT		8
+#define MEM_PAGE_SIZE		(1 << MEM_PAGE_SHIFT)
+#define MEM_PAGES		(MEM_SIZE >> MEM_PAGE_SHIFT)
+
+typedef enum {
+	MEM_UNMAPPED = 0,
+	MEM_ROM,
+	MEM_FLASH,
+	MEM_RAM
+} sim_memtype_t;
+
+/* The decode cache is split into pages which are allocated the first
+ * time code is executed from them.
+ */
+#define ICACHE_PAGE_SHIFT	9
+#define ICACHE_PAGE_SIZE	(1 << ICACHE_PAGE_SHIFT)
+#define ICACHE_PAGES		(MEM_SIZE >> ICACHE_PAGE_SHIFT)
+
+/* The simulator offers more breakpoints than the generic table holds */
+#define SIM_MAX_BREAKPOINTS	1024
+
+#define WATCH_LINE_SHIFT	6
+#define WATCH_LINES		(MEM_SIZE >> WATCH_LINE_SHIFT)
+
+#define COVER_MAP_SIZE		(MEM_SIZE >> 4)
+
+#define FUZZ_MAP_SIZE		(1 << 14)
+
+#define SIMx	dev->base.type->name
+
+struct sim_device;
+struct sim_insn;
+
+typedef int (*sim_handler_t)(struct sim_device *dev,
+			     const struct sim_insn *insn);
+typedef uint32_t (*sim_alu_t)(struct sim_device *dev,
+			      const struct sim_insn *insn,
+			      uint32_t src_data, uint32_t dst_data);
+
+/* Predecoded instruction. An entry is built the first time the CPU
+ * executes from an address, and is discarded whenever either of the
+ * words it was decoded from is written. A NULL handler marks an entry
+ * which has not yet been decoded.
+ */
+struct sim_insn {
+	sim_handler_t		handler;
+	sim_alu_t		alu;
+
+	uint16_t		ins;
+	uint16_t		ext;
+
+	uint8_t			len;
+
+	/* Length including operand words, or 0 if it isn't known until
+	 * the instruction is executed.
+	 */
+	uint8_t			size;
+	uint8_t			opwidth;
+	uint8_t			amode_src;
+	uint8_t			amode_dst;
+	uint8_t			sreg;
+	uint8_t			dreg;
+
+	/* Repeat count from the extension word, or 0 if the count is
+	 * taken from a register.
+	 */
+	uint8_t			rept;
+	uint8_t			flags;
+
+	uint16_t		cycles;
+	int16_t			offset;
+	uint16_t		carry_mask;
+
+	uint32_t		mask;
+	uint32_t		msb;
+};
+
+/* Flags for struct sim_insn */
+#define SIM_OP_NO_FETCH		0x01	/* destination is write-only */
+#define SIM_OP_NO_STORE		0x02	/* result is discarded */
+#define SIM_OP_NO_REPEAT	0x04	/* repeating gives the same result */
+#define SIM_OP_WIDE_STORE	0x08	/* store all 20 bits of a register */
+#define SIM_OP_COVER		0x10	/* not yet marked as executed */
+
+struct sim_op;
+
+/* A saved copy of the simulator state. Memory pages are shared with the
+ * live device until either side writes to them.
+ */
+struct sim_snapshot {
+	struct sim_snapshot	*next;
+	char			name[64];
+
+	uint32_t		regs[DEVICE_NUM_REGS];
+	uint32_t		current_insn;
+	struct simio_snapshot	*io;
+	uint8_t			*mem_pages[MEM_PAGES];
+};
+
+/* Most memory writes made by one step of the CPU. The worst case is
+ * PUSHM.A of 16 registers.
+ */
+#define HISTORY_MAX_WRITES	40
+
+/* Host files which may be open at once by a semihosted program */
+#define SEMIHOST_MAX_FILES	16
+
+/* The last ALU operation, whose status flags are yet to be computed.
+ * See sr_sync().
+ */
+typedef enum {
+	FLAGS_NONE = 0,
+	FLAGS_ADD,	/* ADD, ADDC, SUB, SUBC, CMP */
+	FLAGS_LOGIC,	/* AND, BIT */
+	FLAGS_XOR,
+	FLAGS_ROTATE	/* RRC, RRA */
+} sim_flags_t;
+
+struct history_checkpoint;
+struct checkpoint_file;
+struct sim_profile;
+struct sim_trace;
+struct sim_hook;
+
+struct sim_device {
+	struct device           base;
+
+	uint8_t			*mem_pages[MEM_PAGES];
+	uint8_t			mem_tags[MEM_PAGES];
+
+	/* Direct access tables. An entry points to the page when the CPU
+	 * may read or write it without further checks, or is NULL if the
+	 * access must take the slow path (unallocated, unmapped, read-only
+	 * and IO pages). Kept in step with mem_pages and mem_tags by
+	 * mem_update_fast().
+	 */
+	uint8_t			*mem_read_fast[MEM_PAGES];
+	uint8_t			*mem_write_fast[MEM_PAGES];
+	uint32_t                regs[DEVICE_NUM_REGS];
+
+	int                     running;
+	uint32_t                current_insn;
+
+	/* Instructions run by each call to poll, adjusted to take about
+	 * sim_poll_ms of real time. See run_loop().
+	 */
+	int			run_quantum;
+
+	int			watchpoint_hit;
+
+	/* Set if the run stopped at a write watchpoint, with the address
+	 * and the value written. See sim_watch_write().
+	 */
+	int			watch_written;
+	uint32_t		watch_addr;
+	uint32_t		watch_value;
+
+	/* Set when an instruction performs programmed IO, which may change
+	 * the interrupt state of a peripheral.
+	 */
+	int			io_access;
+
+	/* Cycles run in the current block which haven't yet been passed
+	 * to the IO simulator, and the value of SR they ran with.
+	 */
+	int			io_pending;
+	uint16_t		io_status;
+
+	/* Peripherals, which belong to this device alone */
+	struct simio_context	*simio;
+
+	int			cpux;
+
+	uint32_t		addr_io_end;
+
+	/* Pending status flags. The arithmetic bits of SR are stale while
+	 * flags_op is anything other than FLAGS_NONE, and are computed
+	 * from the last ALU result by sr_sync() when next needed.
+	 */
+	int			flags_op;
+	uint32_t		flags_src;
+	uint32_t		flags_dst;
+	uint32_t		flags_res;
+	uint32_t		flags_mask;
+
+	struct sim_insn		*icache[ICACHE_PAGES];
+
+	/* Breakpoint table, used in place of the generic one */
+	struct device_breakpoint	breakpoints[SIM_MAX_BREAKPOINTS];
+
+	/* Breakpoint and watchpoint lookup tables. These are rebuilt from
+	 * the breakpoint table by update_breakpoints() whenever it
+	 * changes. The breakpoint map has one bit per byte address, and
+	 * is allocated when the first breakpoint is set. The watch map has
+	 * one bit per 64-byte line which overlaps any watchpoint.
+	 */
+	int			num_breaks;
+	uint8_t			*break_map;
+	int			num_watches;
+	int			watch_list[SIM_MAX_BREAKPOINTS];
+	uint8_t			watch_map[WATCH_LINES >> 3];
+
+	const struct sim_op	*const *dispatch;
+	const struct sim_op	*const *ext_dispatch;
+
+	/* Polling loop detection. poll_start and poll_end give the first
+	 * instruction and the backward branch of the loop last examined.
+	 * Once armed, poll_regs holds the registers as of the last pass,
+	 * and poll_cycles counts the cycles since then. poll_event is the
+	 * number of cycles from then until the next peripheral event.
+	 * poll_unstable is set if the loop reads an IO register which
+	 * might change before the next event. See poll_check().
+	 */
+	int			skip_polling;
+	uint32_t		poll_start;
+	uint32_t		poll_end;
+	int			poll_pure;
+	int			poll_armed;
+	int			poll_misses;
+	int			poll_unstable;
+	int			poll_cycles;
+	int			poll_event;
+	uint32_t		poll_regs[DEVICE_NUM_REGS];
+	uint64_t		poll_skipped;
+
+	/* Cycle budget: the IO simulator time at which running stops, or
+	 * zero if there's no limit.
+	 */
+	uint64_t		cycle_limit;
+	int			cycle_limit_hit;
+
+	/* The profile is kept until cleared, and is added to while
+	 * profiling is set.
+	 */
+	int			profiling;
+	struct sim_profile	*profile;
+
+	/* Coverage map, with one bit per word, which is set when an
+	 * instruction at that address is executed while covering is set.
+	 * If cover_file is set, the map is merged into it on exit.
+	 */
+	int			covering;
+	uint8_t			*cover_map;
+	char			*cover_file;
+
+	/* Instruction trace, if one is being written. While trace_mem is
+	 * set, all CPU writes take the slow path, so that they can be
+	 * recorded.
+	 */
+	struct sim_trace	*trace;
+	int			trace_mem;
+
+	/* Semihosting. semihost_port is the IO address at which requests
+	 * are made, or zero. exited is set when the program asks to exit.
+	 */
+	uint32_t		semihost_port;
+	FILE			*semihost_files[SEMIHOST_MAX_FILES];
+	int			exited;
+	int			exit_status;
+
+	/* Routines run natively on the host, see step_hook() */
+	struct sim_hook		*hooks;
+
+	/* Branch counts, while fuzzing. See fuzz_edge(). */
+	uint8_t			*fuzz_edges;
+
+	struct sim_snapshot	*snapshots;
+	struct checkpoint_file	*checkpoint_files;
+
+	/* Execution history, for reverse execution. hist_buf is a ring of
+	 * hist_size bytes holding one undo record per step, from step
+	 * number hist_first up to hist_step. Writes made by the step in
+	 * progress are collected in hist_write_addr and hist_write_old.
+	 * A step which can't be undone sets hist_barrier. See
+	 * history_step().
+	 */
+	uint8_t			*hist_buf;
+	uint32_t		hist_size;
+	uint32_t		hist_head;
+	uint32_t		hist_tail;
+	uint32_t		hist_used;
+	uint64_t		hist_first;
+	uint64_t		hist_step;
+	uint32_t		hist_since_checkpoint;
+	struct history_checkpoint *hist_checkpoints;
+	int			hist_num_writes;
+	uint32_t		hist_write_addr[HISTORY_MAX_WRITES];
+	uint16_t		hist_write_old[HISTORY_MAX_WRITES];
+	int			hist_barrier;
+};
+
+/* Checkpoint files store pages in this layout, so that they can be used
+ * in place (see checkpoint_load()).
+ */
+struct mem_page {
+	uint32_t		refs;
+	uint8_t			data[MEM_PAGE_SIZE];
+};
+
+/* Reference count of a page which lives in a loaded checkpoint file. It
+ * is never freed, and is always copied before it's written.
+ */
+#define PAGE_PINNED		0x40000000
+
+#define MEM_PAGE_OF(mem) \
+	((struct mem_page *)((mem) - offsetof(struct mem_page, data)))
+
+/* Page reference counting. Both accept NULL, for an unallocated page. */
+uint8_t *page_ref(uint8_t *mem);
+void page_unref(uint8_t *mem);
+
+/* Recompute the direct access entries for a page */
+void mem_update_fast(struct sim_device *dev, uint32_t page);
+
+/* Find the page containing the given address so that it can be
+ * modified. Returns NULL if there's no memory.
+ */
+uint8_t *mem_alloc_page(struct sim_device *dev, uint32_t offset);
+
+/* Discard any decoded instructions which overlap the given range */
+void icache_invalidate(struct sim_device *dev, uint32_t addr, uint32_t len);
+
+/* Slow paths for the CPU memory accessors below */
+int mem_setb_slow(struct sim_device *dev, uint32_t offset, uint8_t value);
+int mem_setw_slow(struct sim_device *dev, uint32_t offset, uint16_t value);
+uint16_t mem_getw_slow(struct sim_device *dev, uint32_t offset);
+
+/* Return the type of memory at the given address */
+static inline sim_memtype_t mem_type(const struct sim_device *dev,
+				     uint32_t offset)
+{
+	if (offset >= MEM_SIZE)
+		return MEM_UNMAPPED;
+
+	return dev->mem_tags[offset >> MEM_PAGE_SHIFT];
+}
+
+/* Discard decoded instructions overlapping a written address. Most
+ * data lives in pages which have never been executed, so the icache
+ * pages are checked here before doing any more work.
+ */
+static inline void icache_write(struct sim_device *dev, uint32_t offset,
+				uint32_t len)
+{
+	if (dev->icache[offset >> ICACHE_PAGE_SHIFT] ||
+	    ((offset & (ICACHE_PAGE_SIZE - 1)) < 2 && offset >= 2 &&
+	     dev->icache[(offset - 2) >> ICACHE_PAGE_SHIFT]))
+		icache_invalidate(dev, offset, len);
+}
+
+/* CPU memory accessors. Accesses to ordinary RAM, flash and ROM go
+ * straight through the direct access tables. The byte-wise assembly of
+ * little-endian words compiles to a single load or store on common
+ * hosts. Word accesses are aligned, so they never cross a page.
+ */
+static inline int mem_setb(struct sim_device *dev, uint32_t offset,
+			   uint8_t value)
+{
+	uint8_t *page;
+
+	if (offset >= MEM_SIZE ||
+	    !(page = dev->mem_write_fast[offset >> MEM_PAGE_SHIFT]))
+		return mem_setb_slow(dev, offset, value);
+
+	page[offset & (MEM_PAGE_SIZE - 1)] = value;
+	icache_write(dev, offset, 1);
+	return 0;
+}
+
+static inline int mem_setw(struct sim_device *dev, uint32_t offset,
+			   uint16_t value)
+{
+	uint8_t *page;
+
+	offset &= ~1;
+	if (offset >= MEM_SIZE ||
+	    !(page = dev->mem_write_fast[offset >> MEM_PAGE_SHIFT]))
+		return mem_setw_slow(dev, offset, value);
+
+	page += offset & (MEM_PAGE_SIZE - 1);
+	page[0] = value;
+	page[1] = value >> 8;
+	icache_write(dev, offset, 2);
+	return 0;
+}
+
+static inline uint16_t mem_getw(struct sim_device *dev, uint32_t offset)
+{
+	const uint8_t *page;
+
+	offset &= ~1;
+	if (offset >= MEM_SIZE ||
+	    !(page = dev->mem_read_fast[offset >> MEM_PAGE_SHIFT]))
+		return mem_getw_slow(dev, offset);
+
+	page += offset & (MEM_PAGE_SIZE - 1);
+	return (page[0] | (page[1] << 8));
+}
+
+uint32_t mem_geta(struct sim_device *dev, uint32_t offset);
+
+/* Read memory without complaint, for disassembly and host requests.
+ * Returns the number of bytes available.
+ */
+int mem_peek(struct sim_device *dev, uint32_t addr, uint8_t *buf, int len);
+
+/* Copy memory in from the host. Any mapped memory, including ROM, may
+ * be written this way.
+ */
+int mem_write_block(struct sim_device *dev, uint32_t addr,
+		    const uint8_t *mem, uint32_t len);
+
+/* Bring the arithmetic bits of SR up to date */
+void sr_sync(struct sim_device *dev);
+
+/* Rebuild the breakpoint lookup tables after the table changes, and
+ * check for a breakpoint at the current PC.
+ */
+void update_breakpoints(struct sim_device *dev);
+int breakpoint_check(const struct sim_device *dev);
+
+/* Decode the instruction at the given address, or fetch it from the
+ * decode cache.
+ */
+void decode_insn(struct sim_device *dev, uint32_t addr,
+		 struct sim_insn *insn);
+struct sim_insn *icache_fetch(struct sim_device *dev, uint32_t addr);
+
+/* Execute one block of up to limit instructions. Returns the number
+ * executed, or -1 if an error occurs.
+ */
+int msp430_step_block(struct sim_device *dev, int limit);
+int cpux_step_block(struct sim_device *dev, int limit);
+
+/* Forget any polling loop being watched */
+void poll_reset(struct sim_device *dev);
+
+/* Start or stop recording history, according to the sim_history
+ * option.
+ */
+void history_setup(struct sim_device *dev);
+
+/* Save the state of the simulator, without giving it a name */
+struct sim_snapshot *snapshot_take(struct sim_device *dev);
+void snapshot_free(struct sim_snapshot *snap);
+
+/* Return the default device if it's a simulator, or print an error and
+ * return NULL.
+ */
+struct sim_device *snapshot_device(void);
+
+/* Format an address as a symbol and offset */
+void symbol_name(uint32_t addr, char *buf, int max_len);
+
+#endif
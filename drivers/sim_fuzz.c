@@ -0,0 +1,849 @@
+/* MSPDebug - debugging tool for the eZ430
+ * Copyright (C) 2009, 2010, 2020 Daniel Beer
+ * Copyright (C) 2020 Bruce G. Burns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef __Windows__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#endif
+
+#include "sim_fuzz.h"
+#include "sim_profile.h"
+#include "sim_trace.h"
+#include "output.h"
+#include "expr.h"
+#include "util.h"
+#include "vector.h"
+#include "bytes.h"
+#include "ctrlc.h"
+#include "opdb.h"
+#include "output_util.h"
+#include "simio_cpu.h"
+
+/* Fuzzing
+ *
+ * The fuzzer runs the program over and over from a snapshot, each time
+ * with a different input written to a buffer in memory, until it
+ * reaches a given address. Inputs are made by mutating those in a
+ * queue, and an input joins the queue if it makes the program take a
+ * branch it hasn't taken before, or take one a number of times it
+ * hasn't before. Branches are counted in fuzz_edges (see fuzz_edge()),
+ * and the counts are compared in buckets, as AFL does. A run which
+ * fails with an error, or triggers a watchpoint, is a crash. A run which
+ * goes on for longer than the cycle limit is a hang.
+ *
+ * Between runs, only the pages written by the last run are restored.
+ * Pages which the program writes on every run stay private to the
+ * device, and are restored by copying, so that nothing is allocated.
+ */
+#define FUZZ_MUTATIONS		256
+#define FUZZ_DEFAULT_CYCLES	1000000
+#define FUZZ_STATUS_INTERVAL	(2 * CLOCKS_PER_SEC)
+
+typedef enum {
+	FUZZ_DONE,
+	FUZZ_CRASH,
+	FUZZ_HANG
+} fuzz_result_t;
+
+struct fuzz_input {
+	uint8_t			*data;
+	uint32_t		len;
+};
+
+struct sim_fuzz {
+	address_t		buf;
+	address_t		size;
+	address_t		len_addr;
+	int			has_len;
+	uint64_t		max_cycles;
+	const char		*corpus;
+	const char		*crash_dir;
+
+	struct sim_snapshot	*base;
+
+	/* Host files which were open at the base snapshot. Any others
+	 * are opened by a run, and are closed when it ends.
+	 */
+	FILE			*files[SEMIHOST_MAX_FILES];
+	struct vector		queue;
+	uint64_t		rng;
+
+	/* Branch counts for the run in progress, and the buckets seen */
+	uint8_t			edges[FUZZ_MAP_SIZE];
+	uint8_t			seen[FUZZ_MAP_SIZE];
+	int			num_edges;
+
+	/* One bit per word, set for each address at which a crash has
+	 * been reported, and the first line of error output of the run in
+	 * progress.
+	 */
+	uint8_t			crash_map[MEM_SIZE >> 4];
+	char			reason[128];
+
+	uint64_t		runs;
+	uint64_t		crashes;
+	uint64_t		hangs;
+	int			unique_crashes;
+};
+
+/* Return the simulator to the base snapshot */
+static int fuzz_reset(struct sim_device *dev, struct sim_fuzz *f)
+{
+	const struct sim_snapshot *base = f->base;
+	int i;
+
+	if (simio_snapshot_restore(dev->simio, base->io) < 0)
+		return -1;
+
+	for (i = 0; i < MEM_PAGES; i++) {
+		uint8_t *mem = dev->mem_pages[i];
+		const uint8_t *orig = base->mem_pages[i];
+
+		if (mem == orig)
+			continue;
+
+		if (!mem || MEM_PAGE_OF(mem)->refs > 1) {
+			page_unref(mem);
+			dev->mem_pages[i] = page_ref(base->mem_pages[i]);
+			mem_update_fast(dev, i);
+		} else if (orig) {
+			if (!memcmp(mem, orig, MEM_PAGE_SIZE))
+				continue;
+			memcpy(mem, orig, MEM_PAGE_SIZE);
+		} else {
+			memset(mem, 0xff, MEM_PAGE_SIZE);
+		}
+
+		icache_write(dev, i << MEM_PAGE_SHIFT, MEM_PAGE_SIZE);
+	}
+
+	/* A file which differs from the base was opened by the run, or
+	 * the run closed the one which was there.
+	 */
+	for (i = 0; i < SEMIHOST_MAX_FILES; i++) {
+		if (dev->semihost_files[i] == f->files[i])
+			continue;
+
+		if (dev->semihost_files[i])
+			fclose(dev->semihost_files[i]);
+
+		dev->semihost_files[i] = NULL;
+		f->files[i] = NULL;
+	}
+
+	memcpy(dev->regs, base->regs, sizeof(dev->regs));
+	dev->flags_op = FLAGS_NONE;
+	dev->current_insn = base->current_insn;
+	dev->watchpoint_hit = 0;
+	dev->exited = 0;
+	poll_reset(dev);
+	profile_resync(dev);
+	trace_sync(dev);
+
+	return 0;
+}
+
+static uint32_t fuzz_rand(struct sim_fuzz *f, uint32_t limit)
+{
+	f->rng ^= f->rng << 13;
+	f->rng ^= f->rng >> 7;
+	f->rng ^= f->rng << 17;
+
+	return (f->rng >> 32) % limit;
+}
+
+/* Apply a stack of random changes to an input, and return its new
+ * length. The length changes only if the program is told it.
+ */
+static uint32_t fuzz_mutate(struct sim_fuzz *f, uint8_t *data, uint32_t len)
+{
+	static const uint8_t interesting_8[] = {
+		0x00, 0x01, 0x10, 0x20, 0x40, 0x64, 0x7f, 0x80, 0xff
+	};
+	static const uint16_t interesting_16[] = {
+		0x0000, 0x0080, 0x00ff, 0x0100, 0x03e8, 0x1000, 0x7fff,
+		0x8000, 0xffff
+	};
+	int n = 1 << (1 + fuzz_rand(f, 5));
+
+	while (n--) {
+		const int op = fuzz_rand(f, f->has_len ? 10 : 8);
+		uint32_t pos;
+		uint32_t count;
+
+		if (!len) {
+			if (!f->has_len)
+				break;
+
+			data[0] = fuzz_rand(f, 256);
+			len = 1;
+			continue;
+		}
+
+		pos = fuzz_rand(f, len);
+
+		switch (op) {
+		case 0:
+			data[pos] ^= 1 << fuzz_rand(f, 8);
+			break;
+
+		case 1:
+			data[pos] = interesting_8[fuzz_rand(f,
+					ARRAY_LEN(interesting_8))];
+			break;
+
+		case 2:
+			if (pos + 1 < len) {
+				const uint16_t v = interesting_16[fuzz_rand(f,
+					ARRAY_LEN(interesting_16))];
+
+				data[pos] = v;
+				data[pos + 1] = v >> 8;
+			}
+			break;
+
+		case 3:
+			data[pos] = fuzz_rand(f, 256);
+			break;
+
+		case 4:
+			data[pos] += 1 + fuzz_rand(f, 35);
+			break;
+
+		case 5:
+			data[pos] -= 1 + fuzz_rand(f, 35);
+			break;
+
+		case 6:
+			/* Copy a block from elsewhere in the input */
+			{
+				const uint32_t from = fuzz_rand(f, len);
+				const uint32_t end = pos > from ? pos : from;
+
+				count = 1 + fuzz_rand(f, len - end);
+				memmove(data + pos, data + from, count);
+			}
+			break;
+
+		case 7:
+			/* Splice in a block of another input */
+			{
+				const struct fuzz_input *in =
+					VECTOR_PTR(f->queue,
+						   fuzz_rand(f, f->queue.size),
+						   struct fuzz_input);
+
+				if (pos >= in->len)
+					break;
+
+				count = 1 + fuzz_rand(f, (in->len < len ?
+							  in->len : len) - pos);
+				memcpy(data + pos, in->data + pos, count);
+			}
+			break;
+
+		case 8:
+			/* Insert a run of random or repeated bytes */
+			if (len >= f->size)
+				break;
+
+			pos = fuzz_rand(f, len + 1);
+			count = 1 + fuzz_rand(f, f->size - len < 16 ?
+					      f->size - len : 16);
+			memmove(data + pos + count, data + pos, len - pos);
+			if (fuzz_rand(f, 2)) {
+				memset(data + pos, fuzz_rand(f, 256), count);
+			} else {
+				uint32_t i;
+
+				for (i = 0; i < count; i++)
+					data[pos + i] = fuzz_rand(f, 256);
+			}
+			len += count;
+			break;
+
+		case 9:
+			/* Delete a block */
+			count = 1 + fuzz_rand(f, len - pos < 16 ?
+					      len - pos : 16);
+			memmove(data + pos, data + pos + count,
+				len - pos - count);
+			len -= count;
+			break;
+		}
+	}
+
+	return len;
+}
+
+static void fuzz_capture(void *user_data, const char *text)
+{
+	struct sim_fuzz *f = (struct sim_fuzz *)user_data;
+
+	if (!f->reason[0])
+		snprintf(f->reason, sizeof(f->reason), "%s", text);
+}
+
+/* Run the program once with the given input. Output is kept quiet, but
+ * the first line of it is kept in case of a crash. This relies on the
+ * output capture, which is shared by the whole process, so fuzzing
+ * isn't thread-safe: no other simulator may run alongside it.
+ */
+static int fuzz_run(struct sim_device *dev, struct sim_fuzz *f,
+		    const uint8_t *data, uint32_t len)
+{
+	uint8_t len_data[2];
+	int ret;
+
+	if (fuzz_reset(dev, f) < 0 ||
+	    mem_write_block(dev, f->buf, data, len) < 0)
+		return -1;
+
+	if (f->has_len) {
+		w16le(len_data, len);
+		if (mem_write_block(dev, f->len_addr, len_data, 2) < 0)
+			return -1;
+	}
+
+	memset(f->edges, 0, sizeof(f->edges));
+	f->reason[0] = 0;
+	dev->fuzz_edges = f->edges;
+	dev->cycle_limit = simio_time(dev->simio) + f->max_cycles;
+	capture_start_quiet(fuzz_capture, f);
+
+	for (;;) {
+		int n;
+
+		if (dev->num_breaks && breakpoint_check(dev)) {
+			ret = FUZZ_DONE;
+			break;
+		}
+
+		if (simio_time(dev->simio) >= dev->cycle_limit) {
+			ret = FUZZ_HANG;
+			break;
+		}
+
+		n = dev->cpux ? cpux_step_block(dev, INT32_MAX) :
+			msp430_step_block(dev, INT32_MAX);
+		if (n < 0) {
+			ret = FUZZ_CRASH;
+			break;
+		}
+
+		if (dev->watchpoint_hit) {
+			snprintf(f->reason, sizeof(f->reason),
+				 "watchpoint triggered");
+			ret = FUZZ_CRASH;
+			break;
+		}
+
+		if (dev->exited) {
+			ret = FUZZ_DONE;
+			break;
+		}
+	}
+
+	capture_end();
+	dev->fuzz_edges = NULL;
+	f->runs++;
+	return ret;
+}
+
+static uint8_t fuzz_bucket(uint8_t count)
+{
+	if (count < 3)
+		return count;
+	if (count < 4)
+		return 4;
+	if (count < 8)
+		return 8;
+	if (count < 16)
+		return 16;
+	if (count < 32)
+		return 32;
+	if (count < 128)
+		return 64;
+
+	return 128;
+}
+
+/* Merge the branches taken by the last run into the map of those seen.
+ * Returns non-zero if anything new was seen.
+ */
+static int fuzz_update(struct sim_fuzz *f)
+{
+	int found = 0;
+	int i;
+
+	for (i = 0; i < FUZZ_MAP_SIZE; i += 8) {
+		uint64_t word;
+		int j;
+
+		memcpy(&word, f->edges + i, sizeof(word));
+		if (!word)
+			continue;
+
+		for (j = i; j < i + 8; j++) {
+			const uint8_t b = fuzz_bucket(f->edges[j]);
+
+			if (b & ~f->seen[j]) {
+				if (!f->seen[j])
+					f->num_edges++;
+				f->seen[j] |= b;
+				found = 1;
+			}
+		}
+	}
+
+	return found;
+}
+
+static int fuzz_save(const char *path, const uint8_t *data, uint32_t len)
+{
+	FILE *out = fopen(path, "wb");
+
+	if (!out) {
+		pr_error(path);
+		return -1;
+	}
+
+	fwrite(data, 1, len, out);
+	if (ferror(out) | fclose(out)) {
+		pr_error(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int fuzz_add(struct sim_fuzz *f, const uint8_t *data, uint32_t len)
+{
+	struct fuzz_input in;
+
+	in.data = malloc(f->size ? f->size : 1);
+	if (!in.data) {
+		pr_error("sim fuzz: can't allocate memory");
+		return -1;
+	}
+
+	memcpy(in.data, data, len);
+	in.len = len;
+
+	if (vector_push(&f->queue, &in, 1) < 0) {
+		pr_error("sim fuzz: can't allocate memory");
+		free(in.data);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Add a new input to the queue, and save it in the corpus under a name
+ * made from its contents.
+ */
+static int fuzz_keep(struct sim_fuzz *f, const uint8_t *data, uint32_t len)
+{
+	if (fuzz_add(f, data, len) < 0)
+		return -1;
+
+	if (f->corpus) {
+		char path[1024];
+		uint32_t hash = 2166136261u;
+		uint32_t i;
+
+		for (i = 0; i < len; i++)
+			hash = (hash ^ data[i]) * 16777619u;
+
+		snprintf(path, sizeof(path), "%s/%08x", f->corpus, hash);
+		fuzz_save(path, data, len);
+	}
+
+	return 0;
+}
+
+/* Report the first crash at each address */
+static void fuzz_crash(struct sim_device *dev, struct sim_fuzz *f,
+		       const uint8_t *data, uint32_t len)
+{
+	const uint32_t pc = dev->current_insn;
+	uint8_t *bit = &f->crash_map[pc >> 4];
+	const uint8_t mask = 1 << ((pc >> 1) & 7);
+
+	f->crashes++;
+	if (*bit & mask)
+		return;
+
+	*bit |= mask;
+	f->unique_crashes++;
+	printc("Crash at PC = 0x%05x: %s\n", pc, f->reason);
+
+	if (f->crash_dir) {
+		char path[1024];
+
+		snprintf(path, sizeof(path), "%s/crash-%05x", f->crash_dir, pc);
+		if (!fuzz_save(path, data, len)) {
+			printc("Input saved to %s\n", path);
+			return;
+		}
+	}
+
+	hexdump(0, data, len < 256 ? len : 256);
+}
+
+static int fuzz_load(struct sim_fuzz *f)
+{
+#ifdef __Windows__
+	printc_err("sim fuzz: corpus directories are not supported on this "
+		   "platform\n");
+	return -1;
+#else
+	DIR *dir = opendir(f->corpus);
+	uint8_t *data;
+	struct dirent *e;
+	int ret = 0;
+
+	if (!dir) {
+		/* The corpus is created if it doesn't exist */
+		if (errno == ENOENT && !mkdir(f->corpus, 0777))
+			return 0;
+
+		pr_error(f->corpus);
+		return -1;
+	}
+
+	data = malloc(f->size ? f->size : 1);
+	if (!data) {
+		pr_error("sim fuzz: can't allocate memory");
+		closedir(dir);
+		return -1;
+	}
+
+	while ((e = readdir(dir))) {
+		char path[1024];
+		struct stat st;
+		FILE *in;
+		size_t len;
+
+		snprintf(path, sizeof(path), "%s/%s", f->corpus, e->d_name);
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		in = fopen(path, "rb");
+		if (!in) {
+			pr_error(path);
+			continue;
+		}
+
+		memset(data, 0, f->size);
+		len = fread(data, 1, f->size, in);
+		fclose(in);
+
+		if (fuzz_add(f, data, f->has_len ? len : f->size) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	free(data);
+	closedir(dir);
+	return ret;
+#endif
+}
+
+static void fuzz_status(const struct sim_fuzz *f, clock_t start)
+{
+	const double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printc("%llu runs, %.0f/s, %d edges, %d inputs, "
+	       "%llu crashes (%d unique), %llu hangs\n",
+	       (unsigned long long)f->runs, secs > 0 ? f->runs / secs : 0.0,
+	       f->num_edges, f->queue.size,
+	       (unsigned long long)f->crashes, f->unique_crashes,
+	       (unsigned long long)f->hangs);
+}
+
+/* Run an input, and deal with the result. Returns 1 if the input found
+ * new branches, 0 if not, or -1 if an error occurs.
+ */
+static int fuzz_one(struct sim_device *dev, struct sim_fuzz *f,
+		    const uint8_t *data, uint32_t len)
+{
+	switch (fuzz_run(dev, f, data, len)) {
+	case FUZZ_DONE:
+		return fuzz_update(f);
+
+	case FUZZ_CRASH:
+		fuzz_crash(dev, f, data, len);
+		return 0;
+
+	case FUZZ_HANG:
+		f->hangs++;
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+static int fuzz_loop(struct sim_device *dev, struct sim_fuzz *f,
+		     uint64_t max_runs)
+{
+	const int seeds = f->queue.size;
+	clock_t start = clock();
+	clock_t last = start;
+	uint8_t *work = malloc(f->size ? f->size : 1);
+	int next = 0;
+	int i;
+
+	if (!work) {
+		pr_error("sim fuzz: can't allocate memory");
+		return -1;
+	}
+
+	/* Run the seeds first, so that the branches they take aren't
+	 * taken to be new.
+	 */
+	for (i = 0; i < seeds; i++) {
+		const struct fuzz_input *in =
+			VECTOR_PTR(f->queue, i, struct fuzz_input);
+
+		if (fuzz_one(dev, f, in->data, in->len) < 0) {
+			free(work);
+			return -1;
+		}
+	}
+
+	while (f->runs < max_runs && !ctrlc_check()) {
+		const struct fuzz_input in =
+			VECTOR_AT(f->queue, next, struct fuzz_input);
+
+		next = (next + 1) % f->queue.size;
+
+		for (i = 0; i < FUZZ_MUTATIONS && f->runs < max_runs &&
+			    !ctrlc_check(); i++) {
+			uint32_t len;
+			int ret;
+
+			memcpy(work, in.data, in.len);
+			len = fuzz_mutate(f, work, in.len);
+
+			ret = fuzz_one(dev, f, work, len);
+			if (ret < 0 || (ret && fuzz_keep(f, work, len) < 0)) {
+				free(work);
+				return -1;
+			}
+		}
+
+		if (clock() - last >= FUZZ_STATUS_INTERVAL) {
+			last = clock();
+			fuzz_status(f, start);
+		}
+	}
+
+	fuzz_status(f, start);
+	free(work);
+	return 0;
+}
+
+static int fuzz_start(struct sim_device *dev, struct sim_fuzz *f,
+		      address_t done, uint64_t max_runs)
+{
+	const uint64_t cycle_limit = dev->cycle_limit;
+	int bp = -1;
+	int ret;
+	int i;
+
+	history_setup(dev);
+	if (dev->hist_buf) {
+		printc_err("sim fuzz: execution history must be off\n");
+		return -1;
+	}
+
+	if (f->corpus && fuzz_load(f) < 0)
+		return -1;
+
+#ifndef __Windows__
+	if (f->crash_dir && mkdir(f->crash_dir, 0777) < 0 && errno != EEXIST) {
+		pr_error(f->crash_dir);
+		return -1;
+	}
+#endif
+
+	if (!f->queue.size) {
+		uint8_t *zero = calloc(1, f->size ? f->size : 1);
+
+		if (!zero) {
+			pr_error("sim fuzz: can't allocate memory");
+			return -1;
+		}
+
+		ret = fuzz_add(f, zero, f->size);
+		free(zero);
+		if (ret < 0)
+			return -1;
+	}
+
+	/* Runs end at a breakpoint, which is set for the duration unless
+	 * there's one there already.
+	 */
+	for (i = 0; i < dev->base.max_breakpoints; i++) {
+		const struct device_breakpoint *b = &dev->breakpoints[i];
+
+		if ((b->flags & DEVICE_BP_ENABLED) &&
+		    b->type == DEVICE_BPTYPE_BREAK && b->addr == done)
+			break;
+	}
+
+	if (i >= dev->base.max_breakpoints) {
+		bp = device_setbrk(&dev->base, -1, 1, done,
+				   DEVICE_BPTYPE_BREAK);
+		if (bp < 0) {
+			printc_err("sim fuzz: no free breakpoint slots\n");
+			return -1;
+		}
+	}
+
+	update_breakpoints(dev);
+	dev->semihost_port = opdb_get_numeric("sim_semihost");
+	dev->skip_polling = opdb_get_boolean("sim_skip_polling") &&
+		!dev->profiling && !dev->trace;
+
+	ret = -1;
+	memcpy(f->files, dev->semihost_files, sizeof(f->files));
+	f->base = snapshot_take(dev);
+	if (f->base) {
+		printc("Fuzzing from %d inputs...\n", f->queue.size);
+		ret = fuzz_loop(dev, f, max_runs);
+
+		fuzz_reset(dev, f);
+		snapshot_free(f->base);
+	}
+
+	if (bp >= 0)
+		device_setbrk(&dev->base, bp, 0, 0, 0);
+	update_breakpoints(dev);
+	dev->cycle_limit = cycle_limit;
+	return ret;
+}
+
+int cmd_fuzz(char **arg_text)
+{
+	const char *buf_text = get_arg(arg_text);
+	const char *size_text = get_arg(arg_text);
+	const char *done_text = get_arg(arg_text);
+	struct sim_device *dev = snapshot_device();
+	struct sim_fuzz *f;
+	address_t max_runs = 0;
+	address_t seed = time(NULL);
+	address_t done;
+	const char *opt;
+	int ret;
+	int i;
+
+	if (!dev)
+		return -1;
+
+	if (!(buf_text && size_text && done_text)) {
+		printc_err("sim fuzz: you must specify a buffer, its size, "
+			   "and an address at which to stop\n");
+		return -1;
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (!f) {
+		pr_error("sim fuzz: can't allocate memory");
+		return -1;
+	}
+
+	f->max_cycles = FUZZ_DEFAULT_CYCLES;
+	vector_init(&f->queue, sizeof(struct fuzz_input));
+
+	if (expr_eval(buf_text, &f->buf) < 0 ||
+	    expr_eval(size_text, &f->size) < 0 ||
+	    expr_eval(done_text, &done) < 0) {
+		printc_err("sim fuzz: can't parse arguments\n");
+		goto fail;
+	}
+
+	while ((opt = get_arg(arg_text))) {
+		const char *arg = get_arg(arg_text);
+		address_t value = 0;
+
+		if (!arg) {
+			printc_err("sim fuzz: %s needs an argument\n", opt);
+			goto fail;
+		}
+
+		if (!strcasecmp(opt, "corpus")) {
+			f->corpus = arg;
+			continue;
+		}
+
+		if (!strcasecmp(opt, "crashes")) {
+			f->crash_dir = arg;
+			continue;
+		}
+
+		if (expr_eval(arg, &value) < 0) {
+			printc_err("sim fuzz: can't parse %s: %s\n", opt, arg);
+			goto fail;
+		}
+
+		if (!strcasecmp(opt, "len")) {
+			f->len_addr = value;
+			f->has_len = 1;
+		} else if (!strcasecmp(opt, "cycles")) {
+			f->max_cycles = value;
+		} else if (!strcasecmp(opt, "runs")) {
+			max_runs = value;
+		} else if (!strcasecmp(opt, "seed")) {
+			seed = value;
+		} else {
+			printc_err("sim fuzz: unknown option: %s\n", opt);
+			goto fail;
+		}
+	}
+
+	if (!f->size || f->size > MEM_SIZE || !f->max_cycles) {
+		printc_err("sim fuzz: invalid buffer size or cycle limit\n");
+		goto fail;
+	}
+
+	f->rng = ((uint64_t)seed << 32) | 0x9e3779b9;
+	ret = fuzz_start(dev, f, done, max_runs ? max_runs : UINT64_MAX);
+
+	for (i = 0; i < f->queue.size; i++)
+		free(VECTOR_AT(f->queue, i, struct fuzz_input).data);
+	vector_destroy(&f->queue);
+	free(f);
+	return ret;
+
+fail:
+	vector_destroy(&f->queue);
+	free(f);
+	return -1;
+}
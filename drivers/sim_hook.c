@@ -0,0 +1,656 @@
+/* MSPDebug - debugging tool for the eZ430
+ * Copyright (C) 2009, 2010, 2020 Daniel Beer
+ * Copyright (C) 2020 Bruce G. Burns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "sim_hook.h"
+#include "output.h"
+#include "dis.h"
+#include "expr.h"
+#include "stab.h"
+#include "util.h"
+
+/* Host-native routines
+ *
+ * A hook replaces a library routine in the target program with an
+ * equivalent run on the host. The first instruction of the routine is
+ * decoded with step_hook() as its handler, so that reaching it costs
+ * nothing more than any other instruction. The hook reads its arguments
+ * from registers as given by the MSP430 EABI, does the work directly on
+ * the simulator's memory, returns to the caller, and charges a fixed
+ * number of cycles plus a number per byte processed.
+ *
+ * Calls which the hook can't handle exactly are left to the real
+ * routine: those which touch IO or unmapped memory, or would fault, and
+ * divisions by zero. So are all calls while history or a trace of
+ * writes is being recorded, or a watchpoint is set, since the writes
+ * must then be seen one at a time.
+ */
+#define HOOK_MAX_CYCLES		0x1000000
+
+struct sim_hook;
+
+typedef int (*hook_func_t)(struct sim_device *dev, const struct sim_hook *h,
+			   uint32_t *bytes);
+
+/* A routine which can be hooked, and its default cost. These are rough
+ * figures for the compiler's own libraries, without a hardware
+ * multiplier, and can be changed with "sim hook cost".
+ */
+struct hook_routine {
+	const char		*name;
+	hook_func_t		func;
+	int			cycles;
+	int			per_byte;
+};
+
+struct sim_hook {
+	struct sim_hook		*next;
+	const struct hook_routine *routine;
+	uint32_t		addr;
+
+	/* Large memory model: 20-bit pointers, and return by RETA */
+	int			large;
+
+	int			cycles;
+	int			per_byte;
+	uint64_t		calls;
+};
+
+struct sim_hook *hook_find(struct sim_device *dev, uint32_t addr)
+{
+	struct sim_hook *h;
+
+	for (h = dev->hooks; h; h = h->next)
+		if (h->addr == addr)
+			return h;
+
+	return NULL;
+}
+
+static uint32_t hook_ptr(const struct sim_device *dev,
+			 const struct sim_hook *h, int reg)
+{
+	return dev->regs[reg] & (h->large ? 0xfffff : 0xffff);
+}
+
+static uint32_t hook_get32(const struct sim_device *dev, int reg)
+{
+	return (dev->regs[reg] & 0xffff) |
+		((dev->regs[reg + 1] & 0xffff) << 16);
+}
+
+static void hook_set32(struct sim_device *dev, int reg, uint32_t value)
+{
+	dev->regs[reg] = value & 0xffff;
+	dev->regs[reg + 1] = value >> 16;
+}
+
+/* Check that a block of memory lies within the program's address space
+ * and can be accessed without side effects.
+ */
+static int hook_span(const struct sim_device *dev, const struct sim_hook *h,
+		     uint32_t addr, uint32_t len, int write)
+{
+	const uint32_t limit = h->large ? MEM_SIZE : 0x10000;
+	uint32_t page;
+
+	if (!len)
+		return 1;
+
+	if (addr < dev->addr_io_end || addr >= limit || len > limit - addr)
+		return 0;
+
+	for (page = addr >> MEM_PAGE_SHIFT;
+	     page <= (addr + len - 1) >> MEM_PAGE_SHIFT; page++)
+		if (dev->mem_tags[page] < (write ? MEM_FLASH : MEM_ROM))
+			return 0;
+
+	return 1;
+}
+
+static void hook_load(const struct sim_device *dev, uint32_t addr,
+		      uint8_t *buf, uint32_t len)
+{
+	while (len) {
+		const uint32_t offset = addr & (MEM_PAGE_SIZE - 1);
+		const uint8_t *page = dev->mem_pages[addr >> MEM_PAGE_SHIFT];
+		uint32_t n = MEM_PAGE_SIZE - offset;
+
+		if (n > len)
+			n = len;
+
+		if (page)
+			memcpy(buf, page + offset, n);
+		else
+			memset(buf, 0xff, n);
+
+		addr += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Write a block, or fill it with a single byte if buf is NULL */
+static int hook_store(struct sim_device *dev, uint32_t addr,
+		      const uint8_t *buf, int fill, uint32_t len)
+{
+	const uint32_t start = addr;
+	const uint32_t total = len;
+
+	while (len) {
+		const uint32_t offset = addr & (MEM_PAGE_SIZE - 1);
+		uint8_t *page = mem_alloc_page(dev, addr);
+		uint32_t n = MEM_PAGE_SIZE - offset;
+
+		if (!page)
+			return -1;
+
+		if (n > len)
+			n = len;
+
+		if (buf) {
+			memcpy(page + offset, buf, n);
+			buf += n;
+		} else {
+			memset(page + offset, fill, n);
+		}
+
+		addr += n;
+		len -= n;
+	}
+
+	icache_invalidate(dev, start, total);
+	return 0;
+}
+
+static int hook_memmove(struct sim_device *dev, const struct sim_hook *h,
+			uint32_t *bytes)
+{
+	const uint32_t dst = hook_ptr(dev, h, MSP430_REG_R12);
+	const uint32_t src = hook_ptr(dev, h, MSP430_REG_R13);
+	const uint32_t len = hook_ptr(dev, h, MSP430_REG_R14);
+	const int backward = dst > src && dst - src < len;
+	uint8_t buf[MEM_PAGE_SIZE];
+	uint32_t done = 0;
+
+	if (!hook_span(dev, h, src, len, 0) ||
+	    !hook_span(dev, h, dst, len, 1))
+		return 1;
+
+	/* Overlapping blocks are copied from the end, as memmove() does */
+	while (done < len) {
+		uint32_t n = len - done;
+		uint32_t offset;
+
+		if (n > sizeof(buf))
+			n = sizeof(buf);
+
+		offset = backward ? len - done - n : done;
+		hook_load(dev, src + offset, buf, n);
+		if (hook_store(dev, dst + offset, buf, 0, n) < 0)
+			return -1;
+
+		done += n;
+	}
+
+	*bytes = len;
+	return 0;
+}
+
+static int hook_memset(struct sim_device *dev, const struct sim_hook *h,
+		       uint32_t *bytes)
+{
+	const uint32_t dst = hook_ptr(dev, h, MSP430_REG_R12);
+	const uint32_t len = hook_ptr(dev, h, MSP430_REG_R14);
+
+	if (!hook_span(dev, h, dst, len, 1))
+		return 1;
+
+	if (hook_store(dev, dst, NULL, dev->regs[MSP430_REG_R13] & 0xff,
+		       len) < 0)
+		return -1;
+
+	*bytes = len;
+	return 0;
+}
+
+static int hook_strlen(struct sim_device *dev, const struct sim_hook *h,
+		       uint32_t *bytes)
+{
+	const uint32_t str = hook_ptr(dev, h, MSP430_REG_R12);
+	uint32_t addr = str;
+
+	for (;;) {
+		const uint8_t *page;
+
+		/* Check each page as the scan reaches it */
+		if ((addr == str || !(addr & (MEM_PAGE_SIZE - 1))) &&
+		    !hook_span(dev, h, addr, 1, 0))
+			return 1;
+
+		page = dev->mem_pages[addr >> MEM_PAGE_SHIFT];
+		if (page && !page[addr & (MEM_PAGE_SIZE - 1)])
+			break;
+
+		addr++;
+	}
+
+	dev->regs[MSP430_REG_R12] = addr - str;
+	*bytes = addr - str;
+	return 0;
+}
+
+static int hook_mpyi(struct sim_device *dev, const struct sim_hook *h,
+		     uint32_t *bytes)
+{
+	(void)h;
+	(void)bytes;
+
+	dev->regs[MSP430_REG_R12] =
+		(dev->regs[MSP430_REG_R12] * dev->regs[MSP430_REG_R13]) &
+		0xffff;
+	return 0;
+}
+
+static int hook_mpysl(struct sim_device *dev, const struct sim_hook *h,
+		      uint32_t *bytes)
+{
+	(void)h;
+	(void)bytes;
+
+	hook_set32(dev, MSP430_REG_R12,
+		   (int32_t)(int16_t)dev->regs[MSP430_REG_R12] *
+		   (int16_t)dev->regs[MSP430_REG_R13]);
+	return 0;
+}
+
+static int hook_mpyul(struct sim_device *dev, const struct sim_hook *h,
+		      uint32_t *bytes)
+{
+	(void)h;
+	(void)bytes;
+
+	hook_set32(dev, MSP430_REG_R12,
+		   (dev->regs[MSP430_REG_R12] & 0xffff) *
+		   (dev->regs[MSP430_REG_R13] & 0xffff));
+	return 0;
+}
+
+static int hook_mpyl(struct sim_device *dev, const struct sim_hook *h,
+		     uint32_t *bytes)
+{
+	(void)h;
+	(void)bytes;
+
+	hook_set32(dev, MSP430_REG_R12,
+		   hook_get32(dev, MSP430_REG_R12) *
+		   hook_get32(dev, MSP430_REG_R14));
+	return 0;
+}
+
+/* Division rounds towards zero, as in C. Arithmetic is done in 64 bits,
+ * so that the most negative value divided by -1 wraps as it does on the
+ * target.
+ */
+static int hook_div16(struct sim_device *dev, int is_signed, int rem)
+{
+	int64_t a = dev->regs[MSP430_REG_R12] & 0xffff;
+	int64_t b = dev->regs[MSP430_REG_R13] & 0xffff;
+
+	if (!b)
+		return 1;
+
+	if (is_signed) {
+		a = (int16_t)a;
+		b = (int16_t)b;
+	}
+
+	dev->regs[MSP430_REG_R12] = (rem ? a % b : a / b) & 0xffff;
+	return 0;
+}
+
+static int hook_div32(struct sim_device *dev, int is_signed, int rem)
+{
+	int64_t a = hook_get32(dev, MSP430_REG_R12);
+	int64_t b = hook_get32(dev, MSP430_REG_R14);
+
+	if (!b)
+		return 1;
+
+	if (is_signed) {
+		a = (int32_t)a;
+		b = (int32_t)b;
+	}
+
+	hook_set32(dev, MSP430_REG_R12, rem ? a % b : a / b);
+	return 0;
+}
+
+#define HOOK_DIV_FUNC(name, div, is_signed, rem) \
+static int name(struct sim_device *dev, const struct sim_hook *h, \
+		uint32_t *bytes) \
+{ \
+	(void)h; \
+	(void)bytes; \
+	return div(dev, is_signed, rem); \
+}
+
+HOOK_DIV_FUNC(hook_divi, hook_div16, 1, 0)
+HOOK_DIV_FUNC(hook_divu, hook_div16, 0, 0)
+HOOK_DIV_FUNC(hook_remi, hook_div16, 1, 1)
+HOOK_DIV_FUNC(hook_remu, hook_div16, 0, 1)
+HOOK_DIV_FUNC(hook_divli, hook_div32, 1, 0)
+HOOK_DIV_FUNC(hook_divul, hook_div32, 0, 0)
+HOOK_DIV_FUNC(hook_remli, hook_div32, 1, 1)
+HOOK_DIV_FUNC(hook_remul, hook_div32, 0, 1)
+
+static const struct hook_routine hook_routines[] = {
+	{"memcpy",		hook_memmove,	16,	8},
+	{"memmove",		hook_memmove,	24,	8},
+	{"memset",		hook_memset,	14,	5},
+	{"strlen",		hook_strlen,	12,	6},
+	{"__mspabi_mpyi",	hook_mpyi,	120,	0},
+	{"__mspabi_mpysl",	hook_mpysl,	160,	0},
+	{"__mspabi_mpyul",	hook_mpyul,	150,	0},
+	{"__mspabi_mpyl",	hook_mpyl,	400,	0},
+	{"__mspabi_divi",	hook_divi,	220,	0},
+	{"__mspabi_divu",	hook_divu,	200,	0},
+	{"__mspabi_remi",	hook_remi,	220,	0},
+	{"__mspabi_remu",	hook_remu,	200,	0},
+	{"__mspabi_divli",	hook_divli,	650,	0},
+	{"__mspabi_divul",	hook_divul,	600,	0},
+	{"__mspabi_remli",	hook_remli,	650,	0},
+	{"__mspabi_remul",	hook_remul,	600,	0}
+};
+
+int step_hook(struct sim_device *dev, const struct sim_insn *insn)
+{
+	struct sim_hook *h = hook_find(dev, dev->current_insn);
+	uint32_t bytes = 0;
+	uint64_t cycles;
+	int ret = 1;
+
+	(void)insn;
+
+	if (h && !dev->hist_buf && !dev->trace_mem && !dev->num_watches)
+		ret = h->routine->func(dev, h, &bytes);
+
+	if (ret < 0)
+		return -1;
+
+	/* Run the routine's own first instruction instead */
+	if (ret) {
+		struct sim_insn real;
+
+		decode_insn(dev, dev->current_insn, &real);
+		return real.handler(dev, &real);
+	}
+
+	if (h->large) {
+		dev->regs[MSP430_REG_PC] =
+			mem_geta(dev, dev->regs[MSP430_REG_SP]);
+		dev->regs[MSP430_REG_SP] += 4;
+	} else {
+		dev->regs[MSP430_REG_PC] =
+			mem_getw(dev, dev->regs[MSP430_REG_SP]);
+		dev->regs[MSP430_REG_SP] += 2;
+	}
+
+	h->calls++;
+	cycles = h->cycles + (uint64_t)h->per_byte * bytes;
+	return cycles > HOOK_MAX_CYCLES ? HOOK_MAX_CYCLES : cycles;
+}
+
+static const struct hook_routine *hook_routine(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_LEN(hook_routines); i++)
+		if (!strcmp(hook_routines[i].name, name))
+			return &hook_routines[i];
+
+	printc_err("sim hook: unknown routine: %s\n", name);
+	return NULL;
+}
+
+static struct sim_hook **hook_by_routine(struct sim_device *dev,
+					 const struct hook_routine *r)
+{
+	struct sim_hook **h;
+
+	for (h = &dev->hooks; *h; h = &(*h)->next)
+		if ((*h)->routine == r)
+			break;
+
+	return h;
+}
+
+static void hook_remove(struct sim_device *dev, struct sim_hook **h)
+{
+	struct sim_hook *old = *h;
+
+	*h = old->next;
+	icache_invalidate(dev, old->addr, 2);
+	free(old);
+}
+
+static int hook_add(struct sim_device *dev, const struct hook_routine *r,
+		    address_t addr, int large)
+{
+	struct sim_hook **old = hook_by_routine(dev, r);
+	struct sim_hook **tail;
+	struct sim_hook *h;
+
+	if ((addr & 1) || addr < dev->addr_io_end || addr >= MEM_SIZE) {
+		printc_err("sim hook: invalid address for %s: 0x%x\n",
+			   r->name, addr);
+		return -1;
+	}
+
+	if (*old)
+		hook_remove(dev, old);
+
+	h = hook_find(dev, addr);
+	if (h) {
+		printc_err("sim hook: %s is already hooked at 0x%05x\n",
+			   h->routine->name, addr);
+		return -1;
+	}
+
+	h = calloc(1, sizeof(*h));
+	if (!h) {
+		printc_err("sim hook: can't allocate memory\n");
+		return -1;
+	}
+
+	h->routine = r;
+	h->addr = addr;
+	h->large = large;
+	h->cycles = r->cycles;
+	h->per_byte = r->per_byte;
+
+	for (tail = &dev->hooks; *tail; tail = &(*tail)->next)
+		;
+	*tail = h;
+
+	icache_invalidate(dev, addr, 2);
+	return 0;
+}
+
+void hook_clear(struct sim_device *dev)
+{
+	while (dev->hooks)
+		hook_remove(dev, &dev->hooks);
+}
+
+static void hook_list(struct sim_device *dev)
+{
+	const struct sim_hook *h;
+
+	if (!dev->hooks) {
+		printc("No routines are hooked.\n");
+		return;
+	}
+
+	for (h = dev->hooks; h; h = h->next) {
+		char cost[32];
+
+		if (h->per_byte)
+			snprintf(cost, sizeof(cost), "%d + %d/byte",
+				 h->cycles, h->per_byte);
+		else
+			snprintf(cost, sizeof(cost), "%d", h->cycles);
+
+		printc("    0x%05x %-16s %-16s %s%llu calls\n", h->addr,
+		       h->routine->name, cost, h->large ? "large, " : "",
+		       (unsigned long long)h->calls);
+	}
+}
+
+int cmd_hook(char **arg_text)
+{
+	const char *subcmd = get_arg(arg_text);
+	struct sim_device *dev = snapshot_device();
+	const struct hook_routine *r;
+	const char *name;
+	const char *arg;
+
+	if (!dev)
+		return -1;
+
+	if (!subcmd) {
+		hook_list(dev);
+		return 0;
+	}
+
+	if (!strcasecmp(subcmd, "clear")) {
+		hook_clear(dev);
+		return 0;
+	}
+
+	if (!strcasecmp(subcmd, "auto")) {
+		const int large = (arg = get_arg(arg_text)) &&
+			!strcasecmp(arg, "large");
+		int count = 0;
+		int i;
+
+		for (i = 0; i < ARRAY_LEN(hook_routines); i++) {
+			address_t addr;
+
+			if (stab_get(hook_routines[i].name, &addr) < 0)
+				continue;
+			if (hook_add(dev, &hook_routines[i], addr, large) < 0)
+				return -1;
+			count++;
+		}
+
+		printc("Hooked %d routines\n", count);
+		return 0;
+	}
+
+	name = get_arg(arg_text);
+	if (!name) {
+		printc_err("sim hook: you must specify a routine\n");
+		return -1;
+	}
+
+	r = hook_routine(name);
+	if (!r)
+		return -1;
+
+	if (!strcasecmp(subcmd, "add")) {
+		address_t addr;
+		int large = 0;
+
+		arg = get_arg(arg_text);
+		if (arg && strcasecmp(arg, "large")) {
+			if (expr_eval(arg, &addr) < 0) {
+				printc_err("sim hook: can't parse address: "
+					   "%s\n", arg);
+				return -1;
+			}
+
+			arg = get_arg(arg_text);
+		} else if (stab_get(name, &addr) < 0) {
+			printc_err("sim hook: no symbol for %s\n", name);
+			return -1;
+		}
+
+		if (arg) {
+			if (strcasecmp(arg, "large")) {
+				printc_err("sim hook: unknown option: %s\n",
+					   arg);
+				return -1;
+			}
+
+			large = 1;
+		}
+
+		return hook_add(dev, r, addr, large);
+	}
+
+	if (!strcasecmp(subcmd, "del")) {
+		struct sim_hook **h = hook_by_routine(dev, r);
+
+		if (!*h) {
+			printc_err("sim hook: %s is not hooked\n", name);
+			return -1;
+		}
+
+		hook_remove(dev, h);
+		return 0;
+	}
+
+	if (!strcasecmp(subcmd, "cost")) {
+		struct sim_hook *h = *hook_by_routine(dev, r);
+		const char *per_byte_text;
+		address_t cycles;
+		address_t per_byte = 0;
+
+		if (!h) {
+			printc_err("sim hook: %s is not hooked\n", name);
+			return -1;
+		}
+
+		arg = get_arg(arg_text);
+		per_byte_text = get_arg(arg_text);
+		if (!arg) {
+			printc_err("sim hook: you must specify a cost\n");
+			return -1;
+		}
+
+		if (expr_eval(arg, &cycles) < 0 ||
+		    (per_byte_text && expr_eval(per_byte_text,
+						&per_byte) < 0) ||
+		    cycles > HOOK_MAX_CYCLES || per_byte > HOOK_MAX_CYCLES) {
+			printc_err("sim hook: invalid cost\n");
+			return -1;
+		}
+
+		h->cycles = cycles;
+		h->per_byte = per_byte;
+		return 0;
+	}
+
+	printc_err("sim hook: unknown subcommand: %s\n", subcmd);
+	return -1;
+}
@@ -0,0 +1,689 @@
+/* MSPDebug - debugging tool for the eZ430
+ * Copyright (C) 2009, 2010, 2020 Daniel Beer
+ * Copyright (C) 2020 Bruce G. Burns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "sim_profile.h"
+#include "sim_hook.h"
+#include "output.h"
+#include "dis.h"
+#include "expr.h"
+#include "stab.h"
+#include "vector.h"
+#include "util.h"
+
+/* Profiler
+ *
+ * While the profiler is on, the CPU is run one step at a time. The
+ * cycles taken by each instruction are counted against its address, and
+ * every step is also counted against the current node of a call tree.
+ * The tree is built from a shadow call stack: CALL, CALLA and interrupts
+ * push a frame, and RET, RETA and RETI pop every frame which lies below
+ * the new stack pointer. A node is identified by the address called, so
+ * that each path through the tree is a distinct call stack. Time spent
+ * in low-power modes is counted as sleep, against the node which went
+ * to sleep.
+ */
+#define PROFILE_MAX_DEPTH	256
+
+typedef enum {
+	PROFILE_INSN,
+	PROFILE_CALL,
+	PROFILE_RETURN,
+	PROFILE_IRQ,
+	PROFILE_SLEEP,
+	PROFILE_RESET
+} profile_step_t;
+
+struct profile_count {
+	uint64_t		insns;
+	uint64_t		cycles;
+};
+
+struct profile_node {
+	struct profile_node	*parent;
+	struct profile_node	*child;
+	struct profile_node	*next;
+
+	uint32_t		func;
+	uint64_t		calls;
+	uint64_t		insns;
+	uint64_t		cycles;
+	uint64_t		sleep;
+};
+
+/* A caller to return to, and the stack pointer just after the call */
+struct profile_frame {
+	struct profile_node	*node;
+	uint32_t		sp;
+};
+
+struct sim_profile {
+	struct profile_count	*counts[ICACHE_PAGES];
+
+	/* The children of the root are the outermost functions seen */
+	struct profile_node	root;
+	struct profile_node	*current;
+	int			depth;
+	struct profile_frame	stack[PROFILE_MAX_DEPTH];
+
+	/* The step in progress */
+	profile_step_t		step;
+	uint32_t		step_pc;
+	uint64_t		step_start;
+
+	uint64_t		insns;
+	uint64_t		cycles;
+	uint64_t		sleep;
+};
+
+/* The start of the function containing the given address */
+static uint32_t profile_func(uint32_t addr)
+{
+	char name[64];
+	address_t offset;
+
+	if (stab_nearest(addr, name, sizeof(name), &offset))
+		return addr;
+
+	return addr - offset;
+}
+
+/* Find or create a child node. If there's no memory, time is counted
+ * against the parent instead.
+ */
+static struct profile_node *profile_child(struct profile_node *parent,
+					  uint32_t func)
+{
+	struct profile_node *n;
+
+	for (n = parent->child; n; n = n->next)
+		if (n->func == func)
+			return n;
+
+	n = calloc(1, sizeof(*n));
+	if (!n)
+		return parent;
+
+	n->parent = parent;
+	n->func = func;
+	n->next = parent->child;
+	parent->child = n;
+	return n;
+}
+
+static void profile_free_node(struct profile_node *n)
+{
+	while (n->child) {
+		struct profile_node *c = n->child;
+
+		n->child = c->next;
+		profile_free_node(c);
+		free(c);
+	}
+}
+
+void profile_free(struct sim_profile *p)
+{
+	int i;
+
+	if (!p)
+		return;
+
+	for (i = 0; i < ICACHE_PAGES; i++)
+		free(p->counts[i]);
+
+	profile_free_node(&p->root);
+	free(p);
+}
+
+/* Forget the call stack, after the CPU state has been changed by means
+ * other than execution.
+ */
+void profile_resync(struct sim_device *dev)
+{
+	struct sim_profile *p = dev->profile;
+
+	if (!p)
+		return;
+
+	p->depth = 0;
+	p->current = profile_child(&p->root,
+				   profile_func(dev->regs[MSP430_REG_PC]));
+}
+
+static profile_step_t profile_classify(struct sim_device *dev, uint32_t pc)
+{
+	const struct sim_insn *insn;
+
+	if (pc < dev->addr_io_end || pc >= MEM_SIZE ||
+	    mem_type(dev, pc) == MEM_UNMAPPED)
+		return PROFILE_INSN;
+
+	insn = icache_fetch(dev, pc);
+	if (!insn || insn->ext)
+		return PROFILE_INSN;
+
+	if ((insn->ins & 0xff80) == 0x1280)		/* CALL */
+		return PROFILE_CALL;
+	if (insn->handler == step_hook)			/* whole routine */
+		return PROFILE_RETURN;
+	if (insn->ins == 0x1300 || insn->ins == 0x4130)	/* RETI, RET */
+		return PROFILE_RETURN;
+
+	if (dev->cpux) {
+		if ((insn->ins & 0xff00) == 0x1300)	/* CALLA */
+			return PROFILE_CALL;
+		if (insn->ins == 0x0110)		/* RETA */
+			return PROFILE_RETURN;
+	}
+
+	return PROFILE_INSN;
+}
+
+/* Work out what the next step will do, before it's run */
+void profile_step_begin(struct sim_device *dev)
+{
+	struct sim_profile *p = dev->profile;
+	const uint16_t status = dev->regs[MSP430_REG_SR];
+	const int irq = simio_check_interrupt(dev->simio);
+
+	p->step_pc = dev->regs[MSP430_REG_PC];
+	p->step_start = simio_time(dev->simio);
+
+	if (irq == 15)
+		p->step = PROFILE_RESET;
+	else if (irq >= 14 || ((status & MSP430_SR_GIE) && irq >= 0))
+		p->step = PROFILE_IRQ;
+	else if (status & MSP430_SR_CPUOFF)
+		p->step = PROFILE_SLEEP;
+	else
+		p->step = profile_classify(dev, p->step_pc);
+}
+
+static void profile_push(struct sim_profile *p, uint32_t func, uint32_t sp)
+{
+	/* Beyond the limit, calls are counted against the caller */
+	if (p->depth >= PROFILE_MAX_DEPTH)
+		return;
+
+	p->stack[p->depth].node = p->current;
+	p->stack[p->depth].sp = sp;
+	p->depth++;
+
+	p->current = profile_child(p->current, func);
+	p->current->calls++;
+}
+
+static void profile_pop(struct sim_device *dev, uint32_t sp)
+{
+	struct sim_profile *p = dev->profile;
+	int popped = 0;
+
+	while (p->depth && p->stack[p->depth - 1].sp < sp) {
+		p->current = p->stack[--p->depth].node;
+		popped = 1;
+	}
+
+	/* Returning from a function entered before profiling began */
+	if (!popped && !p->depth)
+		profile_resync(dev);
+}
+
+void profile_step_end(struct sim_device *dev)
+{
+	struct sim_profile *p = dev->profile;
+	const uint32_t pc = p->step_pc;
+	const uint64_t cycles = simio_time(dev->simio) - p->step_start;
+	struct profile_count **page = &p->counts[pc >> ICACHE_PAGE_SHIFT];
+
+	p->cycles += cycles;
+
+	switch (p->step) {
+	case PROFILE_SLEEP:
+		p->sleep += cycles;
+		p->current->sleep += cycles;
+		return;
+
+	case PROFILE_RESET:
+		profile_resync(dev);
+		p->current->cycles += cycles;
+		return;
+
+	case PROFILE_IRQ:
+		profile_push(p, dev->regs[MSP430_REG_PC],
+			     dev->regs[MSP430_REG_SP]);
+		p->current->cycles += cycles;
+		return;
+
+	default:
+		break;
+	}
+
+	if (!*page)
+		*page = calloc(ICACHE_PAGE_SIZE >> 1, sizeof(**page));
+	if (*page) {
+		struct profile_count *c =
+			&(*page)[(pc & (ICACHE_PAGE_SIZE - 1)) >> 1];
+
+		c->insns++;
+		c->cycles += cycles;
+	}
+
+	p->insns++;
+	p->current->insns++;
+	p->current->cycles += cycles;
+
+	if (p->step == PROFILE_CALL)
+		profile_push(p, dev->regs[MSP430_REG_PC],
+			     dev->regs[MSP430_REG_SP]);
+	else if (p->step == PROFILE_RETURN)
+		profile_pop(dev, dev->regs[MSP430_REG_SP]);
+}
+
+/* Per-function totals, for the profile report */
+struct profile_func {
+	uint32_t		addr;
+	int			active;
+	uint64_t		calls;
+	uint64_t		insns;
+	uint64_t		cycles;
+	uint64_t		inclusive;
+};
+
+/* A single address, for the list of the busiest */
+struct profile_addr {
+	uint32_t		addr;
+	uint64_t		insns;
+	uint64_t		cycles;
+};
+
+static int cmp_func_addr(const void *a, const void *b)
+{
+	const struct profile_func *x = (const struct profile_func *)a;
+	const struct profile_func *y = (const struct profile_func *)b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int cmp_func_cycles(const void *a, const void *b)
+{
+	const struct profile_func *x = (const struct profile_func *)a;
+	const struct profile_func *y = (const struct profile_func *)b;
+
+	if (x->cycles != y->cycles)
+		return x->cycles < y->cycles ? 1 : -1;
+
+	return (x->inclusive < y->inclusive) - (x->inclusive > y->inclusive);
+}
+
+static int cmp_addr_cycles(const void *a, const void *b)
+{
+	const struct profile_addr *x = (const struct profile_addr *)a;
+	const struct profile_addr *y = (const struct profile_addr *)b;
+
+	if (x->cycles != y->cycles)
+		return x->cycles < y->cycles ? 1 : -1;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int profile_add_func(struct vector *funcs, uint32_t addr)
+{
+	struct profile_func f;
+
+	memset(&f, 0, sizeof(f));
+	f.addr = addr;
+	return vector_push(funcs, &f, 1);
+}
+
+static int profile_add_nodes(struct vector *funcs,
+			     const struct profile_node *n)
+{
+	for (n = n->child; n; n = n->next)
+		if (profile_add_func(funcs, n->func) < 0 ||
+		    profile_add_nodes(funcs, n) < 0)
+			return -1;
+
+	return 0;
+}
+
+static struct profile_func *profile_find(struct vector *funcs, uint32_t addr)
+{
+	struct profile_func key;
+
+	key.addr = addr;
+	return bsearch(&key, funcs->ptr, funcs->size, funcs->elemsize,
+		       cmp_func_addr);
+}
+
+/* Add up the calls and inclusive time of each function in the tree.
+ * Time spent in recursive calls is counted only once.
+ */
+static uint64_t profile_walk(struct vector *funcs,
+			     const struct profile_node *n)
+{
+	struct profile_func *f = profile_find(funcs, n->func);
+	uint64_t total = n->cycles + n->sleep;
+	const struct profile_node *c;
+
+	f->active++;
+	for (c = n->child; c; c = c->next)
+		total += profile_walk(funcs, c);
+	f->active--;
+
+	f->calls += n->calls;
+	if (!f->active)
+		f->inclusive += total;
+
+	return total;
+}
+
+/* Build a list of functions, sorted by address. Exclusive time comes
+ * from the counts for each address, and inclusive time from the call
+ * tree.
+ */
+static int profile_funcs(const struct sim_profile *p, struct vector *funcs)
+{
+	const struct profile_node *n;
+	int i, j;
+
+	for (i = 0; i < ICACHE_PAGES; i++) {
+		if (!p->counts[i])
+			continue;
+
+		for (j = 0; j < ICACHE_PAGE_SIZE >> 1; j++)
+			if (p->counts[i][j].insns &&
+			    profile_add_func(funcs, profile_func(
+				    (i << ICACHE_PAGE_SHIFT) | (j << 1))) < 0)
+				return -1;
+	}
+
+	if (profile_add_nodes(funcs, &p->root) < 0)
+		return -1;
+
+	if (!funcs->size)
+		return 0;
+
+	qsort(funcs->ptr, funcs->size, funcs->elemsize, cmp_func_addr);
+	for (i = j = 1; i < funcs->size; i++)
+		if (VECTOR_AT(*funcs, i, struct profile_func).addr !=
+		    VECTOR_AT(*funcs, j - 1, struct profile_func).addr)
+			VECTOR_AT(*funcs, j++, struct profile_func) =
+				VECTOR_AT(*funcs, i, struct profile_func);
+	funcs->size = j;
+
+	for (i = 0; i < ICACHE_PAGES; i++) {
+		if (!p->counts[i])
+			continue;
+
+		for (j = 0; j < ICACHE_PAGE_SIZE >> 1; j++) {
+			const struct profile_count *c = &p->counts[i][j];
+			struct profile_func *f;
+
+			if (!c->insns)
+				continue;
+
+			f = profile_find(funcs, profile_func(
+				(i << ICACHE_PAGE_SHIFT) | (j << 1)));
+			f->insns += c->insns;
+			f->cycles += c->cycles;
+		}
+	}
+
+	for (n = p->root.child; n; n = n->next)
+		profile_walk(funcs, n);
+
+	return 0;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+	return total ? part * 100.0 / total : 0.0;
+}
+
+static int profile_report(const struct sim_profile *p, address_t count)
+{
+	struct vector funcs;
+	int i;
+
+	vector_init(&funcs, sizeof(struct profile_func));
+	if (profile_funcs(p, &funcs) < 0) {
+		printc_err("sim profile: can't allocate memory\n");
+		vector_destroy(&funcs);
+		return -1;
+	}
+
+	qsort(funcs.ptr, funcs.size, funcs.elemsize, cmp_func_cycles);
+
+	printc("Instructions: %llu\n", (unsigned long long)p->insns);
+	printc("Cycles:       %llu (%llu asleep)\n",
+	       (unsigned long long)p->cycles, (unsigned long long)p->sleep);
+	printc("\n");
+	printc("%10s %12s %12s %6s %12s %6s  %s\n",
+	       "Calls", "Insns", "Excl", "%", "Incl", "%", "Function");
+
+	for (i = 0; i < funcs.size && i < count; i++) {
+		const struct profile_func *f =
+			VECTOR_PTR(funcs, i, struct profile_func);
+		char name[128];
+
+		symbol_name(f->addr, name, sizeof(name));
+		printc("%10llu %12llu %12llu %6.2f %12llu %6.2f  %s\n",
+		       (unsigned long long)f->calls,
+		       (unsigned long long)f->insns,
+		       (unsigned long long)f->cycles,
+		       percent(f->cycles, p->cycles),
+		       (unsigned long long)f->inclusive,
+		       percent(f->inclusive, p->cycles), name);
+	}
+
+	vector_destroy(&funcs);
+	return 0;
+}
+
+static int profile_addrs(const struct sim_profile *p, address_t count)
+{
+	struct vector addrs;
+	int i, j;
+
+	vector_init(&addrs, sizeof(struct profile_addr));
+
+	for (i = 0; i < ICACHE_PAGES; i++) {
+		if (!p->counts[i])
+			continue;
+
+		for (j = 0; j < ICACHE_PAGE_SIZE >> 1; j++) {
+			const struct profile_count *c = &p->counts[i][j];
+			struct profile_addr a;
+
+			if (!c->insns)
+				continue;
+
+			a.addr = (i << ICACHE_PAGE_SHIFT) | (j << 1);
+			a.insns = c->insns;
+			a.cycles = c->cycles;
+
+			if (vector_push(&addrs, &a, 1) < 0) {
+				printc_err("sim profile: can't allocate "
+					   "memory\n");
+				vector_destroy(&addrs);
+				return -1;
+			}
+		}
+	}
+
+	qsort(addrs.ptr, addrs.size, addrs.elemsize, cmp_addr_cycles);
+
+	printc("%7s %12s %12s %6s  %s\n",
+	       "Address", "Insns", "Cycles", "%", "Location");
+
+	for (i = 0; i < addrs.size && i < count; i++) {
+		const struct profile_addr *a =
+			VECTOR_PTR(addrs, i, struct profile_addr);
+		char name[128];
+
+		symbol_name(a->addr, name, sizeof(name));
+		printc("0x%05x %12llu %12llu %6.2f  %s\n", a->addr,
+		       (unsigned long long)a->insns,
+		       (unsigned long long)a->cycles,
+		       percent(a->cycles, p->cycles), name);
+	}
+
+	vector_destroy(&addrs);
+	return 0;
+}
+
+/* Write one line per call stack in the "folded" format used by flame
+ * graph tools: the functions from outermost to innermost, separated by
+ * semicolons, followed by the exclusive cycle count.
+ */
+static void profile_fold(FILE *out, const struct profile_node *n,
+			 char *path, int len, int max_len)
+{
+	char name[128];
+
+	for (n = n->child; n; n = n->next) {
+		int end;
+
+		symbol_name(n->func, name, sizeof(name));
+		end = len + snprintf(path + len, max_len - len, "%s%s",
+				     len ? ";" : "", name);
+		if (end >= max_len)
+			end = max_len - 1;
+
+		if (n->cycles)
+			fprintf(out, "%s %llu\n", path,
+				(unsigned long long)n->cycles);
+		if (n->sleep)
+			fprintf(out, "%s;[sleep] %llu\n", path,
+				(unsigned long long)n->sleep);
+
+		profile_fold(out, n, path, end, max_len);
+		path[len] = 0;
+	}
+}
+
+static int profile_folded(const struct sim_profile *p, const char *path)
+{
+	const int max_len = PROFILE_MAX_DEPTH * 128;
+	char *buf = malloc(max_len);
+	FILE *out;
+
+	if (!buf) {
+		printc_err("sim profile: can't allocate memory\n");
+		return -1;
+	}
+
+	out = fopen(path, "w");
+	if (!out) {
+		pr_error(path);
+		free(buf);
+		return -1;
+	}
+
+	buf[0] = 0;
+	profile_fold(out, &p->root, buf, 0, max_len);
+	free(buf);
+
+	if (ferror(out) | fclose(out)) {
+		pr_error(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int cmd_profile(char **arg_text)
+{
+	const char *subcmd = get_arg(arg_text);
+	const char *arg = get_arg(arg_text);
+	struct sim_device *dev = snapshot_device();
+	address_t count = 20;
+
+	if (!dev)
+		return -1;
+
+	if (!subcmd) {
+		printc("Profiling is %s.\n", dev->profiling ? "on" : "off");
+		if (dev->profile)
+			printc("Profiled %llu instructions, %llu cycles\n",
+			       (unsigned long long)dev->profile->insns,
+			       (unsigned long long)dev->profile->cycles);
+		return 0;
+	}
+
+	if (!strcasecmp(subcmd, "on")) {
+		if (!dev->profile) {
+			dev->profile = calloc(1, sizeof(*dev->profile));
+			if (!dev->profile) {
+				printc_err("sim profile: can't allocate "
+					   "memory\n");
+				return -1;
+			}
+		}
+
+		profile_resync(dev);
+		dev->profiling = 1;
+		return 0;
+	}
+
+	if (!strcasecmp(subcmd, "off")) {
+		dev->profiling = 0;
+		return 0;
+	}
+
+	if (!strcasecmp(subcmd, "clear")) {
+		profile_free(dev->profile);
+		dev->profile = NULL;
+		dev->profiling = 0;
+		return 0;
+	}
+
+	if (!dev->profile) {
+		printc_err("sim profile: no profile has been collected\n");
+		return -1;
+	}
+
+	if (!strcasecmp(subcmd, "folded")) {
+		if (!arg) {
+			printc_err("sim profile: you must specify a "
+				   "filename\n");
+			return -1;
+		}
+
+		return profile_folded(dev->profile, arg);
+	}
+
+	if (arg && expr_eval(arg, &count) < 0) {
+		printc_err("sim profile: can't parse count: %s\n", arg);
+		return -1;
+	}
+
+	if (!strcasecmp(subcmd, "report"))
+		return profile_report(dev->profile, count);
+
+	if (!strcasecmp(subcmd, "addresses"))
+		return profile_addrs(dev->profile, count);
+
+	printc_err("sim profile: unknown subcommand: %s\n", subcmd);
+	return -1;
+}
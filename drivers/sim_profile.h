@@ -0,0 +1,39 @@
+/* MSPDebug - debugging tool for the eZ430
+ * Copyright (C) 2009, 2010, 2020 Daniel Beer
+ * Copyright (C) 2020 Bruce G. Burns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SIM_PROFILE_H_
+#define SIM_PROFILE_H_
+
+#include "sim_device.h"
+
+/* Track the profile across a change of state other than by execution,
+ * such as a snapshot being restored.
+ */
+void profile_resync(struct sim_device *dev);
+
+/* Called around each step of the CPU while profiling */
+void profile_step_begin(struct sim_device *dev);
+void profile_step_end(struct sim_device *dev);
+
+void profile_free(struct sim_profile *p);
+
+/* "sim profile" */
+int cmd_profile(char **arg_text);
+
+#endif
@@ -0,0 +1,547 @@
+/* MSPDebug - debugging tool for the eZ430
+ * Copyright (C) 2009, 2010, 2020 Daniel Beer
+ * Copyright (C) 2020 Bruce G. Burns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+
+#ifndef __Windows__
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "sim_semihost.h"
+#include "output.h"
+#include "dis.h"
+#include "util.h"
+#include "opdb.h"
+#include "bytes.h"
+#include "simio_cpu.h"
+
+/* Semihosting
+ *
+ * A program can have the host perform IO on its behalf by writing the
+ * address of a request block to the port given by the sim_semihost
+ * option. The block is word-aligned, and holds 32-bit little-endian
+ * fields:
+ *
+ *	operation (SEMIHOST_*)
+ *	result, written by the host
+ *	arguments
+ *
+ * Files are numbered as in C: 0, 1 and 2 are the standard input, output
+ * and error of MSPDebug, and files opened by the program follow. Files
+ * may only be opened within the directory given by sim_semihost_dir,
+ * since the program may not be trusted. A result of -1 means that the
+ * request failed. Host IO can't be undone, so any execution history is
+ * discarded.
+ */
+#define SEMIHOST_EXIT		1	/* status */
+#define SEMIHOST_WRITE		2	/* file, buffer, length */
+#define SEMIHOST_READ		3	/* file, buffer, length */
+#define SEMIHOST_OPEN		4	/* path, mode (0 = r, 1 = w, 2 = a) */
+#define SEMIHOST_CLOSE		5	/* file */
+#define SEMIHOST_PRINTF		6	/* file, format, argument list */
+#define SEMIHOST_CLOCK		7	/* high 32 bits are in argument 0 */
+#define SEMIHOST_TIME		8
+
+#define SEMIHOST_ARGS		3
+#define SEMIHOST_CHUNK		1024
+
+static uint32_t semihost_get32(struct sim_device *dev, uint32_t addr)
+{
+	uint8_t buf[4] = {0};
+
+	mem_peek(dev, addr, buf, sizeof(buf));
+	return r32le(buf);
+}
+
+static int semihost_put32(struct sim_device *dev, uint32_t addr,
+			  uint32_t value)
+{
+	if (mem_setw(dev, addr, value) < 0 ||
+	    mem_setw(dev, addr + 2, value >> 16) < 0)
+		return -1;
+
+	return 0;
+}
+
+static uint8_t semihost_byte(struct sim_device *dev, uint32_t addr)
+{
+	uint8_t c = 0;
+
+	mem_peek(dev, addr, &c, 1);
+	return c;
+}
+
+/* Fetch a nul-terminated string */
+static void semihost_string(struct sim_device *dev, uint32_t addr,
+			    char *buf, int max_len)
+{
+	int i;
+
+	for (i = 0; i + 1 < max_len; i++) {
+		const uint8_t c = semihost_byte(dev, addr + i);
+
+		if (!c)
+			break;
+
+		buf[i] = c;
+	}
+
+	buf[i] = 0;
+}
+
+static FILE *semihost_file(struct sim_device *dev, uint32_t fd)
+{
+	if (fd >= 3 && fd < 3 + SEMIHOST_MAX_FILES)
+		return dev->semihost_files[fd - 3];
+
+	return NULL;
+}
+
+static int semihost_output(struct sim_device *dev, uint32_t fd,
+			   const char *text, int len)
+{
+	FILE *out;
+
+	if (fd == 1 || fd == 2) {
+		program_output(fd == 2, text, len);
+		return len;
+	}
+
+	out = semihost_file(dev, fd);
+	if (!out || fwrite(text, 1, len, out) != (size_t)len)
+		return -1;
+
+	return len;
+}
+
+static int semihost_write(struct sim_device *dev, uint32_t fd,
+			  uint32_t addr, uint32_t len)
+{
+	uint32_t done = 0;
+
+	while (done < len) {
+		char buf[SEMIHOST_CHUNK];
+		int n = len - done < sizeof(buf) ? len - done : sizeof(buf);
+
+		n = mem_peek(dev, addr + done, (uint8_t *)buf, n);
+		if (!n)
+			break;
+
+		if (semihost_output(dev, fd, buf, n) < 0)
+			return -1;
+
+		done += n;
+	}
+
+	return done;
+}
+
+static int semihost_read(struct sim_device *dev, uint32_t fd,
+			 uint32_t addr, uint32_t len)
+{
+	FILE *in = fd ? semihost_file(dev, fd) : stdin;
+	uint32_t done = 0;
+
+	if (!in)
+		return -1;
+
+	while (done < len) {
+		uint8_t buf[SEMIHOST_CHUNK];
+		int want = len - done < sizeof(buf) ? len - done : sizeof(buf);
+		int n = fread(buf, 1, want, in);
+		int i;
+
+		for (i = 0; i < n; i++)
+			if (mem_setb(dev, addr + done + i, buf[i]) < 0)
+				return -1;
+
+		done += n;
+		if (n < want)
+			break;
+	}
+
+	return done;
+}
+
+/* Check that a path given by the program stays within the directory
+ * given by sim_semihost_dir: it must be relative, and have no ".."
+ * components.
+ */
+static int semihost_path_ok(const char *path)
+{
+	const char *p = path;
+
+	if (!*path || *path == '/' || *path == '\\' ||
+	    (isalpha((uint8_t)path[0]) && path[1] == ':'))
+		return 0;
+
+	while (*p) {
+		const int len = strcspn(p, "/\\");
+
+		if (len == 2 && p[0] == '.' && p[1] == '.')
+			return 0;
+
+		p += len;
+		if (*p)
+			p++;
+	}
+
+	return 1;
+}
+
+static const char *const semihost_modes[] = {"rb", "wb", "ab"};
+
+#ifndef __Windows__
+/* Open a file within the given directory. Each component of the path is
+ * opened in turn without following symbolic links, so that a link in the
+ * directory can't lead the program out of it.
+ */
+static FILE *semihost_fopen(const char *dir, const char *name,
+			    uint32_t mode)
+{
+	static const int flags[] = {
+		O_RDONLY,
+		O_WRONLY | O_CREAT | O_TRUNC,
+		O_WRONLY | O_CREAT | O_APPEND
+	};
+	char part[256];
+	FILE *f = NULL;
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	int next;
+
+	if (fd < 0)
+		return NULL;
+
+	for (;;) {
+		const size_t len = strcspn(name, "/\\");
+
+		if (!len || len >= sizeof(part)) {
+			close(fd);
+			return NULL;
+		}
+
+		memcpy(part, name, len);
+		part[len] = 0;
+		name += len;
+		if (!*name)
+			break;
+
+		name++;
+		next = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		close(fd);
+		if (next < 0)
+			return NULL;
+
+		fd = next;
+	}
+
+	next = openat(fd, part, flags[mode] | O_NOFOLLOW, 0666);
+	close(fd);
+	if (next >= 0) {
+		f = fdopen(next, semihost_modes[mode]);
+		if (!f)
+			close(next);
+	}
+
+	return f;
+}
+#else
+static FILE *semihost_fopen(const char *dir, const char *name,
+			    uint32_t mode)
+{
+	char path[512];
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >=
+	    (int)sizeof(path))
+		return NULL;
+
+	return fopen(path, semihost_modes[mode]);
+}
+#endif
+
+static int semihost_open(struct sim_device *dev, uint32_t path_addr,
+			 uint32_t mode)
+{
+	const char *dir = opdb_get_string("sim_semihost_dir");
+	char name[256];
+	int i;
+
+	if (mode >= ARRAY_LEN(semihost_modes))
+		return -1;
+
+	for (i = 0; i < SEMIHOST_MAX_FILES; i++)
+		if (!dev->semihost_files[i])
+			break;
+
+	if (i >= SEMIHOST_MAX_FILES)
+		return -1;
+
+	semihost_string(dev, path_addr, name, sizeof(name));
+	if (!*dir) {
+		printc_err("%s: can't open %s: sim_semihost_dir is not set\n",
+			   SIMx, name);
+		return -1;
+	}
+
+	if (!semihost_path_ok(name)) {
+		printc_err("%s: can't open %s: path is outside "
+			   "sim_semihost_dir\n", SIMx, name);
+		return -1;
+	}
+
+	dev->semihost_files[i] = semihost_fopen(dir, name, mode);
+	if (!dev->semihost_files[i])
+		return -1;
+
+	return i + 3;
+}
+
+static int semihost_close(struct sim_device *dev, uint32_t fd)
+{
+	FILE *f = semihost_file(dev, fd);
+
+	if (!f)
+		return -1;
+
+	dev->semihost_files[fd - 3] = NULL;
+	return fclose(f) ? -1 : 0;
+}
+
+/* Take a value of the given number of words from an argument list */
+static uint64_t semihost_arg(struct sim_device *dev, uint32_t *ap,
+			     int words)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < words; i++) {
+		uint8_t buf[2] = {0};
+
+		mem_peek(dev, *ap, buf, sizeof(buf));
+		v |= (uint64_t)r16le(buf) << (i * 16);
+		*ap += 2;
+	}
+
+	return v;
+}
+
+/* Format text as printf() would, from a format string and argument list
+ * in the program's memory. Arguments are laid out as the compiler passes
+ * variable arguments: each takes a whole number of words, with long
+ * values taking two and long long four. Pointers are one word. Returns
+ * the length of the text.
+ */
+static int semihost_format(struct sim_device *dev, uint32_t fmt,
+			   uint32_t ap, char *out, int max_len)
+{
+	int len = 0;
+
+	while (len + 1 < max_len) {
+		char spec[32];
+		char str[256];
+		int spec_len = 1;
+		int words = 1;
+		int r = 0;
+		int c;
+		uint64_t v;
+
+		c = semihost_byte(dev, fmt++);
+		if (!c)
+			break;
+
+		if (c != '%') {
+			out[len++] = c;
+			continue;
+		}
+
+		/* Flags, width and precision are passed on. A width or
+		 * precision of "*" is taken from an int argument.
+		 */
+		spec[0] = '%';
+		for (;;) {
+			c = semihost_byte(dev, fmt++);
+			if (spec_len + 8 >= sizeof(spec))
+				break;
+
+			if (c == '*') {
+				const int n = (int16_t)semihost_arg(dev, &ap, 1);
+
+				/* A negative precision is as if it were omitted */
+				if (n < 0 && spec[spec_len - 1] == '.')
+					spec_len--;
+				else
+					spec_len += sprintf(spec + spec_len,
+							    "%d", n);
+				continue;
+			}
+
+			if (!c || !strchr("-+ #0123456789.", c))
+				break;
+
+			spec[spec_len++] = c;
+		}
+
+		while (c == 'h' || c == 'l') {
+			if (c == 'l')
+				words *= 2;
+
+			c = semihost_byte(dev, fmt++);
+		}
+
+		switch (c) {
+		case 'd':
+		case 'i':
+			v = semihost_arg(dev, &ap, words);
+			if (words < 4 && (v >> (words * 16 - 1)) & 1)
+				v |= ~0ULL << (words * 16);
+
+			strcpy(spec + spec_len, "lld");
+			r = snprintf(out + len, max_len - len, spec,
+				     (long long)v);
+			break;
+
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			v = semihost_arg(dev, &ap, words);
+			spec[spec_len++] = 'l';
+			spec[spec_len++] = 'l';
+			spec[spec_len++] = c;
+			spec[spec_len] = 0;
+			r = snprintf(out + len, max_len - len, spec,
+				     (unsigned long long)v);
+			break;
+
+		case 'c':
+			v = semihost_arg(dev, &ap, 1);
+			strcpy(spec + spec_len, "c");
+			r = snprintf(out + len, max_len - len, spec,
+				     (int)(v & 0xff));
+			break;
+
+		case 's':
+			v = semihost_arg(dev, &ap, 1);
+			semihost_string(dev, v, str, sizeof(str));
+			strcpy(spec + spec_len, "s");
+			r = snprintf(out + len, max_len - len, spec, str);
+			break;
+
+		case 'p':
+			v = semihost_arg(dev, &ap, 1);
+			r = snprintf(out + len, max_len - len, "0x%04x",
+				     (unsigned int)v);
+			break;
+
+		case 0:
+			fmt--;
+			break;
+
+		default:
+			out[len++] = c;
+			break;
+		}
+
+		if (r > 0)
+			len += r;
+		if (len > max_len - 1)
+			len = max_len - 1;
+	}
+
+	out[len] = 0;
+	return len;
+}
+
+/* Carry out the request in the block at the given address. Returns -1
+ * if execution should stop.
+ */
+int semihost_request(struct sim_device *dev, uint32_t block)
+{
+	const uint32_t op = semihost_get32(dev, block);
+	uint32_t arg[SEMIHOST_ARGS];
+	uint32_t result;
+	int i;
+
+	for (i = 0; i < SEMIHOST_ARGS; i++)
+		arg[i] = semihost_get32(dev, block + 8 + i * 4);
+
+	if (dev->hist_buf)
+		dev->hist_barrier = 1;
+
+	switch (op) {
+	case SEMIHOST_EXIT:
+		dev->exited = 1;
+		dev->exit_status = arg[0];
+		result = 0;
+		break;
+
+	case SEMIHOST_WRITE:
+		result = semihost_write(dev, arg[0], arg[1], arg[2]);
+		break;
+
+	case SEMIHOST_READ:
+		result = semihost_read(dev, arg[0], arg[1], arg[2]);
+		break;
+
+	case SEMIHOST_OPEN:
+		result = semihost_open(dev, arg[0], arg[1]);
+		break;
+
+	case SEMIHOST_CLOSE:
+		result = semihost_close(dev, arg[0]);
+		break;
+
+	case SEMIHOST_PRINTF:
+		{
+			char text[4096];
+			const int len = semihost_format(dev, arg[1], arg[2],
+							text, sizeof(text));
+
+			result = semihost_output(dev, arg[0], text, len);
+		}
+		break;
+
+	case SEMIHOST_CLOCK:
+		{
+			const uint64_t now = simio_time(dev->simio);
+
+			if (semihost_put32(dev, block + 8, now >> 32) < 0)
+				return -1;
+
+			result = now;
+		}
+		break;
+
+	case SEMIHOST_TIME:
+		result = time(NULL);
+		break;
+
+	default:
+		printc_err("%s: unknown semihosting request %u at "
+			   "PC = 0x%05x\n", SIMx, op, dev->current_insn);
+		return -1;
+	}
+
+	return semihost_put32(dev, block + 4, result);
+}
@@ -0,0 +1,701 @@
+/* MSPDebug - debugging tool for the eZ430
+ * Copyright (C) 2009, 2010, 2020 Daniel Beer
+ * Copyright (C) 2020 Bruce G. Burns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "sim_trace.h"
+#include "output.h"
+#include "dis.h"
+#include "expr.h"
+#include "stab.h"
+#include "util.h"
+#include "bytes.h"
+#include "thread.h"
+#include "ctrlc.h"
+#include "output_util.h"
+#include "simio_cpu.h"
+
+/* Instruction trace
+ *
+ * While tracing, every instruction, interrupt, sleep and reset is
+ * recorded in a file. Records are built in large buffers, and full
+ * buffers are written out by a separate thread, so that the CPU only
+ * waits for the disk if it gets a long way ahead.
+ *
+ * The file begins with TRACE_MAGIC and a byte of TRACE_OPT_ flags. Most
+ * instructions then take a single byte:
+ *
+ *	0ppp cccc	instruction at (previous + 2 * p), taking c cycles
+ *
+ * Anything else is a tag byte, followed by numbers as LEB128 varints.
+ * Signed numbers are zigzag encoded.
+ *
+ *	TRACE_INSN	PC difference (signed), cycles
+ *	TRACE_IRQ	interrupt number (1 byte), cycles
+ *	TRACE_SLEEP	cycles
+ *	TRACE_RESET	cycles
+ *	TRACE_REGS	mask of registers, then the value of each
+ *	TRACE_WRITE	address * 2 (+ 1 for a word), value
+ *	TRACE_SYNC	PC, IO simulator time
+ *
+ * Register and write records give the effect of the record which
+ * follows them. Only registers other than PC which have changed are
+ * given. A sync record starts the trace, each buffer, and follows any
+ * change of state other than by execution, such as a snapshot being
+ * restored.
+ */
+#define TRACE_MAGIC		"MSPDTRC1"
+
+/* Size and number of buffers. A new buffer is started when there are
+ * fewer than TRACE_MAX_RECORD bytes left in the current one.
+ */
+#define TRACE_BUF_SIZE		(1 << 20)
+#define TRACE_BUFS		4
+#define TRACE_MAX_RECORD	64
+
+struct sim_trace {
+	char			*path;
+	FILE			*out;
+	int			options;
+
+	/* State as of the last record */
+	uint32_t		pc;
+	uint64_t		time;
+	uint32_t		regs[DEVICE_NUM_REGS];
+	uint64_t		events;
+
+	/* Free space in the buffer being filled */
+	uint8_t			*pos;
+	uint8_t			*limit;
+
+	/* The buffer at head is being filled, and full buffers from tail
+	 * onwards are waiting for the writer. The counts and indices are
+	 * protected by the lock.
+	 */
+	uint8_t			*buf[TRACE_BUFS];
+	uint32_t		len[TRACE_BUFS];
+	int			head;
+	int			tail;
+	int			full;
+	int			done;
+	int			error;
+
+	thread_t		writer;
+	thread_lock_t		lock;
+	thread_cond_t		ready;
+	thread_cond_t		space;
+};
+
+static inline uint8_t *trace_put(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+
+	*p++ = v;
+	return p;
+}
+
+static int trace_get(FILE *in, uint64_t *v)
+{
+	int shift = 0;
+	int c;
+
+	*v = 0;
+	do {
+		c = getc(in);
+		if (c == EOF || shift >= 64)
+			return -1;
+
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+static void trace_writer(void *user_data)
+{
+	struct sim_trace *t = (struct sim_trace *)user_data;
+
+	thread_lock_acquire(&t->lock);
+	for (;;) {
+		size_t n;
+		int i;
+
+		while (!t->full && !t->done)
+			thread_cond_wait(&t->ready, &t->lock);
+
+		if (!t->full)
+			break;
+
+		i = t->tail;
+		thread_lock_release(&t->lock);
+		n = fwrite(t->buf[i], 1, t->len[i], t->out);
+		thread_lock_acquire(&t->lock);
+
+		if (n != t->len[i])
+			t->error = 1;
+
+		t->tail = (i + 1) % TRACE_BUFS;
+		t->full--;
+		thread_cond_notify(&t->space);
+	}
+	thread_lock_release(&t->lock);
+}
+
+/* Pass the current buffer to the writer, and move on to the next,
+ * waiting for it to be written out if necessary.
+ */
+static void trace_submit(struct sim_trace *t, int done)
+{
+	thread_lock_acquire(&t->lock);
+	t->len[t->head] = t->pos - t->buf[t->head];
+	t->head = (t->head + 1) % TRACE_BUFS;
+	t->full++;
+	t->done = done;
+	thread_cond_notify(&t->ready);
+
+	while (!done && t->full >= TRACE_BUFS)
+		thread_cond_wait(&t->space, &t->lock);
+	thread_lock_release(&t->lock);
+
+	t->pos = t->buf[t->head];
+	t->limit = t->pos + TRACE_BUF_SIZE - TRACE_MAX_RECORD;
+}
+
+static void trace_put_sync(struct sim_trace *t)
+{
+	*t->pos++ = TRACE_SYNC;
+	t->pos = trace_put(t->pos, t->pc);
+	t->pos = trace_put(t->pos, t->time);
+}
+
+/* Make sure there's room for another record */
+static inline void trace_reserve(struct sim_trace *t)
+{
+	if (t->pos >= t->limit) {
+		trace_submit(t, 0);
+		trace_put_sync(t);
+	}
+}
+
+/* Record the registers which have changed since the last event */
+static void trace_regs(struct sim_device *dev)
+{
+	struct sim_trace *t = dev->trace;
+	uint32_t mask = 0;
+	int i;
+
+	sr_sync(dev);
+	for (i = 1; i < DEVICE_NUM_REGS; i++)
+		if (dev->regs[i] != t->regs[i])
+			mask |= 1 << i;
+
+	if (!mask)
+		return;
+
+	trace_reserve(t);
+	*t->pos++ = TRACE_REGS;
+	t->pos = trace_put(t->pos, mask);
+
+	for (i = 1; i < DEVICE_NUM_REGS; i++)
+		if (mask & (1 << i)) {
+			t->pos = trace_put(t->pos, dev->regs[i]);
+			t->regs[i] = dev->regs[i];
+		}
+}
+
+void trace_insn(struct sim_device *dev, int cycles)
+{
+	struct sim_trace *t = dev->trace;
+	const uint32_t diff = dev->current_insn - t->pc;
+
+	if (t->options & TRACE_OPT_REGS)
+		trace_regs(dev);
+
+	trace_reserve(t);
+	if (diff < 16 && !(diff & 1) && cycles < 16) {
+		*t->pos++ = (diff << 3) | cycles;
+	} else {
+		const int32_t sdiff = diff;
+
+		*t->pos++ = TRACE_INSN;
+		t->pos = trace_put(t->pos, sdiff < 0 ?
+				   ((uint32_t)~sdiff << 1) | 1 : diff << 1);
+		t->pos = trace_put(t->pos, cycles);
+	}
+
+	t->pc = dev->current_insn;
+	t->time += cycles;
+	t->events++;
+}
+
+void trace_event(struct sim_device *dev, int tag, int irq,
+		 int cycles)
+{
+	struct sim_trace *t = dev->trace;
+
+	if (t->options & TRACE_OPT_REGS)
+		trace_regs(dev);
+
+	trace_reserve(t);
+	*t->pos++ = tag;
+	if (tag == TRACE_IRQ)
+		*t->pos++ = irq;
+	t->pos = trace_put(t->pos, cycles);
+
+	t->time += cycles;
+	t->events++;
+}
+
+void trace_write(struct sim_device *dev, uint32_t addr,
+		 uint16_t value, int word)
+{
+	struct sim_trace *t = dev->trace;
+
+	trace_reserve(t);
+	*t->pos++ = TRACE_WRITE;
+	t->pos = trace_put(t->pos, (addr << 1) | word);
+	t->pos = trace_put(t->pos, value);
+}
+
+void trace_sync(struct sim_device *dev)
+{
+	struct sim_trace *t = dev->trace;
+
+	if (!t)
+		return;
+
+	t->pc = dev->regs[MSP430_REG_PC];
+	t->time = simio_time(dev->simio);
+	trace_reserve(t);
+	trace_put_sync(t);
+}
+
+static void trace_free(struct sim_trace *t)
+{
+	int i;
+
+	for (i = 0; i < TRACE_BUFS; i++)
+		free(t->buf[i]);
+
+	free(t->path);
+	free(t);
+}
+
+int trace_start(struct sim_device *dev, const char *path,
+		int options)
+{
+	struct sim_trace *t;
+	uint8_t hdr[9];
+	int i;
+
+	if (dev->trace) {
+		printc_err("sim trace: already tracing to %s\n",
+			   dev->trace->path);
+		return -1;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		printc_err("sim trace: can't allocate memory\n");
+		return -1;
+	}
+
+	t->path = strdup(path);
+	for (i = 0; i < TRACE_BUFS; i++) {
+		t->buf[i] = malloc(TRACE_BUF_SIZE);
+		if (!t->buf[i])
+			break;
+	}
+
+	if (!t->path || i < TRACE_BUFS) {
+		printc_err("sim trace: can't allocate memory\n");
+		trace_free(t);
+		return -1;
+	}
+
+	t->out = fopen(path, "wb");
+	if (!t->out) {
+		pr_error(path);
+		trace_free(t);
+		return -1;
+	}
+
+	memcpy(hdr, TRACE_MAGIC, 8);
+	hdr[8] = options;
+	fwrite(hdr, sizeof(hdr), 1, t->out);
+
+	thread_lock_init(&t->lock);
+	thread_cond_init(&t->ready);
+	thread_cond_init(&t->space);
+
+	if (thread_create(&t->writer, trace_writer, t)) {
+		printc_err("sim trace: can't start writer thread\n");
+		thread_cond_destroy(&t->space);
+		thread_cond_destroy(&t->ready);
+		thread_lock_destroy(&t->lock);
+		fclose(t->out);
+		trace_free(t);
+		return -1;
+	}
+
+	/* The first event gives every register */
+	t->options = options;
+	memset(t->regs, 0xff, sizeof(t->regs));
+	t->pos = t->buf[0];
+	t->limit = t->pos + TRACE_BUF_SIZE - TRACE_MAX_RECORD;
+
+	dev->trace = t;
+	trace_sync(dev);
+
+	if (options & TRACE_OPT_MEM) {
+		dev->trace_mem = 1;
+		for (i = 0; i < MEM_PAGES; i++)
+			mem_update_fast(dev, i);
+	}
+
+	return 0;
+}
+
+int trace_stop(struct sim_device *dev)
+{
+	struct sim_trace *t = dev->trace;
+	int ret = 0;
+	int i;
+
+	dev->trace = NULL;
+	if (dev->trace_mem) {
+		dev->trace_mem = 0;
+		for (i = 0; i < MEM_PAGES; i++)
+			mem_update_fast(dev, i);
+	}
+
+	trace_submit(t, 1);
+	thread_join(t->writer);
+	thread_cond_destroy(&t->space);
+	thread_cond_destroy(&t->ready);
+	thread_lock_destroy(&t->lock);
+
+	if (ferror(t->out) | fclose(t->out) | t->error) {
+		printc_err("sim trace: error writing %s\n", t->path);
+		ret = -1;
+	}
+
+	trace_free(t);
+	return ret;
+}
+
+int trace_open(struct trace_reader *r, const char *path)
+{
+	uint8_t hdr[9];
+
+	memset(r, 0, sizeof(*r));
+	r->path = path;
+	r->in = fopen(path, "rb");
+	if (!r->in) {
+		pr_error(path);
+		return -1;
+	}
+
+	if (fread(hdr, sizeof(hdr), 1, r->in) != 1 ||
+	    memcmp(hdr, TRACE_MAGIC, 8)) {
+		printc_err("sim trace: %s: not a trace file\n", path);
+		fclose(r->in);
+		return -1;
+	}
+
+	r->options = hdr[8];
+	return 0;
+}
+
+void trace_close(struct trace_reader *r)
+{
+	fclose(r->in);
+}
+
+int trace_read(struct trace_reader *r)
+{
+	uint64_t a;
+	uint64_t b;
+	int i;
+
+	/* Registers and writes belong to the record before them, but a
+	 * sync may come between.
+	 */
+	if (r->tag != TRACE_SYNC) {
+		r->reg_mask = 0;
+		r->num_writes = 0;
+	}
+
+	r->time += r->cycles;
+	r->cycles = 0;
+
+	for (;;) {
+		int c = getc(r->in);
+
+		if (c == EOF)
+			return 0;
+
+		if (!(c & 0x80)) {
+			r->pc += (c >> 4) * 2;
+			r->cycles = c & 15;
+			r->tag = TRACE_INSN;
+			return r->tag;
+		}
+
+		switch (c) {
+		case TRACE_INSN:
+			if (trace_get(r->in, &a) < 0 ||
+			    trace_get(r->in, &b) < 0)
+				goto truncated;
+
+			r->pc += (a & 1) ? ~(uint32_t)(a >> 1) :
+				(uint32_t)(a >> 1);
+			r->cycles = b;
+			break;
+
+		case TRACE_IRQ:
+			r->irq = getc(r->in);
+			if (r->irq == EOF || trace_get(r->in, &b) < 0)
+				goto truncated;
+
+			r->cycles = b;
+			break;
+
+		case TRACE_SLEEP:
+		case TRACE_RESET:
+			if (trace_get(r->in, &b) < 0)
+				goto truncated;
+
+			r->cycles = b;
+			break;
+
+		case TRACE_REGS:
+			if (trace_get(r->in, &a) < 0)
+				goto truncated;
+
+			for (i = 1; i < DEVICE_NUM_REGS; i++)
+				if (a & (1 << i)) {
+					if (trace_get(r->in, &b) < 0)
+						goto truncated;
+					r->regs[i] = b;
+				}
+
+			r->reg_mask |= a;
+			continue;
+
+		case TRACE_WRITE:
+			if (trace_get(r->in, &a) < 0 ||
+			    trace_get(r->in, &b) < 0)
+				goto truncated;
+
+			if (r->num_writes < TRACE_SHOW_WRITES) {
+				r->write_addr[r->num_writes] = a;
+				r->write_value[r->num_writes] = b;
+			}
+
+			r->num_writes++;
+			continue;
+
+		case TRACE_SYNC:
+			if (trace_get(r->in, &a) < 0 ||
+			    trace_get(r->in, &b) < 0)
+				goto truncated;
+
+			r->pc = a;
+			r->time = b;
+			break;
+
+		default:
+			printc_err("sim trace: %s: bad record: 0x%02x\n",
+				   r->path, c);
+			return -1;
+		}
+
+		r->tag = c;
+		return r->tag;
+	}
+
+truncated:
+	printc_err("sim trace: %s: file is truncated\n", r->path);
+	return -1;
+}
+
+static void trace_show_deltas(const struct trace_reader *r)
+{
+	int i;
+
+	if (!r->reg_mask && !r->num_writes)
+		return;
+
+	printc("%21s", "");
+	for (i = 1; i < DEVICE_NUM_REGS; i++)
+		if (r->reg_mask & (1 << i))
+			printc(" %s=0x%04x", dis_reg_name(i), r->regs[i]);
+
+	for (i = 0; i < r->num_writes && i < TRACE_SHOW_WRITES; i++)
+		printc((r->write_addr[i] & 1) ? " [0x%04x]=0x%04x" :
+		       " [0x%04x]=0x%02x", r->write_addr[i] >> 1,
+		       r->write_value[i]);
+
+	if (r->num_writes > TRACE_SHOW_WRITES)
+		printc(" (%d more writes)",
+		       r->num_writes - TRACE_SHOW_WRITES);
+
+	printc("\n");
+}
+
+/* Show an instruction, which is disassembled from the device's memory
+ * as it is now.
+ */
+static void trace_show_insn(struct sim_device *dev,
+			    const struct trace_reader *r)
+{
+	struct msp430_instruction insn;
+	uint8_t code[8];
+	char name[64];
+	int len = mem_peek(dev, r->pc, code, sizeof(code));
+
+	symbol_name(r->pc, name, sizeof(name));
+	printc("%12llu  %05x  %-24s ", (unsigned long long)r->time, r->pc,
+	       name);
+	if (len >= 2 && dis_decode(code, r->pc, len, &insn) >= 0)
+		dis_format(&insn);
+	printc("\n");
+}
+
+static int trace_decode(struct sim_device *dev, const char *path,
+			uint64_t count)
+{
+	struct trace_reader r;
+	int ret = 0;
+
+	if (trace_open(&r, path) < 0)
+		return -1;
+
+	while (count && !ctrlc_check()) {
+		ret = trace_read(&r);
+		if (ret <= 0)
+			break;
+
+		switch (ret) {
+		case TRACE_INSN:
+			trace_show_insn(dev, &r);
+			break;
+
+		case TRACE_IRQ:
+			printc("%12llu  interrupt %d (%llu cycles)\n",
+			       (unsigned long long)r.time, r.irq,
+			       (unsigned long long)r.cycles);
+			break;
+
+		case TRACE_SLEEP:
+		case TRACE_RESET:
+			printc("%12llu  %s (%llu cycles)\n",
+			       (unsigned long long)r.time,
+			       ret == TRACE_SLEEP ? "sleep" : "reset",
+			       (unsigned long long)r.cycles);
+			break;
+
+		case TRACE_SYNC:
+			continue;
+		}
+
+		trace_show_deltas(&r);
+		count--;
+	}
+
+	trace_close(&r);
+	return ret < 0 ? -1 : 0;
+}
+
+int cmd_trace(char **arg_text)
+{
+	const char *subcmd = get_arg(arg_text);
+	struct sim_device *dev = snapshot_device();
+	const char *path;
+
+	if (!dev)
+		return -1;
+
+	if (!subcmd) {
+		if (dev->trace)
+			printc("Tracing to %s: %llu events\n",
+			       dev->trace->path,
+			       (unsigned long long)dev->trace->events);
+		else
+			printc("Tracing is off.\n");
+		return 0;
+	}
+
+	if (!strcasecmp(subcmd, "stop")) {
+		if (!dev->trace) {
+			printc_err("sim trace: no trace is being written\n");
+			return -1;
+		}
+
+		return trace_stop(dev);
+	}
+
+	path = get_arg(arg_text);
+	if (!path) {
+		printc_err("sim trace: you must specify a filename\n");
+		return -1;
+	}
+
+	if (!strcasecmp(subcmd, "start")) {
+		const char *opt;
+		int options = 0;
+
+		while ((opt = get_arg(arg_text))) {
+			if (!strcasecmp(opt, "regs")) {
+				options |= TRACE_OPT_REGS;
+			} else if (!strcasecmp(opt, "mem")) {
+				options |= TRACE_OPT_MEM;
+			} else {
+				printc_err("sim trace: unknown option: %s\n",
+					   opt);
+				return -1;
+			}
+		}
+
+		return trace_start(dev, path, options);
+	}
+
+	if (!strcasecmp(subcmd, "decode")) {
+		const char *count_text = get_arg(arg_text);
+		address_t count = 0;
+
+		if (count_text && expr_eval(count_text, &count) < 0) {
+			printc_err("sim trace: can't parse count: %s\n",
+				   count_text);
+			return -1;
+		}
+
+		return trace_decode(dev, path, count ? count : UINT64_MAX);
+	}
+
+	printc_err("sim trace: unknown subcommand: %s\n", subcmd);
+	return -1;
+}
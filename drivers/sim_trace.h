@@ -0,0 +1,87 @@
+/* MSPDebug - debugging tool for the eZ430
+ * Copyright (C) 2009, 2010, 2020 Daniel Beer
+ * Copyright (C) 2020 Bruce G. Burns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SIM_TRACE_H_
+#define SIM_TRACE_H_
+
+#include "sim_device.h"
+
+/* Record tags, and options given in the file header */
+#define TRACE_INSN		0x80
+#define TRACE_IRQ		0x81
+#define TRACE_SLEEP		0x82
+#define TRACE_RESET		0x83
+#define TRACE_REGS		0x84
+#define TRACE_WRITE		0x85
+#define TRACE_SYNC		0x86
+
+#define TRACE_OPT_REGS		0x01
+#define TRACE_OPT_MEM		0x02
+
+/* Start writing a trace to the given file, or finish it */
+int trace_start(struct sim_device *dev, const char *path, int options);
+int trace_stop(struct sim_device *dev);
+
+/* Record an instruction, an event given by one of the tags above, or a
+ * write to memory.
+ */
+void trace_insn(struct sim_device *dev, int cycles);
+void trace_event(struct sim_device *dev, int tag, int irq, int cycles);
+void trace_write(struct sim_device *dev, uint32_t addr, uint16_t value,
+		 int word);
+
+/* Record a change of state other than by execution */
+void trace_sync(struct sim_device *dev);
+
+/* Writes kept per event when reading */
+#define TRACE_SHOW_WRITES	16
+
+/* Reading a trace back. trace_read() returns the tag of the next
+ * instruction, event or sync record, with an instruction in either form
+ * given as TRACE_INSN. The reader then holds the address and time at
+ * which it began, the cycles it took, and the registers and writes
+ * recorded for it. Returns 0 at the end of the file, or -1 if the file
+ * is corrupt.
+ */
+struct trace_reader {
+	FILE			*in;
+	const char		*path;
+	int			options;
+	int			tag;
+
+	uint32_t		pc;
+	uint64_t		time;
+	uint64_t		cycles;
+	int			irq;
+
+	uint32_t		reg_mask;
+	uint32_t		regs[DEVICE_NUM_REGS];
+	int			num_writes;
+	uint32_t		write_addr[TRACE_SHOW_WRITES];
+	uint16_t		write_value[TRACE_SHOW_WRITES];
+};
+
+int trace_open(struct trace_reader *r, const char *path);
+int trace_read(struct trace_reader *r);
+void trace_close(struct trace_reader *r);
+
+/* "sim trace" */
+int cmd_trace(char **arg_text);
+
+#endif
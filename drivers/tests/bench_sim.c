@@ -0,0 +1,245 @@
+/* MSPDebug - debugging tool for MSP430 MCUs
+ * Copyright (C) 2009, 2010 Daniel Beer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "thread.h"
+
+/* Module under test */
+#include "sim.c"
+
+#define CODE_ADDR	0xc000
+#define DATA_SIZE	0x2000
+#define ITERATIONS	200
+#define THREADS		4
+
+/*
+ * Firmware which repeatedly fills 8 kB of RAM at 0x2000, then copies it
+ * to 0x8000, using a word at a time:
+ *
+ *	mov	#ITERATIONS, r12
+ * outer:
+ *	mov	#0x2000, r15
+ *	mov	#0x1000, r14
+ * fill:
+ *	mov	r13, 0(r15)
+ *	incd	r15
+ *	dec	r14
+ *	jnz	fill
+ *	mov	#0x2000, r15
+ *	mov	#0x8000, r14
+ *	mov	#0x1000, r11
+ * copy:
+ *	mov	@r15+, 0(r14)
+ *	incd	r14
+ *	dec	r11
+ *	jnz	copy
+ *	dec	r12
+ *	jnz	outer
+ * done:
+ *	jmp	done
+ */
+static const uint16_t firmware[] = {
+	0x403c, ITERATIONS,
+	0x403f, 0x2000,
+	0x403e, DATA_SIZE / 2,
+	0x4d8f, 0x0000,
+	0x532f,
+	0x831e,
+	0x23fb,
+	0x403f, 0x2000,
+	0x403e, 0x8000,
+	0x403b, DATA_SIZE / 2,
+	0x4fbe, 0x0000,
+	0x532e,
+	0x831b,
+	0x23fb,
+	0x831c,
+	0x23ea,
+	0x3fff
+};
+
+#define DONE_ADDR	(CODE_ADDR + sizeof(firmware) - 2)
+
+/* Instructions executed by the firmware */
+#define INSNS		(1 + ITERATIONS * (DATA_SIZE / 2 * 8 + 6))
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Collect coverage in each run */
+static int coverage;
+
+/* Write a trace with these options in each run, if non-zero */
+#define TRACE_FILE	"bench_sim.trc"
+static int trace_options;
+
+static double run_firmware(const struct device_class *type)
+{
+	struct device_args args;
+	address_t regs[DEVICE_NUM_REGS];
+	uint8_t image[sizeof(firmware)];
+	uint8_t check[2];
+	device_status_t status;
+	device_t dev;
+	double start, elapsed;
+	unsigned int i;
+	int ret;
+
+	memset(&args, 0, sizeof(args));
+	dev = type->open(&args);
+	assert(dev);
+
+	for (i = 0; i < ARRAY_LEN(firmware); i++) {
+		image[i * 2] = firmware[i];
+		image[i * 2 + 1] = firmware[i] >> 8;
+	}
+
+	ret = type->writemem(dev, CODE_ADDR, image, sizeof(image));
+	assert(ret == 0);
+	ret = type->ctl(dev, DEVICE_CTL_RESET);
+	assert(ret == 0);
+	ret = type->getregs(dev, regs);
+	assert(ret == 0);
+	regs[MSP430_REG_PC] = CODE_ADDR;
+	regs[MSP430_REG_R13] = 0x55aa;
+	ret = type->setregs(dev, regs);
+	assert(ret == 0);
+	ret = device_setbrk(dev, 0, 1, DONE_ADDR, DEVICE_BPTYPE_BREAK);
+	assert(ret == 0);
+	if (coverage) {
+		ret = coverage_start((struct sim_device *)dev);
+		assert(ret == 0);
+	}
+	if (trace_options) {
+		ret = trace_start((struct sim_device *)dev, TRACE_FILE,
+				  trace_options);
+		assert(ret == 0);
+	}
+
+	start = now();
+	ret = type->ctl(dev, DEVICE_CTL_RUN);
+	assert(ret == 0);
+	do {
+		status = type->poll(dev);
+	} while (status == DEVICE_STATUS_RUNNING);
+	elapsed = now() - start;
+
+	assert(status == DEVICE_STATUS_HALTED);
+	ret = type->getregs(dev, regs);
+	assert(ret == 0);
+	assert(regs[MSP430_REG_PC] == DONE_ADDR);
+	ret = type->readmem(dev, 0x8000 + DATA_SIZE - 2, check, 2);
+	assert(ret == 0);
+	assert(check[0] == 0xaa && check[1] == 0x55);
+
+	type->destroy(dev);
+	return elapsed;
+}
+
+static void bench(const struct device_class *type)
+{
+	const double elapsed = run_firmware(type);
+
+	printf("  %-5s %8.3f s  %8.2f Minsn/s\n", type->name, elapsed,
+	       INSNS / elapsed / 1000000.0);
+}
+
+/* Each simulator keeps its state in its own device, apart from the
+ * dispatch tables, which are built once and only read after that, and
+ * the options, which are only read. Several may run at once through
+ * the driver interface. Output and the sim commands, which act on
+ * device_default, are global and are not used here.
+ */
+static void bench_thread(void *arg)
+{
+	run_firmware(arg);
+}
+
+static void bench_threads(const struct device_class *type)
+{
+	thread_t threads[THREADS];
+	double start, elapsed;
+	int ret;
+	int i;
+
+	start = now();
+	for (i = 0; i < THREADS; i++) {
+		ret = thread_create(&threads[i], bench_thread, (void *)type);
+		assert(!ret);
+	}
+	for (i = 0; i < THREADS; i++)
+		thread_join(threads[i]);
+	elapsed = now() - start;
+
+	printf("  %-5s %8.3f s  %8.2f Minsn/s\n", type->name, elapsed,
+	       THREADS * (double)INSNS / elapsed / 1000000.0);
+}
+
+int main(int argc, char **argv)
+{
+	union opdb_value history;
+	union opdb_value quiet;
+
+	(void)argc;
+	(void)argv;
+
+	ctrlc_init();
+
+	/* Output isn't serialized between threads */
+	quiet.boolean = 1;
+	opdb_set("quiet", &quiet);
+
+	printf("memset/memcpy loop, %d x %d bytes:\n",
+	       ITERATIONS, DATA_SIZE);
+	bench(&device_sim);
+	bench(&device_simx);
+
+	printf("%d instances on separate threads:\n", THREADS);
+	bench_threads(&device_sim);
+	bench_threads(&device_simx);
+
+	coverage = 1;
+	printf("with coverage:\n");
+	bench(&device_sim);
+	bench(&device_simx);
+	coverage = 0;
+
+	trace_options = TRACE_OPT_REGS | TRACE_OPT_MEM;
+	printf("with a trace of registers and writes:\n");
+	bench(&device_sim);
+	bench(&device_simx);
+	trace_options = 0;
+	remove(TRACE_FILE);
+
+	history.numeric = 1024;
+	opdb_set("sim_history", &history);
+	printf("with %d kB of execution history:\n", (int)history.numeric);
+	bench(&device_sim);
+	bench(&device_simx);
+
+	return 0;
+}
@@ -0,0 +1,1171 @@
+/* MSPDebug - debugging tool for MSP430 MCUs
+ * Copyright (C) 2009, 2010 Daniel Beer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "opdb.h"
+#include "simio.h"
+#include "stab.h"
+
+/* Module under test */
+#include "sim.c"
+
+#define CODE_ADDR	0xc000
+#define MAX_STEPS	100
+
+#define C		MSP430_SR_C
+#define Z		MSP430_SR_Z
+#define N		MSP430_SR_N
+#define V		MSP430_SR_V
+#define FLAGS		(C | Z | N | V)
+
+/* Instructions used below. The source operand is R5 and the destination
+ * is R6, except where noted.
+ */
+#define ADD_W		0x5506
+#define ADD_B		0x5546
+#define ADDC_W		0x6506
+#define SUB_W		0x8506
+#define SUB_B		0x8546
+#define CMP_W		0x9506
+#define CMP_B		0x9546
+#define DADD_W		0xa506
+#define DADD_B		0xa546
+#define RRC_W		0x1006
+#define RRC_B		0x1046
+#define RRA_W		0x1106
+#define RRA_B		0x1146
+#define ADD_R6_R6	0x5606
+#define JMP_SELF	0x3fff
+
+/* Extension words for register operands: 20-bit operation, repeat n
+ * times, repeat by the count in Rn, and treat carry as zero.
+ */
+#define EXT_A		0x1800
+#define EXT_W		0x1840
+#define EXT_RPT(n)	(EXT_W | ((n) - 1))
+#define EXT_RPT_REG(n)	(EXT_W | 0x80 | (n))
+#define EXT_ZC		0x0100
+
+/*
+ * Helpers for running code on the simulator.
+ */
+
+static const struct device_class *type;
+static int stepping;
+static device_t dev;
+static address_t regs[DEVICE_NUM_REGS];
+
+static int is_cpux(void)
+{
+	return type == &device_simx;
+}
+
+/* Load a program which ends with "jmp $" and run it from the start with
+ * the registers in regs[], either by single steps or by running to a
+ * breakpoint. The registers are read back when it finishes.
+ */
+static void load_code(const uint16_t *code, int len)
+{
+	uint8_t image[32];
+	int ret;
+	int i;
+
+	assert(len * 2 <= (int)sizeof(image));
+	assert(code[len - 1] == JMP_SELF);
+
+	for (i = 0; i < len; i++) {
+		image[i * 2] = code[i];
+		image[i * 2 + 1] = code[i] >> 8;
+	}
+
+	ret = type->writemem(dev, CODE_ADDR, image, len * 2);
+	assert(ret == 0);
+
+	regs[MSP430_REG_PC] = CODE_ADDR;
+	ret = type->setregs(dev, regs);
+	assert(ret == 0);
+}
+
+/* Run loaded code until it halts, with a breakpoint on the final jump,
+ * and leave it halted with the registers read back. The check, if
+ * given, is called before the CPU is halted.
+ */
+static void run_to_halt(address_t done, void (*check)(void))
+{
+	device_status_t status;
+	int ret;
+
+	ret = device_setbrk(dev, 0, 1, done, DEVICE_BPTYPE_BREAK);
+	assert(ret == 0);
+	ret = type->ctl(dev, DEVICE_CTL_RUN);
+	assert(ret == 0);
+
+	do {
+		status = type->poll(dev);
+	} while (status == DEVICE_STATUS_RUNNING);
+
+	assert(status == DEVICE_STATUS_HALTED);
+	if (check)
+		check();
+
+	ret = type->ctl(dev, DEVICE_CTL_HALT);
+	assert(ret == 0);
+	ret = type->getregs(dev, regs);
+	assert(ret == 0);
+}
+
+static void run_code(const uint16_t *code, int len)
+{
+	const address_t done = CODE_ADDR + (len - 1) * 2;
+	int ret;
+	int i;
+
+	load_code(code, len);
+
+	if (stepping) {
+		for (i = 0; i < MAX_STEPS; i++) {
+			ret = type->getregs(dev, regs);
+			assert(ret == 0);
+			if (regs[MSP430_REG_PC] == done)
+				break;
+
+			ret = type->ctl(dev, DEVICE_CTL_STEP);
+			assert(ret == 0);
+		}
+
+		assert(i < MAX_STEPS);
+		return;
+	}
+
+	run_to_halt(done, NULL);
+	assert(regs[MSP430_REG_PC] == done);
+}
+
+/* Run a command for the IO simulator, such as "add timer t" */
+static void simio_cmd(const char *text)
+{
+	struct sim_device *sim = (struct sim_device *)dev;
+	char buf[64];
+	char *arg = buf;
+	int ret;
+
+	assert(strlen(text) < sizeof(buf));
+	strcpy(buf, text);
+	ret = simio_command(sim->simio, &arg);
+	assert(ret == 0);
+}
+
+/* Run a single instruction, with an extension word if ext is non-zero,
+ * on R5 and R6 and the given SR. Check the result left in R6 and the
+ * flags selected by mask.
+ */
+static void check_op(uint16_t ext, uint16_t ins,
+		     address_t src, address_t dst, address_t sr,
+		     address_t result, address_t flags, address_t mask)
+{
+	uint16_t code[3];
+	int len = 0;
+
+	if (ext)
+		code[len++] = ext;
+	code[len++] = ins;
+	code[len++] = JMP_SELF;
+
+	regs[MSP430_REG_R5] = src;
+	regs[MSP430_REG_R6] = dst;
+	regs[MSP430_REG_SR] = sr;
+	run_code(code, len);
+
+	assert(regs[MSP430_REG_R6] == result);
+	assert((regs[MSP430_REG_SR] & mask) == flags);
+}
+
+/*
+ * Set up and tear down for each test.
+ */
+
+static void set_up(void)
+{
+	struct device_args args;
+	int ret;
+
+	memset(&args, 0, sizeof(args));
+	dev = type->open(&args);
+	assert(dev);
+
+	ret = type->ctl(dev, DEVICE_CTL_RESET);
+	assert(ret == 0);
+	memset(regs, 0, sizeof(regs));
+	regs[MSP430_REG_SP] = 0x400;
+}
+
+static void tear_down(void)
+{
+	type->destroy(dev);
+	dev = NULL;
+}
+
+/*
+ * Tests for the original instruction set.
+ */
+
+static void test_add(void)
+{
+	check_op(0, ADD_W, 0x7fff, 0x0001, 0, 0x8000, N | V, FLAGS);
+	check_op(0, ADD_W, 0xffff, 0x0001, 0, 0x0000, Z | C, FLAGS);
+	check_op(0, ADD_W, 0x1234, 0x1111, FLAGS, 0x2345, 0, FLAGS);
+	check_op(0, ADD_B, 0x007f, 0x0001, 0, 0x0080, N | V, FLAGS);
+	check_op(0, ADD_B, 0x12ff, 0x3401, 0, 0x0000, Z | C, FLAGS);
+	check_op(0, ADD_B, 0x0080, 0x0080, 0, 0x0000, Z | C | V, FLAGS);
+	check_op(0, ADDC_W, 0x0001, 0x0001, C, 0x0003, 0, FLAGS);
+	check_op(0, ADDC_W, 0xffff, 0x0000, C, 0x0000, Z | C, FLAGS);
+}
+
+static void test_sub(void)
+{
+	check_op(0, SUB_W, 0x0001, 0x0000, 0, 0xffff, N, FLAGS);
+	check_op(0, SUB_W, 0x0001, 0x8000, 0, 0x7fff, V | C, FLAGS);
+	check_op(0, SUB_W, 0x0005, 0x0005, 0, 0x0000, Z | C, FLAGS);
+	check_op(0, SUB_B, 0x0001, 0x0080, 0, 0x007f, V | C, FLAGS);
+	check_op(0, SUB_B, 0x0002, 0x0101, 0, 0x00ff, N, FLAGS);
+}
+
+static void test_cmp(void)
+{
+	check_op(0, CMP_W, 0x0001, 0x8000, 0, 0x8000, V | C, FLAGS);
+	check_op(0, CMP_W, 0x1234, 0x1234, 0, 0x1234, Z | C, FLAGS);
+	check_op(0, CMP_W, 0x0002, 0x0001, 0, 0x0001, N, FLAGS);
+	check_op(0, CMP_B, 0x0001, 0x0100, 0, 0x0100, N, FLAGS);
+	check_op(0, CMP_B, 0x0180, 0x0280, 0, 0x0280, Z | C, FLAGS);
+}
+
+static void test_rrc(void)
+{
+	check_op(0, RRC_W, 0, 0x0001, C, 0x8000, N | C, FLAGS);
+	check_op(0, RRC_W, 0, 0x0002, 0, 0x0001, 0, FLAGS);
+	check_op(0, RRC_W, 0, 0x0001, 0, 0x0000, Z | C, FLAGS);
+	check_op(0, RRC_B, 0, 0x0180, 0, 0x0040, 0, FLAGS);
+	check_op(0, RRC_B, 0, 0x0001, C, 0x0080, N | C, FLAGS);
+}
+
+static void test_rra(void)
+{
+	check_op(0, RRA_W, 0, 0x8001, 0, 0xc000, N | C, FLAGS);
+	check_op(0, RRA_W, 0, 0x4000, C, 0x2000, 0, FLAGS);
+	check_op(0, RRA_W, 0, 0x0001, 0, 0x0000, Z | C, FLAGS);
+	check_op(0, RRA_B, 0, 0x0181, 0, 0x00c0, N | C, FLAGS);
+	check_op(0, RRA_B, 0, 0x0002, 0, 0x0001, 0, FLAGS);
+}
+
+/* The overflow flag is undefined after DADD */
+static void test_dadd(void)
+{
+	check_op(0, DADD_W, 0x0001, 0x0099, 0, 0x0100, 0, C | Z | N);
+	check_op(0, DADD_W, 0x0001, 0x9999, 0, 0x0000, Z | C, C | Z | N);
+	check_op(0, DADD_W, 0x0000, 0x1234, C, 0x1235, 0, C | Z | N);
+	check_op(0, DADD_W, 0x4321, 0x4567, 0, 0x8888, N, C | Z | N);
+	check_op(0, DADD_B, 0x0001, 0x0099, 0, 0x0000, Z | C, C | Z | N);
+	check_op(0, DADD_B, 0x0011, 0x0068, C, 0x0080, N, C | Z | N);
+}
+
+/* Flags left by one instruction are consumed by the next, which within
+ * a block may happen before they're ever written back to SR:
+ *
+ *	cmp	r5, r6
+ *	jnc	1f
+ *	mov	#1, r8
+ * 1:	addc	#0, r7
+ *	jmp	$
+ */
+static void test_flags_consumed(void)
+{
+	static const uint16_t code[] = {
+		0x9506, 0x2801, 0x4318, 0x6307, JMP_SELF
+	};
+
+	regs[MSP430_REG_R5] = 0x0010;
+	regs[MSP430_REG_R6] = 0x0020;
+	regs[MSP430_REG_R7] = 0x0005;
+	run_code(code, ARRAY_LEN(code));
+	assert(regs[MSP430_REG_R7] == 0x0006);
+	assert(regs[MSP430_REG_R8] == 0x0001);
+
+	regs[MSP430_REG_R5] = 0x0030;
+	regs[MSP430_REG_R7] = 0x0005;
+	regs[MSP430_REG_R8] = 0;
+	run_code(code, ARRAY_LEN(code));
+	assert(regs[MSP430_REG_R7] == 0x0005);
+	assert(regs[MSP430_REG_R8] == 0x0000);
+}
+
+/* A write to an instruction which hasn't run yet in the same block must
+ * take effect:
+ *
+ *	mov	#0x5326, &0xc008	; incd r6
+ *	inc	r6
+ *	inc	r6
+ *	jmp	$
+ *
+ * The same must hold for a write from the host.
+ */
+static void test_code_write(void)
+{
+	static const uint16_t code[] = {
+		0x40b2, 0x5326, 0xc008, 0x5316, 0x5316, JMP_SELF
+	};
+	static const uint8_t dec[] = {0x16, 0x83};
+	int ret;
+
+	run_code(code, ARRAY_LEN(code));
+	assert(regs[MSP430_REG_R6] == 3);
+
+	/* Run the modified code again, then change it from the host */
+	regs[MSP430_REG_R6] = 0;
+	regs[MSP430_REG_PC] = CODE_ADDR + 6;
+	ret = type->setregs(dev, regs);
+	assert(ret == 0);
+	ret = type->writemem(dev, CODE_ADDR + 6, dec, sizeof(dec));
+	assert(ret == 0);
+
+	if (stepping) {
+		ret = type->ctl(dev, DEVICE_CTL_STEP);
+		assert(ret == 0);
+		ret = type->ctl(dev, DEVICE_CTL_STEP);
+		assert(ret == 0);
+	} else {
+		device_status_t status;
+
+		ret = type->ctl(dev, DEVICE_CTL_RUN);
+		assert(ret == 0);
+		do {
+			status = type->poll(dev);
+		} while (status == DEVICE_STATUS_RUNNING);
+		assert(status == DEVICE_STATUS_HALTED);
+	}
+
+	ret = type->getregs(dev, regs);
+	assert(ret == 0);
+	assert(regs[MSP430_REG_R6] == 0x0001);
+}
+
+/*
+ * Tests for CPUX instructions.
+ */
+
+static void test_20bit(void)
+{
+	if (!is_cpux())
+		return;
+
+	check_op(EXT_A, ADD_B, 0x7ffff, 0x00001, 0, 0x80000, N | V, FLAGS);
+	check_op(EXT_A, ADD_B, 0xfffff, 0x00001, 0, 0x00000, Z | C, FLAGS);
+	check_op(EXT_A, SUB_B, 0x00001, 0x80000, 0, 0x7ffff, V | C, FLAGS);
+	check_op(EXT_A, CMP_B, 0x00001, 0x00000, 0, 0x00000, N, FLAGS);
+	check_op(EXT_A, RRC_B, 0, 0x00001, C, 0x80000, N | C, FLAGS);
+	check_op(EXT_A, RRA_B, 0, 0x80001, 0, 0xc0000, N | C, FLAGS);
+	check_op(EXT_A, DADD_B, 0x00001, 0x99999, 0, 0x00000, Z | C,
+		 C | Z | N);
+
+	/* Word operations on CPUX clear the upper bits */
+	check_op(EXT_W, ADD_W, 0x1ffff, 0x30001, 0, 0x00000, Z | C, FLAGS);
+}
+
+static void test_repeat(void)
+{
+	if (!is_cpux())
+		return;
+
+	/* Flags come from the last repetition */
+	check_op(EXT_RPT(4), RRA_W, 0, 0x8008, 0, 0xf800, N | C, FLAGS);
+	check_op(EXT_RPT(3), ADD_R6_R6, 0, 0x1001, 0, 0x8008, N | V, FLAGS);
+	check_op(EXT_RPT(16), RRA_W, 0, 0x8000, 0, 0xffff, N | C, FLAGS);
+
+	/* The count may be taken from the low four bits of a register */
+	regs[MSP430_REG_R7] = 0xfff3;
+	check_op(EXT_RPT_REG(7), RRA_W, 0, 0x0100, 0, 0x0010, 0, FLAGS);
+}
+
+static void test_carry_ext(void)
+{
+	if (!is_cpux())
+		return;
+
+	/* RRUX shifts in zero, whatever the carry */
+	check_op(EXT_W | EXT_ZC, RRC_W, 0, 0x0002, C, 0x0001, 0, FLAGS);
+	check_op(EXT_RPT(2) | EXT_ZC, RRC_W, 0, 0x0007, C, 0x0001, C,
+		 FLAGS);
+	check_op(EXT_RPT(2), RRC_W, 0, 0x0007, C, 0xc001, N | C, FLAGS);
+
+	/* With ZC set, ADDCX ignores the carry */
+	check_op(EXT_W | EXT_ZC, ADDC_W, 0x0001, 0x0001, C, 0x0002, 0,
+		 FLAGS);
+}
+
+/* Run the code with a read watchpoint in slot 1 and report whether it
+ * stopped the run before reaching the final jump.
+ */
+static int watch_hit(const uint16_t *code, int len, address_t addr)
+{
+	const address_t done = CODE_ADDR + (len - 1) * 2;
+	int ret;
+
+	load_code(code, len);
+	ret = device_setbrk(dev, 1, 1, addr, DEVICE_BPTYPE_READ);
+	assert(ret == 0);
+	run_to_halt(done, NULL);
+	ret = device_setbrk(dev, 1, 0, 0, 0);
+	assert(ret == 0);
+
+	return regs[MSP430_REG_PC] != done;
+}
+
+/* A read above 64k must trigger a watchpoint on its own address, and
+ * not one on the address it would alias to in the low 64k:
+ *
+ *	movx.w	&0x10200, r5
+ *	nop
+ *	jmp	$
+ */
+static void test_watch_20bit(void)
+{
+	static const uint16_t code[] = {
+		0x18c0, 0x4215, 0x0200, 0x4303, JMP_SELF
+	};
+
+	if (stepping || !is_cpux())
+		return;
+
+	assert(!watch_hit(code, ARRAY_LEN(code), 0x00200));
+	assert(watch_hit(code, ARRAY_LEN(code), 0x10200));
+}
+
+/* Run a loop which polls for a timer overflow five times, with a timer
+ * attached, and return the timer count it finished with. Skipping is
+ * checked for before the CPU halts, since that resets the count.
+ *
+ *	mov	#1000, &TACCR0
+ *	mov	#TASSEL_2 | MC_1, &TACTL
+ * 1:	bit	#CCIFG, &TACCTL0
+ *	jz	1b
+ *	bic	#CCIFG, &TACCTL0
+ *	inc	r4
+ *	cmp	#5, r4
+ *	jnz	1b
+ *	jmp	$
+ */
+static int poll_skip;
+
+static void check_poll_skipped(void)
+{
+	const struct sim_device *sim = (const struct sim_device *)dev;
+
+	assert(poll_skip ? sim->poll_skipped > 0 : !sim->poll_skipped);
+}
+
+static uint16_t run_timer_poll(int skip)
+{
+	static const uint16_t code[] = {
+		0x40b2, 0x03e8, 0x0172, 0x40b2, 0x0210, 0x0160,
+		0xb392, 0x0162, 0x27fd, 0xc392, 0x0162, 0x5314,
+		0x9034, 0x0005, 0x23f7, JMP_SELF
+	};
+	union opdb_value val;
+	uint8_t tar[2];
+	int ret;
+
+	simio_cmd("add timer t");
+	poll_skip = skip;
+	val.boolean = skip;
+	opdb_set("sim_skip_polling", &val);
+	load_code(code, ARRAY_LEN(code));
+	run_to_halt(CODE_ADDR + (ARRAY_LEN(code) - 1) * 2,
+		    check_poll_skipped);
+	val.boolean = 0;
+	opdb_set("sim_skip_polling", &val);
+
+	assert(regs[4] == 5);
+
+	ret = type->readmem(dev, 0x170, tar, sizeof(tar));
+	assert(ret == 0);
+
+	return tar[0] | (tar[1] << 8);
+}
+
+/* Skipping a polling loop must leave the program and the timer in the
+ * same state as running every pass of it.
+ */
+static void test_skip_polling(void)
+{
+	address_t slow[DEVICE_NUM_REGS];
+	uint16_t tar;
+
+	if (stepping)
+		return;
+
+	tar = run_timer_poll(0);
+	memcpy(slow, regs, sizeof(regs));
+
+	tear_down();
+	set_up();
+	assert(run_timer_poll(1) == tar);
+	assert(!memcmp(slow, regs, sizeof(regs)));
+}
+
+/* Record the registers, two words of RAM and the timer count after
+ * each step of a loop, then go back through them with reverse steps
+ * and reverse runs. Each must arrive at exactly the state recorded:
+ *
+ *	mov	#TASSEL_2 | MC_2, &TACTL
+ * 1:	inc	r4
+ *	mov	r4, &0x0200
+ *	add	r4, &0x0202
+ *	jmp	1b
+ */
+#define REVERSE_STEPS	40
+#define REVERSE_STORE	(CODE_ADDR + 8)
+
+struct reverse_state {
+	address_t	regs[DEVICE_NUM_REGS];
+	uint8_t		ram[4];
+	uint8_t		tar[2];
+};
+
+static void reverse_get(struct reverse_state *s)
+{
+	int ret;
+
+	ret = type->getregs(dev, s->regs);
+	assert(ret == 0);
+	ret = type->readmem(dev, 0x200, s->ram, sizeof(s->ram));
+	assert(ret == 0);
+	ret = type->readmem(dev, 0x170, s->tar, sizeof(s->tar));
+	assert(ret == 0);
+}
+
+static void reverse_check(const struct reverse_state *expect)
+{
+	struct reverse_state s;
+
+	reverse_get(&s);
+	assert(!memcmp(&s, expect, sizeof(s)));
+}
+
+static void test_reverse(void)
+{
+	static const uint16_t code[] = {
+		0x40b2, 0x0220, 0x0160, 0x5314, 0x4482, 0x0200,
+		0x5482, 0x0202, 0x3ffa, JMP_SELF
+	};
+	static struct reverse_state states[REVERSE_STEPS + 1];
+	union opdb_value val;
+	int ret;
+	int i;
+
+	if (!stepping)
+		return;
+
+	simio_cmd("add timer t");
+	val.numeric = 64;
+	opdb_set("sim_history", &val);
+	load_code(code, ARRAY_LEN(code));
+
+	for (i = 0; i < REVERSE_STEPS; i++) {
+		reverse_get(&states[i]);
+		ret = type->ctl(dev, DEVICE_CTL_STEP);
+		assert(ret == 0);
+	}
+	reverse_get(&states[i]);
+
+	/* Single steps back */
+	for (i = 1; i <= 5; i++) {
+		ret = type->ctl(dev, DEVICE_CTL_REVERSE_STEP);
+		assert(ret == 0);
+		reverse_check(&states[REVERSE_STEPS - i]);
+	}
+
+	/* Back to the last time the store was reached */
+	ret = device_setbrk(dev, 0, 1, REVERSE_STORE, DEVICE_BPTYPE_BREAK);
+	assert(ret == 0);
+	ret = type->ctl(dev, DEVICE_CTL_REVERSE_RUN);
+	assert(ret == 0);
+
+	for (i = REVERSE_STEPS - 6; i >= 0; i--)
+		if (states[i].regs[MSP430_REG_PC] == REVERSE_STORE)
+			break;
+	assert(i > 0);
+	reverse_check(&states[i]);
+
+	/* Back to the start of the history */
+	ret = device_setbrk(dev, 0, 0, 0, 0);
+	assert(ret == 0);
+	ret = type->ctl(dev, DEVICE_CTL_REVERSE_RUN);
+	assert(ret == 1);
+	reverse_check(&states[0]);
+
+	val.numeric = 0;
+	opdb_set("sim_history", &val);
+}
+
+/*
+ * Hooked routines. Each is checked against a real implementation run
+ * on the simulator: without the hook, with it, and with a watchpoint
+ * set so that the hook must fall back to the real routine.
+ */
+
+/* Division built on a 32-bit shift and subtract, and memmove():
+ *
+ * udiv32:
+ *	push	r9
+ *	push	r10
+ *	push	r11
+ *	clr	r10
+ *	clr	r11
+ *	mov	#32, r9
+ * ud_loop:
+ *	rla	r12
+ *	rlc	r13
+ *	rlc	r10
+ *	rlc	r11
+ *	jc	ud_sub
+ *	cmp	r15, r11
+ *	jlo	ud_next
+ *	jne	ud_sub
+ *	cmp	r14, r10
+ *	jlo	ud_next
+ * ud_sub:
+ *	sub	r14, r10
+ *	subc	r15, r11
+ *	bis	#1, r12
+ * ud_next:
+ *	dec	r9
+ *	jnz	ud_loop
+ *	mov	r10, r14
+ *	mov	r11, r15
+ *	pop	r11
+ *	pop	r10
+ *	pop	r9
+ *	ret
+ * sdiv32:
+ *	push	r8
+ *	clr	r8
+ *	tst	r13
+ *	jge	sd_1
+ *	inv	r12
+ *	inv	r13
+ *	add	#1, r12
+ *	addc	#0, r13
+ *	xor	#3, r8
+ * sd_1:
+ *	tst	r15
+ *	jge	sd_2
+ *	inv	r14
+ *	inv	r15
+ *	add	#1, r14
+ *	addc	#0, r15
+ *	xor	#1, r8
+ * sd_2:
+ *	call	#udiv32
+ *	bit	#1, r8
+ *	jz	sd_3
+ *	inv	r12
+ *	inv	r13
+ *	add	#1, r12
+ *	addc	#0, r13
+ * sd_3:
+ *	bit	#2, r8
+ *	jz	sd_4
+ *	inv	r14
+ *	inv	r15
+ *	add	#1, r14
+ *	addc	#0, r15
+ * sd_4:
+ *	pop	r8
+ *	ret
+ * divli:
+ *	call	#sdiv32
+ *	ret
+ * remli:
+ *	call	#sdiv32
+ *	mov	r14, r12
+ *	mov	r15, r13
+ *	ret
+ * divul:
+ *	call	#udiv32
+ *	ret
+ * remul:
+ *	call	#udiv32
+ *	mov	r14, r12
+ *	mov	r15, r13
+ *	ret
+ * divi:
+ *	call	#wide_s
+ *	call	#sdiv32
+ *	ret
+ * remi:
+ *	call	#wide_s
+ *	call	#sdiv32
+ *	mov	r14, r12
+ *	ret
+ * divu:
+ *	call	#wide_u
+ *	call	#udiv32
+ *	ret
+ * remu:
+ *	call	#wide_u
+ *	call	#udiv32
+ *	mov	r14, r12
+ *	ret
+ * wide_s:
+ *	mov	r13, r14
+ *	clr	r15
+ *	tst	r14
+ *	jge	ws_1
+ *	mov	#-1, r15
+ * ws_1:
+ *	clr	r13
+ *	tst	r12
+ *	jge	ws_2
+ *	mov	#-1, r13
+ * ws_2:
+ *	ret
+ * wide_u:
+ *	mov	r13, r14
+ *	clr	r15
+ *	clr	r13
+ *	ret
+ * memmove:
+ *	mov	r12, r15
+ *	cmp	r12, r13
+ *	jhs	mm_fwd
+ *	add	r14, r12
+ *	add	r14, r13
+ * mm_bwd:
+ *	tst	r14
+ *	jz	mm_done
+ *	dec	r12
+ *	dec	r13
+ *	mov.b	@r13, 0(r12)
+ *	dec	r14
+ *	jmp	mm_bwd
+ * mm_fwd:
+ *	tst	r14
+ *	jz	mm_done
+ *	mov.b	@r13+, 0(r12)
+ *	inc	r12
+ *	dec	r14
+ *	jmp	mm_fwd
+ * mm_done:
+ *	mov	r15, r12
+ *	ret
+ */
+#define HOOK_CODE	0xd000
+#define HOOK_MEMMOVE	0xd0e2
+
+/* RAM for the stack and for memmove(), above the CPUX's IO space */
+#define HOOK_RAM	0x2000
+#define HOOK_STACK	0x2800
+
+static const uint16_t hook_code[] = {
+	0x1209, 0x120a, 0x120b, 0x430a, 0x430b, 0x4039, 0x0020, 0x5c0c,
+	0x6d0d, 0x6a0a, 0x6b0b, 0x2c05, 0x9f0b, 0x2806, 0x2002, 0x9e0a,
+	0x2803, 0x8e0a, 0x7f0b, 0xd31c, 0x8319, 0x23f1, 0x4a0e, 0x4b0f,
+	0x413b, 0x413a, 0x4139, 0x4130, 0x1208, 0x4308, 0x930d, 0x3406,
+	0xe33c, 0xe33d, 0x531c, 0x630d, 0xe038, 0x0003, 0x930f, 0x3405,
+	0xe33e, 0xe33f, 0x531e, 0x630f, 0xe318, 0x12b0, 0xd000, 0xb318,
+	0x2404, 0xe33c, 0xe33d, 0x531c, 0x630d, 0xb328, 0x2404, 0xe33e,
+	0xe33f, 0x531e, 0x630f, 0x4138, 0x4130, 0x12b0, 0xd038, 0x4130,
+	0x12b0, 0xd038, 0x4e0c, 0x4f0d, 0x4130, 0x12b0, 0xd000, 0x4130,
+	0x12b0, 0xd000, 0x4e0c, 0x4f0d, 0x4130, 0x12b0, 0xd0c6, 0x12b0,
+	0xd038, 0x4130, 0x12b0, 0xd0c6, 0x12b0, 0xd038, 0x4e0c, 0x4130,
+	0x12b0, 0xd0da, 0x12b0, 0xd000, 0x4130, 0x12b0, 0xd0da, 0x12b0,
+	0xd000, 0x4e0c, 0x4130, 0x4d0e, 0x430f, 0x930e, 0x3401, 0x433f,
+	0x430d, 0x930c, 0x3401, 0x433d, 0x4130, 0x4d0e, 0x430f, 0x430d,
+	0x4130, 0x4c0f, 0x9c0d, 0x2c0a, 0x5e0c, 0x5e0d, 0x930e, 0x240d,
+	0x831c, 0x831d, 0x4dec, 0x0000, 0x831e, 0x3ff8, 0x930e, 0x2405,
+	0x4dfc, 0x0000, 0x531c, 0x831e, 0x3ff9, 0x4f0c, 0x4130
+};
+
+static const struct {
+	const char	*name;
+	address_t	addr;
+	int		is_long;
+} hook_divs[] = {
+	{"__mspabi_divi",	0xd09a, 0},
+	{"__mspabi_divu",	0xd0b0, 0},
+	{"__mspabi_remi",	0xd0a4, 0},
+	{"__mspabi_remu",	0xd0ba, 0},
+	{"__mspabi_divli",	0xd07a, 1},
+	{"__mspabi_divul",	0xd08a, 1},
+	{"__mspabi_remli",	0xd080, 1},
+	{"__mspabi_remul",	0xd090, 1}
+};
+
+/* Operands, as 32-bit values. The 16-bit routines take the low words. */
+static const uint32_t hook_operands[][2] = {
+	{100, 7}, {-100, 7}, {100, -7}, {-100, -7}, {-7, 100},
+	{0xffff8000, -1}, {0x80000000, -1}, {0x7fffffff, 0x8001},
+	{0xfffffff0, 0x80000001}, {0x12345678, 0x9abc}
+};
+
+/* Overlapping moves in both directions, short and longer than a page
+ * of the simulator's memory, and one which doesn't overlap. These are
+ * offsets into HOOK_RAM and a length.
+ */
+static const address_t hook_moves[][3] = {
+	{4, 0, 12}, {0, 6, 12}, {4, 0, 600}, {0, 6, 600}, {16, 0, 8}
+};
+
+/* Run a "sim hook" command */
+static void hook_cmd(const char *fmt, const char *name, address_t addr)
+{
+	char buf[64];
+	char *arg = buf;
+	int ret;
+
+	snprintf(buf, sizeof(buf), fmt, name, addr);
+	device_default = dev;
+	ret = cmd_hook(&arg);
+	device_default = NULL;
+	assert(ret == 0);
+}
+
+/* Call the routine at addr with arguments in R12 to R15, and return the
+ * cycles taken. The results are left in regs[].
+ */
+static uint64_t hook_call(address_t addr, const address_t *args)
+{
+	const uint16_t code[] = {0x12b0, addr, JMP_SELF};
+	struct sim_device *sim = (struct sim_device *)dev;
+	uint64_t start;
+
+	memcpy(regs + MSP430_REG_R12, args, 4 * sizeof(*args));
+	regs[MSP430_REG_SP] = HOOK_STACK;
+	load_code(code, ARRAY_LEN(code));
+	start = simio_time(sim->simio);
+	run_to_halt(CODE_ADDR + 4, NULL);
+
+	return simio_time(sim->simio) - start;
+}
+
+/* Results of a call to one of the routines */
+struct hook_result {
+	uint64_t	cycles;
+	address_t	regs[DEVICE_NUM_REGS];
+	uint8_t		ram[1024];
+};
+
+static void hook_run(address_t addr, const address_t *args,
+		     struct hook_result *r)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < (int)sizeof(r->ram); i++)
+		r->ram[i] = i + (i >> 8);
+
+	ret = type->writemem(dev, HOOK_RAM, r->ram, sizeof(r->ram));
+	assert(ret == 0);
+	r->cycles = hook_call(addr, args);
+	memcpy(r->regs, regs, sizeof(regs));
+	ret = type->readmem(dev, HOOK_RAM, r->ram, sizeof(r->ram));
+	assert(ret == 0);
+}
+
+/* Call a routine with its real code, then hooked with no cost, then
+ * hooked with a watchpoint set. The hooked call must give the same
+ * results as the real one in fewer cycles, and the one with the
+ * watchpoint must run the real code. Only the result registers are
+ * compared, since the real routines use the others as scratch.
+ */
+static void hook_check(const char *name, address_t addr,
+		       const address_t *args, int num_results)
+{
+	struct hook_result real;
+	struct hook_result hooked;
+	struct hook_result watched;
+	const int r = MSP430_REG_R12;
+	int ret;
+
+	hook_run(addr, args, &real);
+
+	hook_cmd("add %s 0x%x", name, addr);
+	hook_cmd("cost %s 0", name, 0);
+	hook_run(addr, args, &hooked);
+
+	/* The stack only grows down from here, so this is never hit */
+	ret = device_setbrk(dev, 1, 1, HOOK_STACK, DEVICE_BPTYPE_WRITE);
+	assert(ret == 0);
+	hook_run(addr, args, &watched);
+	ret = device_setbrk(dev, 1, 0, 0, 0);
+	assert(ret == 0);
+	hook_cmd("del %s", name, 0);
+
+	assert(hooked.cycles < real.cycles);
+	assert(watched.cycles == real.cycles);
+	assert(!memcmp(hooked.regs + r, real.regs + r,
+		       num_results * sizeof(real.regs[0])));
+	assert(!memcmp(watched.regs, real.regs, sizeof(real.regs)));
+	assert(hooked.regs[MSP430_REG_SP] == real.regs[MSP430_REG_SP]);
+	assert(!memcmp(hooked.ram, real.ram, sizeof(real.ram)));
+	assert(!memcmp(watched.ram, real.ram, sizeof(real.ram)));
+}
+
+static void hook_load(void)
+{
+	uint8_t image[sizeof(hook_code)];
+	int ret;
+	int i;
+
+	for (i = 0; i < ARRAY_LEN(hook_code); i++) {
+		image[i * 2] = hook_code[i];
+		image[i * 2 + 1] = hook_code[i] >> 8;
+	}
+
+	ret = type->writemem(dev, HOOK_CODE, image, sizeof(image));
+	assert(ret == 0);
+}
+
+/* Signed and unsigned division with negative operands, and the most
+ * negative value divided by -1, which wraps.
+ */
+static void test_hook_div(void)
+{
+	int i;
+	int j;
+
+	if (stepping)
+		return;
+
+	hook_load();
+
+	for (i = 0; i < ARRAY_LEN(hook_divs); i++)
+		for (j = 0; j < ARRAY_LEN(hook_operands); j++) {
+			const uint32_t a = hook_operands[j][0];
+			const uint32_t b = hook_operands[j][1];
+			const address_t args[4] = {
+				a & 0xffff, hook_divs[i].is_long ?
+				a >> 16 : b & 0xffff,
+				b & 0xffff, b >> 16
+			};
+
+			hook_check(hook_divs[i].name, hook_divs[i].addr,
+				   args, hook_divs[i].is_long ? 2 : 1);
+		}
+}
+
+static void test_hook_memmove(void)
+{
+	int i;
+
+	if (stepping)
+		return;
+
+	hook_load();
+
+	for (i = 0; i < ARRAY_LEN(hook_moves); i++) {
+		const address_t args[4] = {
+			HOOK_RAM + hook_moves[i][0],
+			HOOK_RAM + hook_moves[i][1],
+			hook_moves[i][2], 0
+		};
+
+		hook_check("memmove", HOOK_MEMMOVE, args, 1);
+	}
+}
+
+/*
+ * Trace files. Records are written through the encoder and read back,
+ * to check that they come back as they went in.
+ */
+
+/* Instructions, as the difference from the address of the one before
+ * and the cycles taken. The first two fit the single-byte form.
+ */
+static const struct {
+	int32_t		diff;
+	int		cycles;
+} trace_insns[] = {
+	{2, 1}, {14, 15}, {16, 1}, {2, 16}, {0, 3}, {-2, 1}, {-16, 2},
+	{-0x8000, 4}, {0x4000, 5}, {0x10000, 6}, {-0x18000, 7}
+};
+
+/* Enough instructions to fill several buffers */
+#define TRACE_LONG	500000
+
+static void test_trace(void)
+{
+	struct sim_device *sim = (struct sim_device *)dev;
+	char path[] = "/tmp/test_sim.XXXXXX";
+	struct trace_reader r;
+	address_t pc = CODE_ADDR;
+	address_t last_pc;
+	uint64_t time;
+	int syncs = 0;
+	int ret;
+	int fd;
+	int i;
+
+	if (stepping)
+		return;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	sim->regs[MSP430_REG_PC] = pc;
+	sim->regs[MSP430_REG_R5] = 0;
+	time = simio_time(sim->simio);
+	ret = trace_start(sim, path, TRACE_OPT_REGS);
+	assert(ret == 0);
+
+	for (i = 0; i < (int)ARRAY_LEN(trace_insns); i++) {
+		pc += trace_insns[i].diff;
+		sim->current_insn = pc;
+		sim->regs[MSP430_REG_R4] = i;
+		trace_insn(sim, trace_insns[i].cycles);
+	}
+
+	trace_event(sim, TRACE_IRQ, 9, 6);
+
+	/* Registers change with every instruction, so some buffers end
+	 * between an instruction and its registers.
+	 */
+	for (i = 0; i < TRACE_LONG; i++) {
+		sim->current_insn = CODE_ADDR + (i & 7) * 2;
+		sim->regs[MSP430_REG_R5] = i + 1;
+		trace_insn(sim, 1 + (i & 3));
+	}
+
+	ret = trace_stop(sim);
+	assert(ret == 0);
+
+	ret = trace_open(&r, path);
+	assert(ret == 0);
+	assert(r.options == TRACE_OPT_REGS);
+	assert(trace_read(&r) == TRACE_SYNC);
+	assert(r.pc == CODE_ADDR && r.time == time);
+
+	/* The first instruction gives every register but PC */
+	pc = CODE_ADDR;
+	for (i = 0; i < (int)ARRAY_LEN(trace_insns); i++) {
+		pc += trace_insns[i].diff;
+		assert(trace_read(&r) == TRACE_INSN);
+		assert(r.pc == pc && r.time == time);
+		assert(r.cycles == (uint64_t)trace_insns[i].cycles);
+		assert(r.reg_mask == (i ? 1 << MSP430_REG_R4 : 0xfffe));
+		assert(r.regs[MSP430_REG_R4] == (uint32_t)i);
+		time += trace_insns[i].cycles;
+	}
+
+	assert(trace_read(&r) == TRACE_IRQ);
+	assert(r.irq == 9 && r.cycles == 6 && r.time == time);
+	assert(!r.reg_mask);
+	time += 6;
+
+	/* Each buffer begins with a sync record */
+	last_pc = pc;
+	for (i = 0; i < TRACE_LONG; i++) {
+		int tag = trace_read(&r);
+
+		if (tag == TRACE_SYNC) {
+			assert(r.pc == last_pc && r.time == time);
+			syncs++;
+			tag = trace_read(&r);
+		}
+
+		assert(tag == TRACE_INSN);
+		assert(r.pc == (uint32_t)(CODE_ADDR + (i & 7) * 2));
+		assert(r.time == time && r.cycles == (uint64_t)(1 + (i & 3)));
+		assert(r.reg_mask == 1 << MSP430_REG_R5);
+		assert(r.regs[MSP430_REG_R5] == (uint32_t)i + 1);
+		last_pc = r.pc;
+		time += r.cycles;
+	}
+
+	assert(syncs >= 2);
+	assert(trace_read(&r) == 0);
+	trace_close(&r);
+	unlink(path);
+}
+
+/*
+ * Test runner. Every test is run on both simulators, once by single
+ * steps and once through the block execution loop.
+ */
+
+static void run_test(void (*test)(void), const char *test_name)
+{
+	static const struct device_class *const types[] = {
+		&device_sim, &device_simx
+	};
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		type = types[i >> 1];
+		stepping = i & 1;
+
+		set_up();
+		test();
+		tear_down();
+	}
+
+	printf("  PASS %s\n", test_name);
+}
+
+#define RUN_TEST(test) run_test(test, #test)
+
+int main(int argc, char **argv)
+{
+	union opdb_value quiet;
+
+	(void)argc;
+	(void)argv;
+
+	ctrlc_init();
+	if (stab_init() < 0)
+		return -1;
+
+	quiet.boolean = 1;
+	opdb_set("quiet", &quiet);
+
+	RUN_TEST(test_add);
+	RUN_TEST(test_sub);
+	RUN_TEST(test_cmp);
+	RUN_TEST(test_rrc);
+	RUN_TEST(test_rra);
+	RUN_TEST(test_dadd);
+	RUN_TEST(test_flags_consumed);
+	RUN_TEST(test_code_write);
+	RUN_TEST(test_20bit);
+	RUN_TEST(test_repeat);
+	RUN_TEST(test_carry_ext);
+	RUN_TEST(test_watch_20bit);
+	RUN_TEST(test_skip_polling);
+	RUN_TEST(test_reverse);
+	RUN_TEST(test_hook_div);
+	RUN_TEST(test_hook_memmove);
+	RUN_TEST(test_trace);
+
+	stab_exit();
+	return 0;
+}
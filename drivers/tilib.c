@@ -371,6 +371,10 @@ static int tilib_ctl(device_t dev_base, device_ctl_t op)
 			return -1;
 		}
 		return 0;
+
+	default:
+		printc_err("tilib: unsupported operation\n");
+		return -1;
 	}
 
 	return 0;
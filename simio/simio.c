@@ -16,8 +16,10 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <stdlib.h>
 #include <string.h>
 
+#include "bytes.h"
 #include "output.h"
 #include "output_util.h"
 #include "dis.h"
@@ -41,32 +43,206 @@ static const struct simio_class *const class_db[] = {
 	&simio_console
 };
 
-/* Simulator data. We keep a list of devices on the bus, and the special
- * function registers.
+/* Each simulated MCU has its own IO simulator context. It holds a list
+ * of devices on the bus, and the special function registers.
  *
  * Currently, MCLK and SMCLK are tied together, and ACLK runs at a fixed
  * ratio of 1:256 with MCLK. aclk_counter counts fractional cycles.
+ *
+ * The remaining fields are scheduler data. sim_time counts the system
+ * cycles passed to simio_step(), and clock_total counts the ticks of
+ * each clock. Clocked devices are kept in a heap, ordered by the time
+ * of their next event, and are brought up to date only when that event
+ * is due or when they are accessed. The deadlines are valid for the
+ * clock control bits in cur_status.
+ */
+#define CLOCK_CONTROL_BITS \
+	(MSP430_SR_CPUOFF | MSP430_SR_OSCOFF | MSP430_SR_SCG1)
+
+struct simio_context {
+	struct list_node	device_list;
+	uint8_t			sfr_data[16];
+	int			aclk_counter;
+
+	uint64_t		sim_time;
+	unsigned int		clock_total[SIMIO_NUM_CLOCKS];
+	struct vector		sched_heap;
+	uint16_t		cur_status;
+};
+
+#define SCHED_AT(ctx, i) VECTOR_AT((ctx)->sched_heap, i, struct simio_device *)
+
+static void sched_set(int i, struct simio_device *dev)
+{
+	SCHED_AT(dev->ctx, i) = dev;
+	dev->sched_index = i;
+}
+
+/* Move a device to its correct place in the heap after its deadline
+ * has changed.
+ */
+static void sched_sift(struct simio_device *dev)
+{
+	struct simio_context *ctx = dev->ctx;
+	int i = dev->sched_index;
+
+	while (i > 0) {
+		struct simio_device *parent = SCHED_AT(ctx, (i - 1) / 2);
+
+		if (parent->deadline <= dev->deadline)
+			break;
+
+		sched_set(i, parent);
+		i = (i - 1) / 2;
+	}
+
+	for (;;) {
+		int c = i * 2 + 1;
+
+		if (c >= ctx->sched_heap.size)
+			break;
+		if (c + 1 < ctx->sched_heap.size &&
+		    SCHED_AT(ctx, c + 1)->deadline < SCHED_AT(ctx, c)->deadline)
+			c++;
+		if (SCHED_AT(ctx, c)->deadline >= dev->deadline)
+			break;
+
+		sched_set(i, SCHED_AT(ctx, c));
+		i = c;
+	}
+
+	sched_set(i, dev);
+}
+
+static int sched_insert(struct simio_device *dev)
+{
+	struct simio_context *ctx = dev->ctx;
+
+	if (vector_push(&ctx->sched_heap, &dev, 1) < 0)
+		return -1;
+
+	dev->sched_index = ctx->sched_heap.size - 1;
+	dev->deadline = UINT64_MAX;
+	sched_sift(dev);
+	return 0;
+}
+
+static void sched_remove(struct simio_device *dev)
+{
+	struct simio_context *ctx = dev->ctx;
+	struct simio_device *last = SCHED_AT(ctx, ctx->sched_heap.size - 1);
+
+	vector_pop(&ctx->sched_heap);
+	if (dev != last) {
+		last->sched_index = dev->sched_index;
+		sched_sift(last);
+	}
+
+	dev->sched_index = -1;
+}
+
+/* Run a device's clocks up to the present */
+static void sync_device(struct simio_device *dev)
+{
+	struct simio_context *ctx = dev->ctx;
+	int clocks[SIMIO_NUM_CLOCKS];
+	int elapsed = 0;
+	int i;
+
+	if (!dev->type->step)
+		return;
+
+	for (i = 0; i < SIMIO_NUM_CLOCKS; i++) {
+		clocks[i] = ctx->clock_total[i] - dev->clock_sync[i];
+		dev->clock_sync[i] = ctx->clock_total[i];
+		elapsed |= clocks[i];
+	}
+
+	if (elapsed)
+		dev->type->step(dev, ctx->cur_status, clocks);
+}
+
+/* Recompute the deadline of a device which is up to date */
+static void schedule_device(struct simio_device *dev)
+{
+	struct simio_context *ctx = dev->ctx;
+	int delay = 1;
+
+	if (dev->sched_index < 0)
+		return;
+
+	if (dev->type->next_event)
+		delay = dev->type->next_event(dev, ctx->cur_status);
+
+	if (delay < 1)
+		delay = 1;
+
+	dev->deadline = (delay >= SIMIO_NO_EVENT) ?
+		UINT64_MAX : ctx->sim_time + delay;
+	sched_sift(dev);
+}
+
+static void sync_all(struct simio_context *ctx)
+{
+	struct list_node *n;
+
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next)
+		sync_device((struct simio_device *)n);
+}
+
+/* Deadlines depend on which clocks are running. If they've been
+ * started or stopped, bring all devices up to date and schedule them
+ * again.
  */
-static struct list_node device_list;
-static uint8_t sfr_data[16];
-static int aclk_counter;
+static void set_status(struct simio_context *ctx, uint16_t status_register)
+{
+	struct list_node *n;
+
+	if (!((status_register ^ ctx->cur_status) & CLOCK_CONTROL_BITS)) {
+		ctx->cur_status = status_register;
+		return;
+	}
+
+	sync_all(ctx);
+	ctx->cur_status = status_register;
+
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next)
+		schedule_device((struct simio_device *)n);
+}
 
 static void destroy_device(struct simio_device *dev)
 {
 	list_remove(&dev->node);
+	if (dev->sched_index >= 0)
+		sched_remove(dev);
 	dev->type->destroy(dev);
 }
 
-void simio_init(void)
+struct simio_context *simio_context_new(void)
 {
-	list_init(&device_list);
-	simio_reset();
+	struct simio_context *ctx = calloc(1, sizeof(*ctx));
+
+	if (!ctx) {
+		pr_error("simio: can't allocate memory");
+		return NULL;
+	}
+
+	list_init(&ctx->device_list);
+	vector_init(&ctx->sched_heap, sizeof(struct simio_device *));
+	simio_reset(ctx);
+	return ctx;
 }
 
-void simio_exit(void)
+void simio_context_free(struct simio_context *ctx)
 {
-	while (!LIST_EMPTY(&device_list))
-		destroy_device((struct simio_device *)device_list.next);
+	if (!ctx)
+		return;
+
+	while (!LIST_EMPTY(&ctx->device_list))
+		destroy_device((struct simio_device *)ctx->device_list.next);
+
+	vector_destroy(&ctx->sched_heap);
+	free(ctx);
 }
 
 static const struct simio_class *find_class(const char *name)
@@ -83,11 +259,12 @@ static const struct simio_class *find_class(const char *name)
 	return NULL;
 }
 
-static struct simio_device *find_device(const char *name)
+static struct simio_device *find_device(struct simio_context *ctx,
+					const char *name)
 {
 	struct list_node *n;
 
-	for (n = device_list.next; n != &device_list; n = n->next) {
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next) {
 		struct simio_device *dev = (struct simio_device *)n;
 
 		if (!strcasecmp(dev->name, name))
@@ -97,7 +274,7 @@ static struct simio_device *find_device(const char *name)
 	return NULL;
 }
 
-static int cmd_add(char **arg_text)
+static int cmd_add(struct simio_context *ctx, char **arg_text)
 {
 	const char *type_text = get_arg(arg_text);
 	const char *name_text = get_arg(arg_text);
@@ -110,7 +287,7 @@ static int cmd_add(char **arg_text)
 		return -1;
 	}
 
-	if (find_device(name_text)) {
+	if (find_device(ctx, name_text)) {
 		printc_err("simio add: device name is not unique: %s\n",
 			   name_text);
 		return -1;
@@ -128,7 +305,17 @@ static int cmd_add(char **arg_text)
 		return -1;
 	}
 
-	list_insert(&dev->node, &device_list);
+	dev->ctx = ctx;
+	dev->sched_index = -1;
+	memcpy(dev->clock_sync, ctx->clock_total, sizeof(dev->clock_sync));
+	if (dev->type->step && sched_insert(dev) < 0) {
+		printc_err("simio add: can't allocate memory\n");
+		dev->type->destroy(dev);
+		return -1;
+	}
+
+	schedule_device(dev);
+	list_insert(&dev->node, &ctx->device_list);
 	strncpy(dev->name, name_text, sizeof(dev->name));
 	dev->name[sizeof(dev->name) - 1] = 0;
 
@@ -137,7 +324,7 @@ static int cmd_add(char **arg_text)
 	return 0;
 }
 
-static int cmd_del(char **arg_text)
+static int cmd_del(struct simio_context *ctx, char **arg_text)
 {
 	const char *name_text = get_arg(arg_text);
 	struct simio_device *dev;
@@ -147,7 +334,7 @@ static int cmd_del(char **arg_text)
 		return -1;
 	}
 
-	dev = find_device(name_text);
+	dev = find_device(ctx, name_text);
 	if (!dev) {
 		printc_err("simio del: no such device: %s\n", name_text);
 		return -1;
@@ -158,13 +345,13 @@ static int cmd_del(char **arg_text)
 	return 0;
 }
 
-static int cmd_devices(char **arg_text)
+static int cmd_devices(struct simio_context *ctx, char **arg_text)
 {
 	struct list_node *n;
 
 	(void)arg_text;
 
-	for (n = device_list.next; n != &device_list; n = n->next) {
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next) {
 		struct simio_device *dev = (struct simio_device *)n;
 		int irq = -1;
 
@@ -181,11 +368,12 @@ static int cmd_devices(char **arg_text)
 	return 0;
 }
 
-static int cmd_classes(char **arg_text)
+static int cmd_classes(struct simio_context *ctx, char **arg_text)
 {
 	struct vector v;
 	int i;
 
+	(void)ctx;
 	(void)arg_text;
 
 	vector_init(&v, sizeof(const char *));
@@ -204,11 +392,13 @@ static int cmd_classes(char **arg_text)
 	return 0;
 }
 
-static int cmd_help(char **arg_text)
+static int cmd_help(struct simio_context *ctx, char **arg_text)
 {
 	const char *name = get_arg(arg_text);
 	const struct simio_class *type;
 
+	(void)ctx;
+
 	if (!name) {
 		printc_err("simio help: you must specify a device class\n");
 		return -1;
@@ -224,11 +414,12 @@ static int cmd_help(char **arg_text)
 	return 0;
 }
 
-static int cmd_config(char **arg_text)
+static int cmd_config(struct simio_context *ctx, char **arg_text)
 {
 	const char *name = get_arg(arg_text);
 	const char *param = get_arg(arg_text);
 	struct simio_device *dev;
+	int ret;
 
 	if (!(name && param)) {
 		printc_err("simio config: you must specify a device name and "
@@ -236,7 +427,7 @@ static int cmd_config(char **arg_text)
 		return -1;
 	}
 
-	dev = find_device(name);
+	dev = find_device(ctx, name);
 	if (!dev) {
 		printc_err("simio config: no such device: %s\n", name);
 		return -1;
@@ -248,10 +439,14 @@ static int cmd_config(char **arg_text)
 		return -1;
 	}
 
-	return dev->type->config(dev, param, arg_text);
+	sync_device(dev);
+	ret = dev->type->config(dev, param, arg_text);
+	schedule_device(dev);
+
+	return ret;
 }
 
-static int cmd_info(char **arg_text)
+static int cmd_info(struct simio_context *ctx, char **arg_text)
 {
 	const char *name = get_arg(arg_text);
 	struct simio_device *dev;
@@ -261,7 +456,7 @@ static int cmd_info(char **arg_text)
 		return -1;
 	}
 
-	dev = find_device(name);
+	dev = find_device(ctx, name);
 	if (!dev) {
 		printc_err("simio info: no such device: %s\n", name);
 		return -1;
@@ -272,15 +467,16 @@ static int cmd_info(char **arg_text)
 		return -1;
 	}
 
+	sync_device(dev);
 	return dev->type->info(dev);
 }
 
-int cmd_simio(char **arg_text)
+int simio_command(struct simio_context *ctx, char **arg_text)
 {
 	const char *subcmd = get_arg(arg_text);
 	static const struct {
 		const char *name;
-		int (*func)(char **arg_text);
+		int (*func)(struct simio_context *ctx, char **arg_text);
 	} cmd_table[] = {
 		{"add",		cmd_add},
 		{"del",		cmd_del},
@@ -299,40 +495,46 @@ int cmd_simio(char **arg_text)
 
 	for (i = 0; i < ARRAY_LEN(cmd_table); i++)
 		if (!strcasecmp(cmd_table[i].name, subcmd))
-			return cmd_table[i].func(arg_text);
+			return cmd_table[i].func(ctx, arg_text);
 
 	printc_err("simio: unknown subcommand: %s\n", subcmd);
 	return -1;
 }
 
-void simio_reset(void)
+void simio_reset(struct simio_context *ctx)
 {
 	struct list_node *n;
 
-	memset(sfr_data, 0, sizeof(sfr_data));
-	aclk_counter = 0;
+	sync_all(ctx);
+	memset(ctx->sfr_data, 0, sizeof(ctx->sfr_data));
+	ctx->aclk_counter = 0;
 
-	for (n = device_list.next; n != &device_list; n = n->next) {
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next) {
 		struct simio_device *dev = (struct simio_device *)n;
 		const struct simio_class *type = dev->type;
 
 		if (type->reset)
 			type->reset(dev);
+
+		schedule_device(dev);
 	}
 }
 
-#define IO_REQUEST_FUNC(name, method, datatype) \
-int name(address_t addr, datatype data) { \
+#define IO_REQUEST_FUNC(name, method, datatype, is_read) \
+int name(struct simio_context *ctx, address_t addr, datatype data) { \
 	struct list_node *n; \
 	int ret = 1; \
 \
-	for (n = device_list.next; n != &device_list; n = n->next) { \
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next) { \
 		struct simio_device *dev = (struct simio_device *)n; \
 		const struct simio_class *type = dev->type; \
 \
 		if (type->method) { \
 			int r = type->method(dev, addr, data); \
 \
+			if (r != 1 && !(is_read && type->read_stable && \
+					type->read_stable(dev, addr))) \
+				schedule_device(dev); \
 			if (r < ret) \
 				ret = r; \
 		} \
@@ -340,70 +542,83 @@ int name(address_t addr, datatype data) { \
 \
 	return ret; \
 }
-#define IO_REQUEST_FUNC_S(name, method, datatype) \
-	static IO_REQUEST_FUNC(name, method, datatype)
+#define IO_REQUEST_FUNC_S(name, method, datatype, is_read) \
+	static IO_REQUEST_FUNC(name, method, datatype, is_read)
+
+IO_REQUEST_FUNC_S(simio_write_device, write, uint16_t, 0)
+IO_REQUEST_FUNC_S(simio_read_device, read, uint16_t *, 1)
+IO_REQUEST_FUNC_S(simio_write_b_device, write_b, uint8_t, 0)
+IO_REQUEST_FUNC_S(simio_read_b_device, read_b, uint8_t *, 1)
 
-IO_REQUEST_FUNC(simio_write, write, uint16_t)
-IO_REQUEST_FUNC(simio_read_device, read, uint16_t *)
-IO_REQUEST_FUNC_S(simio_write_b_device, write_b, uint8_t)
-IO_REQUEST_FUNC_S(simio_read_b_device, read_b, uint8_t *)
+/* Devices must be brought up to date before their registers or the SFRs
+ * are accessed, and are rescheduled if they handle the request. Reading
+ * a stable register can't change a device's next event.
+ */
+int simio_write(struct simio_context *ctx, address_t addr, uint16_t data)
+{
+	sync_all(ctx);
+	return simio_write_device(ctx, addr, data);
+}
 
-int simio_read(address_t addr, uint16_t *data)
+int simio_read(struct simio_context *ctx, address_t addr, uint16_t *data)
 {
+	sync_all(ctx);
 	addr &= ~1;
 	if (addr < 16) {
-		*data = ((uint16_t)sfr_data[addr]) |
-			(((uint16_t)sfr_data[addr + 1]) << 8);
+		*data = ((uint16_t)ctx->sfr_data[addr]) |
+			(((uint16_t)ctx->sfr_data[addr + 1]) << 8);
 		return 0;
 
 	} else if (addr >= 0x100 && addr < 0x110) {
 		/* most MSPs map SFR at 0x100 */
-		*data = ((uint16_t)sfr_data[addr - 0x100]) |
-			(((uint16_t)sfr_data[addr - 0x100 + 1]) << 8);
+		*data = ((uint16_t)ctx->sfr_data[addr - 0x100]) |
+			(((uint16_t)ctx->sfr_data[addr - 0x100 + 1]) << 8);
 		return 0;
 	}
 
 	*data = 0;
-	return simio_read_device(addr, data);
+	return simio_read_device(ctx, addr, data);
 }
 
-int simio_write_b(address_t addr, uint8_t data)
+int simio_write_b(struct simio_context *ctx, address_t addr, uint8_t data)
 {
+	sync_all(ctx);
 	if (addr < 16) {
-		sfr_data[addr] = data;
+		ctx->sfr_data[addr] = data;
 		return 0;
 
 	} else if (addr >= 0x100 && addr < 0x110) {
 		/* most MSPs map SFR at 0x100 */
-		sfr_data[addr - 0x100] = data;
+		ctx->sfr_data[addr - 0x100] = data;
 		return 0;
 	}
 
-	return simio_write_b_device(addr, data);
+	return simio_write_b_device(ctx, addr, data);
 }
 
-int simio_read_b(address_t addr, uint8_t *data)
+int simio_read_b(struct simio_context *ctx, address_t addr, uint8_t *data)
 {
+	sync_all(ctx);
 	if (addr < 16) {
-		*data = sfr_data[addr];
+		*data = ctx->sfr_data[addr];
 		return 0;
 
 	} else if (addr >= 0x100 && addr < 0x110) {
 		/* most MSPs map SFR at 0x100 */
-		*data = sfr_data[addr - 0x100];
+		*data = ctx->sfr_data[addr - 0x100];
 		return 0;
 	}
 
 	*data = 0;
-	return simio_read_b_device(addr, data);
+	return simio_read_b_device(ctx, addr, data);
 }
 
-int simio_check_interrupt(void)
+int simio_check_interrupt(struct simio_context *ctx)
 {
 	int irq = -1;
 	struct list_node *n;
 
-	for (n = device_list.next; n != &device_list; n = n->next) {
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next) {
 		struct simio_device *dev = (struct simio_device *)n;
 		const struct simio_class *type = dev->type;
 
@@ -418,31 +633,81 @@ int simio_check_interrupt(void)
 	return irq;
 }
 
-void simio_ack_interrupt(int irq)
+void simio_ack_interrupt(struct simio_context *ctx, int irq)
 {
 	struct list_node *n;
 
-	for (n = device_list.next; n != &device_list; n = n->next) {
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next) {
 		struct simio_device *dev = (struct simio_device *)n;
 		const struct simio_class *type = dev->type;
 
-		if (type->ack_interrupt)
+		if (type->ack_interrupt) {
+			sync_device(dev);
 			type->ack_interrupt(dev, irq);
+			schedule_device(dev);
+		}
 	}
 }
 
-void simio_step(uint16_t status_register, int cycles)
+int simio_next_event(struct simio_context *ctx, uint16_t status_register)
+{
+	const struct simio_device *next;
+
+	set_status(ctx, status_register);
+	if (!ctx->sched_heap.size)
+		return SIMIO_NO_EVENT;
+
+	next = SCHED_AT(ctx, 0);
+	if (next->deadline <= ctx->sim_time)
+		return 1;
+	if (next->deadline - ctx->sim_time >= SIMIO_NO_EVENT)
+		return SIMIO_NO_EVENT;
+
+	return next->deadline - ctx->sim_time;
+}
+
+uint64_t simio_time(const struct simio_context *ctx)
+{
+	return ctx->sim_time;
+}
+
+int simio_read_stable(struct simio_context *ctx, address_t addr)
 {
-	int clocks[SIMIO_NUM_CLOCKS] = {0};
 	struct list_node *n;
 
-	aclk_counter += cycles;
+	/* SFRs are changed only by devices and by the CPU */
+	if (addr < 16 || (addr >= 0x100 && addr < 0x110))
+		return 1;
+
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next) {
+		struct simio_device *dev = (struct simio_device *)n;
+		const struct simio_class *type = dev->type;
+
+		if (type->read_stable) {
+			if (!type->read_stable(dev, addr))
+				return 0;
+		} else if (type->read || type->read_b) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+void simio_step(struct simio_context *ctx, uint16_t status_register,
+		int cycles)
+{
+	int clocks[SIMIO_NUM_CLOCKS] = {0};
+	int i;
+
+	set_status(ctx, status_register);
+	ctx->aclk_counter += cycles;
 
 	clocks[SIMIO_MCLK] = cycles;
 	clocks[SIMIO_SMCLK] = cycles;
-	clocks[SIMIO_ACLK] = aclk_counter >> 8;
+	clocks[SIMIO_ACLK] = ctx->aclk_counter >> 8;
 
-	aclk_counter &= 0xff;
+	ctx->aclk_counter &= 0xff;
 
 	if (status_register & MSP430_SR_CPUOFF)
 		clocks[SIMIO_MCLK] = 0;
@@ -453,27 +718,395 @@ void simio_step(uint16_t status_register, int cycles)
 	if (status_register & MSP430_SR_OSCOFF)
 		clocks[SIMIO_ACLK] = 0;
 
-	for (n = device_list.next; n != &device_list; n = n->next) {
-		struct simio_device *dev = (struct simio_device *)n;
-		const struct simio_class *type = dev->type;
+	for (i = 0; i < SIMIO_NUM_CLOCKS; i++)
+		ctx->clock_total[i] += clocks[i];
+	ctx->sim_time += cycles;
+
+	/* Step only the devices whose events are due */
+	while (ctx->sched_heap.size &&
+	       SCHED_AT(ctx, 0)->deadline <= ctx->sim_time) {
+		struct simio_device *dev = SCHED_AT(ctx, 0);
+
+		sync_device(dev);
+		schedule_device(dev);
+	}
+}
 
-		if (type->step)
-			type->step(dev, status_register, clocks);
+int simio_clock_cycles(struct simio_context *ctx, simio_clock_t clock,
+		       uint16_t status_register, int ticks)
+{
+	int64_t cycles = ticks;
+
+	switch (clock) {
+	case SIMIO_MCLK:
+		if (status_register & MSP430_SR_CPUOFF)
+			return SIMIO_NO_EVENT;
+		break;
+
+	case SIMIO_SMCLK:
+		if (status_register & MSP430_SR_SCG1)
+			return SIMIO_NO_EVENT;
+		break;
+
+	case SIMIO_ACLK:
+		if (status_register & MSP430_SR_OSCOFF)
+			return SIMIO_NO_EVENT;
+		cycles = cycles * 256 - ctx->aclk_counter;
+		break;
+
+	default:
+		return SIMIO_NO_EVENT;
 	}
+
+	if (cycles < 1)
+		return 1;
+	if (cycles >= SIMIO_NO_EVENT)
+		return SIMIO_NO_EVENT;
+
+	return cycles;
 }
 
-uint8_t simio_sfr_get(address_t which)
+uint8_t simio_sfr_get(struct simio_context *ctx, address_t which)
 {
-	if (which > sizeof(sfr_data))
+	if (which > sizeof(ctx->sfr_data))
 		return 0;
 
-	return sfr_data[which];
+	return ctx->sfr_data[which];
+}
+
+void simio_sfr_modify(struct simio_context *ctx, address_t which,
+		      uint8_t mask, uint8_t bits)
+{
+	if (which > sizeof(ctx->sfr_data))
+		return;
+
+	ctx->sfr_data[which] = (ctx->sfr_data[which] & ~mask) | bits;
+}
+
+/* Snapshots. Each device's state is kept along with its name and class,
+ * which must match when the snapshot is restored.
+ */
+struct saved_device {
+	char				name[64];
+	const struct simio_class	*type;
+	void				*data;
+	size_t				len;
+};
+
+struct simio_snapshot {
+	uint64_t			sim_time;
+	unsigned int			clock_total[SIMIO_NUM_CLOCKS];
+	uint16_t			cur_status;
+	int				aclk_counter;
+	uint8_t				sfr_data[16];
+
+	int				num_devices;
+	struct saved_device		*devices;
+};
+
+struct simio_snapshot *simio_snapshot_save(struct simio_context *ctx)
+{
+	struct simio_snapshot *snap = malloc(sizeof(*snap));
+	struct list_node *n;
+	int count = 0;
+
+	if (!snap) {
+		pr_error("simio: can't allocate memory for snapshot");
+		return NULL;
+	}
+
+	memset(snap, 0, sizeof(*snap));
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next)
+		count++;
+
+	snap->devices = calloc(count ? count : 1, sizeof(snap->devices[0]));
+	if (!snap->devices) {
+		pr_error("simio: can't allocate memory for snapshot");
+		free(snap);
+		return NULL;
+	}
+
+	sync_all(ctx);
+
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next) {
+		struct simio_device *dev = (struct simio_device *)n;
+		struct saved_device *s = &snap->devices[snap->num_devices];
+
+		if (!dev->type->save) {
+			printc_err("simio: device \"%s\" doesn't support "
+				   "snapshots\n", dev->name);
+			simio_snapshot_free(snap);
+			return NULL;
+		}
+
+		s->data = dev->type->save(dev, &s->len);
+		if (!s->data) {
+			simio_snapshot_free(snap);
+			return NULL;
+		}
+
+		memcpy(s->name, dev->name, sizeof(s->name));
+		s->type = dev->type;
+		snap->num_devices++;
+	}
+
+	snap->sim_time = ctx->sim_time;
+	memcpy(snap->clock_total, ctx->clock_total, sizeof(snap->clock_total));
+	snap->cur_status = ctx->cur_status;
+	snap->aclk_counter = ctx->aclk_counter;
+	memcpy(snap->sfr_data, ctx->sfr_data, sizeof(snap->sfr_data));
+
+	return snap;
+}
+
+int simio_snapshot_restore(struct simio_context *ctx,
+			   const struct simio_snapshot *snap)
+{
+	struct simio_snapshot *undo;
+	struct list_node *n;
+	int count = 0;
+	int ret = 0;
+	int i;
+
+	/* Check that the same devices are attached before touching any */
+	for (n = ctx->device_list.next; n != &ctx->device_list; n = n->next)
+		count++;
+
+	for (i = 0; i < snap->num_devices; i++) {
+		const struct saved_device *s = &snap->devices[i];
+		const struct simio_device *dev = find_device(ctx, s->name);
+
+		if (!dev || dev->type != s->type) {
+			printc_err("simio: device \"%s\" has changed since "
+				   "the snapshot was taken\n", s->name);
+			return -1;
+		}
+	}
+
+	if (count != snap->num_devices) {
+		printc_err("simio: devices have been added since the "
+			   "snapshot was taken\n");
+		return -1;
+	}
+
+	/* A device may still refuse its state, so keep the current state
+	 * to put back if it does.
+	 */
+	undo = simio_snapshot_save(ctx);
+	if (!undo)
+		return -1;
+
+	ctx->sim_time = snap->sim_time;
+	memcpy(ctx->clock_total, snap->clock_total, sizeof(ctx->clock_total));
+	ctx->cur_status = snap->cur_status;
+	ctx->aclk_counter = snap->aclk_counter;
+	memcpy(ctx->sfr_data, snap->sfr_data, sizeof(ctx->sfr_data));
+
+	for (i = 0; i < snap->num_devices; i++) {
+		const struct saved_device *s = &snap->devices[i];
+		struct simio_device *dev = find_device(ctx, s->name);
+
+		if (dev->type->restore(dev, s->data, s->len) < 0)
+			ret = -1;
+
+		memcpy(dev->clock_sync, ctx->clock_total,
+		       sizeof(dev->clock_sync));
+		schedule_device(dev);
+	}
+
+	if (ret < 0)
+		simio_snapshot_restore(ctx, undo);
+
+	simio_snapshot_free(undo);
+	return ret;
 }
 
-void simio_sfr_modify(address_t which, uint8_t mask, uint8_t bits)
+void simio_snapshot_free(struct simio_snapshot *snap)
 {
-	if (which > sizeof(sfr_data))
+	int i;
+
+	if (!snap)
 		return;
 
-	sfr_data[which] = (sfr_data[which] & ~mask) | bits;
+	for (i = 0; i < snap->num_devices; i++)
+		free(snap->devices[i].data);
+
+	free(snap->devices);
+	free(snap);
+}
+
+/* Encoded snapshots begin with the global state:
+ *
+ *	sim_time (8 bytes)
+ *	clock_total (4 bytes per clock)
+ *	cur_status (4 bytes)
+ *	aclk_counter (4 bytes)
+ *	sfr_data (16 bytes)
+ *	number of devices (4 bytes)
+ *
+ * All values are little-endian. Then, for each device, padded to a
+ * multiple of 4 bytes:
+ *
+ *	name (64 bytes, nul-terminated)
+ *	class name (32 bytes, nul-terminated)
+ *	length of state (4 bytes)
+ *	state
+ */
+#define SNAP_GLOBAL_LEN		(36 + SIMIO_NUM_CLOCKS * 4)
+#define SNAP_CLASS_LEN		32
+#define SNAP_DEVICE_LEN		(64 + SNAP_CLASS_LEN + 4)
+#define SNAP_ALIGN(n)		(((n) + 3) & ~3)
+
+void *simio_snapshot_encode(const struct simio_snapshot *snap, size_t *len)
+{
+	size_t total = SNAP_GLOBAL_LEN;
+	uint8_t *data;
+	uint8_t *p;
+	int i;
+
+	for (i = 0; i < snap->num_devices; i++)
+		total += SNAP_ALIGN(SNAP_DEVICE_LEN + snap->devices[i].len);
+
+	data = calloc(1, total);
+	if (!data) {
+		pr_error("simio: can't allocate memory for snapshot");
+		return NULL;
+	}
+
+	p = data;
+	w32le(p, snap->sim_time);
+	w32le(p + 4, snap->sim_time >> 32);
+	p += 8;
+	for (i = 0; i < SIMIO_NUM_CLOCKS; i++) {
+		w32le(p, snap->clock_total[i]);
+		p += 4;
+	}
+	w32le(p, snap->cur_status);
+	w32le(p + 4, snap->aclk_counter);
+	memcpy(p + 8, snap->sfr_data, sizeof(snap->sfr_data));
+	w32le(p + 24, snap->num_devices);
+	p += 28;
+
+	for (i = 0; i < snap->num_devices; i++) {
+		const struct saved_device *s = &snap->devices[i];
+
+		strncpy((char *)p, s->name, 63);
+		strncpy((char *)p + 64, s->type->name, SNAP_CLASS_LEN - 1);
+		w32le(p + 64 + SNAP_CLASS_LEN, s->len);
+		memcpy(p + SNAP_DEVICE_LEN, s->data, s->len);
+		p += SNAP_ALIGN(SNAP_DEVICE_LEN + s->len);
+	}
+
+	*len = total;
+	return data;
+}
+
+struct simio_snapshot *simio_snapshot_decode(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = p + len;
+	struct simio_snapshot *snap;
+	uint32_t count;
+	int i;
+
+	if (len < SNAP_GLOBAL_LEN)
+		goto bad;
+
+	count = r32le(p + 8 + SIMIO_NUM_CLOCKS * 4 + 24);
+	if (count > len / SNAP_DEVICE_LEN)
+		goto bad;
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap) {
+		pr_error("simio: can't allocate memory for snapshot");
+		return NULL;
+	}
+
+	snap->devices = calloc(count ? count : 1, sizeof(snap->devices[0]));
+	if (!snap->devices) {
+		pr_error("simio: can't allocate memory for snapshot");
+		free(snap);
+		return NULL;
+	}
+
+	snap->sim_time = r32le(p) | ((uint64_t)r32le(p + 4) << 32);
+	p += 8;
+	for (i = 0; i < SIMIO_NUM_CLOCKS; i++) {
+		snap->clock_total[i] = r32le(p);
+		p += 4;
+	}
+	snap->cur_status = r32le(p);
+	snap->aclk_counter = r32le(p + 4);
+	memcpy(snap->sfr_data, p + 8, sizeof(snap->sfr_data));
+	p += 28;
+
+	for (i = 0; i < (int)count; i++) {
+		struct saved_device *s = &snap->devices[i];
+		char class_name[SNAP_CLASS_LEN];
+		uint32_t n;
+
+		if (end - p < SNAP_DEVICE_LEN)
+			goto bad_free;
+
+		n = r32le(p + 64 + SNAP_CLASS_LEN);
+		if (end - p - SNAP_DEVICE_LEN < n)
+			goto bad_free;
+
+		memcpy(s->name, p, 63);
+		memcpy(class_name, p + 64, SNAP_CLASS_LEN - 1);
+		class_name[SNAP_CLASS_LEN - 1] = 0;
+
+		s->type = find_class(class_name);
+		if (!s->type) {
+			printc_err("simio: unknown device class in snapshot: "
+				   "%s\n", class_name);
+			simio_snapshot_free(snap);
+			return NULL;
+		}
+
+		s->data = malloc(n ? n : 1);
+		if (!s->data) {
+			pr_error("simio: can't allocate memory for snapshot");
+			simio_snapshot_free(snap);
+			return NULL;
+		}
+
+		memcpy(s->data, p + SNAP_DEVICE_LEN, n);
+		s->len = n;
+		snap->num_devices++;
+		p += SNAP_ALIGN(SNAP_DEVICE_LEN + n);
+	}
+
+	return snap;
+
+bad_free:
+	simio_snapshot_free(snap);
+bad:
+	printc_err("simio: snapshot data is corrupt\n");
+	return NULL;
+}
+
+void *simio_state_alloc(uint32_t version, size_t len, size_t *total,
+			uint8_t **fields)
+{
+	uint8_t *data = malloc(4 + len);
+
+	if (!data) {
+		pr_error("simio: can't allocate memory for snapshot");
+		return NULL;
+	}
+
+	w32le(data, version);
+	*total = 4 + len;
+	*fields = data + 4;
+	return data;
+}
+
+const uint8_t *simio_state_fields(const void *data, size_t len,
+				  uint32_t version, size_t expect)
+{
+	if (len != 4 + expect || r32le(data) != version)
+		return NULL;
+
+	return (const uint8_t *)data + 4;
 }
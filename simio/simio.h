@@ -19,13 +19,11 @@
 #ifndef SIMIO_H_
 #define SIMIO_H_
 
-/* Initialize the IO simulator. */
-void simio_init(void);
+struct simio_context;
 
-/* Clean up allocated resources. */
-void simio_exit(void);
-
-/* This file gives the prototype for the "simio" command function. */
-int cmd_simio(char **arg_text);
+/* This file gives the prototype for the "simio" command function, which
+ * operates on the given IO simulator context.
+ */
+int simio_command(struct simio_context *ctx, char **arg_text);
 
 #endif
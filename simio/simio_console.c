@@ -24,6 +24,7 @@
 #include "simio_console.h"
 #include "expr.h"
 #include "output.h"
+#include "bytes.h"
 
 
 struct console {
@@ -170,7 +171,7 @@ static int console_write_b(struct simio_device *dev,
 		c->buffer[c->buffer_offset++] = data;
 		if (data == '\n' || c->buffer_offset == sizeof c->buffer)
 		{
-			printc("%.*s", c->buffer_offset, c->buffer);
+			program_output(0, c->buffer, c->buffer_offset);
 			c->buffer_offset = 0;
 		}
 	}
@@ -178,6 +179,53 @@ static int console_write_b(struct simio_device *dev,
 	return 1;
 }
 
+/* Snapshots hold the buffered text and, for file output, the position
+ * in the file, so that restoring works like a reset. Saved state is the
+ * buffer, then the number of bytes used in it (2 bytes) and the file
+ * position (4 bytes).
+ */
+#define CONSOLE_STATE_VERSION	1
+#define CONSOLE_STATE_LEN	(sizeof(((struct console *)0)->buffer) + 6)
+
+static void *console_save(struct simio_device *dev, size_t *len)
+{
+	struct console *c = (struct console *)dev;
+	const size_t buf_len = sizeof(c->buffer);
+	uint8_t *p;
+	void *data = simio_state_alloc(CONSOLE_STATE_VERSION,
+				       CONSOLE_STATE_LEN, len, &p);
+
+	if (!data)
+		return NULL;
+
+	memcpy(p, c->buffer, buf_len);
+	w16le(p + buf_len, c->buffer_offset);
+	w32le(p + buf_len + 2, c->file ? ftell(c->file) : 0);
+	return data;
+}
+
+static int console_restore(struct simio_device *dev,
+			   const void *data, size_t len)
+{
+	struct console *c = (struct console *)dev;
+	const size_t buf_len = sizeof(c->buffer);
+	const uint8_t *p = simio_state_fields(data, len, CONSOLE_STATE_VERSION,
+					      CONSOLE_STATE_LEN);
+
+	if (!p || r16le(p + buf_len) >= buf_len) {
+		printc_err("console: snapshot doesn't match device\n");
+		return -1;
+	}
+
+	memcpy(c->buffer, p, buf_len);
+	c->buffer_offset = r16le(p + buf_len);
+
+	if (c->file != NULL)
+		fseek(c->file, r32le(p + buf_len + 2), SEEK_SET);
+
+	return 0;
+}
+
 const struct simio_class simio_console = {
 	.name = "console",
 	.help =
@@ -196,4 +244,6 @@ const struct simio_class simio_console = {
 	.config			= console_config,
 	.info			= console_info,
 	.write_b		= console_write_b,
+	.save			= console_save,
+	.restore		= console_restore
 };
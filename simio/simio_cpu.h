@@ -22,35 +22,48 @@
 /* This file describes the interface between the CPU simulator and the IO
  * simulator. It gives prototypes for functions which should be periodically
  * called by the CPU simulator.
+ *
+ * Each simulated MCU has its own IO simulator context, which is passed
+ * to every function. Separate contexts share no state, and may be used
+ * concurrently from different threads. Output isn't serialized, though,
+ * and the output capture is shared by the whole process (see output.h).
  */
 
 #include <stdint.h>
 #include "util.h"
 
+struct simio_context;
+
+/* Create and destroy a context. A new context has no devices attached.
+ * Destroying it also destroys its devices.
+ */
+struct simio_context *simio_context_new(void);
+void simio_context_free(struct simio_context *ctx);
+
 /* This function should be called when the CPU is reset, to also reset
  * the IO simulator.
  */
-void simio_reset(void);
+void simio_reset(struct simio_context *ctx);
 
 /* These functions should be called to perform programmed IO requests. A
  * return value of 0 indicates success, 1 is an unhandled request, and -1
  * is an error which should cause execution to stop.
  */
-int simio_write(address_t addr, uint16_t data);
-int simio_read(address_t addr, uint16_t *data);
-int simio_write_b(address_t addr, uint8_t data);
-int simio_read_b(address_t addr, uint8_t *data);
+int simio_write(struct simio_context *ctx, address_t addr, uint16_t data);
+int simio_read(struct simio_context *ctx, address_t addr, uint16_t *data);
+int simio_write_b(struct simio_context *ctx, address_t addr, uint8_t data);
+int simio_read_b(struct simio_context *ctx, address_t addr, uint8_t *data);
 
 /* Check for an interrupt before executing an instruction. It returns -1 if
  * no interrupt is pending, otherwise the number of the highest priority
  * pending interrupt.
  */
-int simio_check_interrupt(void);
+int simio_check_interrupt(struct simio_context *ctx);
 
 /* When the CPU begins to handle an interrupt, it needs to notify the IO
  * simulation. Some interrupt flags are cleared automatically when handled.
  */
-void simio_ack_interrupt(int irq);
+void simio_ack_interrupt(struct simio_context *ctx, int irq);
 
 /* This should be called after executing an instruction to advance the system
  * clocks.
@@ -58,6 +71,47 @@ void simio_ack_interrupt(int irq);
  * The status_register value should be the value of SR _before_ the
  * instruction was executed.
  */
-void simio_step(uint16_t status_register, int cycles);
+void simio_step(struct simio_context *ctx, uint16_t status_register,
+		int cycles);
+
+/* Return the number of MCLK cycles which may be passed to simio_step()
+ * before any peripheral could change its interrupt state, assuming no
+ * programmed IO happens in the meantime. The CPU simulator may execute
+ * this many cycles worth of instructions before checking for interrupts
+ * and stepping the IO simulator. SIMIO_NO_EVENT is returned if nothing
+ * is pending.
+ */
+#define SIMIO_NO_EVENT		0x7fffffff
+
+int simio_next_event(struct simio_context *ctx, uint16_t status_register);
+
+/* Return non-zero if the given IO address may be read any number of
+ * times without side effects, and gives the same value until the event
+ * reported by simio_next_event(). The CPU simulator uses this to skip
+ * ahead through loops which poll a register.
+ */
+int simio_read_stable(struct simio_context *ctx, address_t addr);
+
+/* Return the number of system cycles passed to simio_step() so far. */
+uint64_t simio_time(const struct simio_context *ctx);
+
+/* Snapshots of the complete state of the IO simulator. A snapshot may be
+ * restored any number of times, provided that the same devices are still
+ * attached. If any device refuses its saved state, nothing is changed.
+ */
+struct simio_snapshot;
+
+struct simio_snapshot *simio_snapshot_save(struct simio_context *ctx);
+int simio_snapshot_restore(struct simio_context *ctx,
+			   const struct simio_snapshot *snap);
+void simio_snapshot_free(struct simio_snapshot *snap);
+
+/* Convert a snapshot to and from a flat block of memory, for storage in
+ * a file. Device state is stored as the devices save it, so the result
+ * can only be decoded on a host with the same data layout. The encoded
+ * block is allocated with malloc().
+ */
+void *simio_snapshot_encode(const struct simio_snapshot *snap, size_t *len);
+struct simio_snapshot *simio_snapshot_decode(const void *data, size_t len);
 
 #endif
@@ -19,9 +19,11 @@
 #ifndef SIMIO_DEVICE_H_
 #define SIMIO_DEVICE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include "util.h"
 #include "list.h"
+#include "simio_cpu.h"
 
 /* Each system clock has a unique index. After each instruction, step()
  * is invoked on each device with an array of clock transition counts.
@@ -43,22 +45,41 @@ typedef enum {
 #define SIMIO_IE2		0x02
 #define SIMIO_IFG2		0x03
 
-uint8_t simio_sfr_get(address_t which);
-void simio_sfr_modify(address_t which, uint8_t mask, uint8_t bits);
+uint8_t simio_sfr_get(struct simio_context *ctx, address_t which);
+void simio_sfr_modify(struct simio_context *ctx, address_t which,
+		      uint8_t mask, uint8_t bits);
+
+/* Return the number of system cycles which will pass before the given
+ * clock has ticked the given number of times, or SIMIO_NO_EVENT if the
+ * clock is stopped.
+ */
+int simio_clock_cycles(struct simio_context *ctx, simio_clock_t clock,
+		       uint16_t status_register, int ticks);
 
 struct simio_class;
 
 /* Device base class.
  *
- * The node and name fields will be filled out by the IO simulator - they're
- * used for keeping track of the device list. The node member MUST be the
- * first in the struct.
+ * The node, name and ctx fields will be filled out by the IO simulator -
+ * they're used for keeping track of the device list, and ctx gives the
+ * context the device is attached to. The node member MUST be the first
+ * in the struct.
+ *
+ * The remaining fields are used by the IO simulator to schedule calls to
+ * step(). A device is stepped only when its next event is due, or before
+ * it is accessed. clock_sync holds the clock counters as of the last
+ * step.
  */
 struct simio_device {
 	struct list_node		node;
 
 	char				name[64];
 	const struct simio_class	*type;
+	struct simio_context		*ctx;
+
+	int				sched_index;
+	uint64_t			deadline;
+	unsigned int			clock_sync[SIMIO_NUM_CLOCKS];
 };
 
 struct simio_class {
@@ -105,6 +126,46 @@ struct simio_class {
 	 */
 	void (*step)(struct simio_device *dev,
 		     uint16_t status_register, const int *clocks);
+
+	/* Return the number of system cycles until the device could next
+	 * change its interrupt state, or SIMIO_NO_EVENT if nothing will
+	 * happen until it's next accessed. Devices which implement step()
+	 * but not this method are stepped after every instruction.
+	 */
+	int (*next_event)(struct simio_device *dev,
+			  uint16_t status_register);
+
+	/* Return non-zero if reading the given address has no side
+	 * effects, and gives the same value until the device's next
+	 * event. Devices which handle reads but don't implement this
+	 * method are assumed to have no stable registers.
+	 */
+	int (*read_stable)(struct simio_device *dev, address_t addr);
+
+	/* Snapshot support. save() returns the device's state in a single
+	 * block of memory, allocated with malloc(), laid out as described
+	 * for simio_state_alloc(). Only registers and other state which
+	 * changes as the device runs are saved, not its configuration.
+	 * restore() loads saved state, returning -1 if it doesn't fit the
+	 * device as it's now configured.
+	 */
+	void *(*save)(struct simio_device *dev, size_t *len);
+	int (*restore)(struct simio_device *dev, const void *data, size_t len);
 };
 
+/* Saved device state is a block of little-endian fields, so that it
+ * doesn't depend on the host's data layout and can be kept in a
+ * checkpoint file. It begins with a 4-byte version number, which each
+ * class changes whenever its fields change.
+ *
+ * simio_state_alloc() allocates state with room for len bytes of
+ * fields, and returns the block, with a pointer to the fields.
+ * simio_state_fields() checks the version and length of saved state,
+ * and returns a pointer to the fields, or NULL if they don't match.
+ */
+void *simio_state_alloc(uint32_t version, size_t len, size_t *total,
+			uint8_t **fields);
+const uint8_t *simio_state_fields(const void *data, size_t len,
+				  uint32_t version, size_t expect);
+
 #endif
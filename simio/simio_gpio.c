@@ -23,6 +23,7 @@
 #include "simio_gpio.h"
 #include "expr.h"
 #include "output.h"
+#include "bytes.h"
 
 #define REG_IN			0
 #define REG_OUT			1
@@ -329,6 +330,47 @@ static int gpio_read_b(struct simio_device *dev,
 	return 0;
 }
 
+/* Port registers change only when written or configured */
+static int gpio_read_stable(struct simio_device *dev, address_t addr)
+{
+	(void)dev;
+	(void)addr;
+
+	return 1;
+}
+
+/* Saved state is the port's registers, one byte each */
+#define GPIO_STATE_VERSION	1
+
+static void *gpio_save(struct simio_device *dev, size_t *len)
+{
+	struct gpio *g = (struct gpio *)dev;
+	uint8_t *p;
+	void *data = simio_state_alloc(GPIO_STATE_VERSION, sizeof(g->regs),
+				       len, &p);
+
+	if (!data)
+		return NULL;
+
+	memcpy(p, g->regs, sizeof(g->regs));
+	return data;
+}
+
+static int gpio_restore(struct simio_device *dev, const void *data, size_t len)
+{
+	struct gpio *g = (struct gpio *)dev;
+	const uint8_t *p = simio_state_fields(data, len, GPIO_STATE_VERSION,
+					      sizeof(g->regs));
+
+	if (!p) {
+		printc_err("gpio: snapshot doesn't match device\n");
+		return -1;
+	}
+
+	memcpy(g->regs, p, sizeof(g->regs));
+	return 0;
+}
+
 static int gpio_check_interrupt(struct simio_device *dev)
 {
 	struct gpio *g = (struct gpio *)dev;
@@ -366,5 +408,8 @@ const struct simio_class simio_gpio = {
 	.info			= gpio_info,
 	.write_b		= gpio_write_b,
 	.read_b			= gpio_read_b,
+	.read_stable		= gpio_read_stable,
+	.save			= gpio_save,
+	.restore		= gpio_restore,
 	.check_interrupt	= gpio_check_interrupt
 };
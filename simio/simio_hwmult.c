@@ -23,6 +23,7 @@
 #include "simio_hwmult.h"
 #include "output.h"
 #include "expr.h"
+#include "bytes.h"
 
 /* Multiplier register offsets from base addr */
 #define MPY            0x0  /* Multiply Unsigned/Operand 1 */
@@ -208,6 +209,58 @@ static int hwmult_read(struct simio_device *dev, address_t addr, uint16_t *data)
 	return 1;
 }
 
+/* Results change only when the operands are written */
+static int hwmult_read_stable(struct simio_device *dev, address_t addr)
+{
+	(void)dev;
+	(void)addr;
+
+	return 1;
+}
+
+/* Saved state is the mode, OP1 and OP2 (2 bytes each), the result (4
+ * bytes) and SUMEXT (2 bytes).
+ */
+#define HWMULT_STATE_VERSION	1
+#define HWMULT_STATE_LEN	12
+
+static void *hwmult_save(struct simio_device *dev, size_t *len)
+{
+	struct hwmult *h = (struct hwmult *)dev;
+	uint8_t *p;
+	void *data = simio_state_alloc(HWMULT_STATE_VERSION,
+				       HWMULT_STATE_LEN, len, &p);
+
+	if (!data)
+		return NULL;
+
+	w16le(p, h->mode);
+	w16le(p + 2, h->op1);
+	w16le(p + 4, h->op2);
+	w32le(p + 6, h->result);
+	w16le(p + 10, h->sumext);
+	return data;
+}
+
+static int hwmult_restore(struct simio_device *dev, const void *data, size_t len)
+{
+	struct hwmult *h = (struct hwmult *)dev;
+	const uint8_t *p = simio_state_fields(data, len, HWMULT_STATE_VERSION,
+					      HWMULT_STATE_LEN);
+
+	if (!p) {
+		printc_err("hwmult: snapshot doesn't match device\n");
+		return -1;
+	}
+
+	h->mode = r16le(p);
+	h->op1 = r16le(p + 2);
+	h->op2 = r16le(p + 4);
+	h->result = r32le(p + 6);
+	h->sumext = r16le(p + 10);
+	return 0;
+}
+
 const struct simio_class simio_hwmult = {
 	.name = "hwmult",
 	.help =
@@ -220,5 +273,8 @@ const struct simio_class simio_hwmult = {
 	.config			= hwmult_config,
 	.info			= hwmult_info,
 	.write			= hwmult_write,
-	.read			= hwmult_read
+	.read			= hwmult_read,
+	.read_stable		= hwmult_read_stable,
+	.save			= hwmult_save,
+	.restore		= hwmult_restore
 };
@@ -24,6 +24,7 @@
 #include "simio_timer.h"
 #include "expr.h"
 #include "output.h"
+#include "bytes.h"
 
 /* TACTL bits (taken from mspgcc headers) */
 #define TASSEL2             0x0400  /* unused */
@@ -495,6 +496,81 @@ static int timer_read(struct simio_device *dev,
 	return 1;
 }
 
+/* TAR counts between events, and reading TAIV clears a flag. Everything
+ * else changes only at an event or when written.
+ */
+static int timer_read_stable(struct simio_device *dev, address_t addr)
+{
+	struct timer *tr = (struct timer *)dev;
+
+	return addr != tr->base_addr + 0x10 && addr != tr->iv_addr;
+}
+
+/* Saved state is the type and size of the timer, which must match,
+ * then TxCTL, TxR and the counting direction (2 bytes each), then
+ * TxCCTLn, TxCCRn, the compare latch and its valid flag (2 bytes each)
+ * for each capture/compare block.
+ */
+#define TIMER_STATE_VERSION	1
+#define TIMER_STATE_LEN(size)	(10 + (size) * 8)
+
+static void *timer_save(struct simio_device *dev, size_t *len)
+{
+	struct timer *tr = (struct timer *)dev;
+	uint8_t *p;
+	void *data = simio_state_alloc(TIMER_STATE_VERSION,
+				       TIMER_STATE_LEN(tr->size), len, &p);
+	int i;
+
+	if (!data)
+		return NULL;
+
+	w16le(p, tr->timer_type);
+	w16le(p + 2, tr->size);
+	w16le(p + 4, tr->tactl);
+	w16le(p + 6, tr->tar);
+	w16le(p + 8, tr->go_down);
+	p += 10;
+
+	for (i = 0; i < tr->size; i++) {
+		w16le(p, tr->ctls[i]);
+		w16le(p + 2, tr->ccrs[i]);
+		w16le(p + 4, tr->bcls[i]);
+		w16le(p + 6, tr->valid_ccrs[i]);
+		p += 8;
+	}
+
+	return data;
+}
+
+static int timer_restore(struct simio_device *dev, const void *data, size_t len)
+{
+	struct timer *tr = (struct timer *)dev;
+	const uint8_t *p = simio_state_fields(data, len, TIMER_STATE_VERSION,
+					      TIMER_STATE_LEN(tr->size));
+	int i;
+
+	if (!p || r16le(p) != tr->timer_type || r16le(p + 2) != tr->size) {
+		printc_err("timer: snapshot doesn't match device\n");
+		return -1;
+	}
+
+	tr->tactl = r16le(p + 4);
+	tr->tar = r16le(p + 6);
+	tr->go_down = r16le(p + 8) != 0;
+	p += 10;
+
+	for (i = 0; i < tr->size; i++) {
+		tr->ctls[i] = r16le(p);
+		tr->ccrs[i] = r16le(p + 2);
+		tr->bcls[i] = r16le(p + 4);
+		tr->valid_ccrs[i] = r16le(p + 6) != 0;
+		p += 8;
+	}
+
+	return 0;
+}
+
 static int timer_check_interrupt(struct simio_device *dev)
 {
 	struct timer *tr = (struct timer *)dev;
@@ -683,6 +759,60 @@ static void timer_step(struct simio_device *dev,
 	}
 }
 
+/* Number of pulses until the comparators see TAR equal to the given
+ * value. In up/down mode, TAR may be counting in either direction.
+ */
+static int pulses_to(struct timer *tr, uint16_t value)
+{
+	const uint16_t mask = tar_mask(tr);
+	const int up = ((value - tr->tar) & mask) + 1;
+	const int down = ((tr->tar - value) & mask) + 1;
+
+	if ((tr->tactl & (MC1 | MC0)) != (MC1 | MC0))
+		return up;
+
+	return up < down ? up : down;
+}
+
+static int timer_next_event(struct simio_device *dev, uint16_t status)
+{
+	struct timer *tr = (struct timer *)dev;
+	simio_clock_t clock;
+	int pulses;
+	int i;
+
+	if (!(tr->tactl & (MC1 | MC0)))
+		return SIMIO_NO_EVENT;
+
+	i = (tr->tactl >> 8) & 3;
+	if (i == 2)
+		clock = SIMIO_SMCLK;
+	else if (i == 1)
+		clock = SIMIO_ACLK;
+	else
+		return SIMIO_NO_EVENT;
+
+	/* TAR moves by one count per pulse, and changes direction or
+	 * rolls over only at 0, its maximum, or CCR0. Flags are set only
+	 * when it reaches one of those, 1 (counting down), or a compare
+	 * value.
+	 */
+	pulses = tr->go_down ? 1 : pulses_to(tr, 0);
+
+	if (pulses_to(tr, 1) < pulses)
+		pulses = pulses_to(tr, 1);
+	if (pulses_to(tr, tar_mask(tr)) < pulses)
+		pulses = pulses_to(tr, tar_mask(tr));
+
+	for (i = 0; i < tr->size; i++)
+		if (pulses_to(tr, get_ccr(tr, i)) < pulses)
+			pulses = pulses_to(tr, get_ccr(tr, i));
+
+	i = (tr->tactl >> 6) & 3;
+	return simio_clock_cycles(dev->ctx, clock, status,
+				  (pulses << i) - tr->clock_input);
+}
+
 const struct simio_class simio_timer = {
 	.name = "timer",
 	.help =
@@ -712,7 +842,11 @@ const struct simio_class simio_timer = {
 	.info			= timer_info,
 	.write			= timer_write,
 	.read			= timer_read,
+	.read_stable		= timer_read_stable,
+	.save			= timer_save,
+	.restore		= timer_restore,
 	.check_interrupt	= timer_check_interrupt,
 	.ack_interrupt		= timer_ack_interrupt,
-	.step			= timer_step
+	.step			= timer_step,
+	.next_event		= timer_next_event
 };
@@ -25,6 +25,7 @@
 #include "output.h"
 #include "output_util.h"
 #include "dis.h"
+#include "bytes.h"
 
 #define DEFAULT_HISTORY		16
 
@@ -321,6 +322,110 @@ static void tracer_step(struct simio_device *dev,
 		tr->inscount++;
 }
 
+/* Snapshots hold the counters and the whole history ring. Saved state
+ * is the clock and instruction counters (8 bytes each), the interrupt
+ * request (2 bytes), the size of the ring, which must match, and its
+ * head and tail (4 bytes each), then each event: the time (8 bytes),
+ * type (2 bytes), address (4 bytes) and data (2 bytes).
+ */
+#define TRACER_STATE_VERSION	1
+#define TRACER_STATE_HDR	((SIMIO_NUM_CLOCKS + 1) * 8 + 14)
+#define TRACER_EVENT_LEN	16
+#define TRACER_STATE_LEN(size)	(TRACER_STATE_HDR + (size) * TRACER_EVENT_LEN)
+
+static void w64le(uint8_t *p, counter_t v)
+{
+	w32le(p, v);
+	w32le(p + 4, v >> 32);
+}
+
+static counter_t r64le(const uint8_t *p)
+{
+	return r32le(p) | ((counter_t)r32le(p + 4) << 32);
+}
+
+static void *tracer_save(struct simio_device *dev, size_t *len)
+{
+	struct tracer *tr = (struct tracer *)dev;
+	uint8_t *p;
+	void *data = simio_state_alloc(TRACER_STATE_VERSION,
+				       TRACER_STATE_LEN(tr->size), len, &p);
+	int i;
+
+	if (!data)
+		return NULL;
+
+	for (i = 0; i < SIMIO_NUM_CLOCKS; i++) {
+		w64le(p, tr->cycles[i]);
+		p += 8;
+	}
+
+	w64le(p, tr->inscount);
+	w16le(p + 8, tr->irq_request);
+	w32le(p + 10, tr->size);
+	w32le(p + 14, tr->head);
+	w32le(p + 18, tr->tail);
+	p += 22;
+
+	for (i = 0; i < tr->size; i++) {
+		const struct event *e = &tr->history[i];
+
+		w64le(p, e->when);
+		w16le(p + 8, e->what);
+		w32le(p + 10, e->addr);
+		w16le(p + 14, e->data);
+		p += TRACER_EVENT_LEN;
+	}
+
+	return data;
+}
+
+static int tracer_restore(struct simio_device *dev,
+			  const void *data, size_t len)
+{
+	struct tracer *tr = (struct tracer *)dev;
+	const uint8_t *p = simio_state_fields(data, len, TRACER_STATE_VERSION,
+					      TRACER_STATE_LEN(tr->size));
+	const uint8_t *ring;
+	int i;
+
+	if (!p)
+		goto mismatch;
+
+	ring = p + SIMIO_NUM_CLOCKS * 8 + 10;
+	if (r32le(ring) != (uint32_t)tr->size ||
+	    r32le(ring + 4) >= (uint32_t)tr->size ||
+	    r32le(ring + 8) >= (uint32_t)tr->size)
+		goto mismatch;
+
+	for (i = 0; i < SIMIO_NUM_CLOCKS; i++) {
+		tr->cycles[i] = r64le(p);
+		p += 8;
+	}
+
+	tr->inscount = r64le(p);
+	tr->irq_request = (int16_t)r16le(p + 8);
+	tr->head = r32le(p + 14);
+	tr->tail = r32le(p + 18);
+	p += 22;
+
+	for (i = 0; i < tr->size; i++) {
+		struct event *e = &tr->history[i];
+
+		e->when = r64le(p);
+		e->what = r16le(p + 8);
+		e->addr = r32le(p + 10);
+		e->data = r16le(p + 14);
+		p += TRACER_EVENT_LEN;
+	}
+
+	return 0;
+
+mismatch:
+	printc_err("tracer: snapshot doesn't match device\n");
+	return -1;
+}
+
 const struct simio_class simio_tracer = {
 	.name = "tracer",
 	.help =
@@ -354,5 +459,7 @@ const struct simio_class simio_tracer = {
 	.read_b			= tracer_read_b,
 	.check_interrupt	= tracer_check_interrupt,
 	.ack_interrupt		= tracer_ack_interrupt,
-	.step			= tracer_step
+	.step			= tracer_step,
+	.save			= tracer_save,
+	.restore		= tracer_restore
 };
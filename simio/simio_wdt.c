@@ -23,6 +23,7 @@
 #include "simio_wdt.h"
 #include "output.h"
 #include "expr.h"
+#include "bytes.h"
 
 /* WDTCTL flags, taken from mspgcc.
  *
@@ -129,7 +130,8 @@ static int wdt_config(struct simio_device *dev, const char *param,
 				old && !w->pin_state) ||
 			    (!(w->wdtctl & WDTNMIES) &&
 				 !old && w->pin_state))
-				simio_sfr_modify(SIMIO_IFG1, NMIIFG, NMIIFG);
+				simio_sfr_modify(dev->ctx, SIMIO_IFG1,
+						 NMIIFG, NMIIFG);
 		}
 
 		return 0;
@@ -184,6 +186,55 @@ static int wdt_read(struct simio_device *dev, address_t addr, uint16_t *data)
 	return 0;
 }
 
+static int wdt_read_stable(struct simio_device *dev, address_t addr)
+{
+	(void)dev;
+	(void)addr;
+
+	return 1;
+}
+
+/* Saved state is WDTCTL, the NMI/RST# pin and the reset flag (2 bytes
+ * each), then the counter (4 bytes).
+ */
+#define WDT_STATE_VERSION	1
+#define WDT_STATE_LEN		10
+
+static void *wdt_save(struct simio_device *dev, size_t *len)
+{
+	struct wdt *w = (struct wdt *)dev;
+	uint8_t *p;
+	void *data = simio_state_alloc(WDT_STATE_VERSION, WDT_STATE_LEN,
+				       len, &p);
+
+	if (!data)
+		return NULL;
+
+	w16le(p, w->wdtctl);
+	w16le(p + 2, w->pin_state);
+	w16le(p + 4, w->reset_triggered);
+	w32le(p + 6, w->count_reg);
+	return data;
+}
+
+static int wdt_restore(struct simio_device *dev, const void *data, size_t len)
+{
+	struct wdt *w = (struct wdt *)dev;
+	const uint8_t *p = simio_state_fields(data, len, WDT_STATE_VERSION,
+					      WDT_STATE_LEN);
+
+	if (!p) {
+		printc_err("wdt: snapshot doesn't match device\n");
+		return -1;
+	}
+
+	w->wdtctl = r16le(p);
+	w->pin_state = r16le(p + 2);
+	w->reset_triggered = r16le(p + 4);
+	w->count_reg = r32le(p + 6);
+	return 0;
+}
+
 static int wdt_check_interrupt(struct simio_device *dev)
 {
 	struct wdt *w = (struct wdt *)dev;
@@ -195,7 +246,8 @@ static int wdt_check_interrupt(struct simio_device *dev)
 	if (w->reset_triggered)
 		return 15;
 
-	flags = simio_sfr_get(SIMIO_IFG1) & simio_sfr_get(SIMIO_IE1);
+	flags = simio_sfr_get(dev->ctx, SIMIO_IFG1) &
+		simio_sfr_get(dev->ctx, SIMIO_IE1);
 
 	if (flags & NMIIFG)
 		return 14;
@@ -211,16 +263,28 @@ static void wdt_ack_interrupt(struct simio_device *dev, int irq)
 	struct wdt *w = (struct wdt *)dev;
 
 	if (irq == 14)
-		simio_sfr_modify(SIMIO_IFG1, NMIIFG, 0);
+		simio_sfr_modify(dev->ctx, SIMIO_IFG1, NMIIFG, 0);
 	else if (irq == w->wdt_irq)
-		simio_sfr_modify(SIMIO_IFG1, WDTIFG, 0);
+		simio_sfr_modify(dev->ctx, SIMIO_IFG1, WDTIFG, 0);
+}
+
+/* Figure out the divisor */
+static int wdt_interval(const struct wdt *w)
+{
+	switch (w->wdtctl & 3) {
+	case 0: return 32768;
+	case 1: return 8192;
+	case 2: return 512;
+	}
+
+	return 64;
 }
 
 static void wdt_step(struct simio_device *dev, uint16_t status_register,
 		     const int *clocks)
 {
 	struct wdt *w = (struct wdt *)dev;
-	int max = 1;
+	int max = wdt_interval(w);
 
 	(void)status_register;
 
@@ -234,18 +298,11 @@ static void wdt_step(struct simio_device *dev, uint16_t status_register,
 	else
 		w->count_reg += clocks[SIMIO_SMCLK];
 
-	/* Figure out the divisor */
-	switch (w->wdtctl & 3) {
-	case 0: max = 32768; break;
-	case 1: max = 8192; break;
-	case 2: max = 512; break;
-	case 3: max = 64; break;
-	}
-
 	/* Check for overflow */
 	if (w->count_reg >= max) {
 		if (w->wdtctl & WDTTMSEL)
-			simio_sfr_modify(SIMIO_IFG1, WDTIFG, WDTIFG);
+			simio_sfr_modify(w->base.ctx, SIMIO_IFG1,
+					 WDTIFG, WDTIFG);
 		else
 			w->reset_triggered = 1;
 	}
@@ -253,6 +310,18 @@ static void wdt_step(struct simio_device *dev, uint16_t status_register,
 	w->count_reg &= (max - 1);
 }
 
+static int wdt_next_event(struct simio_device *dev, uint16_t status_register)
+{
+	struct wdt *w = (struct wdt *)dev;
+
+	if (w->wdtctl & WDTHOLD)
+		return SIMIO_NO_EVENT;
+
+	return simio_clock_cycles(dev->ctx, (w->wdtctl & WDTSSEL) ?
+				  SIMIO_ACLK : SIMIO_SMCLK, status_register,
+				  wdt_interval(w) - w->count_reg);
+}
+
 const struct simio_class simio_wdt = {
 	.name = "wdt",
 	.help =
@@ -270,7 +339,11 @@ const struct simio_class simio_wdt = {
 	.info			= wdt_info,
 	.write			= wdt_write,
 	.read			= wdt_read,
+	.read_stable		= wdt_read_stable,
+	.save			= wdt_save,
+	.restore		= wdt_restore,
 	.check_interrupt	= wdt_check_interrupt,
 	.ack_interrupt		= wdt_ack_interrupt,
-	.step			= wdt_step
+	.step			= wdt_step,
+	.next_event		= wdt_next_event
 };
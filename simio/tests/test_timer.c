@@ -29,6 +29,39 @@
 /* Module under test */
 #include "simio_timer.c"
 
+/* Stand-in for the IO simulator's clock conversion. SMCLK runs at the
+ * system clock, and ACLK at 1/256 of it.
+ */
+int simio_clock_cycles(struct simio_context *ctx, simio_clock_t clock,
+		       uint16_t status_register, int ticks)
+{
+	(void)ctx;
+	(void)status_register;
+
+	return (clock == SIMIO_ACLK) ? ticks * 256 : ticks;
+}
+
+/* Stand-ins for the IO simulator's snapshot helpers. */
+void *simio_state_alloc(uint32_t version, size_t len, size_t *total,
+			uint8_t **fields)
+{
+	uint8_t *data = malloc(4 + len);
+
+	w32le(data, version);
+	*total = 4 + len;
+	*fields = data + 4;
+	return data;
+}
+
+const uint8_t *simio_state_fields(const void *data, size_t len,
+				  uint32_t version, size_t expect)
+{
+	if (len != 4 + expect || r32le(data) != version)
+		return NULL;
+
+	return (const uint8_t *)data + 4;
+}
+
 
 /*
  * Helper functions for testing timer simio.
@@ -106,6 +139,12 @@ static void step_aclk(struct simio_device *dev, int aclk)
 	simio_timer.step(dev, status_register, setup_clocks(0, 0, aclk));
 }
 
+static int next_event(struct simio_device *dev)
+{
+	uint16_t status_register = 0;
+	return simio_timer.next_event(dev, status_register);
+}
+
 static bool check_noirq(struct simio_device *dev)
 {
 	return simio_timer.check_interrupt(dev) < 0;
@@ -395,6 +434,121 @@ static void test_timer_a_up()
 	assert(check_noirq(dev));
 }
 
+static void test_timer_next_event_stopped()
+{
+	dev = create_timer("");
+
+	/* Stop mode */
+	write_timer(dev, TxCTL, TASSEL1 | TACLR);
+	assert(next_event(dev) == SIMIO_NO_EVENT);
+
+	/* Continuous mode, external clock */
+	write_timer(dev, TxCTL, MC1 | TACLR);
+	assert(next_event(dev) == SIMIO_NO_EVENT);
+}
+
+static void test_timer_next_event_up()
+{
+	dev = create_timer("");
+
+	/* Up mode, SMCLK, clear */
+	write_timer(dev, TxCTL, MC0 | TASSEL1 | TACLR);
+	write_timer(dev, TxCCTL(0), CCIE);
+	write_timer(dev, TxCCR(0), 10);
+	write_timer(dev, TxCCR(1), 100);
+	write_timer(dev, TxCCR(2), 100);
+
+	/* Nothing happens until TAR reaches CCR0 */
+	step_smclk(dev, 2);
+	assert(next_event(dev) == 9);
+	step_smclk(dev, 8);
+	assert(check_noirq(dev));
+	assert(next_event(dev) == 1);
+	step_smclk(dev, 1);
+	assert(check_irq0(dev));
+}
+
+static void test_timer_next_event_divider()
+{
+	dev = create_timer("");
+
+	/* Continuous mode, ACLK/8, clear */
+	write_timer(dev, TxCTL, MC1 | TASSEL0 | ID1 | ID0 | TACLR);
+	write_timer(dev, TxCCTL(1), CCIE);
+	write_timer(dev, TxCCR(0), 100);
+	write_timer(dev, TxCCR(1), 20);
+	write_timer(dev, TxCCR(2), 100);
+
+	step_aclk(dev, 19);
+	assert(read_timer(dev, TxR) == 2);
+	assert(next_event(dev) == (19 * 8 - 3) * 256);
+	step_aclk(dev, 19 * 8 - 4);
+	assert(check_noirq(dev));
+	step_aclk(dev, 1);
+	assert(check_irq1(dev));
+}
+
+static void test_timer_read_stable()
+{
+	struct timer *tmr;
+
+	dev = create_timer("");
+	tmr = (struct timer *)dev;
+
+	/* TAR counts, and reading TAIV has side effects */
+	assert_not(simio_timer.read_stable(dev, tmr->base_addr + TxR));
+	assert_not(simio_timer.read_stable(dev, tmr->iv_addr));
+
+	/* Everything else changes only at an event */
+	assert(simio_timer.read_stable(dev, tmr->base_addr + TxCTL));
+	assert(simio_timer.read_stable(dev, tmr->base_addr + TxCCTL(0)));
+	assert(simio_timer.read_stable(dev, tmr->base_addr + TxCCR(0)));
+}
+
+static void test_timer_snapshot()
+{
+	struct simio_device *other;
+	void *data;
+	size_t len;
+
+	dev = create_timer("");
+
+	/* Up mode, SMCLK, period 10 */
+	write_timer(dev, TxCTL, MC0 | TASSEL1 | TACLR);
+	write_timer(dev, TxCCTL(0), CCIE);
+	write_timer(dev, TxCCR(0), 10);
+	step_smclk(dev, 3);
+
+	data = simio_timer.save(dev, &len);
+	assert(data);
+
+	step_smclk(dev, 9);
+	assert(read_timer(dev, TxR) == 1);
+	write_timer(dev, TxCCR(0), 20);
+
+	/* Counter, registers and pending interrupt all come back */
+	assert(simio_timer.restore(dev, data, len) == 0);
+	assert(read_timer(dev, TxR) == 3);
+	assert(read_timer(dev, TxCCR(0)) == 10);
+	assert(check_noirq(dev));
+	step_smclk(dev, 8);
+	assert(read_timer(dev, TxR) == 0);
+	assert(check_irq0(dev));
+
+	/* State of the wrong size is refused */
+	assert(simio_timer.restore(dev, data, len - 1) < 0);
+
+	/* So is state from a timer with a different number of blocks */
+	other = create_timer("5");
+	assert(simio_timer.restore(other, data, len) < 0);
+	simio_timer.destroy(other);
+
+	/* And state with a different version */
+	((uint8_t *)data)[0] ^= 0x80;
+	assert(simio_timer.restore(dev, data, len) < 0);
+	free(data);
+}
+
 static void test_timer_a_up_change_period()
 {
 	dev = create_timer("");
@@ -1517,6 +1671,11 @@ int main(int argc, char **argv)
 	RUN_TEST(test_timer_up_stop);
 	RUN_TEST(test_timer_updown_stop);
 	RUN_TEST(test_timer_a_up);
+	RUN_TEST(test_timer_next_event_stopped);
+	RUN_TEST(test_timer_next_event_up);
+	RUN_TEST(test_timer_next_event_divider);
+	RUN_TEST(test_timer_read_stable);
+	RUN_TEST(test_timer_snapshot);
 	RUN_TEST(test_timer_a_up_change_period);
 	RUN_TEST(test_timer_a_updown_change_period);
 	RUN_TEST(test_timer_divider);
@@ -0,0 +1,152 @@
+/* MSPDebug - debugging tool MSP430 MCUs
+ * Copyright (C) 2009-2012 Daniel Beer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <ctype.h>
+
+#include "batch.h"
+#include "device.h"
+#include "devcmd.h"
+#include "dis.h"
+#include "expr.h"
+#include "opdb.h"
+#include "output.h"
+#include "sim.h"
+
+static int parse_exit_code(const char *text, int *reg, address_t *addr)
+{
+	*reg = -1;
+	if (isalpha(*text))
+		*reg = dis_reg_from_name(text);
+	if (*reg >= 0)
+		return 0;
+
+	if (expr_eval(text, addr) < 0) {
+		printc_err("batch: invalid exit code location: %s\n", text);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int read_exit_code(int reg, address_t addr)
+{
+	address_t regs[DEVICE_NUM_REGS];
+	address_t port;
+	address_t value;
+	uint8_t data[2];
+
+	if (reg >= 0) {
+		if (device_getregs(regs) < 0)
+			return -1;
+
+		return regs[reg] & 0xff;
+	}
+
+	/* An IO port can't be read back, so use the value written */
+	if (sim_watch_write(device_default, &port, &value) && port == addr)
+		return value & 0xff;
+
+	if (device_readmem(addr, data, 2) < 0)
+		return -1;
+
+	return data[0];
+}
+
+static int set_exit_point(const char *text, device_bptype_t type)
+{
+	address_t addr;
+
+	if (expr_eval(text, &addr) < 0) {
+		printc_err("batch: invalid exit address: %s\n", text);
+		return -1;
+	}
+
+	if (device_setbrk(device_default, -1, 1, addr, type) < 0) {
+		printc_err("batch: no free breakpoint for exit at %s\n", text);
+		return -1;
+	}
+
+	return 0;
+}
+
+int batch_run(const struct batch_args *args)
+{
+	device_status_t status;
+	address_t code_addr = 0;
+	int code_reg = -1;
+	int code;
+
+	if (!(args->exit_at || args->exit_port || args->max_cycles ||
+	      opdb_get_numeric("sim_semihost"))) {
+		printc_err("batch: an exit condition is required\n");
+		return -1;
+	}
+
+	if (prog_file(args->image) < 0)
+		return -1;
+
+	/* Expressions may refer to the program's symbols */
+	if (args->exit_at &&
+	    set_exit_point(args->exit_at, DEVICE_BPTYPE_BREAK) < 0)
+		return -1;
+
+	if (args->exit_port &&
+	    set_exit_point(args->exit_port, DEVICE_BPTYPE_WRITE) < 0)
+		return -1;
+
+	if (parse_exit_code(args->exit_code ? args->exit_code :
+			    args->exit_port ? args->exit_port : "R12",
+			    &code_reg, &code_addr) < 0)
+		return -1;
+
+	if (args->max_cycles &&
+	    sim_set_cycle_limit(device_default, args->max_cycles) < 0)
+		return -1;
+
+	if (device_ctl(DEVICE_CTL_RUN) < 0) {
+		printc_err("batch: failed to start CPU\n");
+		return -1;
+	}
+
+	do {
+		status = device_poll();
+	} while (status == DEVICE_STATUS_RUNNING);
+
+	if (status != DEVICE_STATUS_HALTED)
+		return -1;
+
+	if (device_ctl(DEVICE_CTL_HALT) < 0)
+		return -1;
+
+	if (args->max_cycles && sim_cycle_limit_reached(device_default)) {
+		printc_err("batch: cycle budget of %llu exhausted\n",
+			   (unsigned long long)args->max_cycles);
+		return BATCH_TIMEOUT;
+	}
+
+	if (sim_exited(device_default, &code)) {
+		code &= 0xff;
+	} else {
+		code = read_exit_code(code_reg, code_addr);
+		if (code < 0)
+			return -1;
+	}
+
+	printc_dbg("Program exited with status %d\n", code);
+	return code;
+}
@@ -0,0 +1,53 @@
+/* MSPDebug - debugging tool MSP430 MCUs
+ * Copyright (C) 2009-2012 Daniel Beer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdint.h>
+
+/* Batch mode loads a program, runs it without interaction until an exit
+ * condition is met, and turns the outcome into a process exit status.
+ *
+ * The program stops when it reaches exit_at, after it writes to
+ * exit_port, or when max_cycles system cycles have passed (simulator
+ * only). The first two are address expressions, which may refer to the
+ * program's symbols, and at least one condition must be given. The
+ * exit status is read from exit_code, which names either a register or
+ * the address of a word in memory, of which only the low 8 bits are
+ * used. It defaults to the exit port if there is one, or otherwise R12.
+ */
+struct batch_args {
+	const char		*image;
+	const char		*exit_at;
+	const char		*exit_port;
+	const char		*exit_code;
+	uint64_t		max_cycles;
+};
+
+/* Returns the program's exit status, BATCH_TIMEOUT if the cycle budget
+ * runs out, or -1 if the program couldn't be run. Since the program's
+ * status may be anything from 0 to 255, these are kept apart from it
+ * until MSPDebug exits, when a timeout gives BATCH_TIMEOUT_STATUS.
+ */
+#define BATCH_TIMEOUT		(-2)
+#define BATCH_TIMEOUT_STATUS	124
+
+int batch_run(const struct batch_args *args);
+
+#endif
@@ -27,7 +27,7 @@
 #include "rtools.h"
 #include "sym.h"
 #include "stdcmd.h"
-#include "simio.h"
+#include "sim.h"
 #include "aliasdb.h"
 #include "power.h"
 
@@ -67,22 +67,23 @@ const struct cmddb_record commands[] = {
 		.name = "setwatch",
 		.func = cmd_setwatch,
 		.help =
-"setwatch <addr> [index]\n"
-"    Set a watchpoint. If no index is specified. the first available\n"
-"    slot will be used.\n"
+"setwatch <addr> [index] [length]\n"
+"    Set a watchpoint. If no index is specified, or the index is \"-\",\n"
+"    the first available slot will be used. If a length is given, the\n"
+"    watchpoint covers that many bytes starting at the address.\n"
 	},
 	{
 		.name = "setwatch_r",
 		.func = cmd_setwatch_r,
 		.help =
-"setwatch_r <addr> [index]\n"
+"setwatch_r <addr> [index] [length]\n"
 "    Set a read-only watchpoint.\n"
 	},
 	{
 		.name = "setwatch_w",
 		.func = cmd_setwatch_w,
 		.help =
-"setwatch_w <addr> [index]\n"
+"setwatch_w <addr> [index] [length]\n"
 "    Set a write-only watchpoint.\n"
 	},
 	{
@@ -300,6 +301,58 @@ const struct cmddb_record commands[] = {
 		.help =
 "exit\n"
 "    Exit from MSPDebug.\n"
+	},
+	{
+		.name = "sim",
+		.func = cmd_sim,
+		.help =
+"sim snapshot save <name>\n"
+"    Save the state of the simulator under the given name.\n"
+"sim snapshot restore <name>\n"
+"    Return the simulator to a previously saved state.\n"
+"sim snapshot delete <name>\n"
+"    Discard a saved state.\n"
+"sim snapshot list\n"
+"    Show the names of all saved states.\n"
+"sim checkpoint save <file>\n"
+"    Write the state of the simulator to a file.\n"
+"sim checkpoint load <file>\n"
+"    Return the simulator to a state stored in a file.\n"
+"sim history\n"
+"    Show how much execution history has been recorded.\n"
+"sim reverse-step [count]\n"
+"    Step backwards through the recorded history.\n"
+"sim reverse-continue\n"
+"    Run backwards to a breakpoint, or to a write to a watched address.\n"
+"sim profile [on|off|clear]\n"
+"    Start, stop or discard the execution profile.\n"
+"sim profile report [count]\n"
+"    Show the functions which took the most cycles.\n"
+"sim profile addresses [count]\n"
+"    Show the instructions which took the most cycles.\n"
+"sim profile folded <file>\n"
+"    Write the profile's call stacks for flame graph tools.\n"
+"sim coverage [on [file]|off|clear]\n"
+"    Start, stop or discard the record of instructions executed.\n"
+"sim coverage save|load <file>\n"
+"    Merge coverage into, or from, a file.\n"
+"sim coverage report [start [end]]\n"
+"    Show how much of each function has been executed.\n"
+"sim trace start <file> [regs] [mem]\n"
+"    Write a record of every instruction executed to a file.\n"
+"sim trace stop\n"
+"    Finish writing the trace.\n"
+"sim trace decode <file> [count]\n"
+"    Show the events recorded in a trace.\n"
+"sim hook [add <routine> [address] [large]|auto [large]]\n"
+"    Run library routines such as memcpy natively on the host.\n"
+"sim hook cost <routine> <cycles> [per-byte]\n"
+"    Change the cycles charged for each call to a hooked routine.\n"
+"sim hook del <routine>|clear\n"
+"    Stop running one or all routines natively.\n"
+"sim fuzz <buffer> <size> <done> [options ...]\n"
+"    Run the program repeatedly with generated input, looking for\n"
+"    inputs which crash it.\n"
 	},
 	{
 		.name = "simio",
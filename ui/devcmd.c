@@ -48,7 +48,7 @@ int cmd_regs(char **arg)
 	/* Check for breakpoints */
 	for (i = 0; i < device_default->max_breakpoints; i++) {
 		const struct device_breakpoint *bp =
-		    &device_default->breakpoints[i];
+		    device_breakpoint(device_default, i);
 
 		if ((bp->flags & DEVICE_BP_ENABLED) &&
 		    (bp->type == DEVICE_BPTYPE_BREAK) &&
@@ -244,7 +244,7 @@ static int bp_poll(void)
 
 	for (i = 0; i < device_default->max_breakpoints; i++) {
 		const struct device_breakpoint *bp =
-		    &device_default->breakpoints[i];
+		    device_breakpoint(device_default, i);
 
 		if ((bp->flags & DEVICE_BP_ENABLED) &&
 		    (bp->type == DEVICE_BPTYPE_BREAK) &&
@@ -303,7 +303,7 @@ int cmd_run(char **arg)
 
 		for (i = 0; i < device_default->max_breakpoints; i++) {
 			struct device_breakpoint *bp =
-				&device_default->breakpoints[i];
+				device_breakpoint(device_default, i);
 
 			if ((bp->flags & DEVICE_BP_ENABLED) &&
 			    bp->type == DEVICE_BPTYPE_BREAK &&
@@ -625,19 +625,12 @@ static int cmd_prog_feed(void *user_data, const struct binfile_chunk *ch)
 	return prog_feed((struct prog_data *)user_data, ch);
 }
 
-static int do_cmd_prog(char **arg, int prog_flags)
+static int do_prog(const char *path_arg, int prog_flags)
 {
 	FILE *in;
 	struct prog_data prog;
-	const char *path_arg;
 	char * path;
 
-	path_arg = get_arg(arg);
-	if (!path_arg) {
-		printc_err("prog: you need to specify a filename\n");
-		return -1;
-	}
-
 	if (prompt_abort(MODIFY_SYMS))
 		return 0;
 
@@ -686,6 +679,23 @@ static int do_cmd_prog(char **arg, int prog_flags)
 	return 0;
 }
 
+static int do_cmd_prog(char **arg, int prog_flags)
+{
+	const char *path_arg = get_arg(arg);
+
+	if (!path_arg) {
+		printc_err("prog: you need to specify a filename\n");
+		return -1;
+	}
+
+	return do_prog(path_arg, prog_flags);
+}
+
+int prog_file(const char *path)
+{
+	return do_prog(path, PROG_WANT_ERASE);
+}
+
 int cmd_prog(char **arg)
 {
 	return do_cmd_prog(arg, PROG_WANT_ERASE);
@@ -705,8 +715,10 @@ static int do_setbreak(device_bptype_t type, char **arg)
 {
 	char *addr_text = get_arg(arg);
 	char *index_text = get_arg(arg);
+	char *size_text = get_arg(arg);
 	int index = -1;
 	address_t addr;
+	address_t size = 1;
 
 	if (!addr_text) {
 		printc_err("setbreak: address required\n");
@@ -718,7 +730,7 @@ static int do_setbreak(device_bptype_t type, char **arg)
 		return -1;
 	}
 
-	if (index_text) {
+	if (index_text && strcmp(index_text, "-")) {
 		address_t val;
 
 		if (expr_eval(index_text, &val) < 0 ||
@@ -731,7 +743,22 @@ static int do_setbreak(device_bptype_t type, char **arg)
 		index = val;
 	}
 
-	index = device_setbrk(device_default, index, 1, addr, type);
+	if (size_text) {
+		if (type == DEVICE_BPTYPE_BREAK) {
+			printc_err("setbreak: breakpoints can't cover a "
+				   "range\n");
+			return -1;
+		}
+
+		if (expr_eval(size_text, &size) < 0 || !size) {
+			printc_err("setbreak: invalid length: %s\n",
+				   size_text);
+			return -1;
+		}
+	}
+
+	index = device_setbrk_range(device_default, index, 1,
+				    addr, size, type);
 	if (index < 0) {
 		printc_err("setbreak: all breakpoint slots are "
 			"occupied\n");
@@ -800,7 +827,7 @@ int cmd_break(char **arg)
 	       device_default->max_breakpoints);
 	for (i = 0; i < device_default->max_breakpoints; i++) {
 		const struct device_breakpoint *bp =
-			&device_default->breakpoints[i];
+			device_breakpoint(device_default, i);
 
 		if (bp->flags & DEVICE_BP_ENABLED) {
 			char name[128];
@@ -808,6 +835,9 @@ int cmd_break(char **arg)
 			print_address(bp->addr, name, sizeof(name), 0);
 			printc("    %d. %s", i, name);
 
+			if (bp->type != DEVICE_BPTYPE_BREAK && bp->size > 1)
+				printc(" (%d bytes)", bp->size);
+
 			switch (bp->type) {
 			case DEVICE_BPTYPE_WATCH:
 				printc(" [watchpoint]\n");
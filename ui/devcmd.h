@@ -41,4 +41,9 @@ int cmd_break(char **arg);
 int cmd_fill(char **arg);
 int cmd_blow_jtag_fuse(char **arg);
 
+/* Erase and program the device from a file, and load its symbols, as
+ * the "prog" command does.
+ */
+int prog_file(const char *path);
+
 #endif
@@ -0,0 +1,657 @@
+/* MSPDebug - debugging tool MSP430 MCUs
+ * Copyright (C) 2009-2012 Daniel Beer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __Windows__
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "farm.h"
+#include "batch.h"
+#include "ctrlc.h"
+#include "output.h"
+#include "opdb.h"
+#include "util.h"
+
+#ifdef __Windows__
+int farm_run(const struct farm_args *args, farm_test_func_t func,
+	     void *user_data)
+{
+	(void)args;
+	(void)func;
+	(void)user_data;
+
+	printc_err("farm: not supported on this platform\n");
+	return -1;
+}
+#else
+/* Captured output beyond this length is discarded */
+#define MAX_OUTPUT		65536
+
+#define CYCLES_UNKNOWN		UINT64_MAX
+
+typedef enum {
+	RESULT_PASS,
+	RESULT_FAIL,
+	RESULT_TIMEOUT,
+	RESULT_ERROR
+} result_t;
+
+static const char *const result_names[] = {
+	[RESULT_PASS]		= "pass",
+	[RESULT_FAIL]		= "fail",
+	[RESULT_TIMEOUT]	= "timeout",
+	[RESULT_ERROR]		= "error"
+};
+
+/* What a test's child process reports back, in memory shared with the
+ * parent. This doesn't depend on the exit status of the child, which
+ * is taken from the program and so can't be trusted to show how the
+ * test finished.
+ */
+struct farm_outcome {
+	int			ret;
+	uint64_t		cycles;
+};
+
+struct farm_test {
+	char			*path;
+	result_t		result;
+
+	/* Exit status, or the signal which killed the test */
+	int			status;
+	int			signal;
+
+	double			time;
+	char			*output;
+	size_t			output_len;
+};
+
+/* A running test */
+struct farm_slot {
+	pid_t			pid;
+	int			test;
+	FILE			*out;
+	struct timeval		start;
+};
+
+/************************************************************************
+ * Test discovery
+ */
+
+static int add_test(struct vector *list, const char *path)
+{
+	struct farm_test t;
+
+	memset(&t, 0, sizeof(t));
+	t.path = strdup(path);
+	if (!t.path || vector_push(list, &t, 1) < 0) {
+		printc_err("farm: can't allocate memory for tests\n");
+		free(t.path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int is_elf_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 4 && !strcasecmp(name + len - 4, ".elf");
+}
+
+static int cmp_test(const void *a, const void *b)
+{
+	return strcmp(((const struct farm_test *)a)->path,
+		      ((const struct farm_test *)b)->path);
+}
+
+static int add_dir(struct vector *list, const char *path)
+{
+	DIR *d = opendir(path);
+	const int first = list->size;
+	struct dirent *e;
+
+	if (!d) {
+		pr_error(path);
+		return -1;
+	}
+
+	while ((e = readdir(d))) {
+		char name[1024];
+		struct stat st;
+
+		if (!is_elf_name(e->d_name))
+			continue;
+
+		snprintf(name, sizeof(name), "%s/%s", path, e->d_name);
+		if (stat(name, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (add_test(list, name) < 0) {
+			closedir(d);
+			return -1;
+		}
+	}
+
+	closedir(d);
+
+	/* Directory order is arbitrary */
+	qsort(VECTOR_PTR(*list, first, struct farm_test),
+	      list->size - first, list->elemsize, cmp_test);
+	return 0;
+}
+
+static int find_tests(struct vector *list, const struct vector *paths)
+{
+	int i;
+
+	for (i = 0; i < paths->size; i++) {
+		const char *path = VECTOR_AT(*paths, i, const char *);
+		struct stat st;
+
+		if (stat(path, &st) < 0) {
+			pr_error(path);
+			return -1;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			if (add_dir(list, path) < 0)
+				return -1;
+		} else if (add_test(list, path) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/************************************************************************
+ * Running tests
+ */
+
+static int start_test(struct farm_slot *s, const struct farm_test *t,
+		      struct farm_outcome *o, farm_test_func_t func,
+		      void *user_data)
+{
+	static const union opdb_value quiet = {
+		.boolean = 1
+	};
+	int null;
+
+	s->out = tmpfile();
+	if (!s->out) {
+		pr_error("farm: can't create output file");
+		return -1;
+	}
+
+	/* Anything still buffered would otherwise be written twice */
+	fflush(stdout);
+	fflush(stderr);
+	gettimeofday(&s->start, NULL);
+
+	s->pid = fork();
+	if (s->pid < 0) {
+		pr_error("farm: fork");
+		fclose(s->out);
+		return -1;
+	}
+
+	if (s->pid)
+		return 0;
+
+	/* Only the program's own output goes in the report. Of the child's
+	 * messages, just the errors are shown.
+	 */
+	null = open("/dev/null", O_WRONLY);
+	if (null >= 0) {
+		dup2(null, STDOUT_FILENO);
+		close(null);
+	}
+
+	opdb_set("quiet", &quiet);
+	program_output_redirect(s->out);
+	o->ret = func(t->path, &o->cycles, user_data);
+
+	fflush(stdout);
+	fflush(stderr);
+	_exit(0);
+}
+
+static void read_output(struct farm_test *t, FILE *out)
+{
+	rewind(out);
+
+	t->output = malloc(MAX_OUTPUT);
+	if (t->output)
+		t->output_len = fread(t->output, 1, MAX_OUTPUT, out);
+
+	fclose(out);
+}
+
+static void finish_test(struct farm_slot *s, struct farm_test *t,
+			const struct farm_outcome *o, int status)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	t->time = (now.tv_sec - s->start.tv_sec) +
+		(now.tv_usec - s->start.tv_usec) * 1e-6;
+
+	read_output(t, s->out);
+	s->pid = 0;
+
+	if (WIFSIGNALED(status)) {
+		t->result = RESULT_ERROR;
+		t->signal = WTERMSIG(status);
+		return;
+	}
+
+	/* A child which exits early leaves its outcome as an error */
+	if (o->ret == BATCH_TIMEOUT) {
+		t->result = RESULT_TIMEOUT;
+	} else if (o->ret < 0) {
+		t->result = RESULT_ERROR;
+	} else {
+		t->status = o->ret;
+		t->result = t->status ? RESULT_FAIL : RESULT_PASS;
+	}
+}
+
+static void describe(const struct farm_test *t, char *buf, int max_len)
+{
+	switch (t->result) {
+	case RESULT_PASS:
+		snprintf(buf, max_len, "passed");
+		break;
+
+	case RESULT_FAIL:
+		snprintf(buf, max_len, "exit status %d", t->status);
+		break;
+
+	case RESULT_TIMEOUT:
+		snprintf(buf, max_len, "cycle budget exhausted");
+		break;
+
+	case RESULT_ERROR:
+		if (t->signal)
+			snprintf(buf, max_len, "killed by signal %d",
+				 t->signal);
+		else
+			snprintf(buf, max_len, "test could not be run");
+		break;
+	}
+}
+
+static void show_result(const struct farm_test *t,
+			const struct farm_outcome *o)
+{
+	char text[64];
+
+	describe(t, text, sizeof(text));
+
+	if (o->cycles == CYCLES_UNKNOWN)
+		printc("%-7s %s: %s, %.3f s\n", result_names[t->result],
+		       t->path, text, t->time);
+	else
+		printc("%-7s %s: %s, %llu cycles, %.3f s\n",
+		       result_names[t->result], t->path, text,
+		       (unsigned long long)o->cycles, t->time);
+}
+
+/* Run tests until they're all done, or until interrupted. Returns the
+ * number of tests which were run.
+ */
+static int run_tests(struct vector *list, struct farm_outcome *outcomes,
+		     int jobs, farm_test_func_t func, void *user_data)
+{
+	struct farm_slot *slots = calloc(jobs, sizeof(*slots));
+	int running = 0;
+	int next = 0;
+	int failed = 0;
+
+	if (!slots) {
+		printc_err("farm: can't allocate memory for jobs\n");
+		return -1;
+	}
+
+	for (;;) {
+		pid_t pid;
+		int status;
+		int i;
+
+		for (i = 0; !failed && i < jobs && next < list->size; i++) {
+			if (slots[i].pid)
+				continue;
+
+			if (ctrlc_check())
+				break;
+
+			if (start_test(&slots[i],
+				       VECTOR_PTR(*list, next,
+						  struct farm_test),
+				       outcomes + next, func,
+				       user_data) < 0) {
+				failed = 1;
+				break;
+			}
+
+			slots[i].test = next++;
+			running++;
+		}
+
+		if (!running)
+			break;
+
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+
+			pr_error("farm: waitpid");
+			break;
+		}
+
+		for (i = 0; i < jobs; i++)
+			if (slots[i].pid == pid)
+				break;
+
+		if (i >= jobs)
+			continue;
+
+		finish_test(&slots[i], VECTOR_PTR(*list, slots[i].test,
+						  struct farm_test),
+			    outcomes + slots[i].test, status);
+		show_result(VECTOR_PTR(*list, slots[i].test, struct farm_test),
+			    outcomes + slots[i].test);
+		running--;
+	}
+
+	free(slots);
+
+	if (next < list->size) {
+		printc_err("farm: stopped after %d of %d tests\n",
+			   next, list->size);
+		return -1;
+	}
+
+	return next;
+}
+
+/************************************************************************
+ * Reports
+ */
+
+static void xml_escape(FILE *out, const char *text, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		const unsigned char c = text[i];
+
+		switch (c) {
+		case '&': fputs("&amp;", out); break;
+		case '<': fputs("&lt;", out); break;
+		case '>': fputs("&gt;", out); break;
+		case '"': fputs("&quot;", out); break;
+
+		default:
+			/* Output needn't be valid UTF-8, so bytes outside
+			 * ASCII are given as the Latin-1 characters. Most
+			 * control characters aren't allowed in XML.
+			 */
+			if (c >= 0x80)
+				fprintf(out, "&#x%02x;", c);
+			else if (c >= 0x20 || c == '\t' || c == '\n' ||
+				 c == '\r')
+				fputc(c, out);
+			break;
+		}
+	}
+}
+
+static void json_escape(FILE *out, const char *text, size_t len)
+{
+	size_t i;
+
+	fputc('"', out);
+
+	for (i = 0; i < len; i++) {
+		const unsigned char c = text[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c == '\n')
+			fputs("\\n", out);
+		else if (c < 0x20 || c >= 0x80)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+
+	fputc('"', out);
+}
+
+static void write_xml(FILE *out, const struct vector *list, int count,
+		      const struct farm_outcome *outcomes)
+{
+	int failures = 0;
+	int errors = 0;
+	double total = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		const struct farm_test *t =
+			VECTOR_PTR(*list, i, struct farm_test);
+
+		if (t->result == RESULT_ERROR)
+			errors++;
+		else if (t->result != RESULT_PASS)
+			failures++;
+
+		total += t->time;
+	}
+
+	fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<testsuite name=\"mspdebug\" tests=\"%d\" failures=\"%d\" "
+		"errors=\"%d\" time=\"%.3f\">\n",
+		count, failures, errors, total);
+
+	for (i = 0; i < count; i++) {
+		const struct farm_test *t =
+			VECTOR_PTR(*list, i, struct farm_test);
+		char text[64];
+
+		describe(t, text, sizeof(text));
+
+		fputs("  <testcase classname=\"mspdebug\" name=\"", out);
+		xml_escape(out, t->path, strlen(t->path));
+		fprintf(out, "\" time=\"%.3f\">\n", t->time);
+
+		if (outcomes[i].cycles != CYCLES_UNKNOWN)
+			fprintf(out, "    <properties>\n"
+				"      <property name=\"cycles\" "
+				"value=\"%llu\"/>\n"
+				"    </properties>\n",
+				(unsigned long long)outcomes[i].cycles);
+
+		if (t->result == RESULT_ERROR)
+			fprintf(out, "    <error message=\"%s\"/>\n", text);
+		else if (t->result != RESULT_PASS)
+			fprintf(out, "    <failure message=\"%s\"/>\n", text);
+
+		fputs("    <system-out>", out);
+		xml_escape(out, t->output, t->output_len);
+		fputs("</system-out>\n  </testcase>\n", out);
+	}
+
+	fputs("</testsuite>\n", out);
+}
+
+static void write_json(FILE *out, const struct vector *list, int count,
+		       const struct farm_outcome *outcomes)
+{
+	int totals[4] = {0};
+	int i;
+
+	fputs("{\n  \"tests\": [", out);
+
+	for (i = 0; i < count; i++) {
+		const struct farm_test *t =
+			VECTOR_PTR(*list, i, struct farm_test);
+
+		totals[t->result]++;
+
+		fputs(i ? ",\n    {\"name\": " : "\n    {\"name\": ", out);
+		json_escape(out, t->path, strlen(t->path));
+		fprintf(out, ", \"result\": \"%s\"", result_names[t->result]);
+
+		if (t->signal)
+			fprintf(out, ", \"signal\": %d", t->signal);
+		else
+			fprintf(out, ", \"status\": %d", t->status);
+
+		if (outcomes[i].cycles != CYCLES_UNKNOWN)
+			fprintf(out, ", \"cycles\": %llu",
+				(unsigned long long)outcomes[i].cycles);
+
+		fprintf(out, ", \"time\": %.3f, \"output\": ", t->time);
+		json_escape(out, t->output, t->output_len);
+		fputc('}', out);
+	}
+
+	fprintf(out, "\n  ],\n"
+		"  \"passed\": %d,\n"
+		"  \"failed\": %d,\n"
+		"  \"timeouts\": %d,\n"
+		"  \"errors\": %d\n"
+		"}\n",
+		totals[RESULT_PASS], totals[RESULT_FAIL],
+		totals[RESULT_TIMEOUT], totals[RESULT_ERROR]);
+}
+
+static int write_report(const char *path, const struct vector *list,
+			int count, const struct farm_outcome *outcomes)
+{
+	const size_t len = strlen(path);
+	FILE *out = fopen(path, "w");
+
+	if (!out) {
+		pr_error(path);
+		return -1;
+	}
+
+	if (len >= 5 && !strcasecmp(path + len - 5, ".json"))
+		write_json(out, list, count, outcomes);
+	else
+		write_xml(out, list, count, outcomes);
+
+	if (ferror(out) | fclose(out)) {
+		pr_error(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int farm_run(const struct farm_args *args, farm_test_func_t func,
+	     void *user_data)
+{
+	struct vector list;
+	struct farm_outcome *outcomes = NULL;
+	size_t outcomes_len = 0;
+	int jobs = args->jobs;
+	int passed = 0;
+	int count;
+	int ret = -1;
+	int i;
+
+	vector_init(&list, sizeof(struct farm_test));
+	if (find_tests(&list, &args->tests) < 0)
+		goto out;
+
+	if (!list.size) {
+		printc_err("farm: no tests found\n");
+		goto out;
+	}
+
+	if (jobs <= 0) {
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs <= 0)
+			jobs = 1;
+	}
+
+	/* Outcomes are written by the child processes */
+	outcomes_len = list.size * sizeof(*outcomes);
+	outcomes = mmap(NULL, outcomes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (outcomes == MAP_FAILED) {
+		pr_error("farm: can't map shared memory");
+		outcomes = NULL;
+		goto out;
+	}
+
+	for (i = 0; i < list.size; i++) {
+		outcomes[i].ret = -1;
+		outcomes[i].cycles = CYCLES_UNKNOWN;
+	}
+
+	count = run_tests(&list, outcomes, jobs, func, user_data);
+	if (count < 0)
+		goto out;
+
+	for (i = 0; i < count; i++)
+		if (VECTOR_AT(list, i, struct farm_test).result == RESULT_PASS)
+			passed++;
+
+	printc("%d tests, %d passed, %d failed\n",
+	       count, passed, count - passed);
+
+	if (args->report && write_report(args->report, &list, count,
+					 outcomes) < 0)
+		goto out;
+
+	ret = (passed == count) ? 0 : 1;
+
+out:
+	if (outcomes)
+		munmap(outcomes, outcomes_len);
+
+	for (i = 0; i < list.size; i++) {
+		struct farm_test *t = VECTOR_PTR(list, i, struct farm_test);
+
+		free(t->path);
+		free(t->output);
+	}
+
+	vector_destroy(&list);
+	return ret;
+}
+#endif
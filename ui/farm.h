@@ -0,0 +1,55 @@
+/* MSPDebug - debugging tool MSP430 MCUs
+ * Copyright (C) 2009-2012 Daniel Beer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef FARM_H_
+#define FARM_H_
+
+#include <stdint.h>
+
+#include "vector.h"
+
+/* A test farm runs many test images, each in a fresh child process with
+ * its own device, and reports the results. Several tests are run at
+ * once, up to the given number of jobs.
+ *
+ * Each entry in tests is the path of an image, or of a directory, in
+ * which case every ELF file in it (by extension) is used. If a report
+ * file is given, a JSON report is written if its name ends in ".json",
+ * and a JUnit-style XML report otherwise.
+ */
+struct farm_args {
+	struct vector		tests;
+	const char		*report;
+	int			jobs;
+};
+
+/* Run a single test, in the child process. Returns the test's exit
+ * status, which is 0 if it passed, BATCH_TIMEOUT if it ran out of
+ * cycles, or -1 if it couldn't be run. cycles is filled in if the
+ * number of cycles taken is known.
+ */
+typedef int (*farm_test_func_t)(const char *image, uint64_t *cycles,
+				void *user_data);
+
+/* Returns 0 if every test passed, 1 if any failed, or -1 if an error
+ * occurs.
+ */
+int farm_run(const struct farm_args *args, farm_test_func_t func,
+	     void *user_data);
+
+#endif
@@ -242,7 +242,10 @@ static int run_set_pc(char *buf)
 	return device_setregs(regs);
 }
 
-static int run_final_status(struct gdb_data *data)
+/* Report a stop. If the target is replaying execution history and
+ * reached the start of it, gdb is told so.
+ */
+static int run_final_status(struct gdb_data *data, int history_begin)
 {
 	address_t regs[DEVICE_NUM_REGS];
 	int i;
@@ -266,6 +269,8 @@ static int run_final_status(struct gdb_data *data)
 		}
 		gdb_printf(data, ";");
 	}
+	if (history_begin)
+		gdb_printf(data, "replaylog:begin;");
 	gdb_packet_end(data);
 
 	return gdb_flush_ack(data);
@@ -279,7 +284,7 @@ static int single_step(struct gdb_data *data, char *buf)
 	    device_ctl(DEVICE_CTL_STEP) < 0)
 		gdb_send(data, "E00");
 
-	return run_final_status(data);
+	return run_final_status(data, 0);
 }
 
 static int run(struct gdb_data *data, char *buf)
@@ -321,18 +326,41 @@ static int run(struct gdb_data *data, char *buf)
 	if (device_ctl(DEVICE_CTL_HALT) < 0)
 		return gdb_send(data, "E00");
 
-	return run_final_status(data);
+	return run_final_status(data, 0);
+}
+
+static int reverse_run(struct gdb_data *data, char *buf)
+{
+	device_ctl_t op;
+	int ret;
+
+	if (buf[0] == 's') {
+		printc("Reverse stepping\n");
+		op = DEVICE_CTL_REVERSE_STEP;
+	} else if (buf[0] == 'c') {
+		printc("Reverse running\n");
+		op = DEVICE_CTL_REVERSE_RUN;
+	} else {
+		return gdb_send(data, "");
+	}
+
+	ret = device_ctl(op);
+	if (ret < 0)
+		return gdb_send(data, "E00");
+
+	return run_final_status(data, ret > 0);
 }
 
 static int set_breakpoint(struct gdb_data *data, int enable, char *buf)
 {
-	char *parts[2];
+	char *parts[3];
 	address_t addr;
+	address_t size = 1;
 	device_bptype_t type;
 	int i;
 
 	/* Break up the arguments */
-	for (i = 0; i < 2; i++)
+	for (i = 0; i < 3; i++)
 		parts[i] = strsep(&buf, ",");
 
 	/* Make sure there's a type argument */
@@ -374,8 +402,13 @@ static int set_breakpoint(struct gdb_data *data, int enable, char *buf)
 	/* Parse the breakpoint address */
 	addr = strtoul(parts[1], NULL, 16);
 
+	/* For watchpoints, the kind gives the number of bytes watched */
+	if (type != DEVICE_BPTYPE_BREAK && parts[2])
+		size = strtoul(parts[2], NULL, 16);
+
 	if (enable) {
-		if (device_setbrk(device_default, -1, 1, addr, type) < 0) {
+		if (device_setbrk_range(device_default, -1, 1,
+					addr, size, type) < 0) {
 			printc_err("gdb: can't add breakpoint at "
 				"0x%04x\n", addr);
 			return gdb_send(data, "E00");
@@ -407,6 +440,8 @@ static int gdb_send_supported(struct gdb_data *data)
 {
 	gdb_packet_start(data);
 	gdb_printf(data, "PacketSize=%x", GDB_MAX_XFER * 2);
+	if (device_default->can_reverse)
+		gdb_printf(data, ";ReverseStep+;ReverseContinue+");
 	gdb_packet_end(data);
 	return gdb_flush_ack(data);
 }
@@ -418,7 +453,7 @@ static int process_gdb_command(struct gdb_data *data, char *buf)
 #endif
 	switch (buf[0]) {
 	case '?': /* Return target halt reason */
-		return run_final_status(data);
+		return run_final_status(data, 0);
 
 	case 'z':
 	case 'Z':
@@ -462,6 +497,10 @@ static int process_gdb_command(struct gdb_data *data, char *buf)
 
 	case 's': /* Single step */
 		return single_step(data, buf + 1);
+
+	case 'b': /* Reverse step or continue */
+		return reverse_run(data, buf + 1);
+
 	case 'k': /* kill */
 		return -1;
 	}
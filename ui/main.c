@@ -30,6 +30,8 @@
 #include "util.h"
 #include "usbutil.h"
 #include "gdb.h"
+#include "batch.h"
+#include "farm.h"
 #include "rtools.h"
 #include "sym.h"
 #include "devcmd.h"
@@ -38,7 +40,6 @@
 #include "reader.h"
 #include "output.h"
 #include "output_util.h"
-#include "simio.h"
 #include "ctrlc.h"
 
 #include "sim.h"
@@ -72,6 +73,12 @@ struct cmdline_args {
 	const char		*alt_config;
 	int			flags;
 	struct device_args	devarg;
+	struct batch_args	batch;
+	struct farm_args	farm;
+
+	/* Commands given after the driver name */
+	char			**commands;
+	int			num_commands;
 };
 
 static const struct device_class *const driver_table[] = {
@@ -162,6 +169,25 @@ static void usage(const char *progname)
 "        On some host (say RaspberryPi) defines a GPIO pin# to be used as DTR\n"
 "    --bsl-entry-password <hex string>\n"
 "        Use the given hex byte string as a BSL entry password.\n"
+"    --run <image>\n"
+"        Load the image and run it without interaction until an exit\n"
+"        condition is met, then exit with the program's status.\n"
+"    --exit-at <address>\n"
+"        Stop a batch run when the CPU reaches the given address.\n"
+"    --exit-port <address>\n"
+"        Stop a batch run after the program writes to the given address.\n"
+"    --exit-code <register|address>\n"
+"        Take the exit status of a batch run from a register or memory.\n"
+"    --max-cycles <count>\n"
+"        Stop a batch run after the given number of cycles (sim only).\n"
+"    --test <image|directory>\n"
+"        Run test images in batch mode, each in a new process. May be\n"
+"        given more than once.\n"
+"    --jobs <count>\n"
+"        Run up to this many tests at once (default: number of CPUs).\n"
+"    --report <file>\n"
+"        Write test results as JUnit XML, or JSON if the name ends in\n"
+"        .json.\n"
 "\n"
 "Most drivers connect by default via USB, unless told otherwise via the\n"
 "-d option. By default, the first USB device found is opened.\n"
@@ -309,6 +335,14 @@ static int parse_cmdline_args(int argc, char **argv,
 		LOPT_BSL_GPIO_RTS,
 		LOPT_BSL_GPIO_DTR,
 		LOPT_BSL_ENTRY_PASSWORD,
+		LOPT_RUN,
+		LOPT_EXIT_AT,
+		LOPT_EXIT_PORT,
+		LOPT_EXIT_CODE,
+		LOPT_MAX_CYCLES,
+		LOPT_TEST,
+		LOPT_JOBS,
+		LOPT_REPORT,
 	};
 
 	static const struct option longopts[] = {
@@ -327,6 +361,14 @@ static int parse_cmdline_args(int argc, char **argv,
 		{"bsl-gpio-rts",	1, 0, LOPT_BSL_GPIO_RTS},
 		{"bsl-gpio-dtr",	1, 0, LOPT_BSL_GPIO_DTR},
 		{"bsl-entry-password",  1, 0, LOPT_BSL_ENTRY_PASSWORD},
+		{"run",			1, 0, LOPT_RUN},
+		{"exit-at",		1, 0, LOPT_EXIT_AT},
+		{"exit-port",		1, 0, LOPT_EXIT_PORT},
+		{"exit-code",		1, 0, LOPT_EXIT_CODE},
+		{"max-cycles",		1, 0, LOPT_MAX_CYCLES},
+		{"test",		1, 0, LOPT_TEST},
+		{"jobs",		1, 0, LOPT_JOBS},
+		{"report",		1, 0, LOPT_REPORT},
 		{NULL, 0, 0, 0}
 	};
 
@@ -378,6 +420,55 @@ static int parse_cmdline_args(int argc, char **argv,
 			args->flags |= OPT_EMBEDDED;
 			break;
 
+		case LOPT_RUN:
+			args->batch.image = optarg;
+			break;
+
+		case LOPT_EXIT_AT:
+			args->batch.exit_at = optarg;
+			break;
+
+		case LOPT_EXIT_PORT:
+			args->batch.exit_port = optarg;
+			break;
+
+		case LOPT_EXIT_CODE:
+			args->batch.exit_code = optarg;
+			break;
+
+		case LOPT_MAX_CYCLES:
+			{
+				char *end;
+
+				args->batch.max_cycles =
+					strtoull(optarg, &end, 0);
+				if (*end || !args->batch.max_cycles) {
+					printc_err("Invalid cycle count: "
+						   "%s\n", optarg);
+					return -1;
+				}
+			}
+			break;
+
+		case LOPT_TEST:
+			if (vector_push(&args->farm.tests, &optarg, 1) < 0) {
+				printc_err("Can't allocate memory for tests\n");
+				return -1;
+			}
+			break;
+
+		case LOPT_JOBS:
+			args->farm.jobs = atoi(optarg);
+			if (args->farm.jobs <= 0) {
+				printc_err("Invalid job count: %s\n", optarg);
+				return -1;
+			}
+			break;
+
+		case LOPT_REPORT:
+			args->farm.report = optarg;
+			break;
+
 		case LOPT_ALLOW_FW_UPDATE:
 			args->devarg.flags |= DEVICE_FLAG_DO_FWUPDATE;
 			break;
@@ -464,6 +555,25 @@ static int parse_cmdline_args(int argc, char **argv,
 			return -1;
 		}
 
+	if (args->batch.image && args->farm.tests.size) {
+		printc_err("You can't specify both --run and --test.\n");
+		return -1;
+	}
+
+	if (!(args->batch.image || args->farm.tests.size) &&
+	    (args->batch.exit_at || args->batch.exit_port ||
+	     args->batch.exit_code || args->batch.max_cycles)) {
+		printc_err("Exit conditions can only be given with --run or "
+			   "--test.\n");
+		return -1;
+	}
+
+	if (!args->farm.tests.size && (args->farm.jobs || args->farm.report)) {
+		printc_err("--jobs and --report can only be given with "
+			   "--test.\n");
+		return -1;
+	}
+
 	if (want_usb && (args->devarg.flags & DEVICE_FLAG_TTY)) {
 		printc_err("You can't simultaneously specify a serial and "
 			"a USB device.\n");
@@ -477,7 +587,8 @@ static int parse_cmdline_args(int argc, char **argv,
 	}
 
 	args->driver_name = argv[optind];
-	optind++;
+	args->commands = argv + optind + 1;
+	args->num_commands = argc - optind - 1;
 
 	return 0;
 }
@@ -508,6 +619,58 @@ int setup_driver(struct cmdline_args *args)
 	return 0;
 }
 
+/* Open the device, and run the startup file and commands, followed by
+ * the batch program if there is one. Returns its exit status, as for
+ * batch_run(), or -1 if an error occurs.
+ */
+static int run_session(struct cmdline_args *args, uint64_t *cycles)
+{
+	int ret = 0;
+	int i;
+
+	if (setup_driver(args) < 0)
+		return -1;
+
+	if (device_probe_id(device_default, args->devarg.forced_chip_id) < 0)
+		printc_err("warning: device ID probe failed\n");
+
+	if (!(args->flags & OPT_NO_RC))
+		process_rc_file(args->alt_config);
+
+	/* Process commands. In batch mode, they're run first, to set up
+	 * the device.
+	 */
+	if (args->num_commands) {
+		for (i = 0; i < args->num_commands; i++)
+			if (process_command(args->commands[i]) < 0) {
+				ret = -1;
+				break;
+			}
+	} else if (!args->batch.image) {
+		reader_loop();
+	}
+
+	if (!ret && args->batch.image) {
+		ret = batch_run(&args->batch);
+		if (cycles)
+			sim_get_cycles(device_default, cycles);
+	}
+
+	device_destroy();
+	stab_exit();
+	return ret;
+}
+
+/* Each test of a farm is a batch run, in its own process */
+static int run_farm_test(const char *image, uint64_t *cycles,
+			 void *user_data)
+{
+	struct cmdline_args *args = user_data;
+
+	args->batch.image = image;
+	return run_session(args, cycles);
+}
+
 #ifdef __Windows__
 static int sockets_init(void)
 {
@@ -535,6 +698,8 @@ int main(int argc, char **argv)
 	struct cmdline_args args = {0};
 	int ret = 0;
 
+	vector_init(&args.farm.tests, sizeof(const char *));
+
 	setvbuf(stderr, NULL, _IOFBF, 0);
 	setvbuf(stdout, NULL, _IOFBF, 0);
 
@@ -563,48 +728,29 @@ int main(int argc, char **argv)
 
 	printc_dbg("%s", version_text);
 	printc_dbg("%s\n", chipinfo_copyright());
-	if (setup_driver(&args) < 0) {
-		ret = -1;
-		goto fail_driver;
-	}
-
-	simio_init();
-
-	if (device_probe_id(device_default, args.devarg.forced_chip_id) < 0)
-		printc_err("warning: device ID probe failed\n");
-
-	if (!(args.flags & OPT_NO_RC))
-		process_rc_file(args.alt_config);
 
-	/* Process commands */
-	if (optind < argc) {
-		while (optind < argc) {
-			if (process_command(argv[optind++]) < 0) {
-				ret = -1;
-				break;
-			}
-		}
+	if (args.farm.tests.size) {
+		ret = farm_run(&args.farm, run_farm_test, &args);
 	} else {
-		reader_loop();
+		ret = run_session(&args, NULL);
+		if (ret == BATCH_TIMEOUT)
+			ret = BATCH_TIMEOUT_STATUS;
 	}
 
-	simio_exit();
-	device_destroy();
-	stab_exit();
-fail_driver:
 	sockets_exit();
 fail_sockets:
 	input_module->exit();
 fail_input:
 fail_parse:
+	vector_destroy(&args.farm.tests);
 
 	/* We need to do this on Windows, because in embedded mode we
 	 * may still have a running background thread for input. If so,
 	 * returning from main() won't cause the process to terminate.
 	 */
 #if defined(__CYGWIN__)
-	cygwin_internal(CW_EXIT_PROCESS,
-		(ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE, 1);
+	/* Keep the status of a batch run, as returning would */
+	cygwin_internal(CW_EXIT_PROCESS, ret & 0xff, 1);
 #elif defined(__Windows__)
 	ExitProcess(ret);
 #endif
@@ -121,6 +121,62 @@ static const struct opdb_key keys[] = {
 "If set, disassembled instruction and register name are displayed in\n"
 "lowercase.\n"
 	},
+	{
+		.name = "sim_skip_polling",
+		.type = OPDB_TYPE_BOOLEAN,
+		.help =
+"If set, the simulator looks for short loops which do nothing but poll\n"
+"memory or a peripheral register, and skips ahead to the next peripheral\n"
+"event instead of executing every pass. Cycle counts are unaffected.\n",
+		.defval = {
+			.boolean = 0
+		}
+	},
+	{
+		.name = "sim_history",
+		.type = OPDB_TYPE_NUMERIC,
+		.help =
+"Size, in kilobytes, of the simulator's execution history. If non-zero,\n"
+"the simulator records enough information to step and run backwards\n"
+"through the most recently executed instructions.\n",
+		.defval = {
+			.numeric = 0
+		}
+	},
+	{
+		.name = "sim_semihost",
+		.type = OPDB_TYPE_NUMERIC,
+		.help =
+"Address of the simulator's semihosting port, or zero to disable it. A\n"
+"program writes the address of a request block to this port to have\n"
+"the host perform IO on its behalf.\n",
+		.defval = {
+			.numeric = 0
+		}
+	},
+	{
+		.name = "sim_semihost_dir",
+		.type = OPDB_TYPE_STRING,
+		.help =
+"Directory in which a semihosted program may open host files. Paths\n"
+"given by the program are taken relative to it, and may not leave it.\n"
+"If empty, the program can't open files.\n",
+		.defval = {
+			.string = ""
+		}
+	},
+	{
+		.name = "sim_poll_ms",
+		.type = OPDB_TYPE_NUMERIC,
+		.help =
+"Time, in milliseconds, which the simulator runs for before checking for\n"
+"requests from the user or from gdb. Larger values run a little faster.\n"
+"If zero, it runs until the program stops or Ctrl+C is pressed, and gdb\n"
+"can't interrupt it.\n",
+		.defval = {
+			.numeric = 20
+		}
+	},
 };
 
 static union opdb_value values[ARRAY_LEN(keys)];
@@ -31,7 +31,23 @@
 
 static capture_func_t capture_func;
 static void *capture_data;
+static int capture_quiet;
 static int is_embedded_mode;
+static FILE *program_out;
+
+/* Captures which were active when another was started, to be restored
+ * by capture_end().
+ */
+#define CAPTURE_DEPTH		4
+
+struct capture {
+	capture_func_t		func;
+	void			*data;
+	int			quiet;
+};
+
+static struct capture capture_saved[CAPTURE_DEPTH];
+static int capture_depth;
 
 #define LINEBUF_SIZE	4096
 
@@ -146,7 +162,9 @@ static void handle_line(const char *text, FILE *out, char sigil)
 	int cap_len = 0;
 	int ansi_state = 7;
 
-	if (is_embedded_mode) {
+	if (capture_quiet) {
+		out = NULL;
+	} else if (is_embedded_mode) {
 		out = stdout;
 		fputc(sigil, out);
 	}
@@ -156,25 +174,28 @@ static void handle_line(const char *text, FILE *out, char sigil)
 
 		if (*text == 0x1b) {
 			r = parse_ansi(text, &ansi_state);
-			if (want_color)
+			if (want_color && out)
 				emit_ansi(text, r, ansi_state, out);
 		} else {
 			r = parse_text(text);
 
 			memcpy(cap_buf + cap_len, text, r);
 			cap_len += r;
-			fwrite(text, 1, r, out);
+			if (out)
+				fwrite(text, 1, r, out);
 		}
 
 		text += r;
 	}
 
-	/* Reset colours if necessary */
-	if (want_color && (ansi_state != 7))
-		emit_ansi("\x1b[0m", 4, 7, out);
+	if (out) {
+		/* Reset colours if necessary */
+		if (want_color && (ansi_state != 7))
+			emit_ansi("\x1b[0m", 4, 7, out);
 
-	fputc('\n', out);
-	fflush(out);
+		fputc('\n', out);
+		fflush(out);
+	}
 
 	/* Invoke output capture callback */
 	cap_buf[cap_len] = 0;
@@ -293,13 +314,71 @@ void pr_error(const char *prefix)
 	printc_err("%s: %s\n", prefix, last_error());
 }
 
-void capture_start(capture_func_t func, void *data)
+void program_output(int is_err, const char *text, size_t len)
+{
+	FILE *out = program_out;
+
+	if (capture_quiet)
+		return;
+
+	if (!out) {
+		/* Lines must each be marked in embedded mode */
+		if (is_embedded_mode) {
+			if (is_err)
+				printc_err("%.*s", (int)len, text);
+			else
+				printc("%.*s", (int)len, text);
+			return;
+		}
+
+		out = is_err ? stderr : stdout;
+	}
+
+	fwrite(text, 1, len, out);
+	fflush(out);
+}
+
+void program_output_redirect(FILE *out)
 {
+	program_out = out;
+}
+
+static void capture_push(capture_func_t func, void *data, int quiet)
+{
+	if (capture_depth < CAPTURE_DEPTH) {
+		struct capture *c = &capture_saved[capture_depth];
+
+		c->func = capture_func;
+		c->data = capture_data;
+		c->quiet = capture_quiet;
+	}
+
+	capture_depth++;
 	capture_func = func;
 	capture_data = data;
+	capture_quiet = quiet;
+}
+
+void capture_start(capture_func_t func, void *data)
+{
+	capture_push(func, data, 0);
+}
+
+void capture_start_quiet(capture_func_t func, void *data)
+{
+	capture_push(func, data, 1);
 }
 
 void capture_end(void)
 {
-	capture_func = NULL;
+	if (capture_depth && --capture_depth < CAPTURE_DEPTH) {
+		const struct capture *c = &capture_saved[capture_depth];
+
+		capture_func = c->func;
+		capture_data = c->data;
+		capture_quiet = c->quiet;
+	} else {
+		capture_func = NULL;
+		capture_quiet = 0;
+	}
 }
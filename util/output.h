@@ -19,6 +19,8 @@
 #ifndef OUTPUT_H_
 #define OUTPUT_H_
 
+#include <stdio.h>
+
 #include "vector.h"
 
 /* Print output. ANSI colour codes may be embedded, and these will be
@@ -38,6 +40,17 @@ int printc_shell(const char *fmt, ...)
 
 void pr_error(const char *prefix);
 
+/* Print output from the simulated program, such as text written to the
+ * console peripheral. It's written as given, to stdout, or to stderr if
+ * is_err is set, and may hold any bytes. It isn't passed to captures,
+ * and is discarded during a quiet capture.
+ *
+ * program_output_redirect() sends it to the given file instead, or back
+ * to stdout and stderr if the file is NULL.
+ */
+void program_output(int is_err, const char *text, size_t len);
+void program_output_redirect(FILE *out);
+
 /* Enable embedded output mode. When enabled, all logical streams
  * are sent to stdout (not stderr), and prefixed with the following
  * sigils:
@@ -57,11 +70,21 @@ void output_set_embedded(int enable);
  * printed to either stdout or stderr (output still goes to
  * stdout/stderr as well).
  *
- * Capture is ended by calling capture_end().
+ * Capture is ended by calling capture_end(). Captures may be nested:
+ * ending one restores the capture which was active when it started.
+ *
+ * There is one capture for the whole process, not one per thread, and
+ * nothing here is serialized. While a capture is active, no other thread
+ * may print.
  */
 typedef void (*capture_func_t)(void *user_data, const char *text);
 
 void capture_start(capture_func_t, void *user_data);
 void capture_end(void);
 
+/* As for capture_start(), but the output is passed only to the callback,
+ * and isn't printed.
+ */
+void capture_start_quiet(capture_func_t, void *user_data);
+
 #endif
@@ -168,7 +168,7 @@ static int format_operand(msp430_amode_t amode, address_t addr,
 }
 
 /* Write assembly language for the instruction to this buffer */
-static int dis_format(const struct msp430_instruction *insn)
+int dis_format(const struct msp430_instruction *insn)
 {
 	int len = 0;
 
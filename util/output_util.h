@@ -30,6 +30,12 @@
 address_t disassemble(address_t addr, const uint8_t *buf, int len,
 		 powerbuf_t power);
 
+/* Print a colorized instruction, without its address. Returns the number
+ * of characters printed.
+ */
+struct msp430_instruction;
+int dis_format(const struct msp430_instruction *insn);
+
 /* Print colorized hexdump on standard output */
 void hexdump(address_t addr, const uint8_t *buf, int len);
 
@@ -101,6 +101,26 @@ static inline void thread_cond_notify(thread_cond_t *c)
 {
 	SetEvent(*c);
 }
+
+/* One-time initialization. The flag is 0 until the function is called,
+ * 1 while it runs and 2 once it has returned. Other callers wait until
+ * it has returned.
+ */
+typedef LONG volatile thread_once_t;
+
+#define THREAD_ONCE_INIT	0
+
+static inline void thread_once(thread_once_t *once, void (*func)(void))
+{
+	if (InterlockedCompareExchange(once, 1, 0) == 0) {
+		func();
+		InterlockedExchange(once, 2);
+		return;
+	}
+
+	while (InterlockedCompareExchange(once, 2, 2) != 2)
+		Sleep(0);
+}
 #else /* __Windows__ */
 
 #include <pthread.h>
@@ -163,6 +183,16 @@ static inline void thread_cond_notify(thread_cond_t *c)
 {
 	pthread_cond_signal(c);
 }
+
+/* POSIX one-time initialization. */
+typedef pthread_once_t thread_once_t;
+
+#define THREAD_ONCE_INIT	PTHREAD_ONCE_INIT
+
+static inline void thread_once(thread_once_t *once, void (*func)(void))
+{
+	pthread_once(once, func);
+}
 #endif
 
 #endif
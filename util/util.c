@@ -26,6 +26,8 @@
 
 #ifdef __Windows__
 #include <windows.h>
+#else
+#include <sys/time.h>
 #endif
 
 #include "ctrlc.h"
@@ -322,6 +324,41 @@ int delay_ms(unsigned int s)
 }
 #endif
 
+#ifdef __Windows__
+uint64_t time_us(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	uint64_t q;
+	uint64_t f;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+
+	/* Split the division so that the multiplication can't overflow */
+	QueryPerformanceCounter(&now);
+	q = now.QuadPart;
+	f = freq.QuadPart;
+	return (q / f) * 1000000 + (q % f) * 1000000 / f;
+}
+#elif defined(CLOCK_MONOTONIC)
+uint64_t time_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+#else
+uint64_t time_us(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+#endif
+
 int base64_encode(const uint8_t *src, int len, char *dst, int max_len)
 {
 	static const char basis[] =
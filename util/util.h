@@ -63,6 +63,9 @@ char *expand_tilde(const char *path);
 int delay_s(unsigned int s);
 int delay_ms(unsigned int s);
 
+/* Read a monotonic clock, in microseconds from an arbitrary origin */
+uint64_t time_us(void);
+
 /* Base64 encode a block without breaking into lines. Returns the number
  * of source bytes encoded. The output is nul-terminated.
  */